@@ -19,6 +19,18 @@
 /* Compression methods */
 #define ZLITE_METHOD_LZMA2  0
 #define ZLITE_METHOD_LZMA   1
+#define ZLITE_METHOD_PPMD   2
+#define ZLITE_METHOD_COPY   3         /* stored as is; level 0 always stores */
+
+/* Archive formats written by zlite_add_files() */
+#define ZLITE_FORMAT_ZLITE  0         /* records with a central directory */
+#define ZLITE_FORMAT_7Z     1         /* standard 7z, readable by 7-Zip */
+
+/* Default upper bound for the uncompressed size of a solid block */
+#define ZLITE_DEFAULT_SOLID_BLOCK_SIZE ((uint64_t)32 << 20)
+
+/* Bytes the parallel compression pipeline may hold in memory by default */
+#define ZLITE_DEFAULT_INFLIGHT_BUDGET ((uint64_t)256 << 20)
 
 /* Return codes */
 #define ZLITE_OK            0
@@ -35,6 +47,33 @@
 #define ZLITE_FILETYPE_DIR     1
 #define ZLITE_FILETYPE_SYMLINK 2
 #define ZLITE_FILETYPE_HARDLINK 3
+#define ZLITE_FILETYPE_SOLID_BLOCK 4    /* archive records only */
+#define ZLITE_FILETYPE_REF     5        /* copy of an earlier file, named by link_target */
+
+/* The type word of a record keeps the file type in its low byte, the
+ * filter in the next two, flags in bits 24-27 and the method in the top
+ * four bits */
+#define ZLITE_TYPE_MASK        0xFF
+#define ZLITE_FLAG_SOLID       (1 << 24)   /* data lives in the preceding solid block */
+#define ZLITE_FLAG_TRAILER     (1 << 25)   /* size, compressed_size and crc follow the payload */
+#define ZLITE_METHOD_SHIFT     28
+#define ZLITE_METHOD_MASK      (0xFu << 28)
+
+/* Filters applied before LZMA2, on regular entries and solid blocks */
+#define ZLITE_FILTER_SHIFT     8
+#define ZLITE_FILTER_MASK      (0xFF << 8)
+#define ZLITE_FILTER_ARG_SHIFT 16          /* delta distance - 1 */
+#define ZLITE_FILTER_ARG_MASK  (0xFF << 16)
+
+#define ZLITE_FILTER_NONE   0
+#define ZLITE_FILTER_X86    1
+#define ZLITE_FILTER_ARM    2
+#define ZLITE_FILTER_ARMT   3
+#define ZLITE_FILTER_ARM64  4
+#define ZLITE_FILTER_PPC    5
+#define ZLITE_FILTER_SPARC  6
+#define ZLITE_FILTER_RISCV  7
+#define ZLITE_FILTER_DELTA  8
 
 /* Command types */
 typedef enum {
@@ -43,18 +82,43 @@ typedef enum {
     ZLITE_CMD_LIST,
     ZLITE_CMD_TEST,
     ZLITE_CMD_DELETE,
-    ZLITE_CMD_RENAME
+    ZLITE_CMD_RENAME,
+    ZLITE_CMD_UPDATE
 } ZliteCommand;
 
+/* Called with the path of each finished volume of a split archive */
+typedef void (*ZliteVolumeHook)(const char *volume_path, void *arg);
+
 /* Compression options */
 typedef struct {
     int level;
     int method;
     int solid;
     int num_threads;
-    uint64_t volume_size;
+    uint64_t solid_block_size;  /* 0 = ZLITE_DEFAULT_SOLID_BLOCK_SIZE */
+    uint64_t volume_size;       /* split into .001, .002, ... of this size, 0 = one file */
+    ZliteVolumeHook volume_hook; /* optional, runs on its own thread */
+    void *volume_hook_arg;
+    uint64_t inflight_budget;   /* 0 = ZLITE_DEFAULT_INFLIGHT_BUDGET */
+    uint64_t block_size;        /* LZMA2 block size for multithreading, 0 = auto */
+    int dedup;                  /* store identical files once */
+    int filters;                /* pick branch/delta filters from file headers */
+    int text_ppmd;              /* compress text files with PPMd */
+    int probe;                  /* store files that look incompressible */
+    int ppmd_order;             /* 0 = by level */
+    uint32_t ppmd_mem_size;     /* 0 = by level */
+    int format;                 /* ZLITE_FORMAT_* */
+    FILE *stream_out;           /* write the archive here instead of to its path */
 } ZliteCompressOptions;
 
+/* Extraction options */
+typedef struct {
+    int num_threads;            /* 0 = number of CPUs */
+    char **patterns;            /* paths/globs to extract or test, NULL = all */
+    int num_patterns;
+    FILE *stream_out;           /* write file data here, in archive order, not to files */
+} ZliteExtractOptions;
+
 /* File info structure */
 typedef struct {
     char *path;
@@ -67,8 +131,34 @@ typedef struct {
     int is_hardlink;
     uint64_t inode;
     uint64_t device;
+    int64_t mtime;              /* nanoseconds since the epoch */
 } ZliteFileInfo;
 
+/* Collected file list. Entries are stored column-wise; a path is its last
+ * component plus the index of the directory entry it was found in, and all
+ * strings live in one arena. Build paths with zlite_file_list_path(). */
+#define ZLITE_NO_PARENT 0xFFFFFFFFu     /* command line argument */
+#define ZLITE_NO_STRING 0xFFFFFFFFu
+
+typedef struct {
+    uint32_t count;
+    uint32_t capacity;
+    uint32_t *parent;           /* directory entry index, or ZLITE_NO_PARENT */
+    uint32_t *name;             /* arena offset of the last component */
+    uint32_t *target;           /* arena offset of link target, or ZLITE_NO_STRING */
+    uint64_t *size;
+    uint32_t *crc;
+    uint8_t *type;              /* ZLITE_FILETYPE_* */
+    uint8_t *is_hardlink;
+    uint32_t *coder;            /* filter and method bits of the type word */
+    uint32_t *attrib;           /* st_mode, or Windows file attributes */
+    int64_t *mtime;             /* nanoseconds since the epoch */
+    uint64_t *inode;
+    char *strings;
+    size_t strings_size;
+    size_t strings_capacity;
+} ZliteFileList;
+
 /* Archive handle */
 typedef struct ZliteArchive ZliteArchive;
 
@@ -80,38 +170,283 @@ ZliteArchive* zlite_archive_create(const char *path, int create);
 void zlite_archive_close(ZliteArchive *archive);
 const char* zlite_archive_get_path(ZliteArchive *archive);
 
+/* Archive reader (memory mapped when possible). A split archive reads as
+ * one: offsets run across its volumes. Views returned by
+ * zlite_archive_view() stay valid until the next view call. */
+uint64_t zlite_archive_size(ZliteArchive *archive);
+const uint8_t* zlite_archive_view(ZliteArchive *archive, uint64_t offset, size_t size);
+int zlite_archive_read(ZliteArchive *archive, uint64_t offset, void *buf, size_t size);
+void zlite_archive_prefetch(ZliteArchive *archive, uint64_t offset, uint64_t size);
+
+/* Archive rewriting (see archive.c). zlite_archive_copy() appends raw
+ * archive bytes to an output; zlite_archive_replace() moves a rewritten
+ * archive into place and zlite_archive_discard() removes one that failed. */
+typedef struct ZliteOutput ZliteOutput;
+int zlite_archive_is_7z(ZliteArchive *archive);                /* standard 7z layout */
+uint64_t zlite_archive_volume_size(ZliteArchive *archive);     /* 0 = not split */
+int zlite_archive_copy(ZliteArchive *archive, uint64_t offset, uint64_t size, ZliteOutput *out);
+int zlite_archive_replace(ZliteArchive *archive, const char *tmp_path, uint64_t volume_size,
+                          ZliteVolumeHook hook, void *hook_arg);
+void zlite_archive_discard(const char *tmp_path, uint64_t volume_size);
+
 /* File operations */
 int zlite_add_files(ZliteArchive *archive, char **files, int num_files, 
                     const ZliteCompressOptions *options);
-int zlite_extract_files(ZliteArchive *archive, const char *output_dir);
+int zlite_update_files(ZliteArchive *archive, char **files, int num_files,
+                       const ZliteCompressOptions *options);
+int zlite_append_files(ZliteArchive *archive, char **files, int num_files,
+                       const ZliteCompressOptions *options);
+/* Compress everything read from `in` into a new archive holding one
+ * regular entry called `name` */
+int zlite_add_stream(ZliteArchive *archive, const char *name, FILE *in,
+                     const ZliteCompressOptions *options);
+int zlite_extract_files(ZliteArchive *archive, const char *output_dir,
+                        const ZliteExtractOptions *options);
 int zlite_list_files(ZliteArchive *archive);
-int zlite_test_archive(ZliteArchive *archive);
+int zlite_test_archive(ZliteArchive *archive, const ZliteExtractOptions *options);
+
+/* Edits that copy compressed data as is (see edit.c). Of the options only
+ * the volume settings apply; rename takes old and new paths in turn. */
+int zlite_delete_files(ZliteArchive *archive, char **patterns, int num_patterns,
+                       const ZliteCompressOptions *options);
+int zlite_rename_files(ZliteArchive *archive, char **names, int num_names,
+                       const ZliteCompressOptions *options);
 
 /* File list management */
-int zlite_collect_files(char **files, int num_files, ZliteFileInfo **result, 
-                        int *result_count);
-void zlite_free_file_list(ZliteFileInfo *files, int count);
+int zlite_collect_files(char **files, int num_files, ZliteFileList *list);
+void zlite_free_file_list(ZliteFileList *list);
+size_t zlite_file_list_path(const ZliteFileList *list, uint32_t index, char *buf, size_t size);
+const char* zlite_file_list_target(const ZliteFileList *list, uint32_t index);
+int zlite_file_list_set_target(ZliteFileList *list, uint32_t index, const char *target);
+
+/* Content deduplication: turns copies of earlier files into
+ * ZLITE_FILETYPE_REF entries (see dedup.c) */
+int zlite_dedup_files(ZliteFileList *list, int *dup_count, uint64_t *dup_bytes);
+
+/* Filters and per-file method selection (see filter.c).
+ * zlite_filter_encode/decode convert data in place and return how many
+ * bytes are final; the rest must be passed again with what follows. */
+typedef struct {
+    int filter;
+    unsigned delta;
+    uint32_t pc;
+    uint32_t x86_state;
+    uint8_t delta_state[256];
+} ZliteFilter;
+
+uint32_t zlite_filter_detect(const uint8_t *head, size_t size);
+int zlite_classify_files(ZliteFileList *list, const ZliteCompressOptions *options);
+void zlite_ppmd_props(const ZliteCompressOptions *options, uint64_t size,
+                      unsigned *order, uint32_t *mem_size);
+int zlite_filter_supported(uint32_t flags);
+const char* zlite_coder_name(uint32_t flags);
+void zlite_filter_init(ZliteFilter *f, uint32_t flags);
+size_t zlite_filter_encode(ZliteFilter *f, uint8_t *data, size_t size, int last);
+size_t zlite_filter_decode(ZliteFilter *f, uint8_t *data, size_t size, int last);
 
 /* Link support */
 int zlite_detect_links(const char *path, ZliteFileInfo *info);
 int zlite_create_link(const char *target, const char *link_path, int link_type);
 
+/* Archive layout: a 10-byte header (magic + record count), the entry
+ * records, then a central directory and a fixed-size footer that points
+ * at it. Archives written before the directory existed end after the
+ * last record and are indexed by scanning the records. */
+#define ZLITE_ARCHIVE_MAGIC      "7z\xBC\xAF\x27\x1C"
+#define ZLITE_ARCHIVE_MAGIC_SIZE 6
+#define ZLITE_ARCHIVE_HEADER_SIZE 10
+
+/* Bytes before the payload of a record: path_len, path, type, size,
+ * compressed_size, crc */
+#define ZLITE_RECORD_HEADER_SIZE(path_len) (28 + (uint64_t)(path_len))
+
+/* A record with ZLITE_FLAG_TRAILER was written to a stream that cannot
+ * seek back: its header holds zeros, and size, compressed_size and crc
+ * follow the payload instead. Only the directory knows where it ends. */
+#define ZLITE_RECORD_TRAILER_SIZE 20
+
+#define ZLITE_FOOTER_MAGIC       "ZLCD"
+#define ZLITE_FOOTER_SIZE        32
+#define ZLITE_DIR_VERSION        3
+#define ZLITE_DIR_ENTRY_SIZE     68     /* fixed part, before path and target */
+#define ZLITE_DIR_ENTRY_SIZE_V2  52     /* without mtime and inode */
+#define ZLITE_DIR_ENTRY_SIZE_V1  40     /* without the solid block fields */
+
+#define ZLITE_NO_BLOCK           0xFFFFFFFFu
+
+/* One archive entry, as seen through the index */
+typedef struct {
+    uint64_t offset;            /* start of the record */
+    uint64_t data_offset;       /* start of the payload */
+    uint64_t size;
+    uint64_t compressed_size;
+    uint32_t crc;
+    int type;                   /* ZLITE_FILETYPE_* without flags */
+    uint32_t flags;             /* ZLITE_FLAG_* */
+    uint32_t block;             /* solid block holding the data, or ZLITE_NO_BLOCK */
+    uint64_t unpack_offset;     /* offset of the data inside the solid block */
+    int64_t mtime;              /* of the file when it was added, 0 = unknown */
+    uint64_t inode;
+    const char *path;
+    const char *target;         /* symlink/hardlink/copy target, NULL otherwise */
+} ZliteIndexEntry;
+
+typedef struct {
+    ZliteIndexEntry *entries;
+    uint32_t count;
+    ZliteIndexEntry *blocks;    /* solid block records, in archive order */
+    uint32_t block_count;
+    char *strings;              /* storage behind path and target */
+    int from_directory;         /* 1 = read from the central directory */
+    uint64_t records_end;       /* end of the last record */
+} ZliteIndex;
+
+/* Central directory being built while records are written */
+typedef struct {
+    uint8_t *data;
+    size_t size;
+    size_t capacity;
+    uint32_t count;
+} ZliteDirWriter;
+
+/* Archive index */
+int zlite_index_load(ZliteArchive *archive, ZliteIndex *index);
+void zlite_index_free(ZliteIndex *index);
+
+/* Archive output (see volume.c). With a volume size the archive is split
+ * into path.001, path.002, ... of that many bytes; offsets are positions
+ * in the whole archive. A volume is closed and handed to the hook once
+ * zlite_output_commit() has moved past its end, except the first, which
+ * holds the header patched last. */
+typedef struct {
+    FILE *fp;                   /* NULL once closed */
+    uint64_t pos;               /* position of fp inside the volume */
+} ZliteVolume;
+
+struct ZliteOutput {
+    char *path;
+    uint64_t volume_size;       /* 0 = one file named path */
+    ZliteVolume *volumes;
+    uint32_t num_volumes;
+    uint32_t volumes_capacity;
+    uint32_t num_sealed;        /* volumes 1 .. num_sealed are closed */
+    uint32_t num_existing;      /* volumes opened for update rather than created */
+    int stream;                 /* written sequentially to a pipe, see zlite_output_open_stream() */
+    uint64_t pos;
+    int error;                  /* a volume failed to close */
+    void *hooks;                /* queue of closed volumes for the hook thread */
+};
+
+int zlite_output_open(ZliteOutput *out, const char *path, uint64_t volume_size,
+                      ZliteVolumeHook hook, void *hook_arg);
+int zlite_output_open_stream(ZliteOutput *out, FILE *fp);
+int zlite_output_reopen(ZliteOutput *out, const char *path, uint64_t volume_size,
+                        uint64_t pos, ZliteVolumeHook hook, void *hook_arg);
+size_t zlite_output_write(ZliteOutput *out, const void *data, size_t size);
+uint64_t zlite_output_copy(ZliteOutput *out, FILE *src, uint64_t src_offset, uint64_t size);
+int zlite_output_seek(ZliteOutput *out, uint64_t pos);
+uint64_t zlite_output_tell(const ZliteOutput *out);
+void zlite_output_commit(ZliteOutput *out, uint64_t pos);
+int zlite_output_truncate(ZliteOutput *out);
+int zlite_output_sync(ZliteOutput *out);
+int zlite_output_close(ZliteOutput *out, int complete);
+
+/* Record writers (see compress.c), shared by the add and edit paths */
+int zlite_write_entry_header(ZliteOutput *output, const char *path, int file_type,
+                             uint64_t size, uint64_t compressed_size,
+                             uint32_t crc, uint64_t *size_pos);
+int zlite_write_link_target(ZliteOutput *output, const char *target);
+
+void zlite_dir_init(ZliteDirWriter *dir);
+int zlite_dir_add(ZliteDirWriter *dir, const ZliteIndexEntry *entry);
+int zlite_dir_write(ZliteDirWriter *dir, ZliteOutput *out);
+void zlite_dir_free(ZliteDirWriter *dir);
+
+/* Standard 7z output (see write7z.c). Folders and files are collected
+ * while the packed streams are written after the signature header; the
+ * header goes last. Files with data must be added in the order of their
+ * folders' packed streams, right after the folder they belong to. */
+#define ZLITE_7Z_SIGNATURE_HEADER_SIZE 32
+
+typedef struct {
+    uint32_t coder;             /* filter and method bits */
+    uint8_t props[5];           /* properties of the method's coder */
+    uint8_t props_size;
+    uint64_t pack_size;
+    uint64_t unpack_size;
+    uint32_t num_streams;       /* files stored in the folder */
+} Zlite7zFolder;
+
+typedef struct {
+    uint64_t size;
+    uint32_t crc;
+    uint32_t attrib;            /* Windows attributes, Unix mode in the high 16 bits */
+} Zlite7zFile;
+
+typedef struct {
+    Zlite7zFolder *folders;
+    uint32_t num_folders;
+    uint32_t folders_capacity;
+    Zlite7zFile *files;
+    uint32_t num_files;
+    uint32_t files_capacity;
+    uint8_t *names;             /* UTF-16LE, each name terminated */
+    size_t names_size;
+    size_t names_capacity;
+} Zlite7zWriter;
+
+void zlite_7z_init(Zlite7zWriter *w);
+int zlite_7z_begin(ZliteOutput *out);
+size_t zlite_7z_props_size(uint32_t coder);
+uint32_t zlite_7z_attrib(int file_type, uint32_t attrib);
+int zlite_7z_add_folder(Zlite7zWriter *w, uint32_t coder, const uint8_t *props,
+                        uint64_t pack_size, uint64_t unpack_size);
+int zlite_7z_add_file(Zlite7zWriter *w, const char *path, uint64_t size, uint32_t crc,
+                      uint32_t attrib);
+int zlite_7z_write(Zlite7zWriter *w, ZliteOutput *out);
+void zlite_7z_free(Zlite7zWriter *w);
+
+/* Entry selection by path or glob (see select.c) */
+typedef struct {
+    const char *const *names;
+    const uint8_t *is_dir;      /* may be NULL */
+    uint32_t count;
+    uint32_t *buckets;          /* chain heads, count = empty */
+    uint32_t *next;
+    uint32_t mask;
+} ZliteNameIndex;
+
+int zlite_name_index_init(ZliteNameIndex *ni, const char *const *names,
+                          const uint8_t *is_dir, uint32_t count);
+void zlite_name_index_free(ZliteNameIndex *ni);
+uint32_t zlite_name_index_find(const ZliteNameIndex *ni, const char *name);
+uint32_t zlite_name_index_select(const ZliteNameIndex *ni, char **patterns, int num_patterns,
+                                 uint8_t *selected, int *unmatched);
+int zlite_match_pattern(const char *pattern, const char *path);
+
 /* Hard link table structures */
 struct HardLinkEntry {
     uint64_t inode;
     uint64_t device;
-    char *first_path;
+    char *first_path;           /* owned by the table's arena */
     int ref_count;
 };
 
+struct LinkArenaChunk;
+
 struct HardLinkTable {
-    struct HardLinkEntry *entries;
+    struct HardLinkEntry *entries;  /* in insertion order */
     int capacity;
     int count;
+    int *slots;                     /* open addressing on (device, inode), -1 = empty */
+    uint32_t slot_mask;
+    struct LinkArenaChunk *arena;   /* storage for first_path strings */
 };
 
-/* Hard link table management */
+/* Hard link table management. Pointers returned by find_or_add stay valid
+ * until the next insertion. */
 HardLinkTable* zlite_link_table_create(void);
+void zlite_link_table_reset(HardLinkTable *table);
 void zlite_link_table_free(HardLinkTable *table);
 struct HardLinkEntry* zlite_link_table_find_or_add(HardLinkTable *table, const char *path,
                                             uint64_t inode, uint64_t device);
@@ -135,5 +470,36 @@ int zlite_stat_file(const char *path, ZliteFileStat *stat);
 int zlite_set_file_times(const char *path, time_t mtime, time_t atime);
 int zlite_set_file_mode(const char *path, uint32_t mode);
 int zlite_mkdir_recursive(const char *path);
+int zlite_get_cpu_count(void);
+uint64_t zlite_time_usec(void);         /* monotonic clock, microseconds */
+uint64_t zlite_cpu_usec(void);          /* CPU time of the process, microseconds */
+int zlite_truncate_file(FILE *fp, uint64_t size);
+int zlite_sync_file(FILE *fp);          /* flush to the storage device */
+/* Binary streams on the standard input and output. Taking stdout moves
+ * the process's own stdout to stderr, so messages printed afterwards stay
+ * out of the data; NULL on failure. */
+FILE* zlite_stdin_binary(void);
+FILE* zlite_stdout_binary(void);
+/* Copy size bytes between files in the kernel where the platform can;
+ * returns how many were copied, which may be fewer (or 0). Neither FILE
+ * position moves. */
+uint64_t zlite_copy_range(FILE *src, uint64_t src_offset, FILE *dst, uint64_t dst_offset,
+                          uint64_t size);
+int zlite_replace_file(const char *from, const char *to);   /* rename over `to` */
+
+#ifndef _WIN32
+/* Fill type, size, mtime, attributes, inode and device of `name`
+ * (relative to the directory fd dir_fd, or AT_FDCWD) without following
+ * symlinks. Only symlinks get a link_target, allocated to fit. */
+int zlite_stat_at(int dir_fd, const char *name, ZliteFileInfo *info);
+#endif
+
+/* Memory mapping */
+#define ZLITE_ADVISE_SEQUENTIAL 0
+#define ZLITE_ADVISE_WILLNEED   1
+
+void* zlite_map_file(FILE *fp, uint64_t size, void **handle);
+void zlite_unmap_file(void *addr, uint64_t size, void *handle);
+void zlite_advise(void *addr, uint64_t size, int advice);
 
 #endif /* 7ZLITE_H */
\ No newline at end of file
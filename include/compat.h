@@ -49,6 +49,15 @@ extern "C" {
     #define ZLITE_INVALID_FILE (-1)
 #endif
 
+/* 64-bit file positioning */
+#ifdef _WIN32
+    #define zlite_fseek(fp, offset, whence) _fseeki64(fp, offset, whence)
+    #define zlite_ftell(fp) _ftelli64(fp)
+#else
+    #define zlite_fseek(fp, offset, whence) fseeko(fp, (off_t)(offset), whence)
+    #define zlite_ftell(fp) ((int64_t)ftello(fp))
+#endif
+
 #ifdef __cplusplus
 }
 #endif
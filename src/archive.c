@@ -4,16 +4,130 @@
 #include <stdlib.h>
 #include <string.h>
 
+#ifndef PATH_MAX
+#define PATH_MAX 4096
+#endif
+
+#include "7zCrc.h"
+
+/* One file of the archive. A split archive is the concatenation of its
+ * volumes path.001, path.002, ...; a plain archive is a single volume. */
+typedef struct {
+    FILE *fp;
+    const uint8_t *data;        /* mapped file, NULL when not mapped */
+    void *map_handle;
+    uint64_t offset;            /* position of the volume in the archive */
+    uint64_t size;
+} ReaderVolume;
+
+/* Read-only view of the archive contents. Every volume is memory mapped
+ * when the platform allows it; otherwise views are served from a window
+ * buffer filled with positioned reads on the FILE handles. */
+typedef struct {
+    ReaderVolume *volumes;
+    uint32_t num_volumes;
+    uint64_t size;
+    uint8_t *window;            /* views that are unmapped or span volumes */
+    size_t window_size;
+} ArchiveReader;
+
 struct ZliteArchive {
-    char *path;
+    char *path;                 /* for a volume set, the name without .001 */
     int is_writable;
-    FILE *fp;
-    void *internal_data;
+    int is_split;               /* read from path.001, path.002, ... */
+    void *internal_data;        /* ArchiveReader, NULL when writing */
 };
 
+static void reader_free(ArchiveReader *reader);
+
+/* Append an open file as the next volume */
+static int reader_add_volume(ArchiveReader *reader, FILE *fp) {
+    ReaderVolume *volumes;
+    ReaderVolume *v;
+    int64_t size;
+    
+    if (zlite_fseek(fp, 0, SEEK_END) != 0 || (size = zlite_ftell(fp)) < 0) {
+        fclose(fp);
+        return ZLITE_ERROR_READ;
+    }
+    
+    volumes = (ReaderVolume *)realloc(reader->volumes,
+                                      (reader->num_volumes + 1) * sizeof(ReaderVolume));
+    if (!volumes) {
+        fclose(fp);
+        return ZLITE_ERROR_MEMORY;
+    }
+    reader->volumes = volumes;
+    v = &volumes[reader->num_volumes++];
+    memset(v, 0, sizeof(*v));
+    v->fp = fp;
+    v->offset = reader->size;
+    v->size = (uint64_t)size;
+    reader->size += v->size;
+    
+    /* Map the whole volume; readers walk it front to back */
+    if (v->size > 0) {
+        v->data = (const uint8_t *)zlite_map_file(fp, v->size, &v->map_handle);
+        if (v->data) {
+            zlite_advise((void *)v->data, v->size, ZLITE_ADVISE_SEQUENTIAL);
+        }
+    }
+    return ZLITE_OK;
+}
+
+/* Open archive->path, or the volume set it names: path.001, path.002, ...
+ * when path itself does not exist, or the set that path.001 starts */
+static ArchiveReader* reader_open(ZliteArchive *archive) {
+    ArchiveReader *reader;
+    char *base = archive->path;
+    size_t len = strlen(base);
+    FILE *fp = NULL;
+    uint32_t i;
+    
+    reader = (ArchiveReader *)calloc(1, sizeof(ArchiveReader));
+    if (!reader || len >= PATH_MAX) {
+        free(reader);
+        return NULL;
+    }
+    
+    if (len > 4 && strcmp(base + len - 4, ".001") == 0) {
+        base[len - 4] = '\0';
+    } else {
+        fp = fopen(base, "rb");
+    }
+    
+    if (fp) {
+        if (reader_add_volume(reader, fp) != ZLITE_OK) {
+            reader_free(reader);
+            return NULL;
+        }
+        return reader;
+    }
+    archive->is_split = 1;
+    
+    for (i = 1; ; i++) {
+        char volume[PATH_MAX + 16];
+        
+        snprintf(volume, sizeof(volume), "%s.%03u", base, i);
+        fp = fopen(volume, "rb");
+        if (!fp) {
+            break;
+        }
+        if (reader_add_volume(reader, fp) != ZLITE_OK) {
+            reader_free(reader);
+            return NULL;
+        }
+    }
+    
+    if (reader->num_volumes == 0) {
+        reader_free(reader);
+        return NULL;
+    }
+    return reader;
+}
+
 ZliteArchive* zlite_archive_create(const char *path, int create) {
     ZliteArchive *archive;
-    const char *mode;
     
     archive = (ZliteArchive *)malloc(sizeof(ZliteArchive));
     if (!archive) {
@@ -27,40 +141,326 @@ ZliteArchive* zlite_archive_create(const char *path, int create) {
     }
     
     archive->is_writable = create;
-    mode = create ? "wb" : "rb";
+    archive->is_split = 0;
+    archive->internal_data = NULL;
     
-    archive->fp = fopen(path, mode);
-    if (!archive->fp) {
-        free(archive->path);
-        free(archive);
-        return NULL;
+    /* The add path creates the archive (or its volumes) itself */
+    if (!create) {
+        archive->internal_data = reader_open(archive);
+        if (!archive->internal_data) {
+            free(archive->path);
+            free(archive);
+            return NULL;
+        }
     }
     
-    archive->internal_data = NULL;
-    
     return archive;
 }
 
+static void reader_free(ArchiveReader *reader) {
+    uint32_t i;
+    
+    for (i = 0; i < reader->num_volumes; i++) {
+        ReaderVolume *v = &reader->volumes[i];
+        
+        if (v->data) {
+            zlite_unmap_file((void *)v->data, v->size, v->map_handle);
+        }
+        fclose(v->fp);
+    }
+    free(reader->volumes);
+    free(reader->window);
+    free(reader);
+}
+
 void zlite_archive_close(ZliteArchive *archive) {
     if (!archive) {
         return;
     }
     
-    if (archive->fp) {
-        fclose(archive->fp);
+    if (archive->internal_data) {
+        reader_free((ArchiveReader *)archive->internal_data);
     }
     
     if (archive->path) {
         free(archive->path);
     }
     
-    if (archive->internal_data) {
-        free(archive->internal_data);
-    }
-    
     free(archive);
 }
 
 const char* zlite_archive_get_path(ZliteArchive *archive) {
     return archive ? archive->path : NULL;
-}
\ No newline at end of file
+}
+
+static ArchiveReader* get_reader(ZliteArchive *archive) {
+    return (ArchiveReader *)archive->internal_data;
+}
+
+/* The volume holding archive offset `offset` */
+static ReaderVolume* find_volume(ArchiveReader *reader, uint64_t offset) {
+    uint32_t lo = 0;
+    uint32_t hi = reader->num_volumes - 1;
+    
+    while (lo < hi) {
+        uint32_t mid = lo + (hi - lo + 1) / 2;
+        
+        if (reader->volumes[mid].offset <= offset) {
+            lo = mid;
+        } else {
+            hi = mid - 1;
+        }
+    }
+    return &reader->volumes[lo];
+}
+
+/* Copy a range that may span volumes */
+static int reader_read(ArchiveReader *reader, uint64_t offset, uint8_t *buf, size_t size) {
+    while (size > 0) {
+        ReaderVolume *v = find_volume(reader, offset);
+        uint64_t local = offset - v->offset;
+        size_t n = size;
+        
+        if (local >= v->size) {
+            return ZLITE_ERROR_READ;
+        }
+        if (n > v->size - local) {
+            n = (size_t)(v->size - local);
+        }
+        
+        if (v->data) {
+            memcpy(buf, v->data + local, n);
+        } else if (zlite_fseek(v->fp, (int64_t)local, SEEK_SET) != 0 ||
+                   fread(buf, 1, n, v->fp) != n) {
+            return ZLITE_ERROR_READ;
+        }
+        
+        offset += n;
+        buf += n;
+        size -= n;
+    }
+    return ZLITE_OK;
+}
+
+uint64_t zlite_archive_size(ZliteArchive *archive) {
+    ArchiveReader *reader = get_reader(archive);
+    return reader ? reader->size : 0;
+}
+
+const uint8_t* zlite_archive_view(ZliteArchive *archive, uint64_t offset, size_t size) {
+    ArchiveReader *reader = get_reader(archive);
+    ReaderVolume *v;
+    uint64_t local;
+    
+    if (!reader || offset > reader->size || size > reader->size - offset) {
+        return NULL;
+    }
+    
+    v = find_volume(reader, offset);
+    local = offset - v->offset;
+    if (v->data && local <= v->size && size <= v->size - local) {
+        return v->data + local;
+    }
+    
+    /* Not mapped, or split between volumes: copy into the window buffer */
+    if (size > reader->window_size) {
+        uint8_t *window = (uint8_t *)realloc(reader->window, size);
+        if (!window) {
+            return NULL;
+        }
+        reader->window = window;
+        reader->window_size = size;
+    }
+    
+    if (reader_read(reader, offset, reader->window, size) != ZLITE_OK) {
+        return NULL;
+    }
+    
+    return reader->window;
+}
+
+int zlite_archive_read(ZliteArchive *archive, uint64_t offset, void *buf, size_t size) {
+    ArchiveReader *reader = get_reader(archive);
+    
+    if (!reader || offset > reader->size || size > reader->size - offset) {
+        return ZLITE_ERROR_READ;
+    }
+    
+    return reader_read(reader, offset, (uint8_t *)buf, size);
+}
+
+/* Readahead is requested per volume, so the reads of a range that spans
+ * volumes (possibly on different disks) run side by side */
+void zlite_archive_prefetch(ZliteArchive *archive, uint64_t offset, uint64_t size) {
+    ArchiveReader *reader = get_reader(archive);
+    
+    if (!reader || offset >= reader->size) {
+        return;
+    }
+    if (size > reader->size - offset) {
+        size = reader->size - offset;
+    }
+    
+    while (size > 0) {
+        ReaderVolume *v = find_volume(reader, offset);
+        uint64_t local = offset - v->offset;
+        uint64_t n = v->size - local;
+        
+        if (local >= v->size) {
+            return;
+        }
+        if (n > size) {
+            n = size;
+        }
+        if (v->data) {
+            zlite_advise((void *)(v->data + local), n, ZLITE_ADVISE_WILLNEED);
+        }
+        offset += n;
+        size -= n;
+    }
+}
+
+/* 7-Zip signature header: the CRC at 8 covers the 20 bytes after it. The
+ * custom format starts with the same six bytes. */
+int zlite_archive_is_7z(ZliteArchive *archive) {
+    const uint8_t *p = zlite_archive_view(archive, 0, ZLITE_7Z_SIGNATURE_HEADER_SIZE);
+    uint32_t crc;
+    
+    if (!p) {
+        return 0;
+    }
+    crc = (uint32_t)p[8] | ((uint32_t)p[9] << 8) | ((uint32_t)p[10] << 16) |
+          ((uint32_t)p[11] << 24);
+    return p[6] == 0 && CrcCalc(p + 12, 20) == crc;
+}
+
+uint64_t zlite_archive_volume_size(ZliteArchive *archive) {
+    ArchiveReader *reader = get_reader(archive);
+    
+    if (!reader || !archive->is_split) {
+        return 0;
+    }
+    return reader->volumes[0].size;
+}
+
+/* Append archive bytes [offset, offset + size) to out, in the kernel where
+ * the platform allows */
+int zlite_archive_copy(ZliteArchive *archive, uint64_t offset, uint64_t size, ZliteOutput *out) {
+    ArchiveReader *reader = get_reader(archive);
+    
+    if (!reader || offset > reader->size || size > reader->size - offset) {
+        return ZLITE_ERROR_READ;
+    }
+    
+    while (size > 0) {
+        ReaderVolume *v = find_volume(reader, offset);
+        uint64_t local = offset - v->offset;
+        uint64_t n = v->size - local;
+        uint64_t done;
+        
+        if (n > size) {
+            n = size;
+        }
+        done = zlite_output_copy(out, v->fp, local, n);
+        
+        /* Whatever the kernel did not copy goes through memory */
+        while (done < n) {
+            size_t chunk = n - done > ((uint64_t)1 << 20) ? ((size_t)1 << 20)
+                                                          : (size_t)(n - done);
+            const uint8_t *data = zlite_archive_view(archive, offset + done, chunk);
+            
+            if (!data) {
+                return ZLITE_ERROR_READ;
+            }
+            if (zlite_output_write(out, data, chunk) != chunk) {
+                return ZLITE_ERROR_WRITE;
+            }
+            done += chunk;
+        }
+        
+        offset += n;
+        size -= n;
+    }
+    return ZLITE_OK;
+}
+
+/* Remove an archive written at tmp_path (or tmp_path.001, ...) */
+void zlite_archive_discard(const char *tmp_path, uint64_t volume_size) {
+    char volume[PATH_MAX + 16];
+    uint32_t i;
+    
+    if (volume_size == 0) {
+        remove(tmp_path);
+        return;
+    }
+    for (i = 1; ; i++) {
+        snprintf(volume, sizeof(volume), "%s.%03u", tmp_path, i);
+        if (remove(volume) != 0) {
+            break;
+        }
+    }
+}
+
+/* Move the archive written at tmp_path (or tmp_path.001, ... when
+ * volume_size is set) over this one and remove what is left of the old
+ * layout, then pass the new volumes to hook under their final names. On
+ * failure the rewrite is discarded. The archive can no longer be read
+ * afterwards. */
+int zlite_archive_replace(ZliteArchive *archive, const char *tmp_path, uint64_t volume_size,
+                          ZliteVolumeHook hook, void *hook_arg) {
+    char from[PATH_MAX + 16];
+    char to[PATH_MAX + 16];
+    uint32_t num_volumes;
+    uint32_t i = 1;
+    
+    /* Windows cannot rename over a file that is open */
+    if (archive->internal_data) {
+        reader_free((ArchiveReader *)archive->internal_data);
+        archive->internal_data = NULL;
+    }
+    
+    if (volume_size == 0) {
+        if (zlite_replace_file(tmp_path, archive->path) != 0) {
+            zlite_archive_discard(tmp_path, volume_size);
+            return ZLITE_ERROR_WRITE;
+        }
+    } else {
+        for (i = 1; ; i++) {
+            snprintf(from, sizeof(from), "%s.%03u", tmp_path, i);
+            snprintf(to, sizeof(to), "%s.%03u", archive->path, i);
+            if (zlite_replace_file(from, to) != 0) {
+                break;
+            }
+        }
+        if (i == 1) {
+            zlite_archive_discard(tmp_path, volume_size);
+            return ZLITE_ERROR_WRITE;
+        }
+        if (!archive->is_split) {
+            remove(archive->path);
+        }
+    }
+    num_volumes = i - 1;
+    
+    /* Volumes past the end of the new set */
+    if (archive->is_split) {
+        if (volume_size == 0) {
+            i = 1;
+        }
+        for (; ; i++) {
+            snprintf(to, sizeof(to), "%s.%03u", archive->path, i);
+            if (remove(to) != 0) {
+                break;
+            }
+        }
+    }
+    
+    if (hook && volume_size == 0) {
+        hook(archive->path, hook_arg);
+    }
+    for (i = 1; hook && i <= num_volumes; i++) {
+        snprintf(to, sizeof(to), "%s.%03u", archive->path, i);
+        hook(to, hook_arg);
+    }
+    return ZLITE_OK;
+}
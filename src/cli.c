@@ -20,32 +20,213 @@ static void print_usage(void) {
     printf("  x              Extract files with full paths\n");
     printf("  e              Extract files (without directory names)\n");
     printf("  l              List archive contents\n");
-    printf("  t              Test archive integrity\n\n");
+    printf("  t              Test archive integrity\n");
+    printf("  u              Update archive, compressing only new and changed files\n");
+    printf("  d              Delete files from archive (without recompressing the rest)\n");
+    printf("  rn             Rename files in archive: rn <archive> <old> <new> [<old> <new> ...]\n\n");
     printf("Options:\n");
     printf("  -0..-9         Set compression level (0=store, 9=ultra)\n");
     printf("                 Default: 5\n");
-    printf("  -m{method}     Set compression method (lzma2, lzma)\n");
+    printf("  -m{method}     Set compression method (lzma2, lzma, ppmd, copy)\n");
     printf("                 Default: lzma2\n");
-    printf("  -t{threads}    Set number of threads\n");
+    printf("  -ms={on|off|N} Compress small files together in solid blocks of N bytes\n");
+    printf("                 Default: on, 32M\n");
+    printf("  -mf={on|off}   Filter executables (BCJ, ARM64, ...) and audio (Delta)\n");
+    printf("                 Default: on\n");
+    printf("  -mtext={on|off} Compress text files with PPMd\n");
+    printf("                 Default: on\n");
+    printf("  -mprobe={on|off} Store files that do not compress (by header or a sample)\n");
+    printf("                 Default: on\n");
+    printf("  -mo=N          PPMd model order (2-64)\n");
+    printf("  -mmem={size}   PPMd model memory\n");
+    printf("                 Default: by level\n");
+    printf("  -t{threads}    Set number of threads (compression and extraction)\n");
     printf("                 Default: auto\n");
-    printf("  -v{size}       Set volume size (e.g., 100M, 1G)\n");
+    printf("  -v{size}       Split the archive into volumes of size bytes (e.g., 100M, 1G)\n");
+    printf("                 named archive.001, archive.002, ...\n");
+    printf("  --on-volume=CMD Run CMD with each finished volume's path as its last argument\n");
+    printf("  -b{size}       Set LZMA2 block size for multithreaded compression\n");
+    printf("                 Default: auto\n");
+    printf("  -M{size}       Limit memory held by parallel compression\n");
+    printf("                 Default: 256M\n");
+    printf("  --append       With a: add to the existing archive in place, after its data\n");
+    printf("  -si[name]      With a: compress standard input into one file called name\n");
+    printf("                 Default name: stdin\n");
+    printf("                 With several threads, input goes in blocks of 4M (-b to change),\n");
+    printf("                 about 50M of memory per thread\n");
+    printf("  -so            With a: write the archive to standard output\n");
+    printf("                 With x/e: write the selected files' data to standard output\n");
+    printf("  --format={zlite|7z} Archive format to write; 7z is readable by 7-Zip\n");
+    printf("                 Default: zlite\n");
     printf("  -h, --help     Show this help message\n");
     printf("  -V, --version  Show version information\n\n");
     printf("Examples:\n");
     printf("  7zlite a archive.7z file1 file2 dir/\n");
     printf("  7zlite x archive.7z -ooutput/\n");
+    printf("  7zlite x archive.7z -ooutput/ etc/app.conf 'bin/*'  # Selected files only\n");
     printf("  7zlite l archive.7z\n");
     printf("  7zlite a -9 archive.7z files/  # Maximum compression\n");
     printf("  7zlite a -m lzma archive.7z file  # Use LZMA method\n");
+    printf("  7zlite a --format=7z archive.7z files/  # Standard 7z\n");
+    printf("  7zlite u archive.7z files/  # Refresh from disk, copying what is unchanged\n");
+    printf("  7zlite a --append archive.7z new/  # Add files without rewriting the archive\n");
+    printf("  7zlite d archive.7z 'logs/*.log'  # Delete files\n");
+    printf("  7zlite rn archive.7z docs/old.txt docs/new.txt  # Rename a file\n");
+    printf("  7zlite a -v1G --on-volume='upload' archive.7z files/  # Upload while compressing\n");
+    printf("  tar c build/ | 7zlite a -sibuild.tar build.7z  # Compress a pipe\n");
+    printf("  7zlite a -so - build/ | ssh host 'cat > build.7z'  # Archive into a pipe\n");
+    printf("  7zlite x -so build.7z build.tar | tar x  # Extract a file into a pipe\n");
 }
 
 static void print_version(void) {
     printf("%s\n", VERSION);
     printf("Built with LZMA SDK\n");
-    printf("Supports: LZMA, LZMA2 compression\n");
+    printf("Supports: LZMA, LZMA2, PPMd compression\n");
     printf("          Hard links and symbolic links\n");
 }
 
+/* Parse a size with an optional K/M/G suffix (e.g., 100M, 1.5G) */
+static uint64_t parse_size(const char *str) {
+    if (strstr(str, "G") || strstr(str, "g")) {
+        return (uint64_t)(atof(str) * 1024 * 1024 * 1024);
+    } else if (strstr(str, "M") || strstr(str, "m")) {
+        return (uint64_t)(atof(str) * 1024 * 1024);
+    } else if (strstr(str, "K") || strstr(str, "k")) {
+        return (uint64_t)(atof(str) * 1024);
+    }
+    return (uint64_t)strtoull(str, NULL, 10);
+}
+
+/* Parse the value of -ms=: on, off, or a solid block size */
+static int parse_solid(const char *value, ZliteCompressOptions *opts) {
+    if (strcmp(value, "on") == 0) {
+        opts->solid = 1;
+    } else if (strcmp(value, "off") == 0) {
+        opts->solid = 0;
+    } else if (value[0] >= '0' && value[0] <= '9') {
+        opts->solid = 1;
+        opts->solid_block_size = parse_size(value);
+    } else {
+        fprintf(stderr, "Error: Invalid solid mode '%s'\n", value);
+        return ZLITE_ERROR_PARAM;
+    }
+    return ZLITE_OK;
+}
+
+/* Parse the value of -mf=: on or off */
+static int parse_filters(const char *value, ZliteCompressOptions *opts) {
+    if (strcmp(value, "on") == 0) {
+        opts->filters = 1;
+    } else if (strcmp(value, "off") == 0) {
+        opts->filters = 0;
+    } else {
+        fprintf(stderr, "Error: Invalid filter mode '%s'\n", value);
+        return ZLITE_ERROR_PARAM;
+    }
+    return ZLITE_OK;
+}
+
+/* Parse the value of -m: a method name or one of the s=, f=, text=,
+ * probe=, o= and mem= settings */
+static int parse_method(const char *value, ZliteCompressOptions *opts) {
+    if (strcmp(value, "lzma2") == 0) {
+        opts->method = ZLITE_METHOD_LZMA2;
+    } else if (strcmp(value, "lzma") == 0) {
+        opts->method = ZLITE_METHOD_LZMA;
+    } else if (strcmp(value, "ppmd") == 0) {
+        opts->method = ZLITE_METHOD_PPMD;
+    } else if (strcmp(value, "copy") == 0 || strcmp(value, "store") == 0) {
+        opts->method = ZLITE_METHOD_COPY;
+    } else if (strncmp(value, "s=", 2) == 0) {
+        return parse_solid(value + 2, opts);
+    } else if (strncmp(value, "f=", 2) == 0) {
+        return parse_filters(value + 2, opts);
+    } else if (strcmp(value, "text=on") == 0) {
+        opts->text_ppmd = 1;
+    } else if (strcmp(value, "text=off") == 0) {
+        opts->text_ppmd = 0;
+    } else if (strcmp(value, "probe=on") == 0) {
+        opts->probe = 1;
+    } else if (strcmp(value, "probe=off") == 0) {
+        opts->probe = 0;
+    } else if (strncmp(value, "o=", 2) == 0) {
+        opts->ppmd_order = atoi(value + 2);
+        if (opts->ppmd_order < 2 || opts->ppmd_order > 64) {
+            fprintf(stderr, "Error: Invalid PPMd order '%s'\n", value + 2);
+            return ZLITE_ERROR_PARAM;
+        }
+    } else if (strncmp(value, "mem=", 4) == 0) {
+        uint64_t size = parse_size(value + 4);
+        if (size < ((uint64_t)1 << 11) || size > ((uint64_t)1 << 31)) {
+            fprintf(stderr, "Error: Invalid PPMd memory size '%s'\n", value + 4);
+            return ZLITE_ERROR_PARAM;
+        }
+        opts->ppmd_mem_size = (uint32_t)size;
+    } else {
+        fprintf(stderr, "Error: Unknown compression method '%s'\n", value);
+        return ZLITE_ERROR_PARAM;
+    }
+    return ZLITE_OK;
+}
+
+/* Parse the value of --format=: zlite or 7z */
+static int parse_format(const char *value, ZliteCompressOptions *opts) {
+    if (strcmp(value, "zlite") == 0) {
+        opts->format = ZLITE_FORMAT_ZLITE;
+    } else if (strcmp(value, "7z") == 0) {
+        opts->format = ZLITE_FORMAT_7Z;
+    } else {
+        fprintf(stderr, "Error: Unknown archive format '%s'\n", value);
+        return ZLITE_ERROR_PARAM;
+    }
+    return ZLITE_OK;
+}
+
+/* Volume hook for --on-volume: run the command with the quoted path */
+static void run_volume_command(const char *volume_path, void *arg) {
+    const char *command = (const char *)arg;
+    size_t size = strlen(command) + strlen(volume_path) * 4 + 4;
+    char *line = (char *)malloc(size);
+    char *p;
+    const char *s;
+    int status;
+
+    if (!line) {
+        fprintf(stderr, "Warning: Cannot run volume command for '%s'\n", volume_path);
+        return;
+    }
+
+    p = line + sprintf(line, "%s ", command);
+#ifdef _WIN32
+    *p++ = '"';
+    for (s = volume_path; *s; s++) {
+        *p++ = *s;
+    }
+    *p++ = '"';
+#else
+    /* Single quotes, with each ' written as '\'' */
+    *p++ = '\'';
+    for (s = volume_path; *s; s++) {
+        if (*s == '\'') {
+            memcpy(p, "'\\''", 4);
+            p += 4;
+        } else {
+            *p++ = *s;
+        }
+    }
+    *p++ = '\'';
+#endif
+    *p = '\0';
+
+    fflush(stdout);
+    status = system(line);
+    if (status != 0) {
+        fprintf(stderr, "Warning: Volume command failed for '%s' (status %d)\n",
+                volume_path, status);
+    }
+    free(line);
+}
+
 typedef struct {
     ZliteCommand command;
     char *archive_path;
@@ -53,10 +234,27 @@ typedef struct {
     int num_files;
     char *output_dir;
     ZliteCompressOptions compress_opts;
+    ZliteExtractOptions extract_opts;
+    int append;                 /* add to an existing archive in place */
+    char *stdin_name;           /* -si: compress stdin into an entry of this name */
+    int to_stdout;              /* -so: archive or file data to stdout */
     int show_help;
     int show_version;
 } CommandLineArgs;
 
+/* Parse the value of -s: i[name] or o */
+static int parse_stream(const char *value, CommandLineArgs *args) {
+    if (value[0] == 'i') {
+        args->stdin_name = (char *)(value[1] ? value + 1 : "stdin");
+    } else if (strcmp(value, "o") == 0) {
+        args->to_stdout = 1;
+    } else {
+        fprintf(stderr, "Error: Unknown option '-s%s'\n", value);
+        return ZLITE_ERROR_PARAM;
+    }
+    return ZLITE_OK;
+}
+
 static int parse_args(int argc, char **argv, CommandLineArgs *args) {
 #ifdef _WIN32
     /* Windows: manual parsing */
@@ -67,8 +265,14 @@ static int parse_args(int argc, char **argv, CommandLineArgs *args) {
     args->compress_opts.level = ZLITE_LEVEL_DEFAULT;
     args->compress_opts.method = ZLITE_METHOD_LZMA2;
     args->compress_opts.solid = 1;
+    args->compress_opts.dedup = 1;
+    args->compress_opts.filters = 1;
+    args->compress_opts.text_ppmd = 1;
+    args->compress_opts.probe = 1;
     args->compress_opts.num_threads = 0;
     args->compress_opts.volume_size = 0;
+    args->compress_opts.inflight_budget = 0; /* Auto */
+    args->compress_opts.block_size = 0; /* Auto */
     args->command = ZLITE_CMD_ADD;
     
     /* First argument should be the command */
@@ -87,6 +291,12 @@ static int parse_args(int argc, char **argv, CommandLineArgs *args) {
         args->command = ZLITE_CMD_LIST;
     } else if (strcmp(argv[1], "t") == 0) {
         args->command = ZLITE_CMD_TEST;
+    } else if (strcmp(argv[1], "u") == 0) {
+        args->command = ZLITE_CMD_UPDATE;
+    } else if (strcmp(argv[1], "d") == 0) {
+        args->command = ZLITE_CMD_DELETE;
+    } else if (strcmp(argv[1], "rn") == 0) {
+        args->command = ZLITE_CMD_RENAME;
     } else if (strcmp(argv[1], "-h") == 0 || strcmp(argv[1], "--help") == 0) {
         args->show_help = 1;
         return ZLITE_OK;
@@ -102,21 +312,57 @@ static int parse_args(int argc, char **argv, CommandLineArgs *args) {
         if (argv[i][0] == '-' && argv[i][1] >= '0' && argv[i][1] <= '9') {
             /* Compression level: -0 to -9 */
             args->compress_opts.level = argv[i][1] - '0';
+        } else if (argv[i][0] == '-' && argv[i][1] == 't' && argv[i][2] != '\0') {
+            /* Thread count: -t{threads} */
+            args->compress_opts.num_threads = atoi(argv[i] + 2);
+            args->extract_opts.num_threads = args->compress_opts.num_threads;
+        } else if (argv[i][0] == '-' && argv[i][1] == 'm' && argv[i][2] != '\0') {
+            /* Method and method settings: -m{method}, -ms=, -mf=, ... */
+            if (parse_method(argv[i] + 2, &args->compress_opts) != ZLITE_OK) {
+                return ZLITE_ERROR_PARAM;
+            }
+        } else if (argv[i][0] == '-' && argv[i][1] == 'b' && argv[i][2] != '\0') {
+            /* LZMA2 block size: -b{size} */
+            args->compress_opts.block_size = parse_size(argv[i] + 2);
+        } else if (argv[i][0] == '-' && argv[i][1] == 'M' && argv[i][2] != '\0') {
+            /* Pipeline memory budget: -M{size} */
+            args->compress_opts.inflight_budget = parse_size(argv[i] + 2);
+        } else if (argv[i][0] == '-' && argv[i][1] == 'v' && argv[i][2] != '\0') {
+            /* Volume size: -v{size} */
+            args->compress_opts.volume_size = parse_size(argv[i] + 2);
+        } else if (strncmp(argv[i], "--on-volume=", 12) == 0) {
+            /* Command run on each finished volume: --on-volume=CMD */
+            args->compress_opts.volume_hook = run_volume_command;
+            args->compress_opts.volume_hook_arg = argv[i] + 12;
+        } else if (strcmp(argv[i], "--append") == 0) {
+            /* Add to the archive in place: --append */
+            args->append = 1;
+        } else if (argv[i][0] == '-' && argv[i][1] == 's' && argv[i][2] != '\0') {
+            /* Standard streams: -si[name], -so */
+            if (parse_stream(argv[i] + 2, args) != ZLITE_OK) {
+                return ZLITE_ERROR_PARAM;
+            }
+        } else if (strncmp(argv[i], "--format=", 9) == 0) {
+            /* Archive format: --format={zlite|7z} */
+            if (parse_format(argv[i] + 9, &args->compress_opts) != ZLITE_OK) {
+                return ZLITE_ERROR_PARAM;
+            }
         } else if (argv[i][0] == '-' && strcmp(argv[i], "-o") == 0 && i + 1 < argc) {
             /* Output directory: -o path */
             args->output_dir = strdup(argv[++i]);
         } else if (argv[i][0] == '-' && argv[i][1] == 'o' && argv[i][2] != '\0') {
             /* Output directory: -opath */
             args->output_dir = strdup(argv[i] + 2);
-        } else if (argv[i][0] != '-') {
-            /* Archive path or files */
+        } else if (argv[i][0] != '-' || argv[i][1] == '\0') {
+            /* Archive path or files; "-" names the archive written by -so */
             if (!args->archive_path) {
                 args->archive_path = argv[i];
             } else {
                 /* For extract command, if there's only one remaining argument and no -o was provided,
                    treat it as output directory */
                 if ((args->command == ZLITE_CMD_EXTRACT || args->command == ZLITE_CMD_LIST ||
-                     args->command == ZLITE_CMD_TEST) && !args->output_dir && i == argc - 1) {
+                     args->command == ZLITE_CMD_TEST) && !args->output_dir &&
+                    !args->to_stdout && i == argc - 1) {
                     args->output_dir = strdup(argv[i]);
                 } else {
                     args->files = &argv[i];
@@ -142,6 +388,9 @@ static int parse_args(int argc, char **argv, CommandLineArgs *args) {
     static struct option long_options[] = {
         {"help",    no_argument,       0, 'h'},
         {"version", no_argument,       0, 'V'},
+        {"format",  required_argument, 0, 'F'},
+        {"on-volume", required_argument, 0, 'H'},
+        {"append",  no_argument,       0, 'A'},
         {0, 0, 0, 0}
     };
     
@@ -150,8 +399,14 @@ static int parse_args(int argc, char **argv, CommandLineArgs *args) {
     args->compress_opts.level = ZLITE_LEVEL_DEFAULT;
     args->compress_opts.method = ZLITE_METHOD_LZMA2;
     args->compress_opts.solid = 1;
+    args->compress_opts.dedup = 1;
+    args->compress_opts.filters = 1;
+    args->compress_opts.text_ppmd = 1;
+    args->compress_opts.probe = 1;
     args->compress_opts.num_threads = 0; /* Auto-detect */
     args->compress_opts.volume_size = 0;
+    args->compress_opts.inflight_budget = 0; /* Auto */
+    args->compress_opts.block_size = 0; /* Auto */
     args->command = ZLITE_CMD_ADD;
     
     /* First argument should be the command */
@@ -170,6 +425,12 @@ static int parse_args(int argc, char **argv, CommandLineArgs *args) {
         args->command = ZLITE_CMD_LIST;
     } else if (strcmp(argv[1], "t") == 0) {
         args->command = ZLITE_CMD_TEST;
+    } else if (strcmp(argv[1], "u") == 0) {
+        args->command = ZLITE_CMD_UPDATE;
+    } else if (strcmp(argv[1], "d") == 0) {
+        args->command = ZLITE_CMD_DELETE;
+    } else if (strcmp(argv[1], "rn") == 0) {
+        args->command = ZLITE_CMD_RENAME;
     } else if (strcmp(argv[1], "-h") == 0 || strcmp(argv[1], "--help") == 0) {
         args->show_help = 1;
         return ZLITE_OK;
@@ -181,7 +442,7 @@ static int parse_args(int argc, char **argv, CommandLineArgs *args) {
     }
     
     /* Parse options */
-    while ((opt = getopt_long(argc - 1, argv + 1, "0123456789m:t:v:ho:V", 
+    while ((opt = getopt_long(argc - 1, argv + 1, "0123456789m:t:v:b:M:ho:s:V", 
                               long_options, &long_index)) != -1) {
         switch (opt) {
             case '0': case '1': case '2': case '3': case '4':
@@ -189,33 +450,44 @@ static int parse_args(int argc, char **argv, CommandLineArgs *args) {
                 args->compress_opts.level = opt - '0';
                 break;
             case 'm':
-                if (strcmp(optarg, "lzma2") == 0) {
-                    args->compress_opts.method = ZLITE_METHOD_LZMA2;
-                } else if (strcmp(optarg, "lzma") == 0) {
-                    args->compress_opts.method = ZLITE_METHOD_LZMA;
-                } else {
-                    fprintf(stderr, "Error: Unknown compression method '%s'\n", optarg);
+                if (parse_method(optarg, &args->compress_opts) != ZLITE_OK) {
                     return ZLITE_ERROR_PARAM;
                 }
                 break;
             case 't':
                 args->compress_opts.num_threads = atoi(optarg);
+                args->extract_opts.num_threads = args->compress_opts.num_threads;
                 break;
             case 'v':
                 /* Parse volume size */
-                if (strstr(optarg, "G") || strstr(optarg, "g")) {
-                    args->compress_opts.volume_size = (uint64_t)atof(optarg) * 1024 * 1024 * 1024;
-                } else if (strstr(optarg, "M") || strstr(optarg, "m")) {
-                    args->compress_opts.volume_size = (uint64_t)atof(optarg) * 1024 * 1024;
-                } else if (strstr(optarg, "K") || strstr(optarg, "k")) {
-                    args->compress_opts.volume_size = (uint64_t)atof(optarg) * 1024;
-                } else {
-                    args->compress_opts.volume_size = (uint64_t)atoi(optarg);
-                }
+                args->compress_opts.volume_size = parse_size(optarg);
+                break;
+            case 'b':
+                args->compress_opts.block_size = parse_size(optarg);
+                break;
+            case 'M':
+                args->compress_opts.inflight_budget = parse_size(optarg);
                 break;
             case 'o':
                 args->output_dir = strdup(optarg);
                 break;
+            case 'H':
+                args->compress_opts.volume_hook = run_volume_command;
+                args->compress_opts.volume_hook_arg = optarg;
+                break;
+            case 'A':
+                args->append = 1;
+                break;
+            case 's':
+                if (parse_stream(optarg, args) != ZLITE_OK) {
+                    return ZLITE_ERROR_PARAM;
+                }
+                break;
+            case 'F':
+                if (parse_format(optarg, &args->compress_opts) != ZLITE_OK) {
+                    return ZLITE_ERROR_PARAM;
+                }
+                break;
             case 'h':
                 args->show_help = 1;
                 return ZLITE_OK;
@@ -246,6 +518,7 @@ static int parse_args(int argc, char **argv, CommandLineArgs *args) {
 int zlite_cli_main(int argc, char **argv) {
     CommandLineArgs args;
     ZliteArchive *archive;
+    FILE *stream_out = NULL;
     int result;
 
     result = parse_args(argc, argv, &args);
@@ -265,33 +538,94 @@ int zlite_cli_main(int argc, char **argv) {
         return 0;
     }
 
-    /* Open archive */
+    /* Standard streams: -si only creates an archive, -so writes a new
+     * archive or extracted data */
+    if ((args.stdin_name && (args.command != ZLITE_CMD_ADD || args.append || args.num_files > 0)) ||
+        (args.to_stdout && ((args.command != ZLITE_CMD_ADD && args.command != ZLITE_CMD_EXTRACT) ||
+                            args.append))) {
+        fprintf(stderr, "Error: -si takes no files and only goes with a; "
+                        "-so goes with a (without --append), x and e\n");
+        return 1;
+    }
+    if (args.to_stdout) {
+        stream_out = zlite_stdout_binary();
+        if (!stream_out) {
+            fprintf(stderr, "Error: Cannot write to standard output\n");
+            return 1;
+        }
+        args.compress_opts.stream_out = stream_out;
+        args.extract_opts.stream_out = stream_out;
+    }
+
+    /* Open archive; updating or appending to one that does not exist yet
+     * creates it */
     archive = zlite_archive_create(args.archive_path,
-                                   args.command == ZLITE_CMD_ADD);
+                                   args.command == ZLITE_CMD_ADD && !args.append);
+    if (!archive && (args.command == ZLITE_CMD_UPDATE ||
+                     (args.command == ZLITE_CMD_ADD && args.append))) {
+        archive = zlite_archive_create(args.archive_path, 1);
+        args.command = ZLITE_CMD_ADD;
+        args.append = 0;
+    }
     if (!archive) {
         fprintf(stderr, "Error: Cannot open archive '%s'\n", args.archive_path);
+        if (stream_out) {
+            fclose(stream_out);
+        }
         return 1;
     }
 
     /* Execute command */
     switch (args.command) {
         case ZLITE_CMD_ADD:
+            if (args.stdin_name) {
+                result = zlite_add_stream(archive, args.stdin_name, zlite_stdin_binary(),
+                                          &args.compress_opts);
+                break;
+            }
             if (args.num_files == 0) {
                 fprintf(stderr, "Error: No files specified for adding\n");
                 zlite_archive_close(archive);
                 return 1;
             }
-            result = zlite_add_files(archive, args.files, args.num_files,
-                                    &args.compress_opts);
+            if (args.append) {
+                result = zlite_append_files(archive, args.files, args.num_files,
+                                            &args.compress_opts);
+            } else {
+                result = zlite_add_files(archive, args.files, args.num_files,
+                                        &args.compress_opts);
+            }
+            break;
+        case ZLITE_CMD_UPDATE:
+            if (args.num_files == 0) {
+                fprintf(stderr, "Error: No files specified for updating\n");
+                zlite_archive_close(archive);
+                return 1;
+            }
+            result = zlite_update_files(archive, args.files, args.num_files,
+                                        &args.compress_opts);
             break;
         case ZLITE_CMD_EXTRACT:
-            result = zlite_extract_files(archive, args.output_dir ? args.output_dir : ".");
+            args.extract_opts.patterns = args.files;
+            args.extract_opts.num_patterns = args.num_files;
+            result = zlite_extract_files(archive, args.output_dir ? args.output_dir : ".",
+                                         &args.extract_opts);
             break;
         case ZLITE_CMD_LIST:
             result = zlite_list_files(archive);
             break;
         case ZLITE_CMD_TEST:
-            result = zlite_test_archive(archive);
+            args.extract_opts.patterns = args.files;
+            args.extract_opts.num_patterns = args.num_files;
+            result = zlite_test_archive(archive, &args.extract_opts);
+            break;
+        case ZLITE_CMD_DELETE:
+            result = zlite_delete_files(archive, args.files, args.num_files,
+                                        &args.compress_opts);
+            break;
+        case ZLITE_CMD_RENAME:
+            result = zlite_rename_files(archive, args.files, args.num_files,
+                                        &args.compress_opts);
             break;
         default:
             fprintf(stderr, "Error: Unsupported command\n");
@@ -301,6 +635,11 @@ int zlite_cli_main(int argc, char **argv) {
     
     zlite_archive_close(archive);
     
+    if (stream_out && fclose(stream_out) != 0 && result == ZLITE_OK) {
+        fprintf(stderr, "Error: Cannot write to standard output\n");
+        result = ZLITE_ERROR_WRITE;
+    }
+    
     if (args.output_dir) {
         free(args.output_dir);
     }
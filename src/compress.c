@@ -1,4 +1,5 @@
 #include "../include/7zlite.h"
+#include "../include/compat.h"
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
@@ -12,15 +13,6 @@
 #define DEBUG_PRINT(fmt, ...) do {} while(0)
 #endif
 
-/* Debug macro */
-#define DEBUG_DECOMPRESSION 1
-
-#if DEBUG_DECOMPRESSION
-#define DEBUG_PRINT(fmt, ...) printf(fmt, ##__VA_ARGS__)
-#else
-#define DEBUG_PRINT(fmt, ...) do {} while(0)
-#endif
-
 #ifndef PATH_MAX
 #define PATH_MAX 4096
 #endif
@@ -29,8 +21,11 @@
 #include "7zAlloc.h"
 #include "7zFile.h"
 #include "7zCrc.h"
+#include "7zBuf.h"
 #include "Lzma2Enc.h"
 #include "LzmaEnc.h"
+#include "Ppmd7.h"
+#include "Threads.h"
 
 /* Use LZMA SDK's LZMA_PROPS_SIZE definition if available */
 #ifndef LZMA_PROPS_SIZE
@@ -39,43 +34,261 @@
 
 static ISzAlloc g_Alloc = { SzAlloc, SzFree };
 
-static int compress_file_lzma2(const char *input_path, const char *output_path,
-                               int level, uint64_t *compressed_size) {
-    CLzma2EncHandle enc;
-    CFileSeqInStream inStream;
-    CFileOutStream outStream;
-    Byte prop;
-    SRes res;
-    WRes wres;
-    uint64_t file_size;
+/* Sequential output stream that writes encoder output straight into the
+ * archive and keeps a running CRC of every byte that passes through. */
+typedef struct {
+    ISeqOutStream vt;
+    ZliteOutput *output;
+    uint64_t processed;
+    uint32_t crc;
+} ArchiveOutStream;
 
-    /* Open input file */
-    wres = InFile_Open(&inStream.file, input_path);
-    if (wres != 0) {
-        return ZLITE_ERROR_FILE;
+static size_t ArchiveOutStream_Write(ISeqOutStreamPtr pp, const void *data, size_t size) {
+    ArchiveOutStream *p = Z7_CONTAINER_FROM_VTBL(pp, ArchiveOutStream, vt);
+    size_t written = zlite_output_write(p->output, data, size);
+    
+    p->crc = CrcUpdate(p->crc, data, written);
+    p->processed += written;
+    return written;
+}
+
+static void ArchiveOutStream_Init(ArchiveOutStream *p, ZliteOutput *output) {
+    p->vt.Write = ArchiveOutStream_Write;
+    p->output = output;
+    p->processed = 0;
+    p->crc = CRC_INIT_VAL;
+}
+
+/* In-memory output stream used by pipeline workers */
+typedef struct {
+    ISeqOutStream vt;
+    CDynBuf buf;
+    uint32_t crc;
+    int error;
+} MemOutStream;
+
+static size_t MemOutStream_Write(ISeqOutStreamPtr pp, const void *data, size_t size) {
+    MemOutStream *p = Z7_CONTAINER_FROM_VTBL(pp, MemOutStream, vt);
+    
+    if (!DynBuf_Write(&p->buf, (const Byte *)data, size, &g_Alloc)) {
+        p->error = 1;
+        return 0;
+    }
+    p->crc = CrcUpdate(p->crc, data, size);
+    return size;
+}
+
+static void MemOutStream_Init(MemOutStream *p) {
+    p->vt.Write = MemOutStream_Write;
+    DynBuf_Construct(&p->buf);
+    p->crc = CRC_INIT_VAL;
+    p->error = 0;
+}
+
+/* Map compression level to LZMA encoder properties */
+static void level_to_props(int level, CLzmaEncProps *props) {
+    switch (level) {
+        case 0:
+            props->level = 0;
+            props->dictSize = 1 << 16;
+            break;
+        case 1:
+            props->level = 1;
+            props->dictSize = 1 << 20;
+            break;
+        case 2:
+            props->level = 3;
+            props->dictSize = 1 << 22;
+            break;
+        case 3:
+            props->level = 5;
+            props->dictSize = 1 << 24;
+            break;
+        case 4:
+            props->level = 7;
+            props->dictSize = 1 << 25;
+            break;
+        case 5:
+        case 6:
+            props->level = 7;
+            props->dictSize = 1 << 26;
+            break;
+        case 7:
+        case 8:
+        case 9:
+            props->level = 9;
+            props->dictSize = 1 << 26;
+            break;
+        default:
+            props->level = 5;
+            props->dictSize = 1 << 26;
+            break;
     }
+}
+
+#define ZLITE_BLOCK_SIZE_MIN ((uint64_t)1 << 20)
+#define ZLITE_BLOCK_SIZE_MAX ((uint64_t)1 << 28)
+#define ZLITE_STREAM_BLOCK_SIZE_MAX ((uint64_t)4 << 20)   /* input of unknown size */
+
+/* Pick an LZMA2 block size for block-parallel encoding. Blocks start at four
+ * times the dictionary (so the ratio stays close to solid), but are shrunk
+ * down to the dictionary size when that is needed to give every thread at
+ * least one block of a large file. */
+static uint64_t auto_block_size(uint64_t file_size, uint32_t dict_size, int num_threads) {
+    uint64_t block = (uint64_t)dict_size << 2;
+    uint64_t floor_size = dict_size;
     
-    /* Get input file size */
-    File_GetLength(&inStream.file, &file_size);
+    if (block > ZLITE_BLOCK_SIZE_MAX) block = ZLITE_BLOCK_SIZE_MAX;
+    if (block < ZLITE_BLOCK_SIZE_MIN) block = ZLITE_BLOCK_SIZE_MIN;
+    if (floor_size < ZLITE_BLOCK_SIZE_MIN) floor_size = ZLITE_BLOCK_SIZE_MIN;
     
-    /* Open output file */
-    wres = OutFile_Open(&outStream.file, output_path);
-    if (wres != 0) {
-        File_Close(&inStream.file);
-        return ZLITE_ERROR_FILE;
+    if (file_size / block < (uint64_t)num_threads) {
+        uint64_t per_thread = file_size / (uint64_t)num_threads;
+        block = per_thread > floor_size ? per_thread : floor_size;
     }
     
-    /* Setup stream vtables */
-    FileSeqInStream_CreateVTable(&inStream);
-    FileOutStream_CreateVTable(&outStream);
+    /* Round up to a whole MiB */
+    block = (block + ZLITE_BLOCK_SIZE_MIN - 1) & ~(ZLITE_BLOCK_SIZE_MIN - 1);
+    return block;
+}
+
+/* Block size for input of unknown size. Every LZMA2 block thread holds
+ * a block of input and its output, so blocks stay small enough to bound
+ * memory by the thread count rather than by the input. */
+static uint64_t stream_block_size(int level) {
+    CLzmaEncProps props;
+    uint64_t block;
     
-    /* Create encoder */
-    enc = Lzma2Enc_Create(&g_Alloc, &g_Alloc);
-    if (!enc) {
-        File_Close(&inStream.file);
-        File_Close(&outStream.file);
-        return ZLITE_ERROR_MEMORY;
+    LzmaEncProps_Init(&props);
+    level_to_props(level, &props);
+    block = (uint64_t)props.dictSize << 2;
+    return block < ZLITE_STREAM_BLOCK_SIZE_MAX ? block : ZLITE_STREAM_BLOCK_SIZE_MAX;
+}
+
+/* Size above which a file spans more than one LZMA2 block and is worth
+ * encoding with block-level threads instead of a single pipeline worker */
+static uint64_t multiblock_threshold(int level, uint64_t block_size) {
+    CLzmaEncProps props;
+    uint64_t block;
+    
+    if (block_size > 0) {
+        return block_size;
+    }
+    
+    LzmaEncProps_Init(&props);
+    level_to_props(level, &props);
+    block = (uint64_t)props.dictSize << 2;
+    if (block > ZLITE_BLOCK_SIZE_MAX) block = ZLITE_BLOCK_SIZE_MAX;
+    if (block < ZLITE_BLOCK_SIZE_MIN) block = ZLITE_BLOCK_SIZE_MIN;
+    return block;
+}
+
+/* Smallest dictionary requested for small inputs. Sizes are rounded up to
+ * a power of two from here so that runs of small files share one
+ * dictionary size and the cached coders can keep their buffers. */
+#define ZLITE_REDUCE_SIZE_MIN ((uint64_t)1 << 16)
+
+static uint64_t reduce_size_bucket(uint64_t size) {
+    uint64_t bucket = ZLITE_REDUCE_SIZE_MIN;
+    
+    while (bucket < size && bucket < ((uint64_t)1 << 32)) {
+        bucket <<= 1;
+    }
+    return bucket;
+}
+
+/* Encoders kept by one thread across entries. Lzma2Enc and LzmaEnc hold
+ * on to their state, match finder tables and window between calls and
+ * reallocate them only when the dictionary size changes; the PPMd model
+ * memory is kept as long as its size stays the same. */
+typedef struct {
+    CLzma2EncHandle enc;
+    CLzmaEncHandle lzma;
+    CPpmd7 ppmd;
+    uint32_t ppmd_mem;          /* size of the allocated model, 0 = none */
+} EncoderCache;
+
+static void encoder_cache_free(EncoderCache *cache) {
+    if (cache->enc) {
+        Lzma2Enc_Destroy(cache->enc);
+        cache->enc = NULL;
+    }
+    if (cache->lzma) {
+        LzmaEnc_Destroy(cache->lzma, &g_Alloc, &g_Alloc);
+        cache->lzma = NULL;
+    }
+    if (cache->ppmd_mem) {
+        Ppmd7_Free(&cache->ppmd, &g_Alloc);
+        cache->ppmd_mem = 0;
+    }
+}
+
+/* Applies a filter (ZLITE_FILTER_* bits) to the data read from `real` */
+#define FILTER_BUF_SIZE ((size_t)1 << 16)
+
+typedef struct {
+    ISeqInStream vt;
+    ISeqInStreamPtr real;
+    ZliteFilter filter;
+    size_t pos;             /* next byte to hand out */
+    size_t done;            /* bytes already converted */
+    size_t len;
+    int eof;
+    Byte buf[FILTER_BUF_SIZE];
+} FilterInStream;
+
+static SRes FilterInStream_Read(ISeqInStreamPtr pp, void *buf, size_t *size) {
+    FilterInStream *p = Z7_CONTAINER_FROM_VTBL(pp, FilterInStream, vt);
+    
+    for (;;) {
+        if (p->pos < p->done) {
+            if (*size > p->done - p->pos) {
+                *size = p->done - p->pos;
+            }
+            memcpy(buf, p->buf + p->pos, *size);
+            p->pos += *size;
+            return SZ_OK;
+        }
+        if (p->eof) {
+            *size = 0;
+            return SZ_OK;
+        }
+        
+        /* Keep the unconverted tail and read more behind it */
+        memmove(p->buf, p->buf + p->pos, p->len - p->pos);
+        p->len -= p->pos;
+        p->pos = 0;
+        while (!p->eof && p->len < FILTER_BUF_SIZE) {
+            size_t n = FILTER_BUF_SIZE - p->len;
+            RINOK(ISeqInStream_Read(p->real, p->buf + p->len, &n))
+            if (n == 0) {
+                p->eof = 1;
+            }
+            p->len += n;
+        }
+        p->done = zlite_filter_encode(&p->filter, p->buf, p->len, p->eof);
+    }
+}
+
+/* Compress `size` bytes from in as property byte + LZMA2 stream into out,
+ * using the encoder in cache (created on first use).
+ * num_threads limits the encoder's threads (0 lets the SDK decide); with more
+ * than one thread the input is split into block_size blocks (0 = auto) that
+ * are encoded in parallel. */
+static int compress_stream_lzma2(EncoderCache *cache, ISeqInStreamPtr in, uint64_t size,
+                                 ISeqOutStreamPtr out, int level, int num_threads,
+                                 uint64_t block_size) {
+    CLzma2EncHandle enc;
+    Byte prop;
+    SRes res;
+    
+    if (!cache->enc) {
+        cache->enc = Lzma2Enc_Create(&g_Alloc, &g_Alloc);
+        if (!cache->enc) {
+            return ZLITE_ERROR_MEMORY;
+        }
     }
+    enc = cache->enc;
     
     /* Set encoder properties */
     {
@@ -86,241 +299,2398 @@ static int compress_file_lzma2(const char *input_path, const char *output_path,
         props2.lzmaProps.writeEndMark = 1;
         
         /* Map compression level to properties */
-        switch (level) {
-            case 0:
-                props2.lzmaProps.level = 0;
-                props2.lzmaProps.dictSize = 1 << 16;
-                break;
-            case 1:
-                props2.lzmaProps.level = 1;
-                props2.lzmaProps.dictSize = 1 << 20;
-                break;
-            case 2:
-                props2.lzmaProps.level = 3;
-                props2.lzmaProps.dictSize = 1 << 22;
-                break;
-            case 3:
-                props2.lzmaProps.level = 5;
-                props2.lzmaProps.dictSize = 1 << 24;
-                break;
-            case 4:
-                props2.lzmaProps.level = 7;
-                props2.lzmaProps.dictSize = 1 << 25;
-                break;
-            case 5:
-            case 6:
-                props2.lzmaProps.level = 7;
-                props2.lzmaProps.dictSize = 1 << 26;
-                break;
-            case 7:
-            case 8:
-            case 9:
-                props2.lzmaProps.level = 9;
-                props2.lzmaProps.dictSize = 1 << 26;
-                break;
-            default:
-                props2.lzmaProps.level = 5;
-                props2.lzmaProps.dictSize = 1 << 26;
-                break;
+        level_to_props(level, &props2.lzmaProps);
+        
+        /* Don't allocate a dictionary much larger than the input itself */
+        props2.lzmaProps.reduceSize = reduce_size_bucket(size);
+        if (num_threads > 0) {
+            props2.numTotalThreads = num_threads;
+        }
+        if (num_threads > 1) {
+            props2.numBlockThreads_Max = num_threads;
+            props2.blockSize = block_size > 0 ? block_size
+                             : auto_block_size(size, props2.lzmaProps.dictSize, num_threads);
+            if (props2.blockSize >= size) {
+                props2.blockSize = LZMA2_ENC_PROPS_BLOCK_SIZE_SOLID;
+            }
         }
         
         Lzma2EncProps_Normalize(&props2);
         res = Lzma2Enc_SetProps(enc, &props2);
         if (res != SZ_OK) {
-            Lzma2Enc_Destroy(enc);
-            File_Close(&inStream.file);
-            File_Close(&outStream.file);
             return ZLITE_ERROR_PARAM;
         }
+        Lzma2Enc_SetDataSize(enc, size);
     }
     
     /* Get and write encoder properties */
-    {
-        prop = Lzma2Enc_WriteProperties(enc);
-        size_t written = 1;
-        wres = File_Write(&outStream.file, &prop, &written);
-        if (wres != 0 || written != 1) {
-            Lzma2Enc_Destroy(enc);
-            File_Close(&inStream.file);
-            File_Close(&outStream.file);
-            return ZLITE_ERROR_WRITE;
-        }
+    prop = Lzma2Enc_WriteProperties(enc);
+    if (ISeqOutStream_Write(out, &prop, 1) != 1) {
+        return ZLITE_ERROR_WRITE;
     }
     
     /* Encode */
     DEBUG_PRINT("DEBUG: Starting encoding...\n");
-    res = Lzma2Enc_Encode2(enc, &outStream.vt, NULL, 0, &inStream.vt, NULL, 0, NULL);
+    res = Lzma2Enc_Encode2(enc, out, NULL, 0, in, NULL, 0, NULL);
     DEBUG_PRINT("DEBUG: Encoding result: %d\n", res);
     
-    /* Get compressed size */
-    File_GetLength(&outStream.file, compressed_size);
-    DEBUG_PRINT("DEBUG: Compressed file size (with prop): %llu\n", (unsigned long long)*compressed_size);
-    *compressed_size -= 1; /* Subtract prop byte */
-    DEBUG_PRINT("DEBUG: Compressed data size (without prop): %llu\n", (unsigned long long)*compressed_size);
+    if (res != SZ_OK) {
+        /* Don't carry state from a failed run into the next entry */
+        encoder_cache_free(cache);
+    }
     
-    Lzma2Enc_Destroy(enc);
-    File_Close(&inStream.file);
-    File_Close(&outStream.file);
+    if (res == SZ_ERROR_WRITE) {
+        return ZLITE_ERROR_WRITE;
+    }
+    return (res == SZ_OK) ? ZLITE_OK : ZLITE_ERROR_CORRUPT;
+}
+
+/* Compress `size` bytes from in as 5 property bytes + LZMA stream with an
+ * end mark. LZMA has no blocks; num_threads > 1 only lets the match finder
+ * run on a second thread. */
+static int compress_stream_lzma(EncoderCache *cache, ISeqInStreamPtr in, uint64_t size,
+                                ISeqOutStreamPtr out, int level, int num_threads) {
+    CLzmaEncProps props;
+    Byte header[LZMA_PROPS_SIZE];
+    SizeT header_size = LZMA_PROPS_SIZE;
+    SRes res;
+    
+    if (!cache->lzma) {
+        cache->lzma = LzmaEnc_Create(&g_Alloc);
+        if (!cache->lzma) {
+            return ZLITE_ERROR_MEMORY;
+        }
+    }
+    
+    LzmaEncProps_Init(&props);
+    props.writeEndMark = 1;
+    level_to_props(level, &props);
+    props.reduceSize = reduce_size_bucket(size);
+    props.numThreads = num_threads > 1 ? 2 : 1;
+    if (LzmaEnc_SetProps(cache->lzma, &props) != SZ_OK) {
+        return ZLITE_ERROR_PARAM;
+    }
+    LzmaEnc_SetDataSize(cache->lzma, size);
+    
+    if (LzmaEnc_WriteProperties(cache->lzma, header, &header_size) != SZ_OK) {
+        return ZLITE_ERROR_PARAM;
+    }
+    if (ISeqOutStream_Write(out, header, header_size) != header_size) {
+        return ZLITE_ERROR_WRITE;
+    }
+    
+    res = LzmaEnc_Encode(cache->lzma, out, in, NULL, &g_Alloc, &g_Alloc);
+    if (res != SZ_OK) {
+        encoder_cache_free(cache);
+    }
     
+    if (res == SZ_ERROR_WRITE) {
+        return ZLITE_ERROR_WRITE;
+    }
     return (res == SZ_OK) ? ZLITE_OK : ZLITE_ERROR_CORRUPT;
 }
 
-/* Simple archive header for testing */
-#define ARCHIVE_MAGIC "7z\xBC\xAF\x27\x1C"
+/* Copy up to `size` bytes from in to out unchanged; the count copied goes
+ * to *processed */
+#define COPY_BUF_SIZE ((size_t)1 << 20)
 
-int zlite_add_files(ZliteArchive *archive, char **files, int num_files,
-                    const ZliteCompressOptions *options) {
-    ZliteFileInfo *file_list;
-    int file_count;
-    int i;
-    int result;
-    FILE *archive_fp;
-    uint64_t total_files = 0;
-    uint64_t total_size = 0;
+static int compress_stream_copy(ISeqInStreamPtr in, uint64_t size, ISeqOutStreamPtr out,
+                                uint64_t *processed) {
+    Byte *buf = (Byte *)malloc(COPY_BUF_SIZE);
+    uint64_t total = 0;
+    int result = ZLITE_OK;
+    
+    if (!buf) {
+        return ZLITE_ERROR_MEMORY;
+    }
+    
+    while (total < size) {
+        size_t n = COPY_BUF_SIZE;
+        if (n > size - total) {
+            n = (size_t)(size - total);
+        }
+        if (ISeqInStream_Read(in, buf, &n) != SZ_OK) {
+            result = ZLITE_ERROR_READ;
+            break;
+        }
+        if (n == 0) {
+            break;
+        }
+        if (ISeqOutStream_Write(out, buf, n) != n) {
+            result = ZLITE_ERROR_WRITE;
+            break;
+        }
+        total += n;
+    }
+    
+    *processed = total;
+    free(buf);
+    return result;
+}
 
-    /* Collect files */
-    result = zlite_collect_files(files, num_files, &file_list, &file_count);
+/* Buffers the range coder's byte output */
+#define PPMD_BUF_SIZE ((size_t)1 << 16)
 
-    if (result != ZLITE_OK) {
-        return result;
+typedef struct {
+    IByteOut vt;
+    ISeqOutStreamPtr real;
+    size_t pos;
+    int error;
+    Byte buf[PPMD_BUF_SIZE];
+} PpmdOutBuf;
+
+static void PpmdOutBuf_Flush(PpmdOutBuf *p) {
+    if (p->pos > 0 && !p->error && ISeqOutStream_Write(p->real, p->buf, p->pos) != p->pos) {
+        p->error = 1;
     }
+    p->pos = 0;
+}
 
-    /* Initialize CRC table */
-    CrcGenerateTable();
+static void PpmdOutBuf_Write(IByteOutPtr pp, Byte b) {
+    PpmdOutBuf *p = Z7_CONTAINER_FROM_VTBL(pp, PpmdOutBuf, vt);
+    
+    p->buf[p->pos++] = b;
+    if (p->pos == PPMD_BUF_SIZE) {
+        PpmdOutBuf_Flush(p);
+    }
+}
 
-    /* Open archive file */
-    archive_fp = fopen(zlite_archive_get_path(archive), "wb");
-    if (!archive_fp) {
-        fprintf(stderr, "Error: Cannot open archive for writing\n");
-        zlite_free_file_list(file_list, file_count);
+/* Compress up to `size` bytes from in as 5 property bytes (order, memory
+ * size) + PPMd7 range coded data. PPMd has no end mark, so the bytes
+ * actually encoded are returned in *processed and must be the entry size. */
+static int compress_stream_ppmd(EncoderCache *cache, ISeqInStreamPtr in, uint64_t size,
+                                ISeqOutStreamPtr out, const ZliteCompressOptions *options,
+                                uint64_t *processed) {
+    PpmdOutBuf *ob;
+    Byte *buf;
+    Byte props[5];
+    unsigned order;
+    uint32_t mem_size;
+    uint64_t total = 0;
+    int result = ZLITE_OK;
+    
+    zlite_ppmd_props(options, size, &order, &mem_size);
+    if (cache->ppmd_mem != mem_size) {
+        if (cache->ppmd_mem) {
+            Ppmd7_Free(&cache->ppmd, &g_Alloc);
+        } else {
+            Ppmd7_Construct(&cache->ppmd);
+        }
+        cache->ppmd_mem = 0;
+        if (!Ppmd7_Alloc(&cache->ppmd, mem_size, &g_Alloc)) {
+            return ZLITE_ERROR_MEMORY;
+        }
+        cache->ppmd_mem = mem_size;
+    }
+    
+    ob = (PpmdOutBuf *)malloc(sizeof(PpmdOutBuf));
+    buf = (Byte *)malloc(PPMD_BUF_SIZE);
+    if (!ob || !buf) {
+        free(ob);
+        free(buf);
+        return ZLITE_ERROR_MEMORY;
+    }
+    
+    props[0] = (Byte)order;
+    SetUi32(props + 1, mem_size)
+    if (ISeqOutStream_Write(out, props, sizeof(props)) != sizeof(props)) {
+        free(ob);
+        free(buf);
+        return ZLITE_ERROR_WRITE;
+    }
+    
+    ob->vt.Write = PpmdOutBuf_Write;
+    ob->real = out;
+    ob->pos = 0;
+    ob->error = 0;
+    cache->ppmd.rc.enc.Stream = &ob->vt;
+    Ppmd7z_Init_RangeEnc(&cache->ppmd);
+    Ppmd7_Init(&cache->ppmd, order);
+    
+    while (total < size && !ob->error) {
+        size_t n = PPMD_BUF_SIZE;
+        if (n > size - total) {
+            n = (size_t)(size - total);
+        }
+        if (ISeqInStream_Read(in, buf, &n) != SZ_OK) {
+            result = ZLITE_ERROR_READ;
+            break;
+        }
+        if (n == 0) {
+            break;
+        }
+        Ppmd7z_EncodeSymbols(&cache->ppmd, buf, buf + n);
+        total += n;
+    }
+    Ppmd7z_Flush_RangeEnc(&cache->ppmd);
+    PpmdOutBuf_Flush(ob);
+    
+    if (result == ZLITE_OK && ob->error) {
+        result = ZLITE_ERROR_WRITE;
+    }
+    *processed = total;
+    free(ob);
+    free(buf);
+    return result;
+}
+
+static int coder_method(uint32_t coder) {
+    return (int)((coder & ZLITE_METHOD_MASK) >> ZLITE_METHOD_SHIFT);
+}
+
+/* Compress `size` bytes from in with the method and filter given by the
+ * type word bits in `coder`. *processed (when not NULL) receives the bytes
+ * consumed, which matters for PPMd and Copy; LZMA and LZMA2 mark the end
+ * themselves. */
+static int compress_stream(EncoderCache *cache, ISeqInStreamPtr in, uint64_t size,
+                           uint32_t coder, ISeqOutStreamPtr out,
+                           const ZliteCompressOptions *options, int num_threads,
+                           uint64_t block_size, uint64_t *processed) {
+    FilterInStream *filtered = NULL;
+    uint64_t encoded = size;
+    int result;
+    
+    if (coder & ZLITE_FILTER_MASK) {
+        filtered = (FilterInStream *)malloc(sizeof(FilterInStream));
+        if (!filtered) {
+            return ZLITE_ERROR_MEMORY;
+        }
+        filtered->vt.Read = FilterInStream_Read;
+        filtered->real = in;
+        zlite_filter_init(&filtered->filter, coder);
+        filtered->pos = filtered->done = filtered->len = 0;
+        filtered->eof = 0;
+        in = &filtered->vt;
+    }
+    
+    switch (coder_method(coder)) {
+        case ZLITE_METHOD_LZMA2:
+            result = compress_stream_lzma2(cache, in, size, out, options->level, num_threads,
+                                           block_size);
+            break;
+        case ZLITE_METHOD_LZMA:
+            result = compress_stream_lzma(cache, in, size, out, options->level, num_threads);
+            break;
+        case ZLITE_METHOD_PPMD:
+            result = compress_stream_ppmd(cache, in, size, out, options, &encoded);
+            break;
+        case ZLITE_METHOD_COPY:
+            result = compress_stream_copy(in, size, out, &encoded);
+            break;
+        default:
+            result = ZLITE_ERROR_PARAM;
+            break;
+    }
+    
+    if (processed) {
+        *processed = encoded;
+    }
+    free(filtered);
+    return result;
+}
+
+/* Reads at most `remaining` bytes and keeps the CRC of what was read, so a
+ * file that grows while being compressed is cut at the size it had when
+ * opened and the stored CRC describes the bytes the encoder consumed */
+typedef struct {
+    ISeqInStream vt;
+    ISeqInStreamPtr real;
+    uint64_t remaining;
+    uint64_t processed;
+    uint32_t crc;
+} CrcInStream;
+
+static SRes CrcInStream_Read(ISeqInStreamPtr pp, void *buf, size_t *size) {
+    CrcInStream *p = Z7_CONTAINER_FROM_VTBL(pp, CrcInStream, vt);
+    SRes res;
+    
+    if (*size > p->remaining) {
+        *size = (size_t)p->remaining;
+    }
+    if (*size == 0) {
+        return SZ_OK;
+    }
+    res = ISeqInStream_Read(p->real, buf, size);
+    p->crc = CrcUpdate(p->crc, buf, *size);
+    p->processed += *size;
+    p->remaining -= *size;
+    return res;
+}
+
+/* Compress the file at input_path, see compress_stream(). The size and
+ * CRC of the data read go to *unpacked and *data_crc when not NULL. */
+static int compress_file(EncoderCache *cache, const char *input_path, uint32_t coder,
+                         ISeqOutStreamPtr out, const ZliteCompressOptions *options,
+                         int num_threads, uint64_t block_size,
+                         uint64_t *unpacked, uint32_t *data_crc) {
+    CFileSeqInStream inStream;
+    CrcInStream in;
+    uint64_t file_size = 0;
+    int result;
+    
+    if (InFile_Open(&inStream.file, input_path) != 0) {
         return ZLITE_ERROR_FILE;
     }
+    File_GetLength(&inStream.file, &file_size);
+    FileSeqInStream_CreateVTable(&inStream);
     
-    /* Write simple header */
-    fwrite(ARCHIVE_MAGIC, 1, 6, archive_fp);
+    in.vt.Read = CrcInStream_Read;
+    in.real = &inStream.vt;
+    in.remaining = file_size;
+    in.processed = 0;
+    in.crc = CRC_INIT_VAL;
     
-    /* Write file count */
-    fwrite(&file_count, sizeof(uint32_t), 1, archive_fp);
+    result = compress_stream(cache, &in.vt, file_size, coder, out, options,
+                             num_threads, block_size, NULL);
     
-    /* Process each file */
-    for (i = 0; i < file_count; i++) {
-        ZliteFileInfo *info = &file_list[i];
-        char temp_path[PATH_MAX];
-        uint64_t compressed_size = 0;
-        uint32_t path_len;
-        uint32_t crc = 0;
-        
-        /* Handle hard link references */
-        if (info->is_hardlink && info->link_target) {
-            /* This is a reference to another file in the archive */
-            int hardlink_type = ZLITE_FILETYPE_HARDLINK;
-            path_len = strlen(info->path);
-            fwrite(&path_len, sizeof(uint32_t), 1, archive_fp);
-            fwrite(info->path, 1, path_len, archive_fp);
-            fwrite(&hardlink_type, sizeof(int), 1, archive_fp);
-            fwrite(&info->size, sizeof(uint64_t), 1, archive_fp);
-            fwrite(&compressed_size, sizeof(uint64_t), 1, archive_fp);
-            fwrite(&crc, sizeof(uint32_t), 1, archive_fp);
+    /* A file that shrank while being read cannot match its size */
+    if (result == ZLITE_OK && in.processed != file_size) {
+        result = ZLITE_ERROR_READ;
+    }
+    if (unpacked) {
+        *unpacked = in.processed;
+    }
+    if (data_crc) {
+        *data_crc = CRC_GET_DIGEST(in.crc);
+    }
+    
+    File_Close(&inStream.file);
+    return result;
+}
 
-            /* Store reference path */
-            uint32_t target_len = strlen(info->link_target);
-            fwrite(&target_len, sizeof(uint32_t), 1, archive_fp);
-            fwrite(info->link_target, 1, target_len, archive_fp);
+/* ========================================================================
+ * Solid blocks
+ *
+ * In solid mode runs of small regular files are concatenated into one
+ * LZMA2 stream. The archive gets a ZLITE_FILETYPE_SOLID_BLOCK record with
+ * the compressed stream, followed by the records of the files it covers;
+ * member records carry ZLITE_FLAG_SOLID, the CRC of their contents and no
+ * payload, and their data follows each other in the block in record order.
+ * Files that want a different filter or method start a new block.
+ * ======================================================================== */
 
-            printf("  %s [hardlink -> %s]\n", info->path, info->link_target);
+/* List entries whose record an update copies from the previous archive
+ * (see below). They end a block, since a solid block copied with them may
+ * not come between another block and its members. */
+#define FILETYPE_KEPT 0xFF
+
+typedef struct {
+    int file;               /* index in the file list */
+    uint64_t offset;        /* offset inside the unpacked block */
+    uint64_t size;          /* bytes actually stored */
+    uint32_t crc;           /* CRC of the stored bytes */
+    int error;              /* the file could not be read */
+} SolidMember;
+
+typedef struct {
+    int first;              /* file list range [first, end) written after the block */
+    int end;
+    SolidMember *members;
+    int num_members;
+    uint64_t size;          /* unpacked size planned from the file sizes */
+    uint32_t coder;         /* filter and method bits applied to the whole block */
+} SolidBlock;
+
+typedef struct {
+    SolidBlock *blocks;
+    int num_blocks;
+    SolidMember *members;   /* storage for every block's members */
+    int *block_at;          /* per file: block starting there, or -1 */
+    SolidMember **member_of; /* per file: its member entry, or NULL */
+} SolidPlan;
+
+/* Group solid candidates into blocks of at most `limit` bytes. Files of
+ * `limit` bytes or more are still compressed on their own. */
+static int solid_plan_build(SolidPlan *plan, const ZliteFileList *list, uint64_t limit) {
+    int count = (int)list->count;
+    SolidBlock *block = NULL;
+    int num_members = 0;
+    int i;
+    
+    memset(plan, 0, sizeof(*plan));
+    if (count == 0) {
+        return ZLITE_OK;
+    }
+    
+    plan->blocks = (SolidBlock *)calloc(count, sizeof(SolidBlock));
+    plan->members = (SolidMember *)calloc(count, sizeof(SolidMember));
+    plan->block_at = (int *)malloc(count * sizeof(int));
+    plan->member_of = (SolidMember **)calloc(count, sizeof(SolidMember *));
+    if (!plan->blocks || !plan->members || !plan->block_at || !plan->member_of) {
+        return ZLITE_ERROR_MEMORY;
+    }
+    
+    for (i = 0; i < count; i++) {
+        SolidMember *member;
+        
+        plan->block_at[i] = -1;
+        if (list->type[i] == FILETYPE_KEPT && block) {
+            block->end = i;
+            block = NULL;
+        }
+        if (list->type[i] != ZLITE_FILETYPE_REGULAR || list->is_hardlink[i] ||
+            list->size[i] >= limit) {
             continue;
         }
         
-        /* Skip directories for now */
-        if (info->file_type == ZLITE_FILETYPE_DIR) {
-            path_len = strlen(info->path);
-            fwrite(&path_len, sizeof(uint32_t), 1, archive_fp);
-            fwrite(info->path, 1, path_len, archive_fp);
-            fwrite(&info->file_type, sizeof(int), 1, archive_fp);
-            fwrite(&info->size, sizeof(uint64_t), 1, archive_fp);
-            fwrite(&compressed_size, sizeof(uint64_t), 1, archive_fp);
-            fwrite(&crc, sizeof(uint32_t), 1, archive_fp);
-            
-            printf("  %s [dir]\n", info->path);
-            continue;
+        if (block && (block->size + list->size[i] > limit || block->coder != list->coder[i])) {
+            block->end = i;
+            block = NULL;
+        }
+        if (!block) {
+            block = &plan->blocks[plan->num_blocks];
+            plan->block_at[i] = plan->num_blocks++;
+            block->first = i;
+            block->members = &plan->members[num_members];
+            block->coder = list->coder[i];
         }
         
-        /* Handle symlinks */
-        if (info->file_type == ZLITE_FILETYPE_SYMLINK) {
-            path_len = strlen(info->path);
-            fwrite(&path_len, sizeof(uint32_t), 1, archive_fp);
-            fwrite(info->path, 1, path_len, archive_fp);
-            fwrite(&info->file_type, sizeof(int), 1, archive_fp);
-            fwrite(&info->size, sizeof(uint64_t), 1, archive_fp);
-            fwrite(&compressed_size, sizeof(uint64_t), 1, archive_fp);
-            fwrite(&crc, sizeof(uint32_t), 1, archive_fp);
-            
-            if (info->link_target) {
-                uint32_t target_len = strlen(info->link_target);
-                fwrite(&target_len, sizeof(uint32_t), 1, archive_fp);
-                fwrite(info->link_target, 1, target_len, archive_fp);
-            }
-            
-            printf("  %s [symlink -> %s]\n", info->path, info->link_target ? info->link_target : "NULL");
+        member = &plan->members[num_members++];
+        member->file = i;
+        block->num_members++;
+        block->size += list->size[i];
+        plan->member_of[i] = member;
+    }
+    
+    if (block) {
+        block->end = count;
+    }
+    
+    return ZLITE_OK;
+}
+
+static void solid_plan_free(SolidPlan *plan) {
+    free(plan->blocks);
+    free(plan->members);
+    free(plan->block_at);
+    free(plan->member_of);
+    memset(plan, 0, sizeof(*plan));
+}
+
+/* Reads the members of a block back to back. A member contributes at most
+ * its listed size; what was actually read, and its CRC, is recorded in the
+ * member so files that shrink or fail to open keep the block consistent. */
+typedef struct {
+    ISeqInStream vt;
+    const ZliteFileList *list;
+    SolidBlock *block;
+    int current;
+    CSzFile file;
+    int file_open;
+    uint64_t remaining;
+    uint64_t offset;
+} SolidInStream;
+
+static void SolidInStream_Next(SolidInStream *p) {
+    SolidMember *member;
+    char path[PATH_MAX];
+    
+    if (p->current >= 0) {
+        member = &p->block->members[p->current];
+        member->crc = CRC_GET_DIGEST(member->crc);
+    }
+    if (p->file_open) {
+        File_Close(&p->file);
+        p->file_open = 0;
+    }
+    
+    p->current++;
+    if (p->current >= p->block->num_members) {
+        return;
+    }
+    
+    member = &p->block->members[p->current];
+    member->offset = p->offset;
+    member->size = 0;
+    member->crc = CRC_INIT_VAL;
+    member->error = 0;
+    p->remaining = p->list->size[member->file];
+    
+    if (zlite_file_list_path(p->list, (uint32_t)member->file, path, sizeof(path)) == 0 ||
+        InFile_Open(&p->file, path) != 0) {
+        member->error = 1;
+        p->remaining = 0;
+    } else {
+        p->file_open = 1;
+    }
+}
+
+static SRes SolidInStream_Read(ISeqInStreamPtr pp, void *buf, size_t *size) {
+    SolidInStream *p = Z7_CONTAINER_FROM_VTBL(pp, SolidInStream, vt);
+    size_t requested = *size;
+    
+    *size = 0;
+    while (p->current < p->block->num_members) {
+        SolidMember *member = &p->block->members[p->current];
+        size_t chunk = requested;
+        
+        if (chunk > p->remaining) {
+            chunk = (size_t)p->remaining;
+        }
+        if (chunk > 0 && File_Read(&p->file, buf, &chunk) != 0) {
+            member->error = 1;
+            chunk = 0;
+        }
+        
+        if (chunk == 0) {
+            /* Member done (or short): move on to the next one */
+            SolidInStream_Next(p);
             continue;
         }
         
-        /* Compress regular files */
-        snprintf(temp_path, sizeof(temp_path), "%s.tmp%06d",
-                 zlite_archive_get_path(archive), i);
+        member->crc = CrcUpdate(member->crc, buf, chunk);
+        member->size += chunk;
+        p->remaining -= chunk;
+        p->offset += chunk;
+        *size = chunk;
+        break;
+    }
+    
+    return SZ_OK;
+}
 
-        result = compress_file_lzma2(info->path, temp_path,
-                                     options->level, &compressed_size);
+/* Compress a solid block, see compress_stream() */
+static int compress_solid(EncoderCache *cache, SolidBlock *block, const ZliteFileList *list,
+                          ISeqOutStreamPtr out, const ZliteCompressOptions *options,
+                          int num_threads, uint64_t block_size) {
+    SolidInStream in;
+    int result;
+    
+    in.vt.Read = SolidInStream_Read;
+    in.list = list;
+    in.block = block;
+    in.current = -1;
+    in.file_open = 0;
+    in.offset = 0;
+    SolidInStream_Next(&in);
+    
+    result = compress_stream(cache, &in.vt, block->size, block->coder, out, options,
+                             num_threads, block_size, NULL);
+    
+    /* LZMA and LZMA2 read to the end; PPMd and Copy stop after the
+     * planned size, before empty files at the end of the block. Members
+     * never reached hold no data, which is all an empty file has. */
+    if (in.current < block->num_members) {
+        int i;
         
-        if (result == ZLITE_OK) {
-            /* Read compressed data and write to archive */
-            FILE *compressed_fp = fopen(temp_path, "rb");
-            if (compressed_fp) {
-                Byte *buffer = malloc(compressed_size);
-                if (buffer) {
-                    size_t read_size = fread(buffer, 1, compressed_size, compressed_fp);
-                    
-                    /* Calculate CRC */
-                    crc = CrcCalc(buffer, read_size);
-                    
-                    /* Write file info */
-                    path_len = strlen(info->path);
-                    DEBUG_PRINT("DEBUG: Writing file info: path=%s, size=%llu, compressed_size=%llu\n",
-                               info->path, (unsigned long long)info->size, (unsigned long long)compressed_size);
-                    fwrite(&path_len, sizeof(uint32_t), 1, archive_fp);
-                    fwrite(info->path, 1, path_len, archive_fp);
-                    fwrite(&info->file_type, sizeof(int), 1, archive_fp);
-                    fwrite(&info->size, sizeof(uint64_t), 1, archive_fp);
-                    fwrite(&compressed_size, sizeof(uint64_t), 1, archive_fp);
-                    fwrite(&crc, sizeof(uint32_t), 1, archive_fp);
-                    
-                    /* Write compressed data */
-                    fwrite(buffer, 1, read_size, archive_fp);
-                    
-                    free(buffer);
-                    
-                    printf("  %s (%llu -> %llu bytes, %.1f%%)\n", 
-                           info->path, 
-                           (unsigned long long)info->size,
-                           (unsigned long long)compressed_size,
-                           info->size > 0 ? (compressed_size * 100.0 / info->size) : 0.0);
-                    
-                    total_files++;
-                    total_size += info->size;
-                }
-                fclose(compressed_fp);
-            }
-            remove(temp_path);
-        } else {
-            fprintf(stderr, "Error compressing '%s'\n", info->path);
+        block->members[in.current].crc = CRC_GET_DIGEST(block->members[in.current].crc);
+        for (i = in.current + 1; i < block->num_members; i++) {
+            block->members[i].offset = in.offset;
+            block->members[i].size = 0;
+            block->members[i].crc = 0;
+            block->members[i].error = list->size[block->members[i].file] > 0;
         }
     }
+    if (in.file_open) {
+        File_Close(&in.file);
+    }
+    return result;
+}
+
+/* Bytes actually stored in a compressed block */
+static uint64_t solid_block_unpacked(const SolidBlock *block) {
+    const SolidMember *last = &block->members[block->num_members - 1];
+    return last->offset + last->size;
+}
+
+/* Write the fixed part of an entry record. When size_pos is not NULL it
+ * receives the offset of the compressed_size field so the caller can
+ * back-patch compressed_size and crc once the payload has been written. */
+int zlite_write_entry_header(ZliteOutput *output, const char *path, int file_type,
+                             uint64_t size, uint64_t compressed_size,
+                             uint32_t crc, uint64_t *size_pos) {
+    uint32_t path_len = (uint32_t)strlen(path);
     
-    fclose(archive_fp);
-    zlite_free_file_list(file_list, file_count);
+    if (zlite_output_write(output, &path_len, sizeof(uint32_t)) != sizeof(uint32_t) ||
+        zlite_output_write(output, path, path_len) != path_len ||
+        zlite_output_write(output, &file_type, sizeof(int)) != sizeof(int) ||
+        zlite_output_write(output, &size, sizeof(uint64_t)) != sizeof(uint64_t)) {
+        return ZLITE_ERROR_WRITE;
+    }
     
-    printf("\nCompressed %d files (%llu bytes)\n", total_files, 
+    if (size_pos) {
+        *size_pos = zlite_output_tell(output);
+    }
+    
+    if (zlite_output_write(output, &compressed_size, sizeof(uint64_t)) != sizeof(uint64_t) ||
+        zlite_output_write(output, &crc, sizeof(uint32_t)) != sizeof(uint32_t)) {
+        return ZLITE_ERROR_WRITE;
+    }
+    
+    return ZLITE_OK;
+}
+
+int zlite_write_link_target(ZliteOutput *output, const char *target) {
+    uint32_t target_len = (uint32_t)strlen(target);
+    
+    if (zlite_output_write(output, &target_len, sizeof(uint32_t)) != sizeof(uint32_t) ||
+        zlite_output_write(output, target, target_len) != target_len) {
+        return ZLITE_ERROR_WRITE;
+    }
+    
+    return ZLITE_OK;
+}
+
+/* Flags of a record whose sizes are only known after its payload */
+static uint32_t streamed_flags(const ZliteOutput *output) {
+    return output->stream ? ZLITE_FLAG_TRAILER : 0;
+}
+
+/* Fill in size, compressed_size and crc of a record written with
+ * placeholders: patched into the header, or on a stream as the trailer
+ * right after the payload */
+static int finish_streamed_entry(ZliteOutput *output, uint64_t size_pos, uint64_t size,
+                                 uint64_t compressed_size, uint32_t crc) {
+    uint64_t end_pos = zlite_output_tell(output);
+    
+    if (!output->stream && zlite_output_seek(output, size_pos - sizeof(uint64_t)) != 0) {
+        return ZLITE_ERROR_WRITE;
+    }
+    if (zlite_output_write(output, &size, sizeof(uint64_t)) != sizeof(uint64_t) ||
+        zlite_output_write(output, &compressed_size, sizeof(uint64_t)) != sizeof(uint64_t) ||
+        zlite_output_write(output, &crc, sizeof(uint32_t)) != sizeof(uint32_t)) {
+        return ZLITE_ERROR_WRITE;
+    }
+    if (!output->stream && zlite_output_seek(output, end_pos) != 0) {
+        return ZLITE_ERROR_WRITE;
+    }
+    return ZLITE_OK;
+}
+
+/* Compress a regular file, or a solid block when `block` is set, directly
+ * into the archive at the current position. The record header is written
+ * with placeholder values first, the encoder streams its output through an
+ * ArchiveOutStream, and size/compressed_size/crc are filled in afterwards
+ * (see finish_streamed_entry()). On failure the archive is rewound to the
+ * start of the record so the next entry overwrites the partial data; a
+ * stream cannot be rewound, which fails the whole archive. `coder` applies
+ * to the file; a block carries its own. */
+static int write_streamed_entry(ZliteOutput *output, EncoderCache *cache, const ZliteFileInfo *info,
+                                uint32_t coder, SolidBlock *block, const ZliteFileList *list,
+                                const ZliteCompressOptions *options, int num_threads,
+                                uint64_t *compressed_size, uint32_t *crc) {
+    ArchiveOutStream out;
+    uint64_t record_pos;
+    uint64_t size_pos;
+    uint64_t size;
+    int result;
+    
+    record_pos = zlite_output_tell(output);
+    
+    if (block) {
+        result = zlite_write_entry_header(output, "", ZLITE_FILETYPE_SOLID_BLOCK | block->coder |
+                                          streamed_flags(output), block->size, 0, 0, &size_pos);
+    } else {
+        result = zlite_write_entry_header(output, info->path, info->file_type | coder |
+                                          streamed_flags(output), info->size, 0, 0, &size_pos);
+    }
+    if (result == ZLITE_OK) {
+        ArchiveOutStream_Init(&out, output);
+        if (block) {
+            result = compress_solid(cache, block, list, &out.vt, options, num_threads,
+                                    options->block_size);
+        } else {
+            result = compress_file(cache, info->path, coder, &out.vt, options, num_threads,
+                                   options->block_size, NULL, NULL);
+        }
+    }
+    
+    if (result != ZLITE_OK) {
+        if (zlite_output_seek(output, record_pos) != ZLITE_OK) {
+            result = ZLITE_ERROR_WRITE;
+        }
+        return result;
+    }
+    
+    size = block ? solid_block_unpacked(block) : info->size;
+    *compressed_size = out.processed;
+    *crc = CRC_GET_DIGEST(out.crc);
+    DEBUG_PRINT("DEBUG: Writing file info: path=%s, size=%llu, compressed_size=%llu\n",
+               block ? "(solid)" : info->path, (unsigned long long)size,
+               (unsigned long long)*compressed_size);
+    
+    if (finish_streamed_entry(output, size_pos, size, *compressed_size, *crc) != ZLITE_OK) {
+        zlite_output_seek(output, record_pos);
+        return ZLITE_ERROR_WRITE;
+    }
+    
+    return ZLITE_OK;
+}
+
+/* Write a record whose payload has already been compressed into memory */
+static int write_buffered_entry(ZliteOutput *output, const char *path, int file_type, uint64_t file_size,
+                                const Byte *data, size_t size, uint32_t crc) {
+    int result;
+    
+    result = zlite_write_entry_header(output, path, file_type, file_size, size, crc, NULL);
+    if (result == ZLITE_OK && zlite_output_write(output, data, size) != size) {
+        result = ZLITE_ERROR_WRITE;
+    }
+    
+    return result;
+}
+
+/* ========================================================================
+ * Parallel compression pipeline
+ *
+ * Worker threads claim regular files and solid blocks largest first (LPT
+ * scheduling), so a big file late in the list does not leave the other
+ * threads idle at the end, and compress each one into memory. The calling
+ * thread is the ordered writer: it walks the file list, waits for each
+ * pooled job and copies its payload into the archive, so the output is
+ * identical to a single-threaded run. A job the writer needs that nobody
+ * has claimed yet is compressed by the writer itself. Claimed but not yet
+ * written jobs may reserve at most `budget` bytes; files too large for a
+ * worker slot, or large enough to span several LZMA2 blocks, are streamed
+ * into the archive by the writer with block-level threads, and stored
+ * files are copied in by the writer directly.
+ * ======================================================================== */
+
+#define JOB_NONE     0   /* not handled by the pool */
+#define JOB_PENDING  1
+#define JOB_RUNNING  2
+#define JOB_DONE     3
+
+typedef struct {
+    SolidBlock *block;          /* set for solid block jobs */
+    MemOutStream out;
+    uint64_t unpacked;          /* size and CRC of a file job's input */
+    uint32_t data_crc;
+    uint64_t cost;
+    int state;
+    int result;
+} CompressJob;
+
+typedef struct {
+    CompressJob *jobs;
+    int num_jobs;
+    const ZliteFileList *list;
+    int *order;                 /* pooled jobs, largest cost first */
+    int num_pooled;
+    int next_order;             /* order[] before this is claimed */
+    uint64_t in_flight;
+    uint64_t budget;
+    const ZliteCompressOptions *options;
+    int stop;
+    CCriticalSection cs;
+    CAutoResetEvent job_done;
+    CAutoResetEvent can_claim;
+    CThread *threads;
+    int num_threads;
+} CompressPipeline;
+
+/* Approximate peak memory of a job's output buffer */
+static uint64_t job_cost(uint64_t size) {
+    return size + (size >> 3) + ((uint64_t)1 << 12);
+}
+
+/* Compress a claimed job into memory */
+static void pipeline_run(CompressPipeline *p, CompressJob *job, EncoderCache *cache) {
+    char path[PATH_MAX];
+    
+    MemOutStream_Init(&job->out);
+    if (job->block) {
+        job->result = compress_solid(cache, job->block, p->list, &job->out.vt,
+                                     p->options, 1, 0);
+    } else if (zlite_file_list_path(p->list, (uint32_t)(job - p->jobs),
+                                    path, sizeof(path)) == 0) {
+        job->result = ZLITE_ERROR_FILE;
+    } else {
+        job->result = compress_file(cache, path, p->list->coder[job - p->jobs],
+                                    &job->out.vt, p->options, 1, 0,
+                                    &job->unpacked, &job->data_crc);
+    }
+    if (job->result == ZLITE_OK && job->out.error) {
+        job->result = ZLITE_ERROR_MEMORY;
+    }
+    
+    CriticalSection_Enter(&p->cs);
+    job->state = JOB_DONE;
+    CriticalSection_Leave(&p->cs);
+    Event_Set(&p->job_done);
+}
+
+/* Claim the largest pending job that fits the budget; call with p->cs held */
+static CompressJob* pipeline_claim(CompressPipeline *p) {
+    uint64_t avail = p->budget > p->in_flight ? p->budget - p->in_flight : 0;
+    int lo;
+    int hi;
+    int k;
+    
+    while (p->next_order < p->num_pooled &&
+           p->jobs[p->order[p->next_order]].state != JOB_PENDING) {
+        p->next_order++;
+    }
+    if (p->next_order >= p->num_pooled) {
+        return NULL;
+    }
+    
+    /* Always allow one job in flight so a single oversized job cannot
+     * stall the writer; otherwise skip to the first cost that fits */
+    lo = p->next_order;
+    if (p->in_flight > 0) {
+        hi = p->num_pooled;
+        while (lo < hi) {
+            int mid = lo + (hi - lo) / 2;
+            if (p->jobs[p->order[mid]].cost > avail) {
+                lo = mid + 1;
+            } else {
+                hi = mid;
+            }
+        }
+    }
+    
+    for (k = lo; k < p->num_pooled; k++) {
+        CompressJob *job = &p->jobs[p->order[k]];
+        if (job->state == JOB_PENDING) {
+            job->state = JOB_RUNNING;
+            p->in_flight += job->cost;
+            return job;
+        }
+    }
+    return NULL;
+}
+
+static THREAD_FUNC_DECL pipeline_worker(void *arg) {
+    CompressPipeline *p = (CompressPipeline *)arg;
+    EncoderCache cache = { NULL };
+    
+    for (;;) {
+        CompressJob *job = NULL;
+        
+        CriticalSection_Enter(&p->cs);
+        while (!p->stop) {
+            job = pipeline_claim(p);
+            if (job || p->next_order >= p->num_pooled) {
+                break;
+            }
+            
+            CriticalSection_Leave(&p->cs);
+            Event_Wait(&p->can_claim);
+            CriticalSection_Enter(&p->cs);
+        }
+        CriticalSection_Leave(&p->cs);
+        
+        /* Pass the wakeup on: another worker may be able to claim or exit */
+        Event_Set(&p->can_claim);
+        
+        if (!job) {
+            break;
+        }
+        
+        pipeline_run(p, job, &cache);
+    }
+    
+    encoder_cache_free(&cache);
+    return THREAD_FUNC_RET_ZERO;
+}
+
+static void pipeline_stop(CompressPipeline *p) {
+    int i;
+    
+    if (!p->jobs) {
+        return;
+    }
+    
+    CriticalSection_Enter(&p->cs);
+    p->stop = 1;
+    CriticalSection_Leave(&p->cs);
+    Event_Set(&p->can_claim);
+    
+    for (i = 0; i < p->num_threads; i++) {
+        if (Thread_WasCreated(&p->threads[i])) {
+            Thread_Wait_Close(&p->threads[i]);
+        }
+    }
+    
+    for (i = 0; i < p->num_jobs; i++) {
+        if (p->jobs[i].state == JOB_DONE) {
+            DynBuf_Free(&p->jobs[i].out.buf, &g_Alloc);
+        }
+    }
+    
+    Event_Close(&p->job_done);
+    Event_Close(&p->can_claim);
+    CriticalSection_Delete(&p->cs);
+    free(p->threads);
+    free(p->order);
+    free(p->jobs);
+    p->jobs = NULL;
+}
+
+typedef struct {
+    uint64_t cost;
+    int index;
+} JobOrder;
+
+/* Largest cost first; ties keep file-list order */
+static int cmp_job_order(const void *a, const void *b) {
+    const JobOrder *x = (const JobOrder *)a;
+    const JobOrder *y = (const JobOrder *)b;
+    
+    if (x->cost != y->cost) {
+        return x->cost > y->cost ? -1 : 1;
+    }
+    return x->index - y->index;
+}
+
+/* Fill p->order with the pooled jobs in LPT order */
+static int pipeline_order(CompressPipeline *p, int pooled) {
+    JobOrder *sorted = (JobOrder *)malloc(pooled * sizeof(JobOrder));
+    int n = 0;
+    int i;
+    
+    p->order = (int *)malloc(pooled * sizeof(int));
+    if (!sorted || !p->order) {
+        free(sorted);
+        return ZLITE_ERROR_MEMORY;
+    }
+    
+    for (i = 0; i < p->num_jobs; i++) {
+        if (p->jobs[i].state == JOB_PENDING) {
+            sorted[n].cost = p->jobs[i].cost;
+            sorted[n].index = i;
+            n++;
+        }
+    }
+    qsort(sorted, n, sizeof(JobOrder), cmp_job_order);
+    for (i = 0; i < n; i++) {
+        p->order[i] = sorted[i].index;
+    }
+    p->num_pooled = n;
+    
+    free(sorted);
+    return ZLITE_OK;
+}
+
+/* Stored data is copied straight into the archive by the writer, and
+ * LZMA2 input spanning several blocks is encoded there with block-level
+ * threads; everything else goes to a worker */
+static int worth_pooling(uint64_t size, uint32_t coder, uint64_t multiblock) {
+    switch (coder_method(coder)) {
+        case ZLITE_METHOD_COPY:
+            return 0;
+        case ZLITE_METHOD_LZMA2:
+            return size <= multiblock;
+        default:
+            return 1;
+    }
+}
+
+/* Start the worker pool. Leaves p->jobs NULL (everything is streamed by
+ * the writer) when only one thread is available or nothing fits a slot.
+ * A solid block is one job, keyed by the file that starts it; since blocks
+ * are bounded by the solid block size they may use up to half the budget. */
+static int pipeline_start(CompressPipeline *p, const ZliteFileList *list,
+                          const SolidPlan *plan, const ZliteCompressOptions *options,
+                          int num_threads, uint64_t budget) {
+    uint64_t slot_limit;
+    uint64_t multiblock;
+    int count = (int)list->count;
+    int pooled = 0;
+    int i;
+    
+    memset(p, 0, sizeof(*p));
+    
+    if (num_threads <= 1 || count == 0) {
+        return ZLITE_OK;
+    }
+    
+    p->budget = budget;
+    p->list = list;
+    p->options = options;
+    slot_limit = budget / (uint64_t)num_threads;
+    multiblock = multiblock_threshold(options->level, options->block_size);
+    
+    p->jobs = (CompressJob *)calloc(count, sizeof(CompressJob));
+    if (!p->jobs) {
+        return ZLITE_ERROR_MEMORY;
+    }
+    p->num_jobs = count;
+    
+    for (i = 0; i < count; i++) {
+        if (plan->block_at && plan->block_at[i] >= 0) {
+            SolidBlock *block = &plan->blocks[plan->block_at[i]];
+            if (job_cost(block->size) <= budget / 2 &&
+                worth_pooling(block->size, block->coder, multiblock)) {
+                p->jobs[i].block = block;
+                p->jobs[i].state = JOB_PENDING;
+                p->jobs[i].cost = job_cost(block->size);
+                pooled++;
+            }
+        } else if (plan->member_of && plan->member_of[i]) {
+            /* Compressed with its block */
+        } else if (list->type[i] == ZLITE_FILETYPE_REGULAR && !list->is_hardlink[i] &&
+            job_cost(list->size[i]) <= slot_limit &&
+            worth_pooling(list->size[i], list->coder[i], multiblock)) {
+            p->jobs[i].state = JOB_PENDING;
+            p->jobs[i].cost = job_cost(list->size[i]);
+            pooled++;
+        }
+    }
+    
+    if (pooled == 0) {
+        free(p->jobs);
+        p->jobs = NULL;
+        return ZLITE_OK;
+    }
+    if (num_threads > pooled) {
+        num_threads = pooled;
+    }
+    
+    p->threads = (CThread *)calloc(num_threads, sizeof(CThread));
+    if (!p->threads || pipeline_order(p, pooled) != ZLITE_OK) {
+        free(p->threads);
+        free(p->order);
+        free(p->jobs);
+        p->jobs = NULL;
+        return ZLITE_ERROR_MEMORY;
+    }
+    p->num_threads = num_threads;
+    
+    Event_Construct(&p->job_done);
+    Event_Construct(&p->can_claim);
+    if (CriticalSection_Init(&p->cs) != 0) {
+        free(p->threads);
+        free(p->order);
+        free(p->jobs);
+        p->jobs = NULL;
+        return ZLITE_ERROR_MEMORY;
+    }
+    if (AutoResetEvent_CreateNotSignaled(&p->job_done) != 0 ||
+        AutoResetEvent_CreateNotSignaled(&p->can_claim) != 0) {
+        p->num_threads = 0;
+        pipeline_stop(p);
+        return ZLITE_ERROR_MEMORY;
+    }
+    
+    for (i = 0; i < num_threads; i++) {
+        Thread_CONSTRUCT(&p->threads[i]);
+        if (Thread_Create(&p->threads[i], pipeline_worker, p) != 0) {
+            /* Run with the threads we have; none at all means no pool */
+            if (i == 0) {
+                pipeline_stop(p);
+            }
+            p->num_threads = i;
+            break;
+        }
+    }
+    
+    return ZLITE_OK;
+}
+
+/* Wait until job `index` has been compressed. If no worker has claimed it
+ * yet, the writer compresses it here instead of waiting for the workers to
+ * get through the larger jobs first. */
+static CompressJob* pipeline_wait(CompressPipeline *p, int index, EncoderCache *cache) {
+    CompressJob *job = &p->jobs[index];
+    
+    CriticalSection_Enter(&p->cs);
+    if (job->state == JOB_PENDING) {
+        job->state = JOB_RUNNING;
+        p->in_flight += job->cost;
+        CriticalSection_Leave(&p->cs);
+        pipeline_run(p, job, cache);
+        return job;
+    }
+    while (job->state != JOB_DONE) {
+        CriticalSection_Leave(&p->cs);
+        Event_Wait(&p->job_done);
+        CriticalSection_Enter(&p->cs);
+    }
+    CriticalSection_Leave(&p->cs);
+    
+    return job;
+}
+
+/* Free a written job's buffer and return its bytes to the budget */
+static void pipeline_release(CompressPipeline *p, CompressJob *job) {
+    DynBuf_Free(&job->out.buf, &g_Alloc);
+    
+    CriticalSection_Enter(&p->cs);
+    job->state = JOB_NONE;
+    p->in_flight -= job->cost;
+    CriticalSection_Leave(&p->cs);
+    Event_Set(&p->can_claim);
+}
+
+/* Start a central directory entry for the record at `offset` */
+static void dir_entry_init(ZliteIndexEntry *entry, uint64_t offset, int type, uint64_t size,
+                           const char *path, const char *target) {
+    memset(entry, 0, sizeof(*entry));
+    entry->offset = offset;
+    entry->type = type;
+    entry->size = size;
+    entry->path = path;
+    entry->target = target;
+    entry->block = ZLITE_NO_BLOCK;
+}
+
+/* Fill `info` with a view of list entry `index`; `path` (PATH_MAX bytes)
+ * receives its path */
+static int file_list_info(const ZliteFileList *list, uint32_t index, char *path,
+                          ZliteFileInfo *info) {
+    memset(info, 0, sizeof(*info));
+    if (zlite_file_list_path(list, index, path, PATH_MAX) == 0) {
+        return ZLITE_ERROR_FILE;
+    }
+    info->path = path;
+    info->link_target = (char *)zlite_file_list_target(list, index);
+    info->size = list->size[index];
+    info->crc = list->crc[index];
+    info->file_type = list->type[index];
+    info->is_hardlink = list->is_hardlink[index];
+    return ZLITE_OK;
+}
+
+/* ========================================================================
+ * Standard 7z output
+ *
+ * The same jobs and solid blocks are written as 7z folders (see
+ * write7z.c). Each payload is the method's property bytes followed by the
+ * coded data; 7z keeps the properties in the header, so they are split
+ * off and only the coded data becomes the packed stream. The files of a
+ * solid block are added right after its folder, since 7z assigns streams
+ * to files in folder order.
+ * ======================================================================== */
+
+/* Passes encoder output on after taking the first props_size bytes */
+typedef struct {
+    ISeqOutStream vt;
+    ISeqOutStreamPtr real;
+    Byte props[5];
+    size_t props_size;
+    size_t filled;
+} PropsOutStream;
+
+static size_t PropsOutStream_Write(ISeqOutStreamPtr pp, const void *data, size_t size) {
+    PropsOutStream *p = Z7_CONTAINER_FROM_VTBL(pp, PropsOutStream, vt);
+    size_t n = p->props_size - p->filled;
+    
+    if (n > size) {
+        n = size;
+    }
+    memcpy(p->props + p->filled, data, n);
+    p->filled += n;
+    if (n == size) {
+        return size;
+    }
+    return n + ISeqOutStream_Write(p->real, (const Byte *)data + n, size - n);
+}
+
+/* Compress list entry `index` (a file, or the solid block starting there)
+ * into a packed stream at the current position and add its folder. The
+ * pooled job is used when there is one. A folder is only added when data
+ * was read; otherwise the archive is rewound and *unpacked is 0. */
+static int write_7z_folder(ZliteOutput *output, Zlite7zWriter *w, EncoderCache *cache,
+                           CompressPipeline *pipeline, int index, const char *path,
+                           uint32_t coder, SolidBlock *block, const ZliteFileList *list,
+                           const ZliteCompressOptions *options, int num_threads,
+                           uint64_t *packed, uint64_t *unpacked,
+                           uint32_t *crc) {
+    uint64_t folder_pos = zlite_output_tell(output);
+    size_t props_size = zlite_7z_props_size(coder);
+    Byte props[5];
+    int result;
+    
+    *packed = 0;
+    *unpacked = 0;
+    *crc = 0;
+    
+    if (pipeline->jobs && pipeline->jobs[index].state != JOB_NONE) {
+        CompressJob *job = pipeline_wait(pipeline, index, cache);
+        
+        result = job->result;
+        if (result == ZLITE_OK && job->out.buf.pos < props_size) {
+            result = ZLITE_ERROR_CORRUPT;
+        }
+        if (result == ZLITE_OK) {
+            memcpy(props, job->out.buf.data, props_size);
+            *packed = job->out.buf.pos - props_size;
+            if (zlite_output_write(output, job->out.buf.data + props_size, (size_t)*packed) != *packed) {
+                result = ZLITE_ERROR_WRITE;
+            }
+            *unpacked = block ? solid_block_unpacked(block) : job->unpacked;
+            *crc = job->data_crc;
+        }
+        pipeline_release(pipeline, job);
+    } else {
+        ArchiveOutStream archive_out;
+        PropsOutStream out;
+        
+        ArchiveOutStream_Init(&archive_out, output);
+        out.vt.Write = PropsOutStream_Write;
+        out.real = &archive_out.vt;
+        out.props_size = props_size;
+        out.filled = 0;
+        
+        if (block) {
+            result = compress_solid(cache, block, list, &out.vt, options, num_threads,
+                                    options->block_size);
+        } else {
+            result = compress_file(cache, path, coder, &out.vt, options, num_threads,
+                                   options->block_size, unpacked, crc);
+        }
+        if (result == ZLITE_OK && out.filled != props_size) {
+            result = ZLITE_ERROR_CORRUPT;
+        }
+        if (result == ZLITE_OK) {
+            memcpy(props, out.props, props_size);
+            *packed = archive_out.processed;
+            if (block) {
+                *unpacked = solid_block_unpacked(block);
+            }
+        }
+    }
+    
+    if (result != ZLITE_OK || *unpacked == 0) {
+        zlite_output_seek(output, folder_pos);
+        *packed = 0;
+        return result;
+    }
+    return zlite_7z_add_folder(w, coder, props, *packed, *unpacked);
+}
+
+/* Add the files of a block just written as a folder */
+static int add_7z_members(Zlite7zWriter *w, const SolidBlock *block, const ZliteFileList *list,
+                          uint64_t *total_files, uint64_t *total_size) {
+    char path[PATH_MAX];
+    int k;
+    
+    for (k = 0; k < block->num_members; k++) {
+        const SolidMember *member = &block->members[k];
+        int result;
+        
+        if (zlite_file_list_path(list, (uint32_t)member->file, path, sizeof(path)) == 0) {
+            return ZLITE_ERROR_FILE;
+        }
+        /* Whatever was read of a failed file is part of the folder and
+         * has to stay listed */
+        if (member->error) {
+            fprintf(stderr, "Error compressing '%s'\n", path);
+            if (member->size == 0) {
+                continue;
+            }
+        }
+        
+        result = zlite_7z_add_file(w, path, member->size, member->crc,
+                                   zlite_7z_attrib(ZLITE_FILETYPE_REGULAR,
+                                                   list->attrib[member->file]));
+        if (result != ZLITE_OK) {
+            return result;
+        }
+        
+        printf("  %s (%llu bytes, solid)\n", path, (unsigned long long)member->size);
+        (*total_files)++;
+        *total_size += member->size;
+    }
+    return ZLITE_OK;
+}
+
+/* Write list entry `index` to a 7z archive: the solid block starting there
+ * with its files, then the entry itself unless it is one of them */
+static int write_7z_entry(ZliteOutput *output, Zlite7zWriter *w, EncoderCache *cache,
+                          CompressPipeline *pipeline, const SolidPlan *plan,
+                          const ZliteFileList *list, int index,
+                          const ZliteCompressOptions *options, int num_threads,
+                          uint64_t *total_files, uint64_t *total_size) {
+    char path[PATH_MAX];
+    ZliteFileInfo info;
+    uint32_t coder = list->coder[index];
+    uint32_t attrib;
+    uint64_t packed;
+    uint64_t unpacked;
+    uint32_t crc;
+    int result;
+    
+    result = file_list_info(list, (uint32_t)index, path, &info);
+    if (result != ZLITE_OK) {
+        return result;
+    }
+    attrib = zlite_7z_attrib(info.file_type, list->attrib[index]);
+    
+    if (plan->block_at && plan->block_at[index] >= 0) {
+        SolidBlock *block = &plan->blocks[plan->block_at[index]];
+        int k;
+        
+        result = write_7z_folder(output, w, cache, pipeline, index, NULL, block->coder, block,
+                                 list, options, num_threads, &packed, &unpacked, &crc);
+        if (result == ZLITE_OK) {
+            printf("  [solid block: %d files, %llu -> %llu bytes%s%s]\n", block->num_members,
+                   (unsigned long long)unpacked, (unsigned long long)packed,
+                   block->coder ? ", " : "", zlite_coder_name(block->coder));
+            result = add_7z_members(w, block, list, total_files, total_size);
+        } else if (result != ZLITE_ERROR_WRITE && result != ZLITE_ERROR_MEMORY) {
+            for (k = 0; k < block->num_members; k++) {
+                block->members[k].error = 1;
+                block->members[k].size = 0;
+            }
+            result = add_7z_members(w, block, list, total_files, total_size);
+        }
+        if (result != ZLITE_OK) {
+            return result;
+        }
+    }
+    
+    if (plan->member_of && plan->member_of[index]) {
+        return ZLITE_OK;
+    }
+    
+    if (info.file_type == ZLITE_FILETYPE_DIR) {
+        result = zlite_7z_add_file(w, path, 0, 0, attrib);
+        if (result == ZLITE_OK) {
+            printf("  %s [dir]\n", path);
+        }
+        return result;
+    }
+    
+    /* 7z stores a symlink as a file holding its target */
+    if (info.file_type == ZLITE_FILETYPE_SYMLINK) {
+        const char *target = info.link_target ? info.link_target : "";
+        size_t len = strlen(target);
+        
+        if (len > 0) {
+            if (zlite_output_write(output, target, len) != len) {
+                return ZLITE_ERROR_WRITE;
+            }
+            result = zlite_7z_add_folder(w, (uint32_t)ZLITE_METHOD_COPY << ZLITE_METHOD_SHIFT,
+                                         NULL, len, len);
+        }
+        if (result == ZLITE_OK) {
+            result = zlite_7z_add_file(w, path, len, CrcCalc(target, len), attrib);
+        }
+        if (result == ZLITE_OK) {
+            printf("  %s [symlink -> %s]\n", path, target);
+        }
+        return result;
+    }
+    
+    result = write_7z_folder(output, w, cache, pipeline, index, path, coder, NULL, list, options,
+                             num_threads, &packed, &unpacked, &crc);
+    if (result == ZLITE_OK) {
+        result = zlite_7z_add_file(w, path, unpacked, crc, attrib);
+        if (result != ZLITE_OK) {
+            return result;
+        }
+        printf("  %s (%llu -> %llu bytes, %.1f%%%s%s)\n", path,
+               (unsigned long long)unpacked, (unsigned long long)packed,
+               unpacked > 0 ? (packed * 100.0 / unpacked) : 0.0,
+               coder ? ", " : "", zlite_coder_name(coder));
+        (*total_files)++;
+        *total_size += unpacked;
+    } else if (result != ZLITE_ERROR_WRITE && result != ZLITE_ERROR_MEMORY) {
+        fprintf(stderr, "Error compressing '%s'\n", path);
+        result = ZLITE_OK;
+    }
+    return result;
+}
+
+/* ========================================================================
+ * Updates and appends
+ *
+ * An update writes the archive anew from the files on disk, as an add
+ * would, into path.tmp, which then replaces it. Files whose size, mtime
+ * and inode match their entry in the previous archive are not read at
+ * all: their record is copied as it is (by the kernel where the platform
+ * allows). A solid block is copied when all of its files are unchanged,
+ * otherwise the files left in it are compressed again; a copy of another
+ * file is kept when that file is. Entries of files no longer on disk are
+ * dropped. Entries from archives written before mtimes were recorded
+ * never match, so the first update compresses everything.
+ *
+ * An append leaves the records of the archive where they are and writes
+ * the new ones over its directory, then a directory of old and new
+ * entries, and the record count in the header last. Until that count is
+ * written the archive reads as before: without a valid footer readers
+ * scan the records the header counts. Files whose path is in the archive
+ * already are skipped.
+ * ======================================================================== */
+
+#define FILETYPE_SKIPPED 0xFE   /* list entries an append leaves out */
+#define NOT_KEPT 0xFFFFFFFFu
+
+/* The archive an update or append starts from */
+typedef struct {
+    ZliteArchive *archive;
+    ZliteIndex index;
+    int append;                 /* write after its records instead of anew */
+    char tmp_path[PATH_MAX];    /* where an update writes */
+    uint64_t volume_size;
+    uint32_t *kept;             /* list entry -> previous entry, or NOT_KEPT */
+    uint32_t *new_block;        /* previous block -> block written, or ZLITE_NO_BLOCK */
+    uint32_t num_kept;          /* or, appending, skipped */
+    uint64_t copied;            /* bytes of records copied */
+} BaseArchive;
+
+static int entry_unchanged(const ZliteIndexEntry *entry, const ZliteFileList *list,
+                           uint32_t i) {
+    return entry->mtime != 0 && entry->mtime == list->mtime[i] &&
+           entry->inode == list->inode[i] && entry->size == list->size[i];
+}
+
+/* Find the list entries to copy and mark them FILETYPE_KEPT, so the
+ * passes that read files (dedup, classification, compression) skip them */
+static int update_mark(BaseArchive *u, ZliteFileList *list) {
+    const ZliteIndex *index = &u->index;
+    uint32_t count = index->count;
+    const char **paths;
+    uint32_t *kept_at;          /* previous entry -> list entry, or NOT_KEPT */
+    uint32_t *missing;          /* members of a block not kept */
+    uint32_t *left;             /* members of a block not reached yet */
+    uint64_t *next;             /* where the next member of a block starts */
+    uint32_t open_block = NOT_KEPT;
+    ZliteNameIndex names;
+    char path[PATH_MAX];
+    uint32_t i;
+    int result;
+    
+    u->kept = (uint32_t *)malloc((list->count ? list->count : 1) * sizeof(uint32_t));
+    u->new_block = (uint32_t *)malloc((index->block_count ? index->block_count : 1) *
+                                      sizeof(uint32_t));
+    paths = (const char **)malloc((count ? count : 1) * sizeof(char *));
+    kept_at = (uint32_t *)malloc((count ? count : 1) * sizeof(uint32_t));
+    missing = (uint32_t *)calloc(index->block_count ? index->block_count : 1, sizeof(uint32_t));
+    left = (uint32_t *)malloc((index->block_count ? index->block_count : 1) * sizeof(uint32_t));
+    next = (uint64_t *)calloc(index->block_count ? index->block_count : 1, sizeof(uint64_t));
+    if (!u->kept || !u->new_block || !paths || !kept_at || !missing || !left || !next) {
+        free(paths);
+        free(kept_at);
+        free(missing);
+        free(left);
+        free(next);
+        return ZLITE_ERROR_MEMORY;
+    }
+    
+    for (i = 0; i < count; i++) {
+        paths[i] = index->entries[i].path;
+        kept_at[i] = NOT_KEPT;
+        if (index->entries[i].flags & ZLITE_FLAG_SOLID) {
+            missing[index->entries[i].block]++;
+        }
+    }
+    for (i = 0; i < index->block_count; i++) {
+        u->new_block[i] = ZLITE_NO_BLOCK;
+        left[i] = missing[i];
+    }
+    result = zlite_name_index_init(&names, paths, NULL, count);
+    if (result != ZLITE_OK) {
+        free(paths);
+        free(kept_at);
+        free(missing);
+        free(left);
+        free(next);
+        return result;
+    }
+    
+    /* Unchanged files stored with their data */
+    for (i = 0; i < list->count; i++) {
+        uint32_t j = NOT_KEPT;
+        
+        u->kept[i] = NOT_KEPT;
+        if (list->type[i] == ZLITE_FILETYPE_REGULAR && !list->is_hardlink[i] &&
+            zlite_file_list_path(list, i, path, sizeof(path)) > 0) {
+            j = zlite_name_index_find(&names, path);
+        }
+        if (j >= count || kept_at[j] != NOT_KEPT ||
+            index->entries[j].type != ZLITE_FILETYPE_REGULAR ||
+            !entry_unchanged(&index->entries[j], list, i)) {
+            continue;
+        }
+        u->kept[i] = j;
+        kept_at[j] = i;
+        if (index->entries[j].flags & ZLITE_FLAG_SOLID) {
+            missing[index->entries[j].block]--;
+        }
+    }
+    
+    /* A block is copied whole or not at all, and only when its members
+     * come in block order with no other file between them: readers without
+     * the directory take the members of a block to be the solid records
+     * that follow it, back to back */
+    for (i = 0; i < list->count; i++) {
+        uint32_t j = u->kept[i];
+        uint32_t block = NOT_KEPT;
+        
+        if (j != NOT_KEPT && (index->entries[j].flags & ZLITE_FLAG_SOLID)) {
+            block = index->entries[j].block;
+        } else if (j != NOT_KEPT || list->type[i] != ZLITE_FILETYPE_REGULAR ||
+                   list->is_hardlink[i]) {
+            continue;
+        } else if (zlite_file_list_path(list, i, path, sizeof(path)) > 0) {
+            /* Copies stay copies */
+            j = zlite_name_index_find(&names, path);
+            if (j < count && index->entries[j].type == ZLITE_FILETYPE_REF &&
+                entry_unchanged(&index->entries[j], list, i)) {
+                continue;
+            }
+        }
+        if (open_block != NOT_KEPT && open_block != block && left[open_block] > 0) {
+            missing[open_block]++;
+        }
+        if (block != NOT_KEPT) {
+            if (index->entries[j].unpack_offset != next[block]) {
+                missing[block]++;
+            }
+            next[block] = index->entries[j].unpack_offset + index->entries[j].size;
+            left[block]--;
+        }
+        open_block = block;
+    }
+    for (i = 0; i < list->count; i++) {
+        uint32_t j = u->kept[i];
+        
+        if (j != NOT_KEPT && (index->entries[j].flags & ZLITE_FLAG_SOLID) &&
+            missing[index->entries[j].block] > 0) {
+            u->kept[i] = NOT_KEPT;
+            kept_at[j] = NOT_KEPT;
+        }
+    }
+    
+    /* Copies of a kept file that come after it */
+    for (i = 0; i < list->count; i++) {
+        uint32_t j = NOT_KEPT;
+        uint32_t k;
+        
+        if (list->type[i] == ZLITE_FILETYPE_REGULAR && !list->is_hardlink[i] &&
+            u->kept[i] == NOT_KEPT && zlite_file_list_path(list, i, path, sizeof(path)) > 0) {
+            j = zlite_name_index_find(&names, path);
+        }
+        if (j >= count || kept_at[j] != NOT_KEPT ||
+            index->entries[j].type != ZLITE_FILETYPE_REF ||
+            !entry_unchanged(&index->entries[j], list, i)) {
+            continue;
+        }
+        k = zlite_name_index_find(&names, index->entries[j].target);
+        if (k < count && kept_at[k] < i) {
+            u->kept[i] = j;
+            kept_at[j] = i;
+        }
+    }
+    
+    for (i = 0; i < list->count; i++) {
+        if (u->kept[i] != NOT_KEPT) {
+            list->type[i] = FILETYPE_KEPT;
+            u->num_kept++;
+        }
+    }
+    
+    zlite_name_index_free(&names);
+    free(paths);
+    free(kept_at);
+    free(missing);
+    free(left);
+    free(next);
+    return ZLITE_OK;
+}
+
+/* Copy the record of a previous entry, placed in solid block `block` */
+static int update_copy_record(BaseArchive *u, ZliteOutput *output, ZliteDirWriter *dir,
+                              const ZliteIndexEntry *src, uint32_t block) {
+    ZliteIndexEntry entry = *src;
+    uint64_t size = src->data_offset - src->offset;
+    int result;
+    
+    if (src->type == ZLITE_FILETYPE_REF) {
+        size += sizeof(uint32_t) + strlen(src->target);
+    } else {
+        size += src->compressed_size;
+    }
+    if (src->flags & ZLITE_FLAG_TRAILER) {
+        size += ZLITE_RECORD_TRAILER_SIZE;
+    }
+    
+    entry.offset = zlite_output_tell(output);
+    entry.block = block;
+    result = zlite_archive_copy(u->archive, src->offset, size, output);
+    if (result == ZLITE_OK) {
+        result = zlite_dir_add(dir, &entry);
+    }
+    if (result == ZLITE_OK) {
+        u->copied += size;
+    }
+    return result;
+}
+
+/* Copy the record of kept list entry i, after its solid block if that
+ * has not been copied yet */
+static int update_copy(BaseArchive *u, ZliteOutput *output, ZliteDirWriter *dir, uint32_t i,
+                       uint32_t *records_written, uint32_t *blocks_written) {
+    const ZliteIndexEntry *src = &u->index.entries[u->kept[i]];
+    uint32_t block = ZLITE_NO_BLOCK;
+    int result;
+    
+    if (src->flags & ZLITE_FLAG_SOLID) {
+        if (u->new_block[src->block] == ZLITE_NO_BLOCK) {
+            result = update_copy_record(u, output, dir, &u->index.blocks[src->block],
+                                        ZLITE_NO_BLOCK);
+            if (result != ZLITE_OK) {
+                return result;
+            }
+            u->new_block[src->block] = (*blocks_written)++;
+            (*records_written)++;
+        }
+        block = u->new_block[src->block];
+    }
+    
+    result = update_copy_record(u, output, dir, src, block);
+    if (result == ZLITE_OK) {
+        (*records_written)++;
+    }
+    return result;
+}
+
+static void base_free(BaseArchive *u) {
+    zlite_index_free(&u->index);
+    free(u->kept);
+    free(u->new_block);
+}
+
+/* Mark the list entries whose path the archive has FILETYPE_SKIPPED */
+static int append_mark(BaseArchive *a, ZliteFileList *list) {
+    const ZliteIndex *index = &a->index;
+    const char **paths;
+    ZliteNameIndex names;
+    char path[PATH_MAX];
+    uint32_t i;
+    int result;
+    
+    paths = (const char **)malloc((index->count ? index->count : 1) * sizeof(char *));
+    if (!paths) {
+        return ZLITE_ERROR_MEMORY;
+    }
+    for (i = 0; i < index->count; i++) {
+        paths[i] = index->entries[i].path;
+    }
+    result = zlite_name_index_init(&names, paths, NULL, index->count);
+    if (result != ZLITE_OK) {
+        free(paths);
+        return result;
+    }
+    
+    for (i = 0; i < list->count; i++) {
+        if (zlite_file_list_path(list, i, path, sizeof(path)) > 0 &&
+            zlite_name_index_find(&names, path) < index->count) {
+            list->type[i] = FILETYPE_SKIPPED;
+            a->num_kept++;
+        }
+    }
+    
+    zlite_name_index_free(&names);
+    free(paths);
+    return ZLITE_OK;
+}
+
+/* Start the directory with the entries of the archive, in archive order */
+static int append_directory(const BaseArchive *a, ZliteDirWriter *dir) {
+    const ZliteIndex *index = &a->index;
+    uint32_t ei = 0;
+    uint32_t bi = 0;
+    int result = ZLITE_OK;
+    
+    while (result == ZLITE_OK && (ei < index->count || bi < index->block_count)) {
+        if (bi < index->block_count &&
+            (ei == index->count || index->blocks[bi].offset < index->entries[ei].offset)) {
+            result = zlite_dir_add(dir, &index->blocks[bi++]);
+        } else {
+            result = zlite_dir_add(dir, &index->entries[ei++]);
+        }
+    }
+    return result;
+}
+
+/* Add files to a new archive at the archive's path. With base set the
+ * archive is updated through path.tmp, reusing what is unchanged, or
+ * appended to. */
+static int add_files(ZliteArchive *archive, char **files, int num_files,
+                     const ZliteCompressOptions *options, BaseArchive *base) {
+    ZliteFileList file_list;
+    int file_count;
+    int i;
+    int result;
+    ZliteOutput output;
+    CompressPipeline pipeline;
+    SolidPlan plan;
+    EncoderCache cache = { NULL };  /* for entries compressed on this thread */
+    int num_threads;
+    uint64_t budget;
+    uint32_t records_written = 0;
+    uint32_t blocks_written = 0;
+    ZliteDirWriter dir;
+    Zlite7zWriter seven_z;
+    int is_7z = options->format == ZLITE_FORMAT_7Z;
+    ZliteIndexEntry entry;
+    uint64_t total_files = 0;
+    uint64_t total_size = 0;
+    uint64_t start_time;
+    uint64_t start_cpu;
+    uint32_t plan_block = 0;    /* number of the last solid block of the plan */
+
+    /* A stream gets every byte once, in order: nothing to patch, split or
+     * replace */
+    if (options->stream_out && (is_7z || base || options->volume_size > 0)) {
+        fprintf(stderr, "Error: %s\n", is_7z ? "Standard 7z archives cannot be written to a stream"
+                                             : "Only new archives without volumes can be streamed");
+        return ZLITE_ERROR_UNSUPPORTED;
+    }
+
+    /* Collect files */
+    result = zlite_collect_files(files, num_files, &file_list);
+
+    if (result != ZLITE_OK) {
+        return result;
+    }
+    file_count = (int)file_list.count;
+
+    /* Files unchanged since the previous archive are copied from it;
+     * appending, files already in it are left alone */
+    if (base) {
+        result = base->append ? append_mark(base, &file_list)
+                              : update_mark(base, &file_list);
+        if (result != ZLITE_OK) {
+            zlite_free_file_list(&file_list);
+            return result;
+        }
+    }
+
+    /* Initialize CRC table */
+    CrcGenerateTable();
+    zlite_dir_init(&dir);
+    zlite_7z_init(&seven_z);
+
+    /* 7z has no links between entries: every path gets its own data */
+    if (is_7z) {
+        for (i = 0; i < file_count; i++) {
+            if (file_list.is_hardlink[i]) {
+                file_list.type[i] = ZLITE_FILETYPE_REGULAR;
+                file_list.is_hardlink[i] = 0;
+            }
+        }
+    }
+
+    /* Store identical files once */
+    if (options->dedup && !is_7z) {
+        int dup_count;
+        uint64_t dup_bytes;
+
+        result = zlite_dedup_files(&file_list, &dup_count, &dup_bytes);
+        if (result != ZLITE_OK) {
+            zlite_free_file_list(&file_list);
+            return result;
+        }
+        if (dup_count > 0) {
+            printf("Found %d duplicate files (%llu bytes)\n", dup_count,
+                   (unsigned long long)dup_bytes);
+        }
+    }
+
+    /* Choose filters for executables and audio, PPMd for text and store
+     * what does not compress */
+    result = zlite_classify_files(&file_list, options);
+    if (result != ZLITE_OK) {
+        zlite_free_file_list(&file_list);
+        return result;
+    }
+
+    /* Group small files into solid blocks */
+    memset(&plan, 0, sizeof(plan));
+    if (options->solid) {
+        result = solid_plan_build(&plan, &file_list,
+                                  options->solid_block_size > 0 ? options->solid_block_size
+                                                                : ZLITE_DEFAULT_SOLID_BLOCK_SIZE);
+        if (result != ZLITE_OK) {
+            solid_plan_free(&plan);
+            zlite_free_file_list(&file_list);
+            return result;
+        }
+    }
+
+    /* Open archive file, or its first volume; an update hands the volumes
+     * to the hook once they have their final names */
+    if (base && base->append) {
+        result = zlite_output_reopen(&output, zlite_archive_get_path(archive),
+                                     base->volume_size, base->index.records_end,
+                                     options->volume_hook, options->volume_hook_arg);
+        if (result == ZLITE_OK) {
+            records_written = base->index.count + base->index.block_count;
+            blocks_written = base->index.block_count;
+            result = append_directory(base, &dir);
+            if (result != ZLITE_OK) {
+                zlite_output_close(&output, 0);
+            }
+        }
+    } else if (base) {
+        result = zlite_output_open(&output, base->tmp_path, base->volume_size, NULL, NULL);
+    } else if (options->stream_out) {
+        result = zlite_output_open_stream(&output, options->stream_out);
+    } else {
+        result = zlite_output_open(&output, zlite_archive_get_path(archive),
+                                   options->volume_size, options->volume_hook,
+                                   options->volume_hook_arg);
+    }
+    if (result != ZLITE_OK) {
+        solid_plan_free(&plan);
+        zlite_free_file_list(&file_list);
+        return result;
+    }
+    
+    if (is_7z) {
+        /* Signature header, filled in when the header is written */
+        zlite_7z_begin(&output);
+    } else if (base && base->append) {
+        /* The header stays as it is until the record count is patched */
+    } else {
+        /* Write simple header */
+        zlite_output_write(&output, ZLITE_ARCHIVE_MAGIC, ZLITE_ARCHIVE_MAGIC_SIZE);
+        
+        /* Write file count (patched at the end with the number of records
+         * written; a stream keeps 0 and is read through its directory) */
+        zlite_output_write(&output, &records_written, sizeof(uint32_t));
+    }
+    
+    /* Start compressing regular files in the background */
+    num_threads = options->num_threads > 0 ? options->num_threads : zlite_get_cpu_count();
+    budget = options->inflight_budget > 0 ? options->inflight_budget
+                                          : ZLITE_DEFAULT_INFLIGHT_BUDGET;
+    start_time = zlite_time_usec();
+    start_cpu = zlite_cpu_usec();
+    result = pipeline_start(&pipeline, &file_list, &plan, options,
+                            num_threads, budget);
+    if (result != ZLITE_OK) {
+        zlite_output_close(&output, 0);
+        if (base && !base->append) {
+            zlite_archive_discard(base->tmp_path, base->volume_size);
+        }
+        solid_plan_free(&plan);
+        zlite_free_file_list(&file_list);
+        return result;
+    }
+    
+    /* Process each file */
+    for (i = 0; i < file_count; i++) {
+        ZliteFileInfo entry_info;
+        ZliteFileInfo *info = &entry_info;
+        uint32_t coder = file_list.coder[i];
+        char path[PATH_MAX];
+        uint64_t compressed_size = 0;
+        uint32_t crc = 0;
+        uint32_t trailer = 0;       /* ZLITE_FLAG_TRAILER of a streamed record */
+        uint64_t record_pos = zlite_output_tell(&output);
+        
+        /* Earlier entries are final: hand finished volumes over */
+        zlite_output_commit(&output, record_pos);
+        
+        if (is_7z) {
+            result = write_7z_entry(&output, &seven_z, &cache, &pipeline, &plan, &file_list,
+                                    i, options, num_threads, &total_files, &total_size);
+            if (result != ZLITE_OK) {
+                break;
+            }
+            continue;
+        }
+        
+        result = file_list_info(&file_list, (uint32_t)i, path, info);
+        if (result != ZLITE_OK) {
+            break;
+        }
+        
+        if (info->file_type == FILETYPE_SKIPPED) {
+            continue;
+        }
+        
+        /* Unchanged since the previous archive */
+        if (info->file_type == FILETYPE_KEPT) {
+            result = update_copy(base, &output, &dir, (uint32_t)i, &records_written,
+                                 &blocks_written);
+            if (result != ZLITE_OK) {
+                break;
+            }
+            continue;
+        }
+        
+        /* A solid block goes ahead of the records it covers */
+        if (plan.block_at && plan.block_at[i] >= 0) {
+            SolidBlock *block = &plan.blocks[plan.block_at[i]];
+            uint64_t unpacked = 0;
+            int k;
+            
+            if (pipeline.jobs && pipeline.jobs[i].state != JOB_NONE) {
+                CompressJob *job = pipeline_wait(&pipeline, i, &cache);
+                
+                result = job->result;
+                if (result == ZLITE_OK) {
+                    compressed_size = job->out.buf.pos;
+                    crc = CRC_GET_DIGEST(job->out.crc);
+                    unpacked = solid_block_unpacked(block);
+                    result = write_buffered_entry(&output, "",
+                                                  ZLITE_FILETYPE_SOLID_BLOCK | block->coder,
+                                                  unpacked, job->out.buf.data,
+                                                  job->out.buf.pos, crc);
+                }
+                pipeline_release(&pipeline, job);
+            } else {
+                result = write_streamed_entry(&output, &cache, NULL, 0, block, &file_list, options,
+                                              num_threads, &compressed_size, &crc);
+                if (result == ZLITE_OK) {
+                    unpacked = solid_block_unpacked(block);
+                }
+                trailer = streamed_flags(&output);
+            }
+            
+            if (result == ZLITE_OK) {
+                dir_entry_init(&entry, record_pos, ZLITE_FILETYPE_SOLID_BLOCK, unpacked, "", NULL);
+                entry.flags = block->coder | trailer;
+                entry.compressed_size = compressed_size;
+                entry.crc = crc;
+                result = zlite_dir_add(&dir, &entry);
+            }
+            if (result == ZLITE_OK) {
+                records_written++;
+                plan_block = blocks_written++;
+                printf("  [solid block: %d files, %llu -> %llu bytes%s%s]\n", block->num_members,
+                       (unsigned long long)unpacked, (unsigned long long)compressed_size,
+                       block->coder ? ", " : "", zlite_coder_name(block->coder));
+            } else if (result == ZLITE_ERROR_WRITE || result == ZLITE_ERROR_MEMORY) {
+                break;
+            } else {
+                /* Nothing was stored for this block: skip its members */
+                for (k = 0; k < block->num_members; k++) {
+                    block->members[k].error = 1;
+                }
+                result = ZLITE_OK;
+            }
+            record_pos = zlite_output_tell(&output);
+            trailer = 0;
+        }
+        
+        /* Handle hard link references */
+        if (info->is_hardlink && info->link_target) {
+            /* This is a reference to another file in the archive */
+            result = zlite_write_entry_header(&output, info->path, ZLITE_FILETYPE_HARDLINK,
+                                              info->size, 0, 0, NULL);
+            /* Store reference path */
+            if (result == ZLITE_OK) {
+                result = zlite_write_link_target(&output, info->link_target);
+            }
+            if (result == ZLITE_OK) {
+                dir_entry_init(&entry, record_pos, ZLITE_FILETYPE_HARDLINK, info->size,
+                               info->path, info->link_target);
+                result = zlite_dir_add(&dir, &entry);
+            }
+            if (result != ZLITE_OK) {
+                break;
+            }
+            records_written++;
+
+            printf("  %s [hardlink -> %s]\n", info->path, info->link_target);
+            continue;
+        }
+        
+        /* Copies of an earlier file only name it */
+        if (info->file_type == ZLITE_FILETYPE_REF) {
+            result = zlite_write_entry_header(&output, info->path, ZLITE_FILETYPE_REF,
+                                              info->size, 0, info->crc, NULL);
+            if (result == ZLITE_OK) {
+                result = zlite_write_link_target(&output, info->link_target);
+            }
+            if (result == ZLITE_OK) {
+                dir_entry_init(&entry, record_pos, ZLITE_FILETYPE_REF, info->size,
+                               info->path, info->link_target);
+                entry.crc = info->crc;
+                entry.mtime = file_list.mtime[i];
+                entry.inode = file_list.inode[i];
+                result = zlite_dir_add(&dir, &entry);
+            }
+            if (result != ZLITE_OK) {
+                break;
+            }
+            records_written++;
+            
+            printf("  %s [duplicate of %s]\n", info->path, info->link_target);
+            total_files++;
+            total_size += info->size;
+            continue;
+        }
+        
+        /* Skip directories for now */
+        if (info->file_type == ZLITE_FILETYPE_DIR) {
+            result = zlite_write_entry_header(&output, info->path, info->file_type,
+                                              info->size, 0, 0, NULL);
+            if (result == ZLITE_OK) {
+                dir_entry_init(&entry, record_pos, info->file_type, info->size,
+                               info->path, NULL);
+                result = zlite_dir_add(&dir, &entry);
+            }
+            if (result != ZLITE_OK) {
+                break;
+            }
+            records_written++;
+            
+            printf("  %s [dir]\n", info->path);
+            continue;
+        }
+        
+        /* Handle symlinks */
+        if (info->file_type == ZLITE_FILETYPE_SYMLINK) {
+            result = zlite_write_entry_header(&output, info->path, info->file_type,
+                                              info->size, 0, 0, NULL);
+            if (result == ZLITE_OK && info->link_target) {
+                result = zlite_write_link_target(&output, info->link_target);
+            }
+            if (result == ZLITE_OK) {
+                dir_entry_init(&entry, record_pos, info->file_type, info->size,
+                               info->path, info->link_target);
+                result = zlite_dir_add(&dir, &entry);
+            }
+            if (result != ZLITE_OK) {
+                break;
+            }
+            records_written++;
+            
+            printf("  %s [symlink -> %s]\n", info->path, info->link_target ? info->link_target : "NULL");
+            continue;
+        }
+        
+        /* Solid members: the data is already in the block */
+        if (plan.member_of && plan.member_of[i]) {
+            SolidMember *member = plan.member_of[i];
+            
+            if (member->error) {
+                fprintf(stderr, "Error compressing '%s'\n", info->path);
+                continue;
+            }
+            
+            result = zlite_write_entry_header(&output, info->path,
+                                              ZLITE_FILETYPE_REGULAR | ZLITE_FLAG_SOLID,
+                                              member->size, 0, member->crc, NULL);
+            if (result == ZLITE_OK) {
+                dir_entry_init(&entry, record_pos, ZLITE_FILETYPE_REGULAR, member->size,
+                               info->path, NULL);
+                entry.flags = ZLITE_FLAG_SOLID;
+                entry.crc = member->crc;
+                entry.block = plan_block;
+                entry.unpack_offset = member->offset;
+                entry.mtime = file_list.mtime[i];
+                entry.inode = file_list.inode[i];
+                result = zlite_dir_add(&dir, &entry);
+            }
+            if (result != ZLITE_OK) {
+                break;
+            }
+            records_written++;
+            
+            printf("  %s (%llu bytes, solid)\n", info->path, (unsigned long long)member->size);
+            total_files++;
+            total_size += member->size;
+            continue;
+        }
+        
+        /* Regular files: take the pooled result, or stream it in directly */
+        if (pipeline.jobs && pipeline.jobs[i].state != JOB_NONE) {
+            CompressJob *job = pipeline_wait(&pipeline, i, &cache);
+            
+            result = job->result;
+            if (result == ZLITE_OK) {
+                compressed_size = job->out.buf.pos;
+                crc = CRC_GET_DIGEST(job->out.crc);
+                result = write_buffered_entry(&output, info->path, info->file_type | coder,
+                                              info->size, job->out.buf.data, job->out.buf.pos,
+                                              crc);
+            }
+            pipeline_release(&pipeline, job);
+        } else {
+            result = write_streamed_entry(&output, &cache, info, coder, NULL, NULL, options,
+                                          num_threads, &compressed_size, &crc);
+            trailer = streamed_flags(&output);
+        }
+        
+        if (result == ZLITE_OK) {
+            dir_entry_init(&entry, record_pos, info->file_type, info->size, info->path, NULL);
+            entry.flags = coder | trailer;
+            entry.compressed_size = compressed_size;
+            entry.crc = crc;
+            entry.mtime = file_list.mtime[i];
+            entry.inode = file_list.inode[i];
+            result = zlite_dir_add(&dir, &entry);
+        }
+        
+        if (result == ZLITE_OK) {
+            records_written++;
+            printf("  %s (%llu -> %llu bytes, %.1f%%%s%s)\n", 
+                   info->path, 
+                   (unsigned long long)info->size,
+                   (unsigned long long)compressed_size,
+                   info->size > 0 ? (compressed_size * 100.0 / info->size) : 0.0,
+                   coder ? ", " : "", zlite_coder_name(coder));
+            
+            total_files++;
+            total_size += info->size;
+        } else if (result == ZLITE_ERROR_WRITE || result == ZLITE_ERROR_MEMORY) {
+            break;
+        } else {
+            fprintf(stderr, "Error compressing '%s'\n", info->path);
+            result = ZLITE_OK;
+        }
+    }
+    
+    pipeline_stop(&pipeline);
+    encoder_cache_free(&cache);
+    start_time = zlite_time_usec() - start_time;
+    start_cpu = zlite_cpu_usec() - start_cpu;
+    solid_plan_free(&plan);
+    
+    /* Append the central directory (or the 7z header); a failed entry may
+     * have left data past this point, so cut the file right after it. An
+     * append gets its records to the disk before the footer that points
+     * at them, and the footer before the record count. */
+    if (result == ZLITE_OK && base && base->append) {
+        result = zlite_output_sync(&output);
+    }
+    if (result == ZLITE_OK) {
+        result = is_7z ? zlite_7z_write(&seven_z, &output)
+                       : zlite_dir_write(&dir, &output);
+    }
+    if (result == ZLITE_OK) {
+        result = zlite_output_truncate(&output);
+    }
+    if (result == ZLITE_OK && base && base->append) {
+        result = zlite_output_sync(&output);
+    }
+    zlite_dir_free(&dir);
+    zlite_7z_free(&seven_z);
+    
+    /* Patch the record count in the header */
+    if (result == ZLITE_OK && !is_7z && !output.stream) {
+        if (zlite_output_seek(&output, ZLITE_ARCHIVE_MAGIC_SIZE) != 0 ||
+            zlite_output_write(&output, &records_written, sizeof(uint32_t)) != sizeof(uint32_t)) {
+            result = ZLITE_ERROR_WRITE;
+        }
+    }
+    
+    /* Remaining volumes go to the hook only when the archive is complete */
+    if (zlite_output_close(&output, result == ZLITE_OK) != ZLITE_OK && result == ZLITE_OK) {
+        result = ZLITE_ERROR_WRITE;
+    }
+    zlite_free_file_list(&file_list);
+    
+    /* Move an update into place */
+    if (base && base->append) {
+        /* Nothing to move */
+    } else if (base && result == ZLITE_OK) {
+        result = zlite_archive_replace(archive, base->tmp_path, base->volume_size,
+                                       options->volume_hook, options->volume_hook_arg);
+    } else if (base) {
+        zlite_archive_discard(base->tmp_path, base->volume_size);
+    }
+    
+    if (result != ZLITE_OK) {
+        fprintf(stderr, "Error: Cannot write archive\n");
+        return result;
+    }
+    
+    printf("\nCompressed %llu files (%llu bytes)\n", (unsigned long long)total_files, 
            (unsigned long long)total_size);
+    if (base && base->append) {
+        printf("Skipped %u files already in the archive\n", base->num_kept);
+    } else if (base) {
+        printf("Kept %u unchanged files, %llu bytes copied from the previous archive\n",
+               base->num_kept, (unsigned long long)base->copied);
+    }
+    
+    /* Process CPU time against the cores the threads could have kept
+     * busy, from the first job to the last. Only worth reporting when
+     * several threads compressed over a measurable time. */
+    if (num_threads > 1 && total_files > 0 && start_time >= 10000) {
+        int cores = zlite_get_cpu_count() < num_threads ? zlite_get_cpu_count() : num_threads;
+        double utilization = (double)start_cpu * 100.0 / ((double)start_time * cores);
+        
+        printf("Core utilization: %.0f%% of %d cores over %.2f s\n",
+               utilization < 100.0 ? utilization : 100.0, cores, start_time / 1e6);
+    }
+    
+    return ZLITE_OK;
+}
+
+int zlite_add_files(ZliteArchive *archive, char **files, int num_files,
+                    const ZliteCompressOptions *options) {
+    return add_files(archive, files, num_files, options, NULL);
+}
+
+int zlite_update_files(ZliteArchive *archive, char **files, int num_files,
+                       const ZliteCompressOptions *options) {
+    BaseArchive update;
+    int result;
+    
+    memset(&update, 0, sizeof(update));
+    CrcGenerateTable();
+    if (options->format == ZLITE_FORMAT_7Z || zlite_archive_is_7z(archive)) {
+        fprintf(stderr, "Error: Standard 7z archives cannot be updated\n");
+        return ZLITE_ERROR_UNSUPPORTED;
+    }
+    
+    result = zlite_index_load(archive, &update.index);
+    if (result != ZLITE_OK) {
+        fprintf(stderr, "Error: Cannot read the archive index\n");
+        return result;
+    }
+    
+    update.archive = archive;
+    update.volume_size = options->volume_size ? options->volume_size
+                                              : zlite_archive_volume_size(archive);
+    snprintf(update.tmp_path, sizeof(update.tmp_path), "%s.tmp",
+             zlite_archive_get_path(archive));
+    
+    result = add_files(archive, files, num_files, options, &update);
+    base_free(&update);
+    return result;
+}
+
+int zlite_append_files(ZliteArchive *archive, char **files, int num_files,
+                       const ZliteCompressOptions *options) {
+    BaseArchive append;
+    int result;
+    
+    memset(&append, 0, sizeof(append));
+    CrcGenerateTable();
+    if (options->format == ZLITE_FORMAT_7Z || zlite_archive_is_7z(archive)) {
+        fprintf(stderr, "Error: Standard 7z archives cannot be appended to\n");
+        return ZLITE_ERROR_UNSUPPORTED;
+    }
+    
+    result = zlite_index_load(archive, &append.index);
+    if (result != ZLITE_OK) {
+        fprintf(stderr, "Error: Cannot read the archive index\n");
+        return result;
+    }
+    
+    /* The volumes written so far keep their size */
+    append.archive = archive;
+    append.append = 1;
+    append.volume_size = zlite_archive_volume_size(archive);
+    if (options->volume_size && options->volume_size != append.volume_size) {
+        fprintf(stderr, "Warning: Appending keeps the volume size of the archive\n");
+    }
+    
+    result = add_files(archive, files, num_files, options, &append);
+    base_free(&append);
+    return result;
+}
+
+/* Reads a FILE, such as stdin, sequentially to its end */
+typedef struct {
+    ISeqInStream vt;
+    FILE *fp;
+    uint64_t processed;
+} StdioInStream;
+
+static SRes StdioInStream_Read(ISeqInStreamPtr pp, void *buf, size_t *size) {
+    StdioInStream *p = Z7_CONTAINER_FROM_VTBL(pp, StdioInStream, vt);
+    
+    *size = fread(buf, 1, *size, p->fp);
+    p->processed += *size;
+    return *size == 0 && ferror(p->fp) ? SZ_ERROR_READ : SZ_OK;
+}
+
+int zlite_add_stream(ZliteArchive *archive, const char *name, FILE *in,
+                     const ZliteCompressOptions *options) {
+    ZliteOutput output;
+    ZliteDirWriter dir;
+    ZliteIndexEntry entry;
+    EncoderCache cache = { NULL };
+    StdioInStream stream;
+    ArchiveOutStream out;
+    uint32_t coder;
+    uint32_t records = 1;
+    uint64_t size_pos;
+    uint64_t compressed_size = 0;
+    uint32_t crc = 0;
+    int num_threads;
+    int result;
+    
+    if (options->format == ZLITE_FORMAT_7Z) {
+        fprintf(stderr, "Error: Standard 7z archives cannot be written from a stream\n");
+        return ZLITE_ERROR_UNSUPPORTED;
+    }
+    if (options->stream_out && options->volume_size > 0) {
+        fprintf(stderr, "Error: Only new archives without volumes can be streamed\n");
+        return ZLITE_ERROR_UNSUPPORTED;
+    }
+    
+    CrcGenerateTable();
+    zlite_dir_init(&dir);
+    if (options->stream_out) {
+        result = zlite_output_open_stream(&output, options->stream_out);
+    } else {
+        result = zlite_output_open(&output, zlite_archive_get_path(archive),
+                                   options->volume_size, options->volume_hook,
+                                   options->volume_hook_arg);
+    }
+    if (result != ZLITE_OK) {
+        return result;
+    }
     
+    /* The input is not looked at first: no filters or PPMd for text, only
+     * the method asked for. The size is unknown until the input ends, so
+     * the encoder reads blocks of it like a file of unlimited size. */
+    coder = (uint32_t)(options->level == 0 ? ZLITE_METHOD_COPY : options->method)
+            << ZLITE_METHOD_SHIFT;
+    num_threads = options->num_threads > 0 ? options->num_threads : zlite_get_cpu_count();
+    
+    /* The one record is known up front, so the header needs no patching */
+    if (zlite_output_write(&output, ZLITE_ARCHIVE_MAGIC, ZLITE_ARCHIVE_MAGIC_SIZE) !=
+            ZLITE_ARCHIVE_MAGIC_SIZE ||
+        zlite_output_write(&output, &records, sizeof(uint32_t)) != sizeof(uint32_t)) {
+        result = ZLITE_ERROR_WRITE;
+    }
+    if (result == ZLITE_OK) {
+        result = zlite_write_entry_header(&output, name, ZLITE_FILETYPE_REGULAR | coder |
+                                          streamed_flags(&output), 0, 0, 0, &size_pos);
+    }
+    if (result == ZLITE_OK) {
+        stream.vt.Read = StdioInStream_Read;
+        stream.fp = in;
+        stream.processed = 0;
+        ArchiveOutStream_Init(&out, &output);
+        result = compress_stream(&cache, &stream.vt, (uint64_t)-1, coder, &out.vt, options,
+                                 num_threads, options->block_size > 0 ? options->block_size
+                                              : stream_block_size(options->level), NULL);
+        if (result == ZLITE_OK && ferror(in)) {
+            result = ZLITE_ERROR_READ;
+        }
+    }
+    if (result == ZLITE_OK) {
+        compressed_size = out.processed;
+        crc = CRC_GET_DIGEST(out.crc);
+        result = finish_streamed_entry(&output, size_pos, stream.processed, compressed_size, crc);
+    }
+    if (result == ZLITE_OK) {
+        dir_entry_init(&entry, ZLITE_ARCHIVE_HEADER_SIZE, ZLITE_FILETYPE_REGULAR,
+                       stream.processed, name, NULL);
+        entry.flags = coder | streamed_flags(&output);
+        entry.compressed_size = compressed_size;
+        entry.crc = crc;
+        result = zlite_dir_add(&dir, &entry);
+    }
+    if (result == ZLITE_OK) {
+        result = zlite_dir_write(&dir, &output);
+    }
+    if (result == ZLITE_OK) {
+        result = zlite_output_truncate(&output);
+    }
+    zlite_dir_free(&dir);
+    encoder_cache_free(&cache);
+    
+    if (zlite_output_close(&output, result == ZLITE_OK) != ZLITE_OK && result == ZLITE_OK) {
+        result = ZLITE_ERROR_WRITE;
+    }
+    if (result != ZLITE_OK) {
+        fprintf(stderr, "Error: Cannot write archive\n");
+        return result;
+    }
+    
+    printf("  %s (%llu -> %llu bytes, %.1f%%%s%s)\n", name,
+           (unsigned long long)stream.processed, (unsigned long long)compressed_size,
+           stream.processed > 0 ? (compressed_size * 100.0 / stream.processed) : 0.0,
+           coder ? ", " : "", zlite_coder_name(coder));
+    printf("\nCompressed 1 files (%llu bytes)\n", (unsigned long long)stream.processed);
     return ZLITE_OK;
-}
\ No newline at end of file
+}
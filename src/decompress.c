@@ -1,4 +1,5 @@
 #include "../include/7zlite.h"
+#include "../include/compat.h"
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
@@ -22,16 +23,15 @@
 #include "7zFile.h"
 #include "7zCrc.h"
 #include "7zBuf.h"
-#include "Lzma2Dec.h"
+#include "Lzma2DecMt.h"
+#include "LzmaDec.h"
+#include "Ppmd7.h"
 
 /* Use LZMA SDK's LZMA_PROPS_SIZE definition if available */
 #ifndef LZMA_PROPS_SIZE
 #define LZMA_PROPS_SIZE 1
 #endif
 
-/* Archive magic - same as standard 7z */
-#define ARCHIVE_MAGIC "7z\xBC\xAF\x27\x1C"
-
 static ISzAlloc g_Alloc = { SzAlloc, SzFree };
 static ISzAlloc g_AllocTemp = { SzAlloc, SzFree };
 
@@ -39,145 +39,900 @@ static ISzAlloc g_AllocTemp = { SzAlloc, SzFree };
  * Custom format decompression (legacy format for hard link optimization)
  * ======================================================================== */
 
-static int decompress_file_lzma2(const char *input_path, const char *output_path,
-                                  uint64_t input_size, uint64_t output_size) {
-    CFileSeqInStream inStream;
-    CFileOutStream outStream;
-    CLzma2Dec dec;
-    Byte prop;
+#define ZLITE_DECODE_BUF_SIZE ((size_t)1 << 16)
+
+/* State shared by all entries of one extract/test run */
+typedef struct {
+    const char *output_dir;
+    int num_threads;
+    char **patterns;         /* entries to process, NULL = all */
+    int num_patterns;
+    FILE *stream_out;        /* file data goes here instead of to output_dir */
+    CLzma2DecMtHandle dec;   /* reused for every LZMA2 payload */
+} ExtractContext;
+
+static int extract_context_init(ExtractContext *ctx, const char *output_dir,
+                                const ZliteExtractOptions *options) {
+    ctx->output_dir = output_dir;
+    ctx->patterns = options ? options->patterns : NULL;
+    ctx->num_patterns = options ? options->num_patterns : 0;
+    ctx->stream_out = options ? options->stream_out : NULL;
+    ctx->num_threads = (options && options->num_threads > 0) ? options->num_threads
+                                                             : zlite_get_cpu_count();
+    ctx->dec = Lzma2DecMt_Create(&g_Alloc, &g_Alloc);
+    return ctx->dec ? ZLITE_OK : ZLITE_ERROR_MEMORY;
+}
+
+static void extract_context_free(ExtractContext *ctx) {
+    if (ctx->dec) {
+        Lzma2DecMt_Destroy(ctx->dec);
+        ctx->dec = NULL;
+    }
+}
+
+/* Entries picked by the path arguments. The caller fills names/is_dir
+ * for every entry, then selection_resolve() marks the wanted ones;
+ * without patterns nothing is allocated and every entry is selected. */
+typedef struct {
+    char **names;
+    uint8_t *is_dir;
+    uint8_t *selected;
+    int owns_names;          /* names were allocated for the selection */
+    uint32_t count;
+    uint32_t total;          /* entries selected */
+    int unmatched;           /* patterns that matched no entry */
+    ZliteNameIndex index;
+} Selection;
+
+#define IS_SELECTED(sel, i) (!(sel)->selected || (sel)->selected[i])
+
+static int selection_alloc(Selection *sel, const ExtractContext *ctx, uint32_t count,
+                           int owns_names) {
+    memset(sel, 0, sizeof(*sel));
+    if (!ctx || ctx->num_patterns == 0) {
+        return ZLITE_OK;
+    }
+    
+    sel->count = count;
+    sel->owns_names = owns_names;
+    sel->names = (char **)calloc(count ? count : 1, sizeof(char *));
+    sel->is_dir = (uint8_t *)calloc(count ? count : 1, 1);
+    sel->selected = (uint8_t *)calloc(count ? count : 1, 1);
+    if (!sel->names || !sel->is_dir || !sel->selected) {
+        return ZLITE_ERROR_MEMORY;
+    }
+    return ZLITE_OK;
+}
+
+static int selection_resolve(Selection *sel, const ExtractContext *ctx) {
+    if (!sel->selected) {
+        return ZLITE_OK;
+    }
+    
+    if (zlite_name_index_init(&sel->index, (const char *const *)sel->names,
+                              sel->is_dir, sel->count) != ZLITE_OK) {
+        return ZLITE_ERROR_MEMORY;
+    }
+    
+    sel->total = zlite_name_index_select(&sel->index, ctx->patterns, ctx->num_patterns,
+                                         sel->selected, &sel->unmatched);
+    if (sel->total == 0) {
+        fprintf(stderr, "Error: No files to process\n");
+        return ZLITE_ERROR_PARAM;
+    }
+    return ZLITE_OK;
+}
+
+static void selection_free(Selection *sel) {
+    uint32_t i;
+    
+    if (sel->owns_names && sel->names) {
+        for (i = 0; i < sel->count; i++) {
+            free(sel->names[i]);
+        }
+    }
+    free(sel->names);
+    free(sel->is_dir);
+    free(sel->selected);
+    zlite_name_index_free(&sel->index);
+}
+
+/* Sequential reader over the archive, positioned at a payload so it can
+ * be decoded straight from the mapped archive */
+typedef struct {
+    ISeqInStream vt;
+    ZliteArchive *archive;
+    uint64_t pos;
+    uint64_t size;
+} ArchiveCursor;
+
+static SRes ArchiveCursor_Read(ISeqInStreamPtr pp, void *buf, size_t *size) {
+    ArchiveCursor *p = Z7_CONTAINER_FROM_VTBL(pp, ArchiveCursor, vt);
+    
+    if (*size > p->size - p->pos) {
+        *size = (size_t)(p->size - p->pos);
+    }
+    if (*size == 0) {
+        return SZ_OK;
+    }
+    if (zlite_archive_read(p->archive, p->pos, buf, *size) != ZLITE_OK) {
+        *size = 0;
+        return SZ_ERROR_READ;
+    }
+    p->pos += *size;
+    return SZ_OK;
+}
+
+static void ArchiveCursor_Init(ArchiveCursor *p, ZliteArchive *archive) {
+    p->vt.Read = ArchiveCursor_Read;
+    p->archive = archive;
+    p->pos = 0;
+    p->size = zlite_archive_size(archive);
+}
+
+/* Seekable stream over the archive for the 7z reader, so a split archive
+ * opens like a single file */
+typedef struct {
+    ISeekInStream vt;
+    ZliteArchive *archive;
+    uint64_t pos;
+    uint64_t size;
+} ArchiveSeekStream;
+
+static SRes ArchiveSeekStream_Read(ISeekInStreamPtr pp, void *buf, size_t *size) {
+    ArchiveSeekStream *p = Z7_CONTAINER_FROM_VTBL(pp, ArchiveSeekStream, vt);
+    
+    if (p->pos >= p->size) {
+        *size = 0;
+        return SZ_OK;
+    }
+    if (*size > p->size - p->pos) {
+        *size = (size_t)(p->size - p->pos);
+    }
+    if (zlite_archive_read(p->archive, p->pos, buf, *size) != ZLITE_OK) {
+        *size = 0;
+        return SZ_ERROR_READ;
+    }
+    p->pos += *size;
+    return SZ_OK;
+}
+
+static SRes ArchiveSeekStream_Seek(ISeekInStreamPtr pp, Int64 *pos, ESzSeek origin) {
+    ArchiveSeekStream *p = Z7_CONTAINER_FROM_VTBL(pp, ArchiveSeekStream, vt);
+    Int64 base = 0;
+    
+    if (origin == SZ_SEEK_CUR) {
+        base = (Int64)p->pos;
+    } else if (origin == SZ_SEEK_END) {
+        base = (Int64)p->size;
+    }
+    if (base + *pos < 0) {
+        return SZ_ERROR_PARAM;
+    }
+    p->pos = (uint64_t)(base + *pos);
+    *pos = (Int64)p->pos;
+    return SZ_OK;
+}
+
+static void ArchiveSeekStream_Init(ArchiveSeekStream *p, ZliteArchive *archive) {
+    p->vt.Read = ArchiveSeekStream_Read;
+    p->vt.Seek = ArchiveSeekStream_Seek;
+    p->archive = archive;
+    p->pos = 0;
+    p->size = zlite_archive_size(archive);
+}
+
+/* Limits an underlying stream to one payload and accumulates its CRC, so
+ * the decoder can never read into the next record */
+typedef struct {
+    ISeqInStream vt;
+    ISeqInStreamPtr real;
+    uint64_t remaining;
+    uint32_t crc;
+} PayloadInStream;
+
+static SRes PayloadInStream_Read(ISeqInStreamPtr pp, void *buf, size_t *size) {
+    PayloadInStream *p = Z7_CONTAINER_FROM_VTBL(pp, PayloadInStream, vt);
     SRes res;
-    WRes wres;
-    Byte *inBuf;
-    Byte *outBuf;
-    size_t inLen, outSize;
-    ELzmaStatus status;
-    size_t total_read;
-
-    /* Open input file */
-    wres = InFile_Open(&inStream.file, input_path);
-    if (wres != 0) {
-        return ZLITE_ERROR_FILE;
+    
+    if (*size > p->remaining) {
+        *size = (size_t)p->remaining;
+    }
+    if (*size == 0) {
+        return SZ_OK;
     }
+    res = ISeqInStream_Read(p->real, buf, size);
+    p->crc = CrcUpdate(p->crc, buf, *size);
+    p->remaining -= *size;
+    return res;
+}
 
-    /* Open output file */
-    wres = OutFile_Open(&outStream.file, output_path);
-    if (wres != 0) {
-        File_Close(&inStream.file);
-        return ZLITE_ERROR_FILE;
+static void PayloadInStream_Init(PayloadInStream *p, ISeqInStreamPtr real, uint64_t size) {
+    p->vt.Read = PayloadInStream_Read;
+    p->real = real;
+    p->remaining = size;
+    p->crc = CRC_INIT_VAL;
+}
+
+/* Consume the rest of a payload so its CRC covers every byte */
+static SRes PayloadInStream_Drain(PayloadInStream *p) {
+    Byte buf[4096];
+    
+    while (p->remaining > 0) {
+        size_t size = sizeof(buf);
+        RINOK(PayloadInStream_Read(&p->vt, buf, &size))
+        if (size == 0) {
+            return SZ_ERROR_INPUT_EOF;
+        }
     }
+    return SZ_OK;
+}
+
+/* Decoded-data sink: counts bytes and writes them to a file or a stream,
+ * if any (test mode decodes without either) */
+typedef struct {
+    ISeqOutStream vt;
+    CSzFile *file;
+    FILE *stream;
+    uint64_t processed;
+} EntryOutStream;
+
+static size_t EntryOutStream_Write(ISeqOutStreamPtr pp, const void *data, size_t size) {
+    EntryOutStream *p = Z7_CONTAINER_FROM_VTBL(pp, EntryOutStream, vt);
     
-    /* Setup stream vtables */
-    FileSeqInStream_CreateVTable(&inStream);
-    FileOutStream_CreateVTable(&outStream);
+    if (p->file) {
+        size_t written = size;
+        if (File_Write(p->file, data, &written) != 0) {
+            return 0;
+        }
+        size = written;
+    } else if (p->stream) {
+        size = fwrite(data, 1, size, p->stream);
+    }
+    p->processed += size;
+    return size;
+}
+
+static void EntryOutStream_Init(EntryOutStream *p, CSzFile *file, FILE *stream) {
+    p->vt.Write = EntryOutStream_Write;
+    p->file = file;
+    p->stream = stream;
+    p->processed = 0;
+}
+
+/* Writes decoded data into a preallocated buffer */
+typedef struct {
+    ISeqOutStream vt;
+    Byte *data;
+    size_t size;
+    size_t pos;
+} BufOutStream;
+
+static size_t BufOutStream_Write(ISeqOutStreamPtr pp, const void *data, size_t size) {
+    BufOutStream *p = Z7_CONTAINER_FROM_VTBL(pp, BufOutStream, vt);
     
-    /* Read properties */
-    {
-        size_t read_size = 1;
-        wres = File_Read(&inStream.file, &prop, &read_size);
-        if (wres != 0 || read_size != 1) {
-            File_Close(&inStream.file);
-            File_Close(&outStream.file);
-            return ZLITE_ERROR_CORRUPT;
+    if (size > p->size - p->pos) {
+        size = p->size - p->pos;
+    }
+    memcpy(p->data + p->pos, data, size);
+    p->pos += size;
+    return size;
+}
+
+/* Undoes a filter (ZLITE_FILTER_* bits) on the data written to `real`.
+ * The last bytes are held back until FilterOutStream_Flush(). */
+#define FILTER_BUF_SIZE ((size_t)1 << 16)
+
+typedef struct {
+    ISeqOutStream vt;
+    ISeqOutStreamPtr real;
+    ZliteFilter filter;
+    size_t len;
+    Byte buf[FILTER_BUF_SIZE];
+} FilterOutStream;
+
+static int FilterOutStream_Pass(FilterOutStream *p, int last) {
+    size_t done = zlite_filter_decode(&p->filter, p->buf, p->len, last);
+    
+    if (done > 0 && ISeqOutStream_Write(p->real, p->buf, done) != done) {
+        return 0;
+    }
+    memmove(p->buf, p->buf + done, p->len - done);
+    p->len -= done;
+    return 1;
+}
+
+static size_t FilterOutStream_Write(ISeqOutStreamPtr pp, const void *data, size_t size) {
+    FilterOutStream *p = Z7_CONTAINER_FROM_VTBL(pp, FilterOutStream, vt);
+    size_t pos = 0;
+    
+    while (pos < size) {
+        size_t n = FILTER_BUF_SIZE - p->len;
+        if (n > size - pos) {
+            n = size - pos;
+        }
+        memcpy(p->buf + p->len, (const Byte *)data + pos, n);
+        p->len += n;
+        pos += n;
+        if (!FilterOutStream_Pass(p, 0)) {
+            return 0;
         }
-        DEBUG_PRINT("DEBUG: Read property byte: 0x%02X\n", prop);
     }
+    return size;
+}
+
+static int FilterOutStream_Flush(FilterOutStream *p) {
+    return FilterOutStream_Pass(p, 1);
+}
 
-    /* Initialize decoder */
-    Lzma2Dec_Construct(&dec);
-    res = Lzma2Dec_Allocate(&dec, prop, &g_Alloc);
+/* Decode one LZMA2 payload (property byte + stream) from in to out with
+ * Lzma2DecMt. Streams written with several LZMA2 blocks are decoded in
+ * parallel when ctx->num_threads > 1. */
+static int decode_payload_lzma2(const ExtractContext *ctx, PayloadInStream *in,
+                                ISeqOutStreamPtr out, uint64_t output_size) {
+    CLzma2DecMtProps props;
+    Byte prop;
+    UInt64 in_processed = 0;
+    int is_mt = 0;
+    SRes res;
+    
+    res = SeqInStream_ReadByte(&in->vt, &prop);
     if (res != SZ_OK) {
-        Lzma2Dec_Free(&dec, &g_Alloc);
-        File_Close(&inStream.file);
-        File_Close(&outStream.file);
         return ZLITE_ERROR_CORRUPT;
     }
-
-    Lzma2Dec_Init(&dec);
+    DEBUG_PRINT("DEBUG: Read property byte: 0x%02X\n", prop);
+    
+    Lzma2DecMtProps_Init(&props);
+    props.inBufSize_ST = ZLITE_DECODE_BUF_SIZE;
+    props.outStep_ST = ZLITE_DECODE_BUF_SIZE;
+    props.numThreads = (unsigned)ctx->num_threads;
+    
+    /* Partial finish is allowed: archives written by older versions drop the
+     * final LZMA2 end byte, so we rely on output_size instead */
+    res = Lzma2DecMt_Decode(ctx->dec, prop, &props, out, &output_size, 0,
+                            &in->vt, &in_processed, &is_mt, NULL);
+    DEBUG_PRINT("DEBUG: Decode result: %d (mt=%d)\n", res, is_mt);
     
-    /* Allocate buffers */
-    inBuf = (Byte *)malloc(65536);
-    outBuf = (Byte *)malloc(65536);
-    if (!inBuf || !outBuf) {
-        if (inBuf) free(inBuf);
-        if (outBuf) free(outBuf);
-        Lzma2Dec_Free(&dec, &g_Alloc);
-        File_Close(&inStream.file);
-        File_Close(&outStream.file);
+    if (res == SZ_OK) {
+        res = PayloadInStream_Drain(in);
+    }
+    
+    if (res == SZ_ERROR_WRITE) {
+        return ZLITE_ERROR_WRITE;
+    }
+    if (res == SZ_ERROR_MEM) {
         return ZLITE_ERROR_MEMORY;
     }
+    return (res == SZ_OK) ? ZLITE_OK : ZLITE_ERROR_CORRUPT;
+}
+
+/* Decode the first output_size bytes of an LZMA payload (5 property bytes
+ * + stream) from in to out */
+static int decode_payload_lzma(PayloadInStream *in, ISeqOutStreamPtr out,
+                               uint64_t output_size) {
+    CLzmaDec dec;
+    Byte props[LZMA_PROPS_SIZE];
+    Byte *in_buf;
+    Byte *out_buf;
+    size_t in_pos = 0;
+    size_t in_len = 0;
+    uint64_t done = 0;
+    size_t n = sizeof(props);
+    int result = ZLITE_OK;
+    SRes res;
     
-    /* Decode loop - using DecodeToDic with default dictionary */
-    total_read = 0;
-    size_t total_written = 0;
-    bool finished = false;
+    if (SeqInStream_ReadMax(&in->vt, props, &n) != SZ_OK || n != sizeof(props)) {
+        return ZLITE_ERROR_CORRUPT;
+    }
     
-    while (!finished) {
-        /* Read input data */
-        size_t srcLen = 65536;
-        if (total_read + srcLen > input_size) {
-            srcLen = input_size - total_read;
-        }
+    LzmaDec_Construct(&dec);
+    res = LzmaDec_Allocate(&dec, props, LZMA_PROPS_SIZE, &g_Alloc);
+    if (res != SZ_OK) {
+        return res == SZ_ERROR_MEM ? ZLITE_ERROR_MEMORY : ZLITE_ERROR_CORRUPT;
+    }
+    in_buf = (Byte *)malloc(ZLITE_DECODE_BUF_SIZE);
+    out_buf = (Byte *)malloc(ZLITE_DECODE_BUF_SIZE);
+    if (!in_buf || !out_buf) {
+        free(in_buf);
+        free(out_buf);
+        LzmaDec_Free(&dec, &g_Alloc);
+        return ZLITE_ERROR_MEMORY;
+    }
+    LzmaDec_Init(&dec);
+    
+    while (result == ZLITE_OK && done < output_size) {
+        SizeT in_size;
+        SizeT out_size = ZLITE_DECODE_BUF_SIZE;
+        ELzmaStatus status;
         
-        if (srcLen > 0) {
-            wres = File_Read(&inStream.file, inBuf, &srcLen);
-            if (wres != 0) {
+        if (in_pos == in_len) {
+            in_len = ZLITE_DECODE_BUF_SIZE;
+            in_pos = 0;
+            if (ISeqInStream_Read(&in->vt, in_buf, &in_len) != SZ_OK) {
+                result = ZLITE_ERROR_CORRUPT;
                 break;
             }
-            total_read += srcLen;
         }
-        
-        /* Decode to dictionary with limit */
-        size_t inProcessed = srcLen;
-        size_t dicPosBefore = dec.decoder.dicPos;
-        
-        res = Lzma2Dec_DecodeToDic(&dec, output_size, inBuf, &inProcessed, LZMA_FINISH_END, &status);
-        
-        /* Write only newly decoded data */
-        if (dec.decoder.dicPos > dicPosBefore) {
-            size_t newly_decoded = dec.decoder.dicPos - dicPosBefore;
-            wres = File_Write(&outStream.file, dec.decoder.dic + dicPosBefore, &newly_decoded);
-            if (wres != 0 || newly_decoded != (dec.decoder.dicPos - dicPosBefore)) {
-                free(inBuf);
-                free(outBuf);
-                Lzma2Dec_Free(&dec, &g_Alloc);
-                File_Close(&inStream.file);
-                File_Close(&outStream.file);
-                return ZLITE_ERROR_WRITE;
-            }
-            total_written += newly_decoded;
+        if (out_size > output_size - done) {
+            out_size = (SizeT)(output_size - done);
         }
+        in_size = in_len - in_pos;
         
-        /* Check for completion */
-        if (status == LZMA_STATUS_FINISHED_WITH_MARK) {
-            finished = true;
+        res = LzmaDec_DecodeToBuf(&dec, out_buf, &out_size, in_buf + in_pos, &in_size,
+                                  LZMA_FINISH_ANY, &status);
+        in_pos += in_size;
+        if (res != SZ_OK || (out_size == 0 && in_size == 0)) {
+            /* Bad data, or the stream ended before output_size */
+            result = ZLITE_ERROR_CORRUPT;
+        } else if (out_size > 0 && ISeqOutStream_Write(out, out_buf, out_size) != out_size) {
+            result = ZLITE_ERROR_WRITE;
+        }
+        done += out_size;
+    }
+    
+    free(in_buf);
+    free(out_buf);
+    LzmaDec_Free(&dec, &g_Alloc);
+    
+    if (result == ZLITE_OK && PayloadInStream_Drain(in) != SZ_OK) {
+        result = ZLITE_ERROR_CORRUPT;
+    }
+    return result;
+}
+
+/* Copy the first output_size bytes of a stored payload from in to out */
+static int decode_payload_copy(PayloadInStream *in, ISeqOutStreamPtr out,
+                               uint64_t output_size) {
+    Byte *buf = (Byte *)malloc(ZLITE_DECODE_BUF_SIZE);
+    uint64_t done = 0;
+    int result = ZLITE_OK;
+    
+    if (!buf) {
+        return ZLITE_ERROR_MEMORY;
+    }
+    
+    while (done < output_size) {
+        size_t n = ZLITE_DECODE_BUF_SIZE;
+        if (n > output_size - done) {
+            n = (size_t)(output_size - done);
+        }
+        if (ISeqInStream_Read(&in->vt, buf, &n) != SZ_OK || n == 0) {
+            result = ZLITE_ERROR_CORRUPT;
             break;
         }
-        
-        /* Check if all input consumed */
-        if (total_read >= input_size) {
+        if (ISeqOutStream_Write(out, buf, n) != n) {
+            result = ZLITE_ERROR_WRITE;
             break;
         }
+        done += n;
+    }
+    free(buf);
+    
+    if (result == ZLITE_OK && PayloadInStream_Drain(in) != SZ_OK) {
+        result = ZLITE_ERROR_CORRUPT;
+    }
+    return result;
+}
+
+/* Byte reader for the PPMd range decoder. Reading past the payload sets
+ * `error` and returns zeros. */
+#define PPMD_BUF_SIZE ((size_t)1 << 16)
+
+typedef struct {
+    IByteIn vt;
+    ISeqInStreamPtr real;
+    size_t pos;
+    size_t len;
+    int error;
+    Byte buf[PPMD_BUF_SIZE];
+} PpmdInBuf;
+
+static Byte PpmdInBuf_Read(IByteInPtr pp) {
+    PpmdInBuf *p = Z7_CONTAINER_FROM_VTBL(pp, PpmdInBuf, vt);
+    
+    if (p->pos == p->len) {
+        size_t n = PPMD_BUF_SIZE;
+        p->pos = 0;
+        p->len = 0;
+        if (p->error || ISeqInStream_Read(p->real, p->buf, &n) != SZ_OK || n == 0) {
+            p->error = 1;
+            return 0;
+        }
+        p->len = n;
+    }
+    return p->buf[p->pos++];
+}
+
+/* Decode the first output_size bytes of a PPMd payload (order byte, 32-bit
+ * model size, range coded data) from in to out */
+static int decode_payload_ppmd(PayloadInStream *in, ISeqOutStreamPtr out,
+                               uint64_t output_size) {
+    CPpmd7 ppmd;
+    PpmdInBuf *ib;
+    Byte *buf;
+    Byte props[5];
+    unsigned order;
+    uint32_t mem_size;
+    uint64_t done = 0;
+    size_t n = sizeof(props);
+    int result = ZLITE_OK;
+    
+    if (SeqInStream_ReadMax(&in->vt, props, &n) != SZ_OK || n != sizeof(props)) {
+        return ZLITE_ERROR_CORRUPT;
+    }
+    order = props[0];
+    mem_size = GetUi32(props + 1);
+    if (order < PPMD7_MIN_ORDER || order > PPMD7_MAX_ORDER ||
+        mem_size < PPMD7_MIN_MEM_SIZE || mem_size > PPMD7_MAX_MEM_SIZE) {
+        return ZLITE_ERROR_CORRUPT;
+    }
+    
+    ib = (PpmdInBuf *)malloc(sizeof(PpmdInBuf));
+    buf = (Byte *)malloc(PPMD_BUF_SIZE);
+    Ppmd7_Construct(&ppmd);
+    if (!ib || !buf || !Ppmd7_Alloc(&ppmd, mem_size, &g_Alloc)) {
+        free(ib);
+        free(buf);
+        return ZLITE_ERROR_MEMORY;
+    }
+    
+    ib->vt.Read = PpmdInBuf_Read;
+    ib->real = &in->vt;
+    ib->pos = ib->len = 0;
+    ib->error = 0;
+    ppmd.rc.dec.Stream = &ib->vt;
+    
+    if (!Ppmd7z_RangeDec_Init(&ppmd.rc.dec)) {
+        result = ZLITE_ERROR_CORRUPT;
+    } else {
+        Ppmd7_Init(&ppmd, order);
+    }
+    
+    while (result == ZLITE_OK && done < output_size) {
+        size_t size = PPMD_BUF_SIZE;
+        size_t i;
         
-        if (res != SZ_OK) {
-            break;
+        if (size > output_size - done) {
+            size = (size_t)(output_size - done);
+        }
+        for (i = 0; i < size; i++) {
+            int sym = Ppmd7z_DecodeSymbol(&ppmd);
+            if (sym < 0 || ib->error) {
+                break;
+            }
+            buf[i] = (Byte)sym;
+        }
+        if (i < size) {
+            result = ZLITE_ERROR_CORRUPT;
+        } else if (ISeqOutStream_Write(out, buf, size) != size) {
+            result = ZLITE_ERROR_WRITE;
         }
+        done += size;
     }
+    
+    Ppmd7_Free(&ppmd, &g_Alloc);
+    free(ib);
+    free(buf);
+    
+    if (result == ZLITE_OK && PayloadInStream_Drain(in) != SZ_OK) {
+        result = ZLITE_ERROR_CORRUPT;
+    }
+    return result;
+}
 
-    free(inBuf);
-    free(outBuf);
-    Lzma2Dec_Free(&dec, &g_Alloc);
-    File_Close(&inStream.file);
-    File_Close(&outStream.file);
+/* Decode a payload with the method given by the type word bits in `flags` */
+static int decode_payload(const ExtractContext *ctx, PayloadInStream *in,
+                          ISeqOutStreamPtr out, uint64_t output_size, uint32_t flags) {
+    switch ((flags & ZLITE_METHOD_MASK) >> ZLITE_METHOD_SHIFT) {
+        case ZLITE_METHOD_LZMA2:
+            return decode_payload_lzma2(ctx, in, out, output_size);
+        case ZLITE_METHOD_LZMA:
+            return decode_payload_lzma(in, out, output_size);
+        case ZLITE_METHOD_PPMD:
+            return decode_payload_ppmd(in, out, output_size);
+        case ZLITE_METHOD_COPY:
+            return decode_payload_copy(in, out, output_size);
+        default:
+            return ZLITE_ERROR_UNSUPPORTED;
+    }
+}
 
-    return (res == SZ_OK || finished) ? ZLITE_OK : ZLITE_ERROR_CORRUPT;
+/* Decode a custom-format entry whose payload starts at the current position
+ * of `in` with the method in `flags`, undoing its filter. Decoded data goes to output_path,
+ * or ctx->stream_out when set, or is only verified when output_path is
+ * NULL. The payload is always consumed completely. */
+static int decompress_entry(const ExtractContext *ctx, ISeqInStreamPtr in,
+                            uint64_t input_size, uint32_t expected_crc, uint32_t flags,
+                            const char *output_path, uint64_t output_size) {
+    PayloadInStream payload;
+    EntryOutStream out;
+    FilterOutStream *filtered = NULL;
+    CSzFile outFile;
+    int result;
+    
+    PayloadInStream_Init(&payload, in, input_size);
+    if (output_path && ctx->stream_out) {
+        EntryOutStream_Init(&out, NULL, ctx->stream_out);
+        output_path = NULL;
+    } else {
+        EntryOutStream_Init(&out, NULL, NULL);
+    }
+    
+    if (flags & ZLITE_FILTER_MASK) {
+        if (!zlite_filter_supported(flags)) {
+            PayloadInStream_Drain(&payload);
+            return ZLITE_ERROR_UNSUPPORTED;
+        }
+        filtered = (FilterOutStream *)malloc(sizeof(FilterOutStream));
+        if (!filtered) {
+            PayloadInStream_Drain(&payload);
+            return ZLITE_ERROR_MEMORY;
+        }
+    }
+    
+    if (output_path) {
+        if (OutFile_Open(&outFile, output_path) != 0) {
+            PayloadInStream_Drain(&payload);
+            free(filtered);
+            return ZLITE_ERROR_FILE;
+        }
+        EntryOutStream_Init(&out, &outFile, NULL);
+    }
+    
+    if (filtered) {
+        filtered->vt.Write = FilterOutStream_Write;
+        filtered->real = &out.vt;
+        filtered->len = 0;
+        zlite_filter_init(&filtered->filter, flags);
+        result = decode_payload(ctx, &payload, &filtered->vt, output_size, flags);
+        if (result == ZLITE_OK && !FilterOutStream_Flush(filtered)) {
+            result = ZLITE_ERROR_WRITE;
+        }
+        free(filtered);
+    } else {
+        result = decode_payload(ctx, &payload, &out.vt, output_size, flags);
+    }
+    if (result != ZLITE_OK) {
+        PayloadInStream_Drain(&payload);
+    }
+    
+    if (output_path && File_Close(&outFile) != 0 && result == ZLITE_OK) {
+        result = ZLITE_ERROR_WRITE;
+    }
+    
+    if (result == ZLITE_OK) {
+        if (CRC_GET_DIGEST(payload.crc) != expected_crc) {
+            result = ZLITE_ERROR_CORRUPT;
+        } else if (out.processed != output_size) {
+            result = ZLITE_ERROR_CORRUPT;
+        }
+    }
+    
+    if (result != ZLITE_OK && output_path) {
+        remove(output_path);
+    }
+    
+    return result;
 }
 
-static int extract_custom_format(const char *archive_path, const char *output_dir, int list_only, int test_only) {
-    FILE *fp;
-    char magic[6];
-    uint32_t file_count;
-    int i;
-    CrcGenerateTable();
+/* dir/name into out; fails rather than truncate a long path */
+static int join_output_path(char out[PATH_MAX], const char *dir, const char *name) {
+    int len = snprintf(out, PATH_MAX, "%s/%s", dir, name);
+    
+    return len >= 0 && len < PATH_MAX ? ZLITE_OK : ZLITE_ERROR_FILE;
+}
+
+static void create_parent_dir(const char *path) {
+    char dir_copy[PATH_MAX];
+    char *slash;
+    
+    snprintf(dir_copy, sizeof(dir_copy), "%s", path);
+    slash = strrchr(dir_copy, '/');
+    if (slash) {
+        *slash = '\0';
+        zlite_mkdir_recursive(dir_copy);
+    }
+}
+
+/* Decoded solid block, kept while its members are extracted */
+typedef struct {
+    uint32_t block;          /* ZLITE_NO_BLOCK when empty */
+    Byte *data;
+    uint64_t size;           /* bytes decoded, may be a prefix of the block */
+} SolidCache;
+
+/* Make at least the first `need` bytes of solid block `block` available */
+static int load_solid_block(const ExtractContext *ctx, ZliteArchive *archive,
+                            const ZliteIndex *index, uint32_t block, uint64_t need,
+                            SolidCache *cache) {
+    const ZliteIndexEntry *b = &index->blocks[block];
+    ArchiveCursor cur;
+    PayloadInStream payload;
+    BufOutStream out;
+    int result;
+    
+    if (cache->block == block && cache->size >= need) {
+        return ZLITE_OK;
+    }
+    
+    /* The filter is undone in one pass over the whole block */
+    if (b->flags & ZLITE_FILTER_MASK) {
+        if (!zlite_filter_supported(b->flags)) {
+            return ZLITE_ERROR_UNSUPPORTED;
+        }
+        need = b->size;
+    }
+    
+    free(cache->data);
+    cache->data = NULL;
+    cache->block = ZLITE_NO_BLOCK;
+    cache->size = 0;
+    
+    if ((size_t)need != need) {
+        return ZLITE_ERROR_MEMORY;
+    }
+    cache->data = (Byte *)malloc(need ? (size_t)need : 1);
+    if (!cache->data) {
+        return ZLITE_ERROR_MEMORY;
+    }
+    
+    ArchiveCursor_Init(&cur, archive);
+    cur.pos = b->data_offset;
+    PayloadInStream_Init(&payload, &cur.vt, b->compressed_size);
+    out.vt.Write = BufOutStream_Write;
+    out.data = cache->data;
+    out.size = (size_t)need;
+    out.pos = 0;
+    
+    /* Members past `need` are not wanted: decoding stops early, but the
+     * whole payload is still read so its CRC can be checked */
+    zlite_archive_prefetch(archive, b->data_offset, b->compressed_size);
+    result = decode_payload(ctx, &payload, &out.vt, need, b->flags);
+    if (result == ZLITE_OK &&
+        (CRC_GET_DIGEST(payload.crc) != b->crc || out.pos != need)) {
+        result = ZLITE_ERROR_CORRUPT;
+    }
+    if (result == ZLITE_OK && (b->flags & ZLITE_FILTER_MASK)) {
+        ZliteFilter filter;
+        zlite_filter_init(&filter, b->flags);
+        zlite_filter_decode(&filter, cache->data, (size_t)need, 1);
+    }
+    
+    if (result == ZLITE_OK) {
+        cache->block = block;
+        cache->size = need;
+    }
+    return result;
+}
+
+/* Decode the data of a regular entry to output_path (ctx->stream_out when
+ * set), or only verify it when output_path is NULL. block_need gives how
+ * much of each solid block the run needs, NULL for whole blocks. */
+static int extract_entry_data(const ExtractContext *ctx, ZliteArchive *archive,
+                              const ZliteIndex *index, ArchiveCursor *cur,
+                              SolidCache *cache, const uint64_t *block_need,
+                              const ZliteIndexEntry *entry, const char *output_path) {
+    const Byte *data;
+    uint64_t need;
+    CSzFile outFile;
+    int result;
+    
+    if (!(entry->flags & ZLITE_FLAG_SOLID)) {
+        cur->pos = entry->data_offset;
+        zlite_archive_prefetch(archive, entry->data_offset, entry->compressed_size);
+        return decompress_entry(ctx, &cur->vt, entry->compressed_size, entry->crc,
+                                entry->flags, output_path, entry->size);
+    }
+    
+    need = block_need ? block_need[entry->block] : index->blocks[entry->block].size;
+    if (need < entry->unpack_offset + entry->size) {
+        need = index->blocks[entry->block].size;
+    }
+    result = load_solid_block(ctx, archive, index, entry->block, need, cache);
+    if (result != ZLITE_OK) {
+        return result;
+    }
+    
+    data = cache->data + entry->unpack_offset;
+    if (CrcCalc(data, (size_t)entry->size) != entry->crc) {
+        return ZLITE_ERROR_CORRUPT;
+    }
+    if (!output_path) {
+        return ZLITE_OK;
+    }
+    if (ctx->stream_out) {
+        return fwrite(data, 1, (size_t)entry->size, ctx->stream_out) == entry->size
+               ? ZLITE_OK : ZLITE_ERROR_WRITE;
+    }
+    
+    if (OutFile_Open(&outFile, output_path) != 0) {
+        return ZLITE_ERROR_FILE;
+    }
+    {
+        size_t written = (size_t)entry->size;
+        result = (File_Write(&outFile, data, &written) == 0 && written == entry->size)
+                 ? ZLITE_OK : ZLITE_ERROR_WRITE;
+    }
+    if (File_Close(&outFile) != 0 && result == ZLITE_OK) {
+        result = ZLITE_ERROR_WRITE;
+    }
+    if (result != ZLITE_OK) {
+        remove(output_path);
+    }
+    return result;
+}
+
+/* Regular entries with data to decode; empty non-solid files carry none */
+#define ENTRY_HAS_DATA(e) ((e)->type == ZLITE_FILETYPE_REGULAR && \
+                           ((e)->compressed_size > 0 || ((e)->flags & ZLITE_FLAG_SOLID)))
+
+/* For every copy entry, the entry that holds its data (index->count when
+ * the archive lacks it). *sources stays NULL for archives without copies. */
+static int resolve_copies(const ZliteIndex *index, uint32_t **sources) {
+    ZliteNameIndex names;
+    const char **paths;
+    uint32_t i;
+    
+    *sources = NULL;
+    for (i = 0; i < index->count && index->entries[i].type != ZLITE_FILETYPE_REF; i++) {
+    }
+    if (i == index->count) {
+        return ZLITE_OK;
+    }
+    
+    paths = (const char **)malloc(index->count * sizeof(char *));
+    *sources = (uint32_t *)malloc(index->count * sizeof(uint32_t));
+    if (!paths || !*sources) {
+        free(paths);
+        free(*sources);
+        *sources = NULL;
+        return ZLITE_ERROR_MEMORY;
+    }
+    for (i = 0; i < index->count; i++) {
+        paths[i] = index->entries[i].path;
+    }
+    if (zlite_name_index_init(&names, paths, NULL, index->count) != ZLITE_OK) {
+        free(paths);
+        free(*sources);
+        *sources = NULL;
+        return ZLITE_ERROR_MEMORY;
+    }
+    
+    /* Sources precede their copies, so chains resolve in one pass */
+    for (i = 0; i < index->count; i++) {
+        const ZliteIndexEntry *entry = &index->entries[i];
+        uint32_t s = index->count;
+        
+        if (entry->type == ZLITE_FILETYPE_REF && entry->target) {
+            s = zlite_name_index_find(&names, entry->target);
+            if (s < i && index->entries[s].type == ZLITE_FILETYPE_REF) {
+                s = (*sources)[s];
+            } else if (s >= i || index->entries[s].type != ZLITE_FILETYPE_REGULAR) {
+                s = index->count;
+            }
+        }
+        (*sources)[i] = s;
+    }
+    
+    zlite_name_index_free(&names);
+    free(paths);
+    return ZLITE_OK;
+}
+
+static int extract_custom_format(ZliteArchive *archive, const ExtractContext *ctx,
+                                 int list_only, int test_only) {
+    const char *archive_path = zlite_archive_get_path(archive);
+    const char *output_dir = ctx ? ctx->output_dir : NULL;
+    ZliteIndex index;
+    Selection sel;
+    ArchiveCursor cur;
+    SolidCache cache = { ZLITE_NO_BLOCK, NULL, 0 };
+    uint64_t *block_need = NULL;
+    uint32_t *sources = NULL;
+    uint32_t listed_block = ZLITE_NO_BLOCK;
+    int errors = 0;
+    uint32_t i;
+    int result;
     
     if (list_only) {
         printf("Archive: %s\n", archive_path);
@@ -187,59 +942,83 @@ static int extract_custom_format(const char *archive_path, const char *output_di
         printf("Testing archive: %s\n", archive_path);
         printf("\n");
     } else {
-        printf("Extracting to: %s\n", output_dir);
+        printf("Extracting to: %s\n", ctx->stream_out ? "standard output" : output_dir);
         printf("\n");
     }
     
-    fp = fopen(archive_path, "rb");
-    if (!fp) {
-        fprintf(stderr, "Error: Cannot open archive\n");
-        return ZLITE_ERROR_FILE;
+    /* Entry table from the central directory, or from a record scan for
+     * archives written without one */
+    result = zlite_index_load(archive, &index);
+    if (result != ZLITE_OK) {
+        if (result == ZLITE_ERROR_CORRUPT) {
+            fprintf(stderr, "Error: Invalid archive format\n");
+        }
+        return result;
     }
+    DEBUG_PRINT("DEBUG: %u entries (%s)\n", index.count,
+                index.from_directory ? "directory" : "scan");
     
-    /* Read and verify magic */
-    if (fread(magic, 1, 6, fp) != 6 || memcmp(magic, ARCHIVE_MAGIC, 6) != 0) {
-        fprintf(stderr, "Error: Invalid archive format\n");
-        fclose(fp);
-        return ZLITE_ERROR_CORRUPT;
+    /* Resolve path arguments against the entry names */
+    result = selection_alloc(&sel, list_only ? NULL : ctx, index.count, 0);
+    if (result == ZLITE_OK && sel.selected) {
+        for (i = 0; i < index.count; i++) {
+            sel.names[i] = (char *)index.entries[i].path;
+            sel.is_dir[i] = index.entries[i].type == ZLITE_FILETYPE_DIR;
+        }
+        result = selection_resolve(&sel, ctx);
+    }
+    if (result == ZLITE_OK && !list_only) {
+        result = resolve_copies(&index, &sources);
+    }
+    if (result != ZLITE_OK) {
+        selection_free(&sel);
+        zlite_index_free(&index);
+        return result;
     }
     
-    /* Read file count */
-    if (fread(&file_count, sizeof(uint32_t), 1, fp) != 1) {
-        fclose(fp);
-        return ZLITE_ERROR_CORRUPT;
+    /* With a selection, solid blocks only need decoding up to the end of
+     * their last selected member */
+    if (sel.selected && index.block_count > 0) {
+        block_need = (uint64_t *)calloc(index.block_count, sizeof(uint64_t));
+        if (!block_need) {
+            free(sources);
+            selection_free(&sel);
+            zlite_index_free(&index);
+            return ZLITE_ERROR_MEMORY;
+        }
+        for (i = 0; i < index.count; i++) {
+            const ZliteIndexEntry *entry = &index.entries[i];
+            if (sources && sources[i] < index.count) {
+                entry = &index.entries[sources[i]];
+            }
+            if (sel.selected[i] && (entry->flags & ZLITE_FLAG_SOLID) &&
+                block_need[entry->block] < entry->unpack_offset + entry->size) {
+                block_need[entry->block] = entry->unpack_offset + entry->size;
+            }
+        }
     }
     
+    ArchiveCursor_Init(&cur, archive);
+    
     if (!list_only && !test_only) {
-        printf("Extracting %d files...\n", file_count);
+        printf("Extracting %u files...\n", sel.selected ? sel.total : index.count);
     } else if (test_only) {
-        printf("Testing %d files...\n", file_count);
+        printf("Testing %u files...\n", sel.selected ? sel.total : index.count);
     }
     
-    for (i = 0; i < file_count; i++) {
-        uint32_t path_len;
-        char path[PATH_MAX];
+    for (i = 0; i < index.count; i++) {
+        const ZliteIndexEntry *entry = &index.entries[i];
+        const ZliteIndexEntry *data;
+        const char *path = entry->path;
         char output_path[PATH_MAX];
-        int file_type;
-        uint64_t size;
-        uint64_t compressed_size;
-        uint32_t crc;
         
-        /* Read file info */
-        if (fread(&path_len, sizeof(uint32_t), 1, fp) != 1 ||
-            path_len >= PATH_MAX ||
-            fread(path, 1, path_len, fp) != path_len ||
-            fread(&file_type, sizeof(int), 1, fp) != 1 ||
-            fread(&size, sizeof(uint64_t), 1, fp) != 1 ||
-            fread(&compressed_size, sizeof(uint64_t), 1, fp) != 1 ||
-            fread(&crc, sizeof(uint32_t), 1, fp) != 1) {
-            break;
+        if (!IS_SELECTED(&sel, i)) {
+            continue;
         }
-        path[path_len] = '\0';
         
         /* Get type string for list */
         char type_str[20];
-        switch (file_type) {
+        switch (entry->type) {
             case ZLITE_FILETYPE_REGULAR:
                 strcpy(type_str, "File");
                 break;
@@ -252,178 +1031,168 @@ static int extract_custom_format(const char *archive_path, const char *output_di
             case ZLITE_FILETYPE_HARDLINK:
                 strcpy(type_str, "Hardlink");
                 break;
+            case ZLITE_FILETYPE_REF:
+                strcpy(type_str, "Copy");
+                break;
             default:
                 strcpy(type_str, "Unknown");
                 break;
         }
         
-        /* List mode */
+        /* List mode. Solid members have no compressed size of their own;
+         * their block is listed once, ahead of its first member. */
         if (list_only) {
+            if ((entry->flags & ZLITE_FLAG_SOLID) && entry->block != listed_block &&
+                entry->block < index.block_count) {
+                const ZliteIndexEntry *block = &index.blocks[entry->block];
+                char block_name[32];
+                
+                snprintf(block_name, sizeof(block_name), "[solid block %u]", entry->block);
+                printf("  %-40s %-10s %-10llu %-10llu\n",
+                       block_name, "Block",
+                       (unsigned long long)block->size,
+                       (unsigned long long)block->compressed_size);
+                listed_block = entry->block;
+            }
             printf("  %-40s %-10s %-10llu %-10llu\n", 
                    path, type_str, 
-                   (unsigned long long)size, 
-                   (unsigned long long)compressed_size);
-            
-            /* Skip compressed data */
-            if (file_type == ZLITE_FILETYPE_REGULAR && compressed_size > 0) {
-                fseek(fp, compressed_size, SEEK_CUR);
-            }
-            
-            /* Skip symlink/hardlink target if present */
-            if (file_type == ZLITE_FILETYPE_SYMLINK || file_type == ZLITE_FILETYPE_HARDLINK) {
-                uint32_t target_len;
-                if (fread(&target_len, sizeof(uint32_t), 1, fp) == 1) {
-                    fseek(fp, target_len, SEEK_CUR);
-                }
-            }
+                   (unsigned long long)entry->size, 
+                   (unsigned long long)entry->compressed_size);
             continue;
         }
         
         /* Create output path */
-        snprintf(output_path, sizeof(output_path), "%s/%s", output_dir, path);
-
+        if (join_output_path(output_path, output_dir, path) != ZLITE_OK &&
+            !test_only && !ctx->stream_out) {
+            printf("  Path too long: %s\n", path);
+            errors++;
+            continue;
+        }
+        
+        /* Copies take their data from the entry they duplicate */
+        data = entry;
+        if (entry->type == ZLITE_FILETYPE_REF) {
+            data = sources[i] < index.count ? &index.entries[sources[i]] : NULL;
+        }
+        
         /* Test mode */
         if (test_only) {
-            if (file_type == ZLITE_FILETYPE_REGULAR && compressed_size > 0) {
-                Byte *buffer = malloc(compressed_size);
-                if (buffer && fread(buffer, 1, compressed_size, fp) == compressed_size) {
-                    uint32_t calc_crc = CrcCalc(buffer, compressed_size);
-                    if (crc == calc_crc) {
-                        printf("  OK: %s\n", path);
-                    } else {
-                        printf("  CRC ERROR: %s (expected 0x%08X, got 0x%08X)\n", 
-                               path, crc, calc_crc);
-                    }
+            if (!data) {
+                printf("  ERROR: %s\n", path);
+                errors++;
+            } else if (ENTRY_HAS_DATA(data) &&
+                       (data == entry || (sel.selected && !sel.selected[sources[i]]))) {
+                /* Decode without writing anything to verify data and CRC;
+                 * a copy is covered by its source unless that is left out */
+                if (extract_entry_data(ctx, archive, &index, &cur, &cache, block_need,
+                                       data, NULL) == ZLITE_OK) {
+                    printf("  OK: %s\n", path);
+                } else {
+                    printf("  ERROR: %s\n", path);
+                    errors++;
                 }
-                if (buffer) free(buffer);
             } else {
                 printf("  OK: %s\n", path);
-                
-                /* Skip data */
-                if (compressed_size > 0) {
-                    fseek(fp, compressed_size, SEEK_CUR);
-                }
-                
-                /* Skip symlink/hardlink target if present */
-                if (file_type == ZLITE_FILETYPE_SYMLINK || file_type == ZLITE_FILETYPE_HARDLINK) {
-                    uint32_t target_len;
-                    if (fread(&target_len, sizeof(uint32_t), 1, fp) == 1) {
-                        fseek(fp, target_len, SEEK_CUR);
-                    }
-                }
             }
             continue;
         }
         
-        /* Extract mode */
-        if (file_type == ZLITE_FILETYPE_DIR) {
+        /* Extract mode; a stream only gets the data of files, one after
+         * another */
+        if (ctx->stream_out && (entry->type == ZLITE_FILETYPE_DIR ||
+                                entry->type == ZLITE_FILETYPE_SYMLINK)) {
+            printf("  Skipped: %s\n", path);
+        }
+        else if (entry->type == ZLITE_FILETYPE_DIR) {
             zlite_mkdir_recursive(output_path);
             printf("  Created directory: %s\n", path);
         } 
-        else if (file_type == ZLITE_FILETYPE_SYMLINK) {
-            uint32_t target_len;
-            char target[PATH_MAX];
-            if (fread(&target_len, sizeof(uint32_t), 1, fp) == 1 &&
-                target_len < PATH_MAX &&
-                fread(target, 1, target_len, fp) == target_len) {
-                target[target_len] = '\0';
-                zlite_create_link(target, output_path, ZLITE_FILETYPE_SYMLINK);
-                printf("  Created symlink: %s -> %s\n", path, target);
+        else if (entry->type == ZLITE_FILETYPE_SYMLINK) {
+            if (entry->target) {
+                create_parent_dir(output_path);
+                zlite_create_link(entry->target, output_path, ZLITE_FILETYPE_SYMLINK);
+                printf("  Created symlink: %s -> %s\n", path, entry->target);
             }
         }
-        else if (file_type == ZLITE_FILETYPE_HARDLINK) {
-            uint32_t target_len;
-            char target[PATH_MAX];
+        else if (entry->type == ZLITE_FILETYPE_HARDLINK) {
             char full_target[PATH_MAX];
-            if (fread(&target_len, sizeof(uint32_t), 1, fp) == 1 &&
-                target_len < PATH_MAX &&
-                fread(target, 1, target_len, fp) == target_len) {
-                target[target_len] = '\0';
-                snprintf(full_target, sizeof(full_target), "%s/%s", output_dir, target);
-                
-                /* Create output directory if needed */
-                {
-                    char dir_copy[PATH_MAX];
-                    char *slash;
-                    strcpy(dir_copy, output_path);
-                    slash = strrchr(dir_copy, '/');
-                    if (slash) {
-                        *slash = '\0';
-                        zlite_mkdir_recursive(dir_copy);
-                    }
-                }
-                
-                if (zlite_create_link(full_target, output_path, ZLITE_FILETYPE_HARDLINK) == 0) {
-                    printf("  Created hardlink: %s -> %s\n", path, target);
-                } else {
-                    printf("  Failed to create hardlink: %s -> %s\n", path, target);
+            uint32_t t = sel.selected ? zlite_name_index_find(&sel.index, entry->target)
+                                      : index.count;
+            const ZliteIndexEntry *target = NULL;
+            
+            if (t < index.count && !sel.selected[t]) {
+                target = &index.entries[t];
+                if (target->type == ZLITE_FILETYPE_REF) {
+                    target = sources[t] < index.count ? &index.entries[sources[t]] : NULL;
                 }
             }
-        }
-        else if (file_type == ZLITE_FILETYPE_REGULAR && compressed_size > 0) {
-            /* Read compressed data */
-            Byte *buffer = malloc(compressed_size);
-            if (buffer && fread(buffer, 1, compressed_size, fp) == compressed_size) {
-                uint32_t calc_crc = CrcCalc(buffer, compressed_size);
-                
-                if (crc != calc_crc) {
-                    printf("  CRC mismatch for %s\n", path);
-                    free(buffer);
-                    continue;
+            
+            if (target && ENTRY_HAS_DATA(target)) {
+                /* The link target was not requested: give the link its own
+                 * copy of the target's data */
+                if (!ctx->stream_out) {
+                    create_parent_dir(output_path);
                 }
-                
-                /* Create output directory if needed */
-                {
-                    char dir_copy[PATH_MAX];
-                    char *slash;
-                    strcpy(dir_copy, output_path);
-                    slash = strrchr(dir_copy, '/');
-                    if (slash) {
-                        *slash = '\0';
-                        zlite_mkdir_recursive(dir_copy);
-                    }
+                if (extract_entry_data(ctx, archive, &index, &cur, &cache, block_need,
+                                       target, output_path) == ZLITE_OK) {
+                    printf("  %s\n", path);
+                } else {
+                    printf("  Failed to extract: %s\n", path);
+                    errors++;
                 }
+            } else if (ctx->stream_out) {
+                /* The target's data has been written already */
+                printf("  Skipped: %s\n", path);
+            } else if (entry->target) {
+                /* Create output directory if needed */
+                create_parent_dir(output_path);
                 
-                /* Create temp files for decompression */
-                char temp_input[PATH_MAX];
-                char temp_output[PATH_MAX];
-                snprintf(temp_input, sizeof(temp_input), "%s.zlite_tmp", output_path);
-                snprintf(temp_output, sizeof(temp_output), "%s.zlite_out", output_path);
-                
-                /* Write compressed data */
-                FILE *temp_fp = fopen(temp_input, "wb");
-                if (temp_fp) {
-                    fwrite(buffer, 1, compressed_size, temp_fp);
-                    fclose(temp_fp);
-                    
-                    if (decompress_file_lzma2(temp_input, temp_output, 
-                                             compressed_size - 1, size) == ZLITE_OK) {
-                        rename(temp_output, output_path);
-                        printf("  %s\n", path);
-                    } else {
-                        printf("  Failed to extract: %s\n", path);
-                    }
-                    remove(temp_input);
+                if (join_output_path(full_target, output_dir, entry->target) == ZLITE_OK &&
+                    zlite_create_link(full_target, output_path, ZLITE_FILETYPE_HARDLINK) == 0) {
+                    printf("  Created hardlink: %s -> %s\n", path, entry->target);
+                } else {
+                    printf("  Failed to create hardlink: %s -> %s\n", path, entry->target);
                 }
             }
-            if (buffer) free(buffer);
-        } else {
-            printf("  Skipped: %s\n", path);
+        }
+        else if (data && ENTRY_HAS_DATA(data)) {
+            /* Create output directory if needed */
+            if (!ctx->stream_out) {
+                create_parent_dir(output_path);
+            }
             
-            /* Skip symlink/hardlink target if present */
-            if (file_type == ZLITE_FILETYPE_SYMLINK || file_type == ZLITE_FILETYPE_HARDLINK) {
-                uint32_t target_len;
-                if (fread(&target_len, sizeof(uint32_t), 1, fp) == 1) {
-                    fseek(fp, target_len, SEEK_CUR);
-                }
+            /* Decode the payload straight from the archive into the output
+             * file; solid members are sliced from their decoded block, and
+             * copies are decoded again from their source */
+            if (extract_entry_data(ctx, archive, &index, &cur, &cache, block_need,
+                                   data, output_path) == ZLITE_OK) {
+                printf("  %s\n", path);
+            } else {
+                printf("  Failed to extract: %s\n", path);
+                errors++;
             }
+        } else {
+            printf("  Skipped: %s\n", path);
         }
     }
     
-    fclose(fp);
+    result = sel.unmatched > 0 ? ZLITE_ERROR_FILE : ZLITE_OK;
+    free(cache.data);
+    free(block_need);
+    free(sources);
+    selection_free(&sel);
+    zlite_index_free(&index);
+    
+    if (errors > 0) {
+        printf("\n%d errors\n", errors);
+        return ZLITE_ERROR_CORRUPT;
+    }
+    if (result != ZLITE_OK) {
+        return result;
+    }
     
     if (list_only) {
-        printf("\nTotal: %d files\n", file_count);
+        printf("\nTotal: %u files\n", i);
     } else if (test_only) {
         printf("\nAll tests passed!\n");
     } else {
@@ -480,8 +1249,190 @@ static void print_error(SRes res) {
     }
 }
 
-static int extract_standard_7z(const char *archive_path, const char *output_dir, int list_only, int test_only) {
-    CFileInStream archiveStream;
+#define k7zMethodLzma2 0x21
+
+/* Return the LZMA2 property byte of a folder made of a single LZMA2 coder,
+ * or 0 for folders with filters or other methods */
+static int get_7z_lzma2_folder_prop(const CSzArEx *db, UInt32 folderIndex, Byte *prop) {
+    CSzFolder folder;
+    CSzData sd;
+    const Byte *data = db->db.CodersData + db->db.FoCodersOffsets[folderIndex];
+    
+    sd.Data = data;
+    sd.Size = db->db.FoCodersOffsets[(size_t)folderIndex + 1] - db->db.FoCodersOffsets[folderIndex];
+    
+    if (SzGetNextFolderItem(&folder, &sd) != SZ_OK || sd.Size != 0 ||
+        folder.NumCoders != 1 || folder.NumPackStreams != 1 ||
+        folder.Coders[0].MethodID != k7zMethodLzma2 || folder.Coders[0].PropsSize != 1) {
+        return 0;
+    }
+    
+    *prop = data[folder.Coders[0].PropsOffset];
+    return 1;
+}
+
+/* Decode a whole single-coder LZMA2 folder with Lzma2DecMt into outBuffer */
+static SRes decode_7z_folder_mt(const ExtractContext *ctx, const CSzArEx *db,
+                                ZliteArchive *archive, UInt32 folderIndex,
+                                Byte prop, Byte *outBuffer, size_t outSize) {
+    ArchiveCursor cur;
+    PayloadInStream packStream;
+    BufOutStream out;
+    CLzma2DecMtProps props;
+    UInt64 unpackSize = outSize;
+    const UInt32 packIndex = db->db.FoStartPackStreamIndex[folderIndex];
+    const UInt64 packSize = db->db.PackPositions[packIndex + 1] - db->db.PackPositions[packIndex];
+    UInt64 in_processed = 0;
+    int is_mt = 0;
+    SRes res;
+    
+    /* Read the pack stream straight from the archive; the look stream
+     * used by the SDK re-seeks before its next read */
+    ArchiveCursor_Init(&cur, archive);
+    cur.pos = db->dataPos + db->db.PackPositions[packIndex];
+    if (cur.pos > cur.size || packSize > cur.size - cur.pos) {
+        return SZ_ERROR_READ;
+    }
+    zlite_archive_prefetch(archive, cur.pos, packSize);
+    PayloadInStream_Init(&packStream, &cur.vt, packSize);
+    
+    out.vt.Write = BufOutStream_Write;
+    out.data = outBuffer;
+    out.size = outSize;
+    out.pos = 0;
+    
+    Lzma2DecMtProps_Init(&props);
+    props.numThreads = (unsigned)ctx->num_threads;
+    
+    res = Lzma2DecMt_Decode(ctx->dec, prop, &props, &out.vt, &unpackSize, 1,
+                            &packStream.vt, &in_processed, &is_mt, NULL);
+    if (res == SZ_OK && out.pos != outSize) {
+        res = SZ_ERROR_DATA;
+    }
+    if (res == SZ_OK && SzBitWithVals_Check(&db->db.FolderCRCs, folderIndex) &&
+        CrcCalc(outBuffer, outSize) != db->db.FolderCRCs.Vals[folderIndex]) {
+        res = SZ_ERROR_CRC;
+    }
+    
+    return res;
+}
+
+/* SzArEx_Extract() with multithreaded decoding of plain LZMA2 folders.
+ * The folder is decoded into the SzArEx_Extract cache buffer first, so the
+ * SDK call that follows only slices out the file and checks its CRC. */
+static SRes extract_7z_file(const ExtractContext *ctx, const CSzArEx *db,
+                            CLookToRead2 *lookStream, ZliteArchive *archive,
+                            UInt32 fileIndex, UInt32 *blockIndex,
+                            Byte **outBuffer, size_t *outBufferSize,
+                            size_t *offset, size_t *outSizeProcessed) {
+    const UInt32 folderIndex = db->FileToFolder[fileIndex];
+    Byte prop;
+    
+    if (ctx->num_threads > 1 && folderIndex != (UInt32)-1 &&
+        (*outBuffer == NULL || *blockIndex != folderIndex) &&
+        get_7z_lzma2_folder_prop(db, folderIndex, &prop)) {
+        const UInt64 unpackSizeSpec = SzAr_GetFolderUnpackSize(&db->db, folderIndex);
+        const size_t unpackSize = (size_t)unpackSizeSpec;
+        
+        if (unpackSize == unpackSizeSpec && unpackSize != 0) {
+            SRes res;
+            
+            ISzAlloc_Free(&g_Alloc, *outBuffer);
+            *outBuffer = (Byte *)ISzAlloc_Alloc(&g_Alloc, unpackSize);
+            *outBufferSize = unpackSize;
+            *blockIndex = folderIndex;
+            if (!*outBuffer) {
+                *outBufferSize = 0;
+                return SZ_ERROR_MEM;
+            }
+            
+            res = decode_7z_folder_mt(ctx, db, archive, folderIndex, prop,
+                                      *outBuffer, unpackSize);
+            if (res != SZ_OK) {
+                ISzAlloc_Free(&g_Alloc, *outBuffer);
+                *outBuffer = NULL;
+                *outBufferSize = 0;
+                return res;
+            }
+        }
+    }
+    
+    return SzArEx_Extract(db, &lookStream->vt, fileIndex,
+        blockIndex, outBuffer, outBufferSize,
+        offset, outSizeProcessed,
+        &g_Alloc, &g_AllocTemp);
+}
+
+/* File name of entry i as UTF-8. temp/tempSize is a reusable UTF-16
+ * buffer owned by the caller. */
+static SRes get_7z_file_name(const CSzArEx *db, UInt32 i, UInt16 **temp, size_t *tempSize,
+                             char utf8_path[PATH_MAX]) {
+    size_t len = SzArEx_GetFileNameUtf16(db, i, NULL);
+    const UInt16 *src;
+    const UInt16 *srcEnd;
+    Byte *dest = (Byte *)utf8_path;
+    size_t utf8_len = 0;
+    
+    if (len > *tempSize) {
+        SzFree(NULL, *temp);
+        *tempSize = len;
+        *temp = (UInt16 *)SzAlloc(NULL, *tempSize * sizeof((*temp)[0]));
+        if (!*temp) {
+            *tempSize = 0;
+            return SZ_ERROR_MEM;
+        }
+    }
+    SzArEx_GetFileNameUtf16(db, i, *temp);
+    
+    src = *temp;
+    srcEnd = *temp + len - 1;  /* -1 for null terminator */
+    while (src < srcEnd && utf8_len < PATH_MAX - 4) {
+        UInt32 val = *src++;
+        if (val >= 0xD800 && val < 0xDC00 && src < srcEnd &&
+            *src >= 0xDC00 && *src < 0xE000) {
+            val = 0x10000 + ((val - 0xD800) << 10) + (*src++ - 0xDC00);
+        }
+        if (val < 0x80) {
+            *dest++ = (Byte)val;
+            utf8_len++;
+        } else if (val < 0x800) {
+            *dest++ = (Byte)(0xC0 | (val >> 6));
+            *dest++ = (Byte)(0x80 | (val & 0x3F));
+            utf8_len += 2;
+        } else if (val < 0x10000) {
+            *dest++ = (Byte)(0xE0 | (val >> 12));
+            *dest++ = (Byte)(0x80 | ((val >> 6) & 0x3F));
+            *dest++ = (Byte)(0x80 | (val & 0x3F));
+            utf8_len += 3;
+        } else {
+            *dest++ = (Byte)(0xF0 | (val >> 18));
+            *dest++ = (Byte)(0x80 | ((val >> 12) & 0x3F));
+            *dest++ = (Byte)(0x80 | ((val >> 6) & 0x3F));
+            *dest++ = (Byte)(0x80 | (val & 0x3F));
+            utf8_len += 4;
+        }
+    }
+    *dest = '\0';
+    return SZ_OK;
+}
+
+/* 7-Zip for Linux and p7zip keep the Unix mode in the high 16 bits of the
+ * attributes; the data of a symlink is its target */
+static int is_7z_symlink(const CSzArEx *db, UInt32 i) {
+    UInt32 attrib;
+    
+    if (!SzBitWithVals_Check(&db->Attribs, i)) {
+        return 0;
+    }
+    attrib = db->Attribs.Vals[i];
+    return (attrib & 0x8000) && ((attrib >> 16) & 0170000) == 0120000;
+}
+
+static int extract_standard_7z(ZliteArchive *archive, const ExtractContext *ctx,
+                               int list_only, int test_only) {
+    const char *archive_path = zlite_archive_get_path(archive);
+    const char *output_dir = ctx ? ctx->output_dir : NULL;
+    ArchiveSeekStream archiveStream;
     CLookToRead2 lookStream;
     CSzArEx db;
     SRes res;
@@ -491,6 +1442,9 @@ static int extract_standard_7z(const char *archive_path, const char *output_dir,
     UInt32 blockIndex = 0xFFFFFFFF;
     Byte *outBuffer = NULL;
     size_t outBufferSize = 0;
+    Selection sel;
+    UInt32 num_files;
+    int result;
     
     #define kInputBufSize ((size_t)1 << 18)
     
@@ -500,20 +1454,13 @@ static int extract_standard_7z(const char *archive_path, const char *output_dir,
     /* Initialize archive database */
     SzArEx_Init(&db);
     
-    /* Open archive file */
-    archiveStream.wres = InFile_Open(&archiveStream.file, archive_path);
-    if (archiveStream.wres != 0) {
-        fprintf(stderr, "Error: Cannot open archive file\n");
-        return ZLITE_ERROR_FILE;
-    }
-    
-    FileInStream_CreateVTable(&archiveStream);
+    /* Read through the archive handle, which joins volumes */
+    ArchiveSeekStream_Init(&archiveStream, archive);
     
     /* Initialize look stream */
     LookToRead2_CreateVTable(&lookStream, False);
     lookStream.buf = (Byte *)ISzAlloc_Alloc(&g_Alloc, kInputBufSize);
     if (!lookStream.buf) {
-        File_Close(&archiveStream.file);
         SzArEx_Free(&db, &g_Alloc);
         fprintf(stderr, "Error: Memory allocation failed\n");
         return ZLITE_ERROR_MEMORY;
@@ -525,12 +1472,13 @@ static int extract_standard_7z(const char *archive_path, const char *output_dir,
     /* Open archive */
     res = SzArEx_Open(&db, &lookStream.vt, &g_Alloc, &g_AllocTemp);
     if (res != SZ_OK) {
+        /* Not a standard 7z archive; the caller tries the custom format */
+        DEBUG_PRINT("DEBUG: SzArEx_Open failed: %d\n", res);
         ISzAlloc_Free(&g_Alloc, lookStream.buf);
-        File_Close(&archiveStream.file);
         SzArEx_Free(&db, &g_Alloc);
-        print_error(res);
-        return ZLITE_ERROR_CORRUPT;
+        return ZLITE_ERROR_UNSUPPORTED;
     }
+    num_files = db.NumFiles;  /* SzArEx_Free() resets db */
     
     if (list_only) {
         printf("Archive: %s\n", archive_path);
@@ -540,77 +1488,72 @@ static int extract_standard_7z(const char *archive_path, const char *output_dir,
         printf("Testing archive: %s\n", archive_path);
         printf("\n");
     } else {
-        printf("Extracting to: %s\n", output_dir);
+        printf("Extracting to: %s\n", ctx->stream_out ? "standard output" : output_dir);
         printf("\n");
     }
     
+    /* Resolve path arguments against the file names. Only folders that
+     * hold a selected file are decoded below. */
+    result = selection_alloc(&sel, list_only ? NULL : ctx, db.NumFiles, 1);
+    for (i = 0; result == ZLITE_OK && sel.selected && i < db.NumFiles; i++) {
+        char utf8_path[PATH_MAX];
+        
+        if (get_7z_file_name(&db, i, &temp, &tempSize, utf8_path) != SZ_OK ||
+            !(sel.names[i] = strdup(utf8_path))) {
+            result = ZLITE_ERROR_MEMORY;
+        }
+        sel.is_dir[i] = SzArEx_IsDir(&db, i) ? 1 : 0;
+    }
+    if (result == ZLITE_OK) {
+        result = selection_resolve(&sel, ctx);
+    }
+    if (result != ZLITE_OK) {
+        selection_free(&sel);
+        SzFree(NULL, temp);
+        SzArEx_Free(&db, &g_Alloc);
+        ISzAlloc_Free(&g_Alloc, lookStream.buf);
+        return result;
+    }
+    
     /* Process each file */
     for (i = 0; i < db.NumFiles; i++) {
         size_t offset = 0;
         size_t outSizeProcessed = 0;
         const BoolInt isDir = SzArEx_IsDir(&db, i);
+        const int isLink = !isDir && is_7z_symlink(&db, i);
+        char utf8_path[PATH_MAX];
         
-        /* Skip directories in extract/test mode without full paths */
-        if (!list_only && !test_only && isDir) {
+        if (!IS_SELECTED(&sel, i)) {
             continue;
         }
         
         /* Get filename */
-        size_t len = SzArEx_GetFileNameUtf16(&db, i, NULL);
-        if (len > tempSize) {
-            SzFree(NULL, temp);
-            tempSize = len;
-            temp = (UInt16 *)SzAlloc(NULL, tempSize * sizeof(temp[0]));
-            if (!temp) {
-                res = SZ_ERROR_MEM;
-                break;
-            }
+        res = get_7z_file_name(&db, i, &temp, &tempSize, utf8_path);
+        if (res != SZ_OK) {
+            break;
         }
-        SzArEx_GetFileNameUtf16(&db, i, temp);
         
-        /* Convert UTF-16 to UTF-8 for display */
-        char utf8_path[PATH_MAX];
-        size_t utf8_len = 0;
-        {
-            const UInt16 *src = temp;
-            const UInt16 *srcEnd = temp + len - 1;  /* -1 for null terminator */
-            Byte *dest = (Byte *)utf8_path;
-            
-            while (src < srcEnd && utf8_len < PATH_MAX - 1) {
-                UInt32 val = *src++;
-                if (val < 0x80) {
-                    *dest++ = (Byte)val;
-                    utf8_len++;
-                } else if (val < 0x800) {
-                    *dest++ = (Byte)(0xC0 | (val >> 6));
-                    *dest++ = (Byte)(0x80 | (val & 0x3F));
-                    utf8_len += 2;
-                } else {
-                    *dest++ = (Byte)(0xE0 | (val >> 12));
-                    *dest++ = (Byte)(0x80 | ((val >> 6) & 0x3F));
-                    *dest++ = (Byte)(0x80 | (val & 0x3F));
-                    utf8_len += 3;
+        /* Directories only need creating */
+        if (!list_only && isDir) {
+            if (!test_only && !ctx->stream_out) {
+                char full_path[PATH_MAX];
+                if (join_output_path(full_path, output_dir, utf8_path) != ZLITE_OK) {
+                    fprintf(stderr, "Error: Path too long: %s\n", utf8_path);
+                    res = SZ_ERROR_FAIL;
+                    break;
                 }
+                zlite_mkdir_recursive(full_path);
+                printf("  Created directory: %s\n", utf8_path);
             }
-            *dest = '\0';
+            continue;
         }
         
         /* List mode */
         if (list_only) {
             UInt64 fileSize = SzArEx_GetFileSize(&db, i);
-            char size_str[32];
-            {
-                UInt64 val = fileSize;
-                char *p = size_str + 31;
-                *p = '\0';
-                do {
-                    *--p = '0' + (val % 10);
-                    val /= 10;
-                } while (val != 0);
-            }
+            const char *type = isDir ? "Dir" : isLink ? "Link" : "File";
             
-            const char *type = isDir ? "Dir" : "File";
-            printf("  %-40s %-10s %-10s\n", utf8_path, type, size_str);
+            printf("  %-40s %-10s %-10llu\n", utf8_path, type, (unsigned long long)fileSize);
             continue;
         }
         
@@ -618,10 +1561,9 @@ static int extract_standard_7z(const char *archive_path, const char *output_dir,
         if (test_only) {
             printf("  Testing: %s\n", utf8_path);
             if (!isDir) {
-                res = SzArEx_Extract(&db, &lookStream.vt, i,
+                res = extract_7z_file(ctx, &db, &lookStream, archive, i,
                     &blockIndex, &outBuffer, &outBufferSize,
-                    &offset, &outSizeProcessed,
-                    &g_Alloc, &g_AllocTemp);
+                    &offset, &outSizeProcessed);
                 if (res != SZ_OK) {
                     print_error(res);
                     break;
@@ -631,19 +1573,43 @@ static int extract_standard_7z(const char *archive_path, const char *output_dir,
             printf("  Extracting: %s\n", utf8_path);
             
             if (!isDir) {
-                res = SzArEx_Extract(&db, &lookStream.vt, i,
+                res = extract_7z_file(ctx, &db, &lookStream, archive, i,
                     &blockIndex, &outBuffer, &outBufferSize,
-                    &offset, &outSizeProcessed,
-                    &g_Alloc, &g_AllocTemp);
+                    &offset, &outSizeProcessed);
                 if (res != SZ_OK) {
                     print_error(res);
                     break;
                 }
                 
-                /* Write to file */
-                {
+                /* Write to the stream, which only gets file data, or to a file */
+                if (ctx->stream_out) {
+                    if (!isLink && fwrite(outBuffer + offset, 1, outSizeProcessed,
+                                          ctx->stream_out) != outSizeProcessed) {
+                        res = SZ_ERROR_WRITE;
+                        break;
+                    }
+                } else if (isLink) {
                     char full_path[PATH_MAX];
-                    snprintf(full_path, sizeof(full_path), "%s/%s", output_dir, utf8_path);
+                    char target[PATH_MAX];
+                    size_t len = outSizeProcessed < sizeof(target) - 1 ? outSizeProcessed
+                                                                       : sizeof(target) - 1;
+                    
+                    if (join_output_path(full_path, output_dir, utf8_path) != ZLITE_OK) {
+                        fprintf(stderr, "Error: Path too long: %s\n", utf8_path);
+                        res = SZ_ERROR_FAIL;
+                        break;
+                    }
+                    memcpy(target, outBuffer + offset, len);
+                    target[len] = '\0';
+                    create_parent_dir(full_path);
+                    zlite_create_link(target, full_path, ZLITE_FILETYPE_SYMLINK);
+                } else {
+                    char full_path[PATH_MAX];
+                    if (join_output_path(full_path, output_dir, utf8_path) != ZLITE_OK) {
+                        fprintf(stderr, "Error: Path too long: %s\n", utf8_path);
+                        res = SZ_ERROR_FAIL;
+                        break;
+                    }
                     
                     /* Create directory */
                     {
@@ -678,17 +1644,21 @@ static int extract_standard_7z(const char *archive_path, const char *output_dir,
     if (temp) {
         SzFree(NULL, temp);
     }
+    selection_free(&sel);
     SzArEx_Free(&db, &g_Alloc);
     ISzAlloc_Free(&g_Alloc, lookStream.buf);
-    File_Close(&archiveStream.file);
     
     if (res != SZ_OK) {
         print_error(res);
         return ZLITE_ERROR_CORRUPT;
     }
     
+    if (sel.unmatched > 0) {
+        return ZLITE_ERROR_FILE;
+    }
+    
     if (list_only) {
-        printf("\nTotal: %d files\n", db.NumFiles);
+        printf("\nTotal: %u files\n", (unsigned)num_files);
     } else if (test_only) {
         printf("\nAll tests passed!\n");
     } else {
@@ -703,37 +1673,53 @@ static int extract_standard_7z(const char *archive_path, const char *output_dir,
  * ======================================================================== */
 
 int zlite_list_files(ZliteArchive *archive) {
-    const char *archive_path = zlite_archive_get_path(archive);
+    int result;
     
     /* Try standard 7z format first */
-    if (extract_standard_7z(archive_path, NULL, 1, 0) == ZLITE_OK) {
-        return ZLITE_OK;
+    result = extract_standard_7z(archive, NULL, 1, 0);
+    if (result != ZLITE_ERROR_UNSUPPORTED) {
+        return result;
     }
     
     /* Fallback to custom format */
-    return extract_custom_format(archive_path, NULL, 1, 0);
+    return extract_custom_format(archive, NULL, 1, 0);
 }
 
-int zlite_test_archive(ZliteArchive *archive) {
-    const char *archive_path = zlite_archive_get_path(archive);
+int zlite_test_archive(ZliteArchive *archive, const ZliteExtractOptions *options) {
+    ExtractContext ctx;
+    int result;
     
-    /* Try standard 7z format first */
-    if (extract_standard_7z(archive_path, NULL, 0, 1) == ZLITE_OK) {
-        return ZLITE_OK;
+    if (extract_context_init(&ctx, NULL, options) != ZLITE_OK) {
+        extract_context_free(&ctx);
+        return ZLITE_ERROR_MEMORY;
     }
     
-    /* Fallback to custom format */
-    return extract_custom_format(archive_path, NULL, 0, 1);
+    /* Try standard 7z format first, then fall back to custom format */
+    result = extract_standard_7z(archive, &ctx, 0, 1);
+    if (result == ZLITE_ERROR_UNSUPPORTED) {
+        result = extract_custom_format(archive, &ctx, 0, 1);
+    }
+    
+    extract_context_free(&ctx);
+    return result;
 }
 
-int zlite_extract_files(ZliteArchive *archive, const char *output_dir) {
-    const char *archive_path = zlite_archive_get_path(archive);
+int zlite_extract_files(ZliteArchive *archive, const char *output_dir,
+                        const ZliteExtractOptions *options) {
+    ExtractContext ctx;
+    int result;
     
-    /* Try standard 7z format first */
-    if (extract_standard_7z(archive_path, output_dir, 0, 0) == ZLITE_OK) {
-        return ZLITE_OK;
+    if (extract_context_init(&ctx, output_dir, options) != ZLITE_OK) {
+        extract_context_free(&ctx);
+        return ZLITE_ERROR_MEMORY;
     }
     
-    /* Fallback to custom format */
-    return extract_custom_format(archive_path, output_dir, 0, 0);
+    /* Try standard 7z format first, then fall back to custom format */
+    result = extract_standard_7z(archive, &ctx, 0, 0);
+    if (result == ZLITE_ERROR_UNSUPPORTED) {
+        result = extract_custom_format(archive, &ctx, 0, 0);
+    }
+    
+    extract_context_free(&ctx);
+    return result;
 }
@@ -0,0 +1,248 @@
+#include "../include/7zlite.h"
+#include "../include/compat.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#ifndef PATH_MAX
+#define PATH_MAX 4096
+#endif
+
+#include "7zCrc.h"
+#include "Sha256.h"
+
+/* Content deduplication for the add path.
+ *
+ * Regular files that are byte-identical copies of an earlier file in the
+ * list become ZLITE_FILETYPE_REF entries naming that file, so their data
+ * is compressed and stored once. Candidates are narrowed in three steps:
+ * equal size, then a pre-hash of the first and last blocks, and only the
+ * files that still collide are read in full and compared by SHA-256. */
+
+#define DEDUP_MIN_SIZE    128                   /* smaller files are not worth a reference */
+#define DEDUP_EDGE_SIZE   ((size_t)1 << 12)     /* bytes pre-hashed at each end */
+#define DEDUP_READ_SIZE   ((size_t)1 << 20)
+
+typedef struct {
+    uint64_t size;
+    uint64_t prehash;
+    uint32_t crc;
+    int index;                  /* position in the file list */
+    int state;
+    Byte digest[SHA256_DIGEST_SIZE];
+} DedupItem;
+
+#define ITEM_NEW      0
+#define ITEM_HASHED   1
+#define ITEM_SKIP     2         /* unreadable, or changed while reading */
+
+static int cmp_size(const void *a, const void *b) {
+    const DedupItem *x = (const DedupItem *)a;
+    const DedupItem *y = (const DedupItem *)b;
+
+    if (x->size != y->size) {
+        return x->size < y->size ? -1 : 1;
+    }
+    return x->index - y->index;
+}
+
+static int cmp_prehash(const void *a, const void *b) {
+    const DedupItem *x = (const DedupItem *)a;
+    const DedupItem *y = (const DedupItem *)b;
+
+    if (x->state != y->state) {
+        return x->state - y->state;
+    }
+    if (x->prehash != y->prehash) {
+        return x->prehash < y->prehash ? -1 : 1;
+    }
+    return x->index - y->index;
+}
+
+static int cmp_digest(const void *a, const void *b) {
+    const DedupItem *x = (const DedupItem *)a;
+    const DedupItem *y = (const DedupItem *)b;
+    int r;
+
+    if (x->state != y->state) {
+        return x->state - y->state;
+    }
+    r = memcmp(x->digest, y->digest, SHA256_DIGEST_SIZE);
+    return r != 0 ? r : x->index - y->index;
+}
+
+/* CRC of the first and last DEDUP_EDGE_SIZE bytes */
+static int prehash_file(const ZliteFileList *list, DedupItem *item, Byte *buf) {
+    char path[PATH_MAX];
+    FILE *fp = NULL;
+    size_t edge = item->size < DEDUP_EDGE_SIZE ? (size_t)item->size : DEDUP_EDGE_SIZE;
+    uint32_t head;
+    uint32_t tail;
+
+    if (zlite_file_list_path(list, (uint32_t)item->index, path, sizeof(path)) > 0) {
+        fp = fopen(path, "rb");
+    }
+    if (!fp) {
+        return -1;
+    }
+    if (fread(buf, 1, edge, fp) != edge) {
+        fclose(fp);
+        return -1;
+    }
+    head = CrcCalc(buf, edge);
+
+    if (zlite_fseek(fp, -(int64_t)edge, SEEK_END) != 0 || fread(buf, 1, edge, fp) != edge) {
+        fclose(fp);
+        return -1;
+    }
+    tail = CrcCalc(buf, edge);
+    fclose(fp);
+
+    item->prehash = ((uint64_t)head << 32) | tail;
+    return 0;
+}
+
+/* SHA-256 and CRC of the whole file */
+static int hash_file(const ZliteFileList *list, DedupItem *item, Byte *buf) {
+    char path[PATH_MAX];
+    FILE *fp = NULL;
+    CSha256 sha;
+    uint32_t crc = CRC_INIT_VAL;
+    uint64_t total = 0;
+    size_t n;
+
+    if (zlite_file_list_path(list, (uint32_t)item->index, path, sizeof(path)) > 0) {
+        fp = fopen(path, "rb");
+    }
+    if (!fp) {
+        return -1;
+    }
+
+    Sha256_Init(&sha);
+    while ((n = fread(buf, 1, DEDUP_READ_SIZE, fp)) > 0) {
+        Sha256_Update(&sha, buf, n);
+        crc = CrcUpdate(crc, buf, n);
+        total += n;
+    }
+    fclose(fp);
+
+    if (total != item->size) {
+        return -1;
+    }
+    Sha256_Final(&sha, item->digest);
+    item->crc = CRC_GET_DIGEST(crc);
+    return 0;
+}
+
+/* Turn every item of a run with equal digests after the first into a
+ * reference to the first, which has the lowest list position */
+static int mark_duplicates(ZliteFileList *list, DedupItem *run, int n,
+                           int *dup_count, uint64_t *dup_bytes) {
+    char target[PATH_MAX];
+    int i = 0;
+
+    while (i < n && run[i].state == ITEM_HASHED) {
+        int j = i + 1;
+
+        if (zlite_file_list_path(list, (uint32_t)run[i].index, target, sizeof(target)) == 0) {
+            i = j;
+            continue;
+        }
+        while (j < n && run[j].state == ITEM_HASHED &&
+               memcmp(run[j].digest, run[i].digest, SHA256_DIGEST_SIZE) == 0) {
+            uint32_t k = (uint32_t)run[j].index;
+
+            if (zlite_file_list_set_target(list, k, target) != ZLITE_OK) {
+                return ZLITE_ERROR_MEMORY;
+            }
+            list->type[k] = ZLITE_FILETYPE_REF;
+            list->crc[k] = run[j].crc;
+            (*dup_count)++;
+            *dup_bytes += list->size[k];
+            j++;
+        }
+        i = j;
+    }
+    return ZLITE_OK;
+}
+
+int zlite_dedup_files(ZliteFileList *list, int *dup_count, uint64_t *dup_bytes) {
+    int count = (int)list->count;
+    DedupItem *items;
+    Byte *buf;
+    int num_items = 0;
+    int result = ZLITE_OK;
+    int i;
+
+    *dup_count = 0;
+    *dup_bytes = 0;
+
+    items = (DedupItem *)malloc((count ? count : 1) * sizeof(DedupItem));
+    buf = (Byte *)malloc(DEDUP_READ_SIZE);
+    if (!items || !buf) {
+        free(items);
+        free(buf);
+        return ZLITE_ERROR_MEMORY;
+    }
+
+    for (i = 0; i < count; i++) {
+        if (list->type[i] == ZLITE_FILETYPE_REGULAR && !list->is_hardlink[i] &&
+            list->size[i] >= DEDUP_MIN_SIZE) {
+            items[num_items].size = list->size[i];
+            items[num_items].index = i;
+            items[num_items].state = ITEM_NEW;
+            num_items++;
+        }
+    }
+
+    Sha256Prepare();
+    qsort(items, num_items, sizeof(DedupItem), cmp_size);
+
+    for (i = 0; i < num_items && result == ZLITE_OK; ) {
+        int end = i + 1;
+        int k;
+
+        while (end < num_items && items[end].size == items[i].size) {
+            end++;
+        }
+        if (end - i < 2) {
+            i = end;
+            continue;
+        }
+
+        for (k = i; k < end; k++) {
+            if (prehash_file(list, &items[k], buf) != 0) {
+                items[k].state = ITEM_SKIP;
+            }
+        }
+        qsort(items + i, end - i, sizeof(DedupItem), cmp_prehash);
+
+        /* Read in full only what collides on size and pre-hash */
+        for (k = i; k < end && items[k].state == ITEM_NEW; ) {
+            int run_end = k + 1;
+            int m;
+
+            while (run_end < end && items[run_end].state == ITEM_NEW &&
+                   items[run_end].prehash == items[k].prehash) {
+                run_end++;
+            }
+            if (run_end - k >= 2) {
+                for (m = k; m < run_end; m++) {
+                    items[m].state = hash_file(list, &items[m], buf) == 0
+                                     ? ITEM_HASHED : ITEM_SKIP;
+                }
+                qsort(items + k, run_end - k, sizeof(DedupItem), cmp_digest);
+                result = mark_duplicates(list, items + k, run_end - k, dup_count, dup_bytes);
+                if (result != ZLITE_OK) {
+                    break;
+                }
+            }
+            k = run_end;
+        }
+        i = end;
+    }
+
+    free(items);
+    free(buf);
+    return result;
+}
@@ -0,0 +1,554 @@
+#include "../include/7zlite.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#ifndef PATH_MAX
+#define PATH_MAX 4096
+#endif
+
+#include "7zCrc.h"
+
+/* Delete and rename without recompression.
+ *
+ * The archive is rewritten record by record into path.tmp, which then
+ * replaces it: payloads are copied as they are (by the kernel where the
+ * platform allows) and only the record headers and the central directory
+ * are written anew. A solid block stays as long as one of its files
+ * does; the data of deleted members remains in it, since dropping it
+ * would mean recompressing the block.
+ *
+ * Copies (ZLITE_FILETYPE_REF) and hard links name the entry that holds
+ * their data. When that entry is deleted, the first remaining entry that
+ * names it is written in its place with its data, and the others are
+ * pointed there. */
+
+#define NO_ENTRY 0xFFFFFFFFu
+
+typedef struct {
+    ZliteIndex index;
+    ZliteNameIndex names;
+    const char **paths;         /* entry paths as stored, for the name index */
+    uint8_t *is_dir;
+    uint8_t *deleted;
+    uint32_t *heir;             /* entry written in a deleted entry's place */
+    uint8_t *moved;             /* heirs: skipped in their own place */
+    char **new_paths;           /* renamed paths, NULL = unchanged */
+} Edit;
+
+static void edit_free(Edit *e) {
+    uint32_t i;
+
+    if (e->new_paths) {
+        for (i = 0; i < e->index.count; i++) {
+            free(e->new_paths[i]);
+        }
+    }
+    free(e->new_paths);
+    free(e->moved);
+    free(e->heir);
+    free(e->deleted);
+    free(e->is_dir);
+    free(e->paths);
+    zlite_name_index_free(&e->names);
+    zlite_index_free(&e->index);
+}
+
+static int edit_load(Edit *e, ZliteArchive *archive) {
+    uint32_t count;
+    uint32_t i;
+    int result;
+
+    memset(e, 0, sizeof(*e));
+
+    CrcGenerateTable();
+    if (zlite_archive_is_7z(archive)) {
+        fprintf(stderr, "Error: Standard 7z archives cannot be edited in place\n");
+        return ZLITE_ERROR_UNSUPPORTED;
+    }
+
+    result = zlite_index_load(archive, &e->index);
+    if (result != ZLITE_OK) {
+        fprintf(stderr, "Error: Cannot read the archive index\n");
+        return result;
+    }
+
+    count = e->index.count;
+    e->paths = (const char **)malloc((count ? count : 1) * sizeof(char *));
+    e->is_dir = (uint8_t *)calloc(count ? count : 1, 1);
+    e->deleted = (uint8_t *)calloc(count ? count : 1, 1);
+    e->heir = (uint32_t *)malloc((count ? count : 1) * sizeof(uint32_t));
+    e->moved = (uint8_t *)calloc(count ? count : 1, 1);
+    e->new_paths = (char **)calloc(count ? count : 1, sizeof(char *));
+    if (!e->paths || !e->is_dir || !e->deleted || !e->heir || !e->moved || !e->new_paths) {
+        edit_free(e);
+        return ZLITE_ERROR_MEMORY;
+    }
+
+    for (i = 0; i < count; i++) {
+        e->paths[i] = e->index.entries[i].path;
+        e->is_dir[i] = e->index.entries[i].type == ZLITE_FILETYPE_DIR;
+        e->heir[i] = NO_ENTRY;
+    }
+
+    result = zlite_name_index_init(&e->names, e->paths, e->is_dir, count);
+    if (result != ZLITE_OK) {
+        edit_free(e);
+    }
+    return result;
+}
+
+static const char* entry_path(const Edit *e, uint32_t i) {
+    return e->new_paths[i] ? e->new_paths[i] : e->index.entries[i].path;
+}
+
+/* The entry that copy or hard link i names, or index.count */
+static uint32_t find_source(const Edit *e, uint32_t i) {
+    const ZliteIndexEntry *entry = &e->index.entries[i];
+
+    if ((entry->type != ZLITE_FILETYPE_REF && entry->type != ZLITE_FILETYPE_HARDLINK) ||
+        !entry->target) {
+        return e->index.count;
+    }
+    return zlite_name_index_find(&e->names, entry->target);
+}
+
+/* Path written in place of entry i, NULL when nothing is */
+static const char* slot_path(const Edit *e, uint32_t i) {
+    if (!e->deleted[i]) {
+        return entry_path(e, i);
+    }
+    return e->heir[i] != NO_ENTRY ? entry_path(e, e->heir[i]) : NULL;
+}
+
+/* Path written where link i's source was: deleted links in between are
+ * followed to the entry that took over the data */
+static const char* source_path(const Edit *e, uint32_t i) {
+    uint32_t s = find_source(e, i);
+    uint32_t steps = 0;
+
+    while (s < e->index.count && e->deleted[s] && e->heir[s] == NO_ENTRY &&
+           steps++ < e->index.count) {
+        s = find_source(e, s);
+    }
+    return s < e->index.count ? slot_path(e, s) : NULL;
+}
+
+/* Give every deleted entry that a remaining copy or hard link depends on
+ * an heir: the first such entry in archive order, hard links first so the
+ * rest of a link group stays linked to one of its own. Deleted links in
+ * between are passed over, up to the deleted entry that holds the data
+ * or names a remaining one. */
+static void assign_heirs(Edit *e) {
+    uint32_t count = e->index.count;
+    uint32_t i;
+
+    for (i = 0; i < 2 * count; i++) {
+        uint32_t k = i % count;
+        uint32_t t;
+        uint32_t steps = 0;
+
+        if (e->deleted[k] || e->moved[k] ||
+            (i < count && e->index.entries[k].type != ZLITE_FILETYPE_HARDLINK)) {
+            continue;
+        }
+        t = find_source(e, k);
+        if (t >= count || !e->deleted[t]) {
+            continue;
+        }
+        while (steps++ < count) {
+            uint32_t u = find_source(e, t);
+            if (u >= count || !e->deleted[u]) {
+                break;
+            }
+            t = u;
+        }
+        if (e->heir[t] == NO_ENTRY) {
+            e->heir[t] = k;
+            e->moved[k] = 1;
+        }
+    }
+}
+
+/* Write one record in its new form and add its directory entry. The
+ * header gets the sizes a streamed record kept in its trailer. */
+static int write_record(ZliteArchive *archive, ZliteOutput *out, ZliteDirWriter *dir,
+                        const ZliteIndexEntry *src, const char *path, const char *target,
+                        uint32_t block) {
+    ZliteIndexEntry entry = *src;
+    uint32_t flags = src->flags & ~(uint32_t)ZLITE_FLAG_TRAILER;
+    uint64_t pos = zlite_output_tell(out);
+    int is_link = src->type == ZLITE_FILETYPE_SYMLINK || src->type == ZLITE_FILETYPE_HARDLINK ||
+                  src->type == ZLITE_FILETYPE_REF;
+    int result;
+
+    /* Records are written once; earlier volumes are final */
+    zlite_output_commit(out, pos);
+
+    result = zlite_write_entry_header(out, path, src->type | (int)flags, src->size,
+                                      src->compressed_size, src->crc, NULL);
+    if (result == ZLITE_OK && (src->type == ZLITE_FILETYPE_REGULAR ||
+                               src->type == ZLITE_FILETYPE_SOLID_BLOCK)) {
+        result = zlite_archive_copy(archive, src->data_offset, src->compressed_size, out);
+    }
+    if (result == ZLITE_OK && is_link) {
+        result = zlite_write_link_target(out, target ? target : "");
+    }
+    if (result != ZLITE_OK) {
+        return result;
+    }
+
+    entry.offset = pos;
+    entry.flags = flags;
+    entry.path = path;
+    entry.target = is_link ? (target ? target : "") : NULL;
+    entry.block = block;
+    return zlite_dir_add(dir, &entry);
+}
+
+/* Rewrite the archive with the deletions and renames recorded in e */
+static int edit_write(Edit *e, ZliteArchive *archive, const ZliteCompressOptions *options) {
+    const ZliteIndex *index = &e->index;
+    char tmp_path[PATH_MAX];
+    uint64_t volume_size = options->volume_size ? options->volume_size
+                                                : zlite_archive_volume_size(archive);
+    uint64_t old_size = zlite_archive_size(archive);
+    uint64_t new_size;
+    uint64_t copied = 0;
+    uint32_t *new_block;
+    uint32_t records_written = 0;
+    uint32_t num_blocks = 0;
+    uint32_t ei = 0;
+    uint32_t bi = 0;
+    uint32_t i;
+    ZliteOutput out;
+    ZliteDirWriter dir;
+    int result;
+
+    snprintf(tmp_path, sizeof(tmp_path), "%s.tmp", zlite_archive_get_path(archive));
+
+    /* A solid block stays while any record inside it is written */
+    new_block = (uint32_t *)malloc((index->block_count ? index->block_count : 1) *
+                                   sizeof(uint32_t));
+    if (!new_block) {
+        return ZLITE_ERROR_MEMORY;
+    }
+    for (i = 0; i < index->block_count; i++) {
+        new_block[i] = ZLITE_NO_BLOCK;
+    }
+    for (i = 0; i < index->count; i++) {
+        const ZliteIndexEntry *entry = &index->entries[i];
+
+        if ((entry->flags & ZLITE_FLAG_SOLID) && !e->moved[i] && slot_path(e, i)) {
+            new_block[entry->block] = 0;
+        }
+    }
+    for (i = 0; i < index->block_count; i++) {
+        if (new_block[i] == 0) {
+            new_block[i] = num_blocks++;
+        }
+    }
+
+    result = zlite_output_open(&out, tmp_path, volume_size, NULL, NULL);
+    if (result != ZLITE_OK) {
+        free(new_block);
+        return result;
+    }
+    zlite_dir_init(&dir);
+
+    if (zlite_output_write(&out, ZLITE_ARCHIVE_MAGIC, ZLITE_ARCHIVE_MAGIC_SIZE) !=
+            ZLITE_ARCHIVE_MAGIC_SIZE ||
+        zlite_output_write(&out, &records_written, sizeof(uint32_t)) != sizeof(uint32_t)) {
+        result = ZLITE_ERROR_WRITE;
+    }
+
+    /* Entries and blocks in archive order */
+    while (result == ZLITE_OK && (ei < index->count || bi < index->block_count)) {
+        const ZliteIndexEntry *src;
+        const char *path;
+        const char *target = NULL;
+        uint32_t block = ZLITE_NO_BLOCK;
+
+        if (bi < index->block_count &&
+            (ei == index->count || index->blocks[bi].offset < index->entries[ei].offset)) {
+            src = &index->blocks[bi];
+            if (new_block[bi] == ZLITE_NO_BLOCK) {
+                bi++;
+                continue;
+            }
+            result = write_record(archive, &out, &dir, src, "", NULL, src->block);
+            bi++;
+        } else {
+            i = ei++;
+            src = &index->entries[i];
+            path = slot_path(e, i);
+            if (!path || e->moved[i]) {
+                continue;
+            }
+
+            /* Links name the entry written where their source was */
+            target = source_path(e, i);
+            if (!target) {
+                target = src->target;
+            }
+            if (src->flags & ZLITE_FLAG_SOLID) {
+                block = new_block[src->block];
+            }
+            result = write_record(archive, &out, &dir, src, path, target, block);
+        }
+
+        if (result == ZLITE_OK) {
+            records_written++;
+            if (src->type == ZLITE_FILETYPE_REGULAR || src->type == ZLITE_FILETYPE_SOLID_BLOCK) {
+                copied += src->compressed_size;
+            }
+        }
+    }
+
+    if (result == ZLITE_OK) {
+        result = zlite_dir_write(&dir, &out);
+    }
+    new_size = zlite_output_tell(&out);
+
+    /* Record count last */
+    if (result == ZLITE_OK &&
+        (zlite_output_seek(&out, ZLITE_ARCHIVE_MAGIC_SIZE) != ZLITE_OK ||
+         zlite_output_write(&out, &records_written, sizeof(uint32_t)) != sizeof(uint32_t))) {
+        result = ZLITE_ERROR_WRITE;
+    }
+    if (zlite_output_close(&out, result == ZLITE_OK) != ZLITE_OK && result == ZLITE_OK) {
+        result = ZLITE_ERROR_WRITE;
+    }
+    zlite_dir_free(&dir);
+    free(new_block);
+
+    /* The hook sees the final names */
+    if (result == ZLITE_OK) {
+        result = zlite_archive_replace(archive, tmp_path, volume_size, options->volume_hook,
+                                       options->volume_hook_arg);
+    } else {
+        zlite_archive_discard(tmp_path, volume_size);
+    }
+    if (result != ZLITE_OK) {
+        fprintf(stderr, "Error: Cannot rewrite the archive\n");
+        return result;
+    }
+
+    printf("\nArchive rewritten: %llu -> %llu bytes, %llu bytes of compressed data copied\n",
+           (unsigned long long)old_size, (unsigned long long)new_size,
+           (unsigned long long)copied);
+    return ZLITE_OK;
+}
+
+int zlite_delete_files(ZliteArchive *archive, char **patterns, int num_patterns,
+                       const ZliteCompressOptions *options) {
+    Edit e;
+    uint32_t total;
+    int unmatched;
+    uint32_t i;
+    int result;
+
+    if (num_patterns == 0) {
+        fprintf(stderr, "Error: No files specified for deleting\n");
+        return ZLITE_ERROR_PARAM;
+    }
+
+    result = edit_load(&e, archive);
+    if (result != ZLITE_OK) {
+        return result;
+    }
+
+    total = zlite_name_index_select(&e.names, patterns, num_patterns, e.deleted, &unmatched);
+    if (total == 0) {
+        printf("Nothing to delete\n");
+        edit_free(&e);
+        return unmatched > 0 ? ZLITE_ERROR_FILE : ZLITE_OK;
+    }
+
+    printf("Deleting from archive: %s\n\n", zlite_archive_get_path(archive));
+    assign_heirs(&e);
+    for (i = 0; i < e.index.count; i++) {
+        if (e.deleted[i]) {
+            printf("  %s [deleted]\n", e.index.entries[i].path);
+            if (e.heir[i] != NO_ENTRY) {
+                printf("  %s [now holds the data]\n", entry_path(&e, e.heir[i]));
+            }
+        }
+    }
+
+    result = edit_write(&e, archive, options);
+    if (result == ZLITE_OK) {
+        printf("Deleted %u entries\n", total);
+    }
+    edit_free(&e);
+
+    if (result == ZLITE_OK && unmatched > 0) {
+        result = ZLITE_ERROR_FILE;
+    }
+    return result;
+}
+
+/* Strip "./" in front and '/' at the end, as entry paths have neither */
+static void normalize_path(const char *src, char *dst, size_t size) {
+    size_t len;
+
+    while (src[0] == '.' && src[1] == '/') {
+        src += 2;
+    }
+    snprintf(dst, size, "%s", src);
+    len = strlen(dst);
+    while (len > 0 && dst[len - 1] == '/') {
+        dst[--len] = '\0';
+    }
+}
+
+/* Renamed paths must not meet each other or a path left as it is; the
+ * later entry would overwrite the earlier one on extraction */
+static int check_new_paths(const Edit *e) {
+    ZliteNameIndex ni;
+    const char **paths;
+    uint32_t count = e->index.count;
+    uint32_t i;
+    int result;
+
+    paths = (const char **)malloc((count ? count : 1) * sizeof(char *));
+    if (!paths) {
+        return ZLITE_ERROR_MEMORY;
+    }
+    for (i = 0; i < count; i++) {
+        paths[i] = entry_path(e, i);
+    }
+
+    result = zlite_name_index_init(&ni, paths, NULL, count);
+    for (i = 0; result == ZLITE_OK && i < count; i++) {
+        uint32_t j = zlite_name_index_find(&ni, paths[i]);
+
+        if (j != i && j < count && (e->new_paths[i] || e->new_paths[j])) {
+            fprintf(stderr, "Error: '%s' would exist twice in the archive\n", paths[i]);
+            result = ZLITE_ERROR_PARAM;
+        }
+    }
+
+    zlite_name_index_free(&ni);
+    free(paths);
+    return result;
+}
+
+/* A new name must be relative and stay below the archive root */
+static int valid_new_name(const char *name) {
+    const char *p = name;
+
+    if (name[0] == '\0' || name[0] == '/') {
+        return 0;
+    }
+    while (*p) {
+        size_t len = strcspn(p, "/");
+
+        if (len == 2 && p[0] == '.' && p[1] == '.') {
+            return 0;
+        }
+        p += len;
+        if (*p == '/') {
+            p++;
+        }
+    }
+    return 1;
+}
+
+int zlite_rename_files(ZliteArchive *archive, char **names, int num_names,
+                       const ZliteCompressOptions *options) {
+    Edit e;
+    uint32_t total = 0;
+    int unmatched = 0;
+    int k;
+    uint32_t i;
+    int result;
+
+    if (num_names == 0 || num_names % 2 != 0) {
+        fprintf(stderr, "Error: Rename needs pairs of old and new names\n");
+        return ZLITE_ERROR_PARAM;
+    }
+    for (k = 1; k < num_names; k += 2) {
+        char new_name[PATH_MAX];
+
+        normalize_path(names[k], new_name, sizeof(new_name));
+        if (!valid_new_name(new_name)) {
+            fprintf(stderr, "Error: Invalid new name '%s'\n", names[k]);
+            return ZLITE_ERROR_PARAM;
+        }
+    }
+
+    result = edit_load(&e, archive);
+    if (result != ZLITE_OK) {
+        return result;
+    }
+
+    /* An old name renames the entry itself and everything below it; the
+     * first pair that matches an entry wins */
+    for (k = 0; k < num_names && result == ZLITE_OK; k += 2) {
+        char old_name[PATH_MAX];
+        char new_name[PATH_MAX];
+        size_t old_len;
+        uint32_t matches = 0;
+
+        normalize_path(names[k], old_name, sizeof(old_name));
+        normalize_path(names[k + 1], new_name, sizeof(new_name));
+        old_len = strlen(old_name);
+
+        for (i = 0; i < e.index.count; i++) {
+            const char *path = e.index.entries[i].path;
+            size_t size;
+
+            if (strncmp(path, old_name, old_len) != 0 ||
+                (path[old_len] != '\0' && path[old_len] != '/')) {
+                continue;
+            }
+            matches++;
+            if (e.new_paths[i]) {
+                continue;
+            }
+
+            size = strlen(new_name) + strlen(path + old_len) + 1;
+            e.new_paths[i] = (char *)malloc(size);
+            if (!e.new_paths[i]) {
+                result = ZLITE_ERROR_MEMORY;
+                break;
+            }
+            snprintf(e.new_paths[i], size, "%s%s", new_name, path + old_len);
+            total++;
+        }
+
+        if (matches == 0) {
+            fprintf(stderr, "Warning: No files matching '%s'\n", names[k]);
+            unmatched++;
+        }
+    }
+
+    if (result == ZLITE_OK && total == 0) {
+        printf("Nothing to rename\n");
+        edit_free(&e);
+        return unmatched > 0 ? ZLITE_ERROR_FILE : ZLITE_OK;
+    }
+
+    if (result == ZLITE_OK) {
+        result = check_new_paths(&e);
+    }
+    if (result == ZLITE_OK) {
+        printf("Renaming in archive: %s\n\n", zlite_archive_get_path(archive));
+        for (i = 0; i < e.index.count; i++) {
+            if (e.new_paths[i]) {
+                printf("  %s -> %s\n", e.index.entries[i].path, e.new_paths[i]);
+            }
+        }
+        result = edit_write(&e, archive, options);
+    }
+    if (result == ZLITE_OK) {
+        printf("Renamed %u entries\n", total);
+    }
+    edit_free(&e);
+
+    if (result == ZLITE_OK && unmatched > 0) {
+        result = ZLITE_ERROR_FILE;
+    }
+    return result;
+}
@@ -1,3 +1,8 @@
+/* d_type in struct dirent is not part of POSIX */
+#ifndef _DEFAULT_SOURCE
+#define _DEFAULT_SOURCE
+#endif
+
 #include "../include/7zlite.h"
 #include "../include/compat.h"
 #include <stdio.h>
@@ -13,147 +18,516 @@
 #else
     #include <fnmatch.h>
     #include <dirent.h>
+    #include <fcntl.h>
+    #include <unistd.h>
     #include <sys/stat.h>
 #endif
 
-typedef struct {
-    ZliteFileInfo *files;
-    int capacity;
-    int count;
-} FileList;
+#include "Threads.h"
+
+/* ========================================================================
+ * File list storage
+ *
+ * Entries are stored column-wise. A path is kept as its last component
+ * plus the index of the directory entry it was found in, so a prefix is
+ * stored once however many entries share it. Names and link targets are
+ * appended to a single string arena, and freeing the list is a handful of
+ * free() calls however many entries it holds.
+ * ======================================================================== */
 
-static FileList* filelist_create(void) {
-    FileList *list = (FileList *)malloc(sizeof(FileList));
-    if (!list) {
-        return NULL;
+static int list_reserve(ZliteFileList *list, uint32_t needed) {
+    uint32_t capacity = list->capacity ? list->capacity : 1024;
+    
+    if (needed <= list->capacity) {
+        return 0;
+    }
+    while (capacity < needed) {
+        capacity *= 2;
     }
     
-    list->capacity = 1024;
-    list->count = 0;
-    list->files = (ZliteFileInfo *)calloc(list->capacity, sizeof(ZliteFileInfo));
+#define GROW_COLUMN(col) do { \
+        void *grown = realloc(list->col, capacity * sizeof(*list->col)); \
+        if (!grown) { \
+            return -1; \
+        } \
+        list->col = grown; \
+    } while (0)
     
-    if (!list->files) {
-        free(list);
-        return NULL;
-    }
+    GROW_COLUMN(parent);
+    GROW_COLUMN(name);
+    GROW_COLUMN(target);
+    GROW_COLUMN(size);
+    GROW_COLUMN(crc);
+    GROW_COLUMN(type);
+    GROW_COLUMN(is_hardlink);
+    GROW_COLUMN(coder);
+    GROW_COLUMN(attrib);
+    GROW_COLUMN(mtime);
+    GROW_COLUMN(inode);
+#undef GROW_COLUMN
     
-    return list;
+    list->capacity = capacity;
+    return 0;
 }
 
-static void filelist_free(FileList *list) {
-    int i;
+/* Copy str into the string arena */
+static int list_string(ZliteFileList *list, const char *str, uint32_t *offset) {
+    size_t len = strlen(str) + 1;
     
-    if (!list) {
-        return;
+    if (list->strings_size + len > list->strings_capacity) {
+        size_t capacity = list->strings_capacity ? list->strings_capacity : ((size_t)64 << 10);
+        char *grown;
+        
+        while (capacity < list->strings_size + len) {
+            capacity *= 2;
+        }
+        /* Offsets are 32-bit */
+        if (capacity > ZLITE_NO_STRING) {
+            capacity = ZLITE_NO_STRING;
+            if (list->strings_size + len > capacity) {
+                return -1;
+            }
+        }
+        grown = (char *)realloc(list->strings, capacity);
+        if (!grown) {
+            return -1;
+        }
+        list->strings = grown;
+        list->strings_capacity = capacity;
     }
     
-    for (i = 0; i < list->count; i++) {
-        if (list->files[i].path) {
-            free(list->files[i].path);
+    memcpy(list->strings + list->strings_size, str, len);
+    *offset = (uint32_t)list->strings_size;
+    list->strings_size += len;
+    return 0;
+}
+
+static int is_separator(char c) {
+    return c == '/' || c == PATH_SEPARATOR;
+}
+
+size_t zlite_file_list_path(const ZliteFileList *list, uint32_t index, char *buf, size_t size) {
+    size_t len = 0;
+    size_t pos;
+    uint32_t i;
+    
+    /* Measure first, then fill from the end */
+    for (i = index; i != ZLITE_NO_PARENT; i = list->parent[i]) {
+        const char *name = list->strings + list->name[i];
+        len += strlen(name);
+        if (list->parent[i] != ZLITE_NO_PARENT) {
+            const char *up = list->strings + list->name[list->parent[i]];
+            size_t up_len = strlen(up);
+            len += !(up_len > 0 && is_separator(up[up_len - 1]));
         }
-        if (list->files[i].link_target) {
-            free(list->files[i].link_target);
+    }
+    if (len + 1 > size) {
+        return 0;
+    }
+    
+    pos = len;
+    buf[pos] = '\0';
+    for (i = index; i != ZLITE_NO_PARENT; i = list->parent[i]) {
+        const char *name = list->strings + list->name[i];
+        size_t name_len = strlen(name);
+        
+        pos -= name_len;
+        memcpy(buf + pos, name, name_len);
+        if (list->parent[i] != ZLITE_NO_PARENT) {
+            const char *up = list->strings + list->name[list->parent[i]];
+            size_t up_len = strlen(up);
+            if (!(up_len > 0 && is_separator(up[up_len - 1]))) {
+                buf[--pos] = PATH_SEPARATOR;
+            }
         }
     }
+    return len;
+}
+
+const char* zlite_file_list_target(const ZliteFileList *list, uint32_t index) {
+    return list->target[index] == ZLITE_NO_STRING ? NULL : list->strings + list->target[index];
+}
+
+int zlite_file_list_set_target(ZliteFileList *list, uint32_t index, const char *target) {
+    uint32_t offset = ZLITE_NO_STRING;
     
-    free(list->files);
-    free(list);
+    if (target && list_string(list, target, &offset) != 0) {
+        return ZLITE_ERROR_MEMORY;
+    }
+    list->target[index] = offset;
+    return ZLITE_OK;
 }
 
-static int filelist_add(FileList *list, const char *path, const ZliteFileInfo *info) {
-    if (list->count >= list->capacity) {
-        list->capacity *= 2;
-        list->files = (ZliteFileInfo *)realloc(list->files, 
-                                              list->capacity * sizeof(ZliteFileInfo));
-        if (!list->files) {
-            return -1;
-        }
+void zlite_free_file_list(ZliteFileList *list) {
+    free(list->parent);
+    free(list->name);
+    free(list->target);
+    free(list->size);
+    free(list->crc);
+    free(list->type);
+    free(list->is_hardlink);
+    free(list->coder);
+    free(list->attrib);
+    free(list->mtime);
+    free(list->inode);
+    free(list->strings);
+    memset(list, 0, sizeof(*list));
+}
+
+/* Append the entry `name` found in directory entry `parent` (or a command
+ * line path when parent is ZLITE_NO_PARENT). info->link_target is copied.
+ * Later paths of a hard-linked inode become references to the first path
+ * seen for it. Returns the new index, or ZLITE_NO_PARENT on failure. */
+static uint32_t filelist_push(ZliteFileList *list, uint32_t parent, const char *name,
+                              const ZliteFileInfo *info, HardLinkTable *link_table) {
+    uint32_t i = list->count;
+    int type = info->file_type;
+    int is_hardlink = info->is_hardlink;
+    const char *target = info->link_target;
+    
+    if (list_reserve(list, i + 1) != 0 || list_string(list, name, &list->name[i]) != 0) {
+        return ZLITE_NO_PARENT;
     }
+    list->parent[i] = parent;
     
-    list->files[list->count].path = strdup(path);
-    list->files[list->count].size = info->size;
-    list->files[list->count].attributes = info->attributes;
-    list->files[list->count].file_type = info->file_type;
-    list->files[list->count].is_hardlink = info->is_hardlink;
-    list->files[list->count].inode = info->inode;
-    list->files[list->count].device = info->device;
-    list->files[list->count].crc = 0;
-    list->files[list->count].compressed_size = 0;
-    
-    if (info->link_target) {
-        list->files[list->count].link_target = strdup(info->link_target);
-    } else {
-        list->files[list->count].link_target = NULL;
+    if (is_hardlink) {
+        char path[PATH_MAX];
+        struct HardLinkEntry *entry = NULL;
+        
+        if (zlite_file_list_path(list, i, path, sizeof(path)) > 0) {
+            entry = zlite_link_table_find_or_add(link_table, path, info->inode, info->device);
+        }
+        if (entry && entry->ref_count > 1 && strcmp(entry->first_path, path) != 0) {
+            /* This is a duplicate hard link, just record it */
+            target = entry->first_path;
+        } else {
+            /* First occurrence of hard link, treat as regular file */
+            type = ZLITE_FILETYPE_REGULAR;
+            is_hardlink = 0;
+        }
     }
     
+    list->target[i] = ZLITE_NO_STRING;
+    if (target && list_string(list, target, &list->target[i]) != 0) {
+        return ZLITE_NO_PARENT;
+    }
+    /* Only the root arguments of a walk are stat'ed as directories, so
+     * no directory keeps the size its file system reports */
+    list->size[i] = type == ZLITE_FILETYPE_DIR ? 0 : info->size;
+    list->crc[i] = 0;
+    list->type[i] = (uint8_t)type;
+    list->is_hardlink[i] = (uint8_t)is_hardlink;
+    list->coder[i] = 0;
+    list->attrib[i] = info->attributes;
+    list->mtime[i] = info->mtime;
+    list->inode[i] = info->inode;
     list->count++;
     
-    return 0;
+    return i;
 }
 
 static int is_pattern(const char *str) {
     return (strchr(str, '*') != NULL || strchr(str, '?') != NULL);
 }
 
-static int filelist_add_recursive(FileList *list, const char *path, 
-                                   HardLinkTable *link_table) {
 #ifdef ZLITE_USE_POSIX
+/* ========================================================================
+ * Parallel directory walk
+ *
+ * Directories are read by a pool of threads that take them from a shared
+ * stack, so slow metadata lookups (network file systems, cold caches)
+ * overlap. Each directory is read through its own fd: entries are looked
+ * up with zlite_stat_at() relative to it, and d_type lets subdirectories
+ * skip the stat entirely. The results form a tree that is flattened afterwards
+ * in depth-first order with names sorted, which makes the file order (and
+ * which path of a hard-linked inode is stored in full) deterministic.
+ * ======================================================================== */
+
+#define ZLITE_WALK_THREADS_MAX 16
+
+typedef struct WalkNode WalkNode;
+
+typedef struct {
+    ZliteFileInfo info;         /* link_target is copied to the list */
+    const char *name;           /* points into the node's name buffer */
+    WalkNode *child;            /* contents of a readable directory */
+} WalkEntry;
+
+struct WalkNode {
+    char *path;                 /* owned, except for the root */
+    WalkEntry *entries;
+    int count;
+    int capacity;
+    char *names;                /* entry names, back to back */
+    size_t names_size;
+    size_t names_capacity;
+    WalkNode *next;             /* link in the work stack */
+};
+
+typedef struct {
+    WalkNode *stack;
+    int pending;                /* directories queued or being read */
+    int failed;                 /* out of memory */
+    CCriticalSection cs;
+    CAutoResetEvent wake;
+} Walker;
+
+static void walker_push(Walker *w, WalkNode *node) {
+    CriticalSection_Enter(&w->cs);
+    node->next = w->stack;
+    w->stack = node;
+    w->pending++;
+    CriticalSection_Leave(&w->cs);
+    Event_Set(&w->wake);
+}
+
+static int cmp_walk_entry(const void *a, const void *b) {
+    return strcmp(((const WalkEntry *)a)->name, ((const WalkEntry *)b)->name);
+}
+
+/* Read one directory into node, queueing its subdirectories */
+static void walk_read_dir(Walker *w, WalkNode *node) {
+    size_t base_len = strlen(node->path);
+    int slash = base_len > 0 && node->path[base_len - 1] == '/';
+    struct dirent *de;
     DIR *dir;
-    struct dirent *entry;
-    struct stat st;
-    char full_path[PATH_MAX];
-    ZliteFileInfo info;
+    int fd;
+    int i;
     
-    if (lstat(path, &st) != 0) {
-        return -1;
+    fd = open(node->path, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    if (fd < 0) {
+        return;
+    }
+    dir = fdopendir(fd);
+    if (!dir) {
+        close(fd);
+        return;
     }
     
-    if (zlite_detect_links(path, &info) != 0) {
-        return -1;
+    while ((de = readdir(dir)) != NULL) {
+        size_t name_len = strlen(de->d_name);
+        WalkEntry *e;
+        
+        if (strcmp(de->d_name, ".") == 0 || strcmp(de->d_name, "..") == 0) {
+            continue;
+        }
+        
+        if (node->count >= node->capacity) {
+            int capacity = node->capacity ? node->capacity * 2 : 16;
+            WalkEntry *entries = (WalkEntry *)realloc(node->entries,
+                                                      capacity * sizeof(WalkEntry));
+            if (!entries) {
+                w->failed = 1;
+                break;
+            }
+            node->entries = entries;
+            node->capacity = capacity;
+        }
+        if (node->names_size + name_len + 1 > node->names_capacity) {
+            size_t capacity = node->names_capacity ? node->names_capacity * 2 : 256;
+            char *names;
+            
+            while (capacity < node->names_size + name_len + 1) {
+                capacity *= 2;
+            }
+            names = (char *)realloc(node->names, capacity);
+            if (!names) {
+                w->failed = 1;
+                break;
+            }
+            node->names = names;
+            node->names_capacity = capacity;
+        }
+        
+        e = &node->entries[node->count];
+        memset(e, 0, sizeof(*e));
+        
+#ifdef DT_DIR
+        if (de->d_type == DT_DIR) {
+            /* Directory contents are all we need from it */
+            e->info.file_type = ZLITE_FILETYPE_DIR;
+            e->info.attributes = S_IFDIR;
+        } else
+#endif
+        if (zlite_stat_at(dirfd(dir), de->d_name, &e->info) != 0) {
+            continue;
+        }
+        
+        /* The buffer may still move, so keep the offset for now */
+        e->name = (const char *)(size_t)node->names_size;
+        memcpy(node->names + node->names_size, de->d_name, name_len + 1);
+        node->names_size += name_len + 1;
+        
+        if (e->info.file_type == ZLITE_FILETYPE_DIR) {
+            /* Only directories need their full path, to be opened */
+            e->child = (WalkNode *)calloc(1, sizeof(WalkNode));
+            if (e->child) {
+                e->child->path = (char *)malloc(base_len + !slash + name_len + 1);
+            }
+            if (!e->child || !e->child->path) {
+                free(e->child);
+                w->failed = 1;
+                break;
+            }
+            memcpy(e->child->path, node->path, base_len);
+            if (!slash) {
+                e->child->path[base_len] = '/';
+            }
+            memcpy(e->child->path + base_len + !slash, de->d_name, name_len + 1);
+            walker_push(w, e->child);
+        }
+        node->count++;
     }
+    closedir(dir);
     
-    info.size = st.st_size;
+    for (i = 0; i < node->count; i++) {
+        node->entries[i].name = node->names + (size_t)node->entries[i].name;
+    }
+    qsort(node->entries, node->count, sizeof(WalkEntry), cmp_walk_entry);
+}
+
+static THREAD_FUNC_DECL walk_worker(void *arg) {
+    Walker *w = (Walker *)arg;
     
-    /* Check if this is a hard link we've already processed */
-    if (info.is_hardlink) {
-        struct HardLinkEntry *entry = zlite_link_table_find_or_add(link_table, path, 
-                                                             info.inode, info.device);
-        if (entry && entry->ref_count > 1 && strcmp(entry->first_path, path) != 0) {
-            /* This is a duplicate hard link, just record it */
-            info.link_target = strdup(entry->first_path);  /* Store reference to first file */
-            filelist_add(list, path, &info);
-            return 0;
+    for (;;) {
+        WalkNode *node;
+        int more;
+        
+        CriticalSection_Enter(&w->cs);
+        while (!w->stack && w->pending > 0) {
+            CriticalSection_Leave(&w->cs);
+            Event_Wait(&w->wake);
+            CriticalSection_Enter(&w->cs);
+        }
+        node = w->stack;
+        if (node) {
+            w->stack = node->next;
+        }
+        more = w->stack != NULL || w->pending == 0;
+        CriticalSection_Leave(&w->cs);
+        
+        /* Pass the wakeup on: there is more to take, or it is time to exit */
+        if (more) {
+            Event_Set(&w->wake);
+        }
+        if (!node) {
+            break;
+        }
+        
+        if (!w->failed) {
+            walk_read_dir(w, node);
+        }
+        
+        CriticalSection_Enter(&w->cs);
+        more = --w->pending == 0;
+        CriticalSection_Leave(&w->cs);
+        if (more) {
+            Event_Set(&w->wake);
         }
-        /* First occurrence of hard link, treat as regular file */
-        info.file_type = ZLITE_FILETYPE_REGULAR;
-        info.is_hardlink = 0;
     }
     
-    if (filelist_add(list, path, &info) != 0) {
-                return -1;
-            }
+    return THREAD_FUNC_RET_ZERO;
+}
+
+/* Move the walked tree, found below list entry `parent`, into the list in
+ * depth-first order, releasing it as it goes */
+static int walk_emit(ZliteFileList *list, uint32_t parent, WalkNode *node,
+                     HardLinkTable *link_table, int ok) {
+    int i;
+    
+    for (i = 0; i < node->count; i++) {
+        WalkEntry *e = &node->entries[i];
+        uint32_t index = ZLITE_NO_PARENT;
         
-        /* If it's a directory, recurse */
-        if (S_ISDIR(st.st_mode)) {
-            dir = opendir(path);
-            if (!dir) {
-                return -1;
-            }
-            
-            while ((entry = readdir(dir)) != NULL) {
-                if (strcmp(entry->d_name, ".") == 0 || strcmp(entry->d_name, "..") == 0) {
-                    continue;
-                }
-                
-                /* Build full path, avoiding double slashes */
-                if (path[strlen(path)-1] == '/') {
-                    snprintf(full_path, sizeof(full_path), "%s%s", path, entry->d_name);
-                } else {
-                    snprintf(full_path, sizeof(full_path), "%s/%s", path, entry->d_name);
-                }
-                filelist_add_recursive(list, full_path, link_table);
-            }        
-        closedir(dir);
+        if (ok) {
+            index = filelist_push(list, parent, e->name, &e->info, link_table);
+            ok = index != ZLITE_NO_PARENT;
+        }
+        free(e->info.link_target);
+        if (e->child) {
+            ok = walk_emit(list, index, e->child, link_table, ok);
+            free(e->child->path);
+            free(e->child);
+        }
+    }
+    free(node->entries);
+    free(node->names);
+    return ok;
+}
+
+/* Read the contents of directory `path`, list entry `index`, with a pool
+ * of threads */
+static int walk_tree(ZliteFileList *list, uint32_t index, const char *path,
+                     HardLinkTable *link_table) {
+    CThread threads[ZLITE_WALK_THREADS_MAX];
+    int num_threads = zlite_get_cpu_count() * 2;
+    WalkNode root;
+    Walker w;
+    int i;
+    
+    /* Metadata lookups mostly wait on I/O, so use more threads than CPUs */
+    if (num_threads > ZLITE_WALK_THREADS_MAX) {
+        num_threads = ZLITE_WALK_THREADS_MAX;
+    }
+    
+    memset(&root, 0, sizeof(root));
+    root.path = (char *)path;
+    memset(&w, 0, sizeof(w));
+    Event_Construct(&w.wake);
+    if (CriticalSection_Init(&w.cs) != 0) {
+        return -1;
+    }
+    if (AutoResetEvent_CreateNotSignaled(&w.wake) != 0) {
+        CriticalSection_Delete(&w.cs);
+        return -1;
+    }
+    
+    walker_push(&w, &root);
+    
+    /* The calling thread works too, so failing to start helpers is fine */
+    for (i = 0; i < num_threads - 1; i++) {
+        Thread_CONSTRUCT(&threads[i]);
+        if (Thread_Create(&threads[i], walk_worker, &w) != 0) {
+            break;
+        }
+    }
+    num_threads = i;
+    walk_worker(&w);
+    for (i = 0; i < num_threads; i++) {
+        Thread_Wait_Close(&threads[i]);
+    }
+    
+    Event_Close(&w.wake);
+    CriticalSection_Delete(&w.cs);
+    
+    return walk_emit(list, index, &root, link_table, !w.failed) ? 0 : -1;
+}
+#endif
+
+/* Add `name` (the whole path for a command line argument) found below
+ * list entry `parent`, and everything under it */
+static int filelist_add_recursive(ZliteFileList *list, uint32_t parent, const char *name,
+                                  const char *path, HardLinkTable *link_table) {
+#ifdef ZLITE_USE_POSIX
+    ZliteFileInfo info;
+    uint32_t index;
+    
+    (void)name;
+    memset(&info, 0, sizeof(info));
+    if (zlite_stat_at(AT_FDCWD, path, &info) != 0) {
+        return -1;
+    }
+    
+    /* Duplicate hard links only keep a reference to the first path */
+    index = filelist_push(list, parent, path, &info, link_table);
+    free(info.link_target);
+    if (index == ZLITE_NO_PARENT) {
+        return -1;
+    }
+    
+    /* If it's a directory, read it in parallel */
+    if (info.file_type == ZLITE_FILETYPE_DIR) {
+        return walk_tree(list, index, path, link_table);
     }
     
     return 0;
@@ -164,6 +538,7 @@ static int filelist_add_recursive(FileList *list, const char *path,
     WIN32_FIND_DATAW findData;
     wchar_t wpath[MAX_PATH];
     ZliteFileInfo info;
+    uint32_t index;
     char full_path[PATH_MAX];
     char search_path[PATH_MAX];
     wchar_t wsearch_path[MAX_PATH];
@@ -177,30 +552,22 @@ static int filelist_add_recursive(FileList *list, const char *path,
     }
 
     /* Detect links */
+    memset(&info, 0, sizeof(info));
     if (zlite_detect_links(path, &info) != 0) {
         return -1;
     }
 
     info.size = ((uint64_t)data.nFileSizeHigh << 32) | data.nFileSizeLow;
 
-    /* Check if this is a hard link we've already processed */
-    if (info.is_hardlink) {
-        struct HardLinkEntry *entry = zlite_link_table_find_or_add(link_table, path,
-                                                             info.inode, info.device);
-        if (entry && entry->ref_count > 1 && strcmp(entry->first_path, path) != 0) {
-            /* This is a duplicate hard link, just record it */
-            info.link_target = strdup(entry->first_path);
-            filelist_add(list, path, &info);
-            return 0;
-        }
-        /* First occurrence of hard link, treat as regular file */
-        info.file_type = ZLITE_FILETYPE_REGULAR;
-        info.is_hardlink = 0;
-    }
-
-    if (filelist_add(list, path, &info) != 0) {
+    /* Duplicate hard links only keep a reference to the first path */
+    index = filelist_push(list, parent, name, &info, link_table);
+    free(info.link_target);
+    if (index == ZLITE_NO_PARENT) {
         return -1;
     }
+    if (info.is_hardlink) {
+        return 0;
+    }
 
     /* If it's a directory, recurse */
     if (info.file_type == ZLITE_FILETYPE_DIR) {
@@ -227,7 +594,7 @@ static int filelist_add_recursive(FileList *list, const char *path,
             /* Build full path */
             snprintf(full_path, sizeof(full_path), "%s\\%s", path, filename);
 
-            if (filelist_add_recursive(list, full_path, link_table) != 0) {
+            if (filelist_add_recursive(list, index, filename, full_path, link_table) != 0) {
                 FindClose(hFind);
                 return -1;
             }
@@ -243,20 +610,14 @@ static int filelist_add_recursive(FileList *list, const char *path,
 #endif
 }
 
-int zlite_collect_files(char **files, int num_files, ZliteFileInfo **result, 
-                        int *result_count) {
-    FileList *list;
+int zlite_collect_files(char **files, int num_files, ZliteFileList *list) {
     HardLinkTable *link_table;
     int i;
     
-    list = filelist_create();
-    if (!list) {
-        return ZLITE_ERROR_MEMORY;
-    }
+    memset(list, 0, sizeof(*list));
     
     link_table = zlite_link_table_create();
     if (!link_table) {
-        filelist_free(list);
         return ZLITE_ERROR_MEMORY;
     }
     
@@ -266,38 +627,14 @@ int zlite_collect_files(char **files, int num_files, ZliteFileInfo **result,
             /* For now, just treat as regular path */
         }
         
-        if (filelist_add_recursive(list, files[i], link_table) != 0) {
-            filelist_free(list);
+        if (filelist_add_recursive(list, ZLITE_NO_PARENT, files[i], files[i], link_table) != 0) {
+            zlite_free_file_list(list);
             zlite_link_table_free(link_table);
             return ZLITE_ERROR_FILE;
         }
     }
     
-    *result = list->files;
-    *result_count = list->count;
-    
-    /* Free the list structure but keep the files array */
-    free(list);
     zlite_link_table_free(link_table);
     
     return ZLITE_OK;
 }
-
-void zlite_free_file_list(ZliteFileInfo *files, int count) {
-    int i;
-    
-    if (!files) {
-        return;
-    }
-    
-    for (i = 0; i < count; i++) {
-        if (files[i].path) {
-            free(files[i].path);
-        }
-        if (files[i].link_target) {
-            free(files[i].link_target);
-        }
-    }
-    
-    free(files);
-}
\ No newline at end of file
@@ -0,0 +1,515 @@
+#include "../include/7zlite.h"
+#include "../include/compat.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#ifndef PATH_MAX
+#define PATH_MAX 4096
+#endif
+
+#include "Alloc.h"
+#include "Bra.h"
+#include "Delta.h"
+#include "LzmaEnc.h"
+#include "Ppmd7.h"
+
+/* Filter and method selection for the add path.
+ *
+ * Executables compress better once the relative branch targets in their
+ * code are made absolute, and sampled audio once it is delta coded. The
+ * filter is chosen from the file header (ELF, PE, Mach-O, WAV) and stored
+ * in the record's type word so extraction can apply the inverse. Text,
+ * known by its extension or by a header free of binary bytes, goes to
+ * PPMd when PPMd beats LZMA on a sample of it. Data that is already
+ * compressed, known by its magic number or by a sample that a fast LZMA
+ * pass cannot shrink, is stored. */
+
+#define FILTER_MIN_SIZE   ((uint64_t)1 << 12)   /* smaller files are not sniffed */
+#define FILTER_HEAD_SIZE  1024                  /* enough for the PE header */
+#define PROBE_MIN_SIZE    ((uint64_t)1 << 16)   /* smaller files are not probed */
+#define PROBE_SAMPLE_SIZE ((size_t)1 << 15)     /* sampled at the start and the middle */
+#define PROBE_MIN_GAIN    3                     /* percent the sample must shrink by */
+
+static uint32_t get16(const uint8_t *p, int big_endian) {
+    return big_endian ? ((uint32_t)p[0] << 8) | p[1] : ((uint32_t)p[1] << 8) | p[0];
+}
+
+static uint32_t get32(const uint8_t *p, int big_endian) {
+    return big_endian ? ((uint32_t)get16(p, 1) << 16) | get16(p + 2, 1)
+                      : ((uint32_t)get16(p + 2, 0) << 16) | get16(p, 0);
+}
+
+static uint32_t filter_flags(int filter, unsigned arg) {
+    return ((uint32_t)filter << ZLITE_FILTER_SHIFT) | ((uint32_t)arg << ZLITE_FILTER_ARG_SHIFT);
+}
+
+static uint32_t detect_elf(const uint8_t *head, size_t size) {
+    int big_endian;
+
+    if (size < 20 || head[5] < 1 || head[5] > 2) {
+        return 0;
+    }
+    big_endian = head[5] == 2;
+
+    switch (get16(head + 18, big_endian)) {
+        case 3:     /* i386 */
+        case 62:    /* x86-64 */
+            return filter_flags(ZLITE_FILTER_X86, 0);
+        case 183:   /* AArch64 */
+            return filter_flags(ZLITE_FILTER_ARM64, 0);
+        case 40:    /* ARM */
+            return big_endian ? 0 : filter_flags(ZLITE_FILTER_ARM, 0);
+        case 243:   /* RISC-V */
+            return filter_flags(ZLITE_FILTER_RISCV, 0);
+        case 20:    /* PowerPC */
+        case 21:    /* PowerPC64 */
+            return big_endian ? filter_flags(ZLITE_FILTER_PPC, 0) : 0;
+        case 2:     /* SPARC */
+        case 18:    /* SPARC32PLUS */
+        case 43:    /* SPARC V9 */
+            return big_endian ? filter_flags(ZLITE_FILTER_SPARC, 0) : 0;
+        default:
+            return 0;
+    }
+}
+
+static uint32_t detect_pe(const uint8_t *head, size_t size) {
+    uint32_t pe;
+
+    if (size < 0x40) {
+        return 0;
+    }
+    pe = get32(head + 0x3C, 0);
+    if (pe > size - 6 || memcmp(head + pe, "PE\0\0", 4) != 0) {
+        return 0;
+    }
+
+    switch (get16(head + pe + 4, 0)) {
+        case 0x014C:    /* i386 */
+        case 0x8664:    /* AMD64 */
+            return filter_flags(ZLITE_FILTER_X86, 0);
+        case 0xAA64:    /* ARM64 */
+            return filter_flags(ZLITE_FILTER_ARM64, 0);
+        case 0x01C0:    /* ARM */
+            return filter_flags(ZLITE_FILTER_ARM, 0);
+        case 0x01C2:    /* Thumb */
+        case 0x01C4:    /* Thumb-2 */
+            return filter_flags(ZLITE_FILTER_ARMT, 0);
+        default:
+            return 0;
+    }
+}
+
+static uint32_t detect_macho(const uint8_t *head, size_t size) {
+    int big_endian;
+
+    if (size < 8) {
+        return 0;
+    }
+    big_endian = head[0] == 0xFE;
+
+    switch (get32(head + 4, big_endian)) {
+        case 7:             /* x86 */
+        case 0x01000007:    /* x86-64 */
+            return filter_flags(ZLITE_FILTER_X86, 0);
+        case 0x0100000C:    /* arm64 */
+            return filter_flags(ZLITE_FILTER_ARM64, 0);
+        case 12:            /* arm */
+            return filter_flags(ZLITE_FILTER_ARM, 0);
+        case 18:            /* ppc */
+            return big_endian ? filter_flags(ZLITE_FILTER_PPC, 0) : 0;
+        default:
+            return 0;
+    }
+}
+
+/* Uncompressed PCM: delta over one sample frame */
+static uint32_t detect_wav(const uint8_t *head, size_t size) {
+    uint32_t block_align;
+
+    if (size < 36 || memcmp(head + 8, "WAVEfmt ", 8) != 0 || get16(head + 20, 0) != 1) {
+        return 0;
+    }
+    block_align = get16(head + 32, 0);
+    if (block_align < 2 || block_align > 256) {
+        return 0;
+    }
+    return filter_flags(ZLITE_FILTER_DELTA, block_align - 1);
+}
+
+uint32_t zlite_filter_detect(const uint8_t *head, size_t size) {
+    static const uint8_t macho[][4] = {
+        { 0xCE, 0xFA, 0xED, 0xFE }, { 0xCF, 0xFA, 0xED, 0xFE },
+        { 0xFE, 0xED, 0xFA, 0xCE }, { 0xFE, 0xED, 0xFA, 0xCF }
+    };
+    int i;
+
+    if (size < 4) {
+        return 0;
+    }
+    if (memcmp(head, "\177ELF", 4) == 0) {
+        return detect_elf(head, size);
+    }
+    if (head[0] == 'M' && head[1] == 'Z') {
+        return detect_pe(head, size);
+    }
+    if (memcmp(head, "RIFF", 4) == 0) {
+        return detect_wav(head, size);
+    }
+    for (i = 0; i < 4; i++) {
+        if (memcmp(head, macho[i], 4) == 0) {
+            return detect_macho(head, size);
+        }
+    }
+    return 0;
+}
+
+/* Formats that are compressed already */
+static int looks_compressed(const uint8_t *head, size_t size) {
+    static const struct {
+        const char *magic;
+        size_t len;
+    } formats[] = {
+        { "\x1F\x8B", 2 },              /* gzip */
+        { "PK\x03\x04", 4 },            /* zip, jar, docx, apk */
+        { "\x28\xB5\x2F\xFD", 4 },      /* zstd */
+        { "\xFD" "7zXZ\x00", 6 },       /* xz */
+        { "BZh", 3 },                   /* bzip2 */
+        { "7z\xBC\xAF\x27\x1C", 6 },    /* 7z */
+        { "Rar!\x1A\x07", 6 },          /* rar */
+        { "\x04\x22\x4D\x18", 4 },      /* lz4 */
+        { "\x89PNG", 4 },               /* png */
+        { "\xFF\xD8\xFF", 3 },          /* jpeg */
+        { "GIF8", 4 },                  /* gif */
+        { "OggS", 4 },                  /* ogg, opus */
+        { "fLaC", 4 },                  /* flac */
+        { "\x1A\x45\xDF\xA3", 4 }       /* matroska, webm */
+    };
+    size_t i;
+
+    for (i = 0; i < sizeof(formats) / sizeof(formats[0]); i++) {
+        if (size >= formats[i].len && memcmp(head, formats[i].magic, formats[i].len) == 0) {
+            return 1;
+        }
+    }
+    /* mp4, mov, heic: an ftyp box first */
+    return size >= 8 && memcmp(head + 4, "ftyp", 4) == 0;
+}
+
+/* Compress the sample with fast LZMA settings; 0 when it does not shrink
+ * by PROBE_MIN_GAIN percent. `dest` holds `size` bytes. */
+static int probe_compressible(const uint8_t *sample, size_t size, uint8_t *dest) {
+    CLzmaEncProps props;
+    Byte props_encoded[LZMA_PROPS_SIZE];
+    SizeT props_size = LZMA_PROPS_SIZE;
+    SizeT dest_len = size - size * PROBE_MIN_GAIN / 100;
+
+    LzmaEncProps_Init(&props);
+    props.level = 1;
+    props.dictSize = (UInt32)PROBE_SAMPLE_SIZE * 2;
+    props.numThreads = 1;
+    return LzmaEncode(dest, &dest_len, sample, size, &props, props_encoded, &props_size,
+                      0, NULL, &g_Alloc, &g_Alloc) == SZ_OK;
+}
+
+/* Read up to PROBE_SAMPLE_SIZE bytes from the start of the file into buf,
+ * and, for files worth probing, as much again from the middle */
+static size_t read_sample(FILE *fp, uint64_t size, int probe, uint8_t *buf, size_t *head) {
+    size_t n = fread(buf, 1, PROBE_SAMPLE_SIZE, fp);
+
+    *head = n;
+    if (probe && size >= PROBE_MIN_SIZE && n == PROBE_SAMPLE_SIZE &&
+        zlite_fseek(fp, (int64_t)(size / 2), SEEK_SET) == 0) {
+        n += fread(buf + n, 1, PROBE_SAMPLE_SIZE, fp);
+    }
+    return n;
+}
+
+/* PPMd model order and memory for the options, as 7-Zip picks them by
+ * level. The memory is cut down for small inputs, in powers of two so
+ * runs of similar files keep the cached model. */
+void zlite_ppmd_props(const ZliteCompressOptions *options, uint64_t size,
+                      unsigned *order, uint32_t *mem_size) {
+    static const unsigned orders[10] = { 3, 4, 4, 5, 5, 6, 8, 16, 24, 32 };
+    int level = options->level < 0 ? 0 : options->level > 9 ? 9 : options->level;
+    int i;
+
+    *order = options->ppmd_order > 0 ? (unsigned)options->ppmd_order : orders[level];
+    *mem_size = options->ppmd_mem_size > 0 ? options->ppmd_mem_size
+              : level >= 9 ? ((uint32_t)192 << 20) : ((uint32_t)1 << (level + 19));
+
+    for (i = 16; i < 32; i++) {
+        uint32_t m = (uint32_t)1 << i;
+        if (size <= m / 16) {
+            if (*mem_size > m) {
+                *mem_size = m;
+            }
+            break;
+        }
+    }
+}
+
+/* Counts the range coder's output instead of keeping it */
+typedef struct {
+    IByteOut vt;
+    size_t count;
+} ByteCounter;
+
+static void ByteCounter_Write(IByteOutPtr pp, Byte b) {
+    ByteCounter *p = Z7_CONTAINER_FROM_VTBL(pp, ByteCounter, vt);
+
+    (void)b;
+    p->count++;
+}
+
+/* Compress the sample with PPMd, then with LZMA at the options' level;
+ * 1 when PPMd comes out smaller. PPMd beats LZMA on prose and source
+ * code, but loses badly on repetitive text such as logs or tables of
+ * numbers. `dest` holds `size` bytes. */
+static int ppmd_wins(CPpmd7 *ppmd, unsigned order, const ZliteCompressOptions *options,
+                     const uint8_t *sample, size_t size, uint8_t *dest) {
+    ByteCounter counter;
+    CLzmaEncProps props;
+    Byte props_encoded[LZMA_PROPS_SIZE];
+    SizeT props_size = LZMA_PROPS_SIZE;
+    SizeT dest_len;
+
+    counter.vt.Write = ByteCounter_Write;
+    counter.count = 0;
+    ppmd->rc.enc.Stream = &counter.vt;
+    Ppmd7z_Init_RangeEnc(ppmd);
+    Ppmd7_Init(ppmd, order);
+    Ppmd7z_EncodeSymbols(ppmd, sample, sample + size);
+    Ppmd7z_Flush_RangeEnc(ppmd);
+
+    /* LZMA wins if it fits in what PPMd needed */
+    dest_len = counter.count < size ? counter.count : size;
+    LzmaEncProps_Init(&props);
+    props.level = options->level < 1 ? 1 : options->level > 9 ? 9 : options->level;
+    props.dictSize = (UInt32)PROBE_SAMPLE_SIZE * 2;
+    props.numThreads = 1;
+    return LzmaEncode(dest, &dest_len, sample, size, &props, props_encoded, &props_size,
+                      0, NULL, &g_Alloc, &g_Alloc) != SZ_OK;
+}
+
+static int has_text_extension(const char *name) {
+    static const char *const exts[] = {
+        "txt", "log", "md", "rst", "tex", "csv", "tsv", "json", "xml", "html", "htm",
+        "css", "svg", "yaml", "yml", "toml", "ini", "cfg", "conf", "properties",
+        "c", "h", "cc", "cpp", "cxx", "hh", "hpp", "hxx", "inl", "m", "mm",
+        "java", "kt", "go", "rs", "py", "rb", "pl", "pm", "php", "js", "ts",
+        "lua", "sh", "bash", "zsh", "sql", "asm", "s", "el", "vim", "swift",
+        "cmake", "mk", "am", "in", "ac", "m4", "diff", "patch", "po"
+    };
+    const char *dot = strrchr(name, '.');
+    size_t i;
+
+    if (!dot || dot == name) {
+        return 0;
+    }
+    for (i = 0; i < sizeof(exts) / sizeof(exts[0]); i++) {
+        if (strcmp(dot + 1, exts[i]) == 0) {
+            return 1;
+        }
+    }
+    return 0;
+}
+
+/* No NUL bytes and hardly any other control characters */
+static int looks_like_text(const uint8_t *head, size_t size) {
+    size_t control = 0;
+    size_t i;
+
+    if (size == 0) {
+        return 0;
+    }
+    for (i = 0; i < size; i++) {
+        uint8_t c = head[i];
+        if (c == 0) {
+            return 0;
+        }
+        if (c < 0x20 && c != '\t' && c != '\n' && c != '\r' && c != '\f' && c != 0x1B) {
+            control++;
+        }
+    }
+    return control * 64 <= size;
+}
+
+int zlite_classify_files(ZliteFileList *list, const ZliteCompressOptions *options) {
+    uint32_t ppmd = (uint32_t)ZLITE_METHOD_PPMD << ZLITE_METHOD_SHIFT;
+    uint32_t copy = (uint32_t)ZLITE_METHOD_COPY << ZLITE_METHOD_SHIFT;
+    int forced = options->level == 0 ? ZLITE_METHOD_COPY : options->method;
+    uint32_t method = (uint32_t)forced << ZLITE_METHOD_SHIFT;
+    uint32_t prev = method;
+    CPpmd7 model;
+    unsigned order = 0;
+    uint32_t mem_size = 0;
+    uint8_t *buf;
+    char path[PATH_MAX];
+    uint32_t i;
+
+    /* Sample buffer, then room for the probe's output */
+    buf = (uint8_t *)malloc(PROBE_SAMPLE_SIZE * 4);
+    if (!buf) {
+        return ZLITE_ERROR_MEMORY;
+    }
+
+    /* One small model serves every text sample */
+    Ppmd7_Construct(&model);
+    if (options->text_ppmd && forced != ZLITE_METHOD_PPMD && forced != ZLITE_METHOD_COPY) {
+        zlite_ppmd_props(options, PROBE_SAMPLE_SIZE * 2, &order, &mem_size);
+        if (!Ppmd7_Alloc(&model, mem_size, &g_Alloc)) {
+            free(buf);
+            return ZLITE_ERROR_MEMORY;
+        }
+    }
+
+    for (i = 0; i < list->count; i++) {
+        const char *name = list->strings + list->name[i];
+        FILE *fp;
+        size_t head;
+        size_t n;
+
+        list->coder[i] = method;
+        if (list->type[i] != ZLITE_FILETYPE_REGULAR || list->is_hardlink[i] ||
+            forced == ZLITE_METHOD_PPMD || forced == ZLITE_METHOD_COPY) {
+            continue;
+        }
+
+        /* Small files are not worth an open. They join a PPMd neighbour,
+         * which keeps solid blocks together, and otherwise take the
+         * method. A filter or Copy needs the file to have been looked at. */
+        if (list->size[i] < FILTER_MIN_SIZE) {
+            list->coder[i] = prev == ppmd ? ppmd : method;
+            continue;
+        }
+
+        if ((!options->filters && !options->text_ppmd && !options->probe) ||
+            zlite_file_list_path(list, i, path, sizeof(path)) == 0) {
+            continue;
+        }
+        fp = fopen(path, "rb");
+        if (!fp) {
+            continue;
+        }
+        n = read_sample(fp, list->size[i], options->probe, buf, &head);
+        fclose(fp);
+        if (head > FILTER_HEAD_SIZE) {
+            head = FILTER_HEAD_SIZE;
+        }
+
+        if (options->filters && (list->coder[i] = zlite_filter_detect(buf, head)) != 0) {
+            list->coder[i] |= method;
+        } else if (options->probe && looks_compressed(buf, head)) {
+            list->coder[i] = copy;
+        } else if (mem_size && (has_text_extension(name) || looks_like_text(buf, head)) &&
+                   ppmd_wins(&model, order, options, buf, n, buf + PROBE_SAMPLE_SIZE * 2)) {
+            list->coder[i] = ppmd;
+        } else if (options->probe && list->size[i] >= PROBE_MIN_SIZE &&
+                   !probe_compressible(buf, n, buf + PROBE_SAMPLE_SIZE * 2)) {
+            list->coder[i] = copy;
+        } else {
+            list->coder[i] = method;
+        }
+        prev = list->coder[i];
+    }
+
+    if (mem_size) {
+        Ppmd7_Free(&model, &g_Alloc);
+    }
+    free(buf);
+    return ZLITE_OK;
+}
+
+int zlite_filter_supported(uint32_t flags) {
+    int filter = (int)((flags & ZLITE_FILTER_MASK) >> ZLITE_FILTER_SHIFT);
+
+    return filter <= ZLITE_FILTER_DELTA &&
+           (filter == ZLITE_FILTER_DELTA || (flags & ZLITE_FILTER_ARG_MASK) == 0);
+}
+
+const char* zlite_coder_name(uint32_t flags) {
+    static const char *const names[] = {
+        "", "BCJ", "ARM", "ARMT", "ARM64", "PPC", "SPARC", "RISCV", "Delta"
+    };
+    static const char *const methods[] = { "", "LZMA", "PPMd", "Copy" };
+    uint32_t filter = (flags & ZLITE_FILTER_MASK) >> ZLITE_FILTER_SHIFT;
+    uint32_t method = (flags & ZLITE_METHOD_MASK) >> ZLITE_METHOD_SHIFT;
+
+    if (filter == 0) {
+        return method < sizeof(methods) / sizeof(methods[0]) ? methods[method] : "?";
+    }
+    return filter < sizeof(names) / sizeof(names[0]) ? names[filter] : "?";
+}
+
+void zlite_filter_init(ZliteFilter *f, uint32_t flags) {
+    memset(f, 0, sizeof(*f));
+    f->filter = (int)((flags & ZLITE_FILTER_MASK) >> ZLITE_FILTER_SHIFT);
+    f->delta = ((flags & ZLITE_FILTER_ARG_MASK) >> ZLITE_FILTER_ARG_SHIFT) + 1;
+    f->x86_state = Z7_BRANCH_CONV_ST_X86_STATE_INIT_VAL;
+    Delta_Init(f->delta_state);
+}
+
+/* Run one converter over data; returns the bytes that are final */
+static size_t filter_run(ZliteFilter *f, uint8_t *data, size_t size, int encode) {
+    Byte *end;
+
+    switch (f->filter) {
+        case ZLITE_FILTER_X86:
+            end = encode ? z7_BranchConvSt_X86_Enc(data, size, f->pc, &f->x86_state)
+                         : z7_BranchConvSt_X86_Dec(data, size, f->pc, &f->x86_state);
+            break;
+        case ZLITE_FILTER_ARM:
+            end = encode ? z7_BranchConv_ARM_Enc(data, size, f->pc)
+                         : z7_BranchConv_ARM_Dec(data, size, f->pc);
+            break;
+        case ZLITE_FILTER_ARMT:
+            end = encode ? z7_BranchConv_ARMT_Enc(data, size, f->pc)
+                         : z7_BranchConv_ARMT_Dec(data, size, f->pc);
+            break;
+        case ZLITE_FILTER_ARM64:
+            end = encode ? z7_BranchConv_ARM64_Enc(data, size, f->pc)
+                         : z7_BranchConv_ARM64_Dec(data, size, f->pc);
+            break;
+        case ZLITE_FILTER_PPC:
+            end = encode ? z7_BranchConv_PPC_Enc(data, size, f->pc)
+                         : z7_BranchConv_PPC_Dec(data, size, f->pc);
+            break;
+        case ZLITE_FILTER_SPARC:
+            end = encode ? z7_BranchConv_SPARC_Enc(data, size, f->pc)
+                         : z7_BranchConv_SPARC_Dec(data, size, f->pc);
+            break;
+        case ZLITE_FILTER_RISCV:
+            end = encode ? z7_BranchConv_RISCV_Enc(data, size, f->pc)
+                         : z7_BranchConv_RISCV_Dec(data, size, f->pc);
+            break;
+        case ZLITE_FILTER_DELTA:
+            if (encode) {
+                Delta_Encode(f->delta_state, f->delta, data, size);
+            } else {
+                Delta_Decode(f->delta_state, f->delta, data, size);
+            }
+            end = data + size;
+            break;
+        default:
+            end = data + size;
+            break;
+    }
+
+    f->pc += (uint32_t)(end - data);
+    return (size_t)(end - data);
+}
+
+/* Branch converters leave the last few bytes of a call unconverted until
+ * they see what follows. At the end of the data those bytes are final as
+ * they are, on both sides. */
+size_t zlite_filter_encode(ZliteFilter *f, uint8_t *data, size_t size, int last) {
+    size_t done = filter_run(f, data, size, 1);
+    return last ? size : done;
+}
+
+size_t zlite_filter_decode(ZliteFilter *f, uint8_t *data, size_t size, int last) {
+    size_t done = filter_run(f, data, size, 0);
+    return last ? size : done;
+}
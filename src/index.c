@@ -0,0 +1,550 @@
+#include "../include/7zlite.h"
+#include "../include/compat.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "7zCrc.h"
+
+/* Archive index: the central directory written after the last record, or
+ * for older archives the same information gathered by walking the records.
+ *
+ * Directory entry (ZLITE_DIR_ENTRY_SIZE bytes, then path and target):
+ *   u64 offset, u64 size, u64 compressed_size, u32 crc, u32 type,
+ *   u32 path_len, u32 target_len, u64 unpack_offset, u32 block,
+ *   i64 mtime, u64 inode
+ *
+ * Version 1 entries end after target_len, version 2 entries after block.
+ * `block` counts the solid block records of the directory in order.
+ * mtime (nanoseconds since the epoch) and inode are those of the file when
+ * it was added, for updates to tell whether it changed; 0 = unknown.
+ *
+ * Footer (ZLITE_FOOTER_SIZE bytes, last in the file):
+ *   u64 dir_offset, u64 dir_size, u32 entry_count, u16 entry_size,
+ *   u16 version, u32 dir_crc, "ZLCD"
+ *
+ * Fields use host byte order like the records. Readers honour entry_size
+ * so later versions can append fields to the fixed part. */
+
+static void put_u16(uint8_t *p, uint16_t v) { memcpy(p, &v, sizeof(v)); }
+static void put_u32(uint8_t *p, uint32_t v) { memcpy(p, &v, sizeof(v)); }
+static void put_u64(uint8_t *p, uint64_t v) { memcpy(p, &v, sizeof(v)); }
+
+static uint16_t get_u16(const uint8_t *p) { uint16_t v; memcpy(&v, p, sizeof(v)); return v; }
+static uint32_t get_u32(const uint8_t *p) { uint32_t v; memcpy(&v, p, sizeof(v)); return v; }
+static uint64_t get_u64(const uint8_t *p) { uint64_t v; memcpy(&v, p, sizeof(v)); return v; }
+
+static int is_link_type(int type) {
+    return type == ZLITE_FILETYPE_SYMLINK || type == ZLITE_FILETYPE_HARDLINK ||
+           type == ZLITE_FILETYPE_REF;
+}
+
+/* ========================================================================
+ * Index construction
+ * ======================================================================== */
+
+/* Strings go to one pool that may move while growing, so entries keep
+ * pool offsets until the index is complete */
+typedef struct {
+    ZliteIndex *index;
+    uint32_t capacity;
+    uint32_t block_capacity;
+    size_t *path_offs;
+    size_t *target_offs;        /* (size_t)-1 = no target */
+    size_t strings_size;
+    size_t strings_capacity;
+} IndexBuilder;
+
+#define NO_STRING ((size_t)-1)
+
+static int builder_reserve(IndexBuilder *b, uint32_t entries, size_t strings) {
+    if (entries > b->capacity) {
+        ZliteIndexEntry *new_entries;
+        size_t *new_paths;
+        size_t *new_targets;
+
+        new_entries = (ZliteIndexEntry *)realloc(b->index->entries,
+                                                 entries * sizeof(ZliteIndexEntry));
+        if (!new_entries) {
+            return ZLITE_ERROR_MEMORY;
+        }
+        b->index->entries = new_entries;
+
+        new_paths = (size_t *)realloc(b->path_offs, entries * sizeof(size_t));
+        if (!new_paths) {
+            return ZLITE_ERROR_MEMORY;
+        }
+        b->path_offs = new_paths;
+
+        new_targets = (size_t *)realloc(b->target_offs, entries * sizeof(size_t));
+        if (!new_targets) {
+            return ZLITE_ERROR_MEMORY;
+        }
+        b->target_offs = new_targets;
+        b->capacity = entries;
+    }
+
+    if (strings > b->strings_capacity) {
+        char *new_strings = (char *)realloc(b->index->strings, strings);
+        if (!new_strings) {
+            return ZLITE_ERROR_MEMORY;
+        }
+        b->index->strings = new_strings;
+        b->strings_capacity = strings;
+    }
+
+    return ZLITE_OK;
+}
+
+static int builder_string(IndexBuilder *b, const uint8_t *data, size_t len, size_t *offset) {
+    size_t needed = b->strings_size + len + 1;
+
+    if (needed > b->strings_capacity) {
+        size_t capacity = b->strings_capacity ? b->strings_capacity : 4096;
+        while (capacity < needed) {
+            capacity *= 2;
+        }
+        if (builder_reserve(b, 0, capacity) != ZLITE_OK) {
+            return ZLITE_ERROR_MEMORY;
+        }
+    }
+
+    memcpy(b->index->strings + b->strings_size, data, len);
+    b->index->strings[b->strings_size + len] = '\0';
+    *offset = b->strings_size;
+    b->strings_size = needed;
+    return ZLITE_OK;
+}
+
+static int builder_push(IndexBuilder *b, const ZliteIndexEntry *entry,
+                        size_t path_off, size_t target_off) {
+    uint32_t i = b->index->count;
+
+    if (i == b->capacity) {
+        uint32_t capacity = b->capacity ? b->capacity * 2 : 256;
+        if (builder_reserve(b, capacity, 0) != ZLITE_OK) {
+            return ZLITE_ERROR_MEMORY;
+        }
+    }
+
+    b->index->entries[i] = *entry;
+    b->path_offs[i] = path_off;
+    b->target_offs[i] = target_off;
+    b->index->count++;
+    return ZLITE_OK;
+}
+
+static int builder_push_block(IndexBuilder *b, const ZliteIndexEntry *block) {
+    uint32_t i = b->index->block_count;
+
+    if (i == b->block_capacity) {
+        uint32_t capacity = b->block_capacity ? b->block_capacity * 2 : 16;
+        ZliteIndexEntry *blocks = (ZliteIndexEntry *)realloc(b->index->blocks,
+                                                             capacity * sizeof(ZliteIndexEntry));
+        if (!blocks) {
+            return ZLITE_ERROR_MEMORY;
+        }
+        b->index->blocks = blocks;
+        b->block_capacity = capacity;
+    }
+
+    b->index->blocks[i] = *block;
+    b->index->blocks[i].path = "";
+    b->index->blocks[i].target = NULL;
+    b->index->block_count++;
+    return ZLITE_OK;
+}
+
+/* A solid member must lie inside a block that was already indexed */
+static int member_is_valid(const IndexBuilder *b, const ZliteIndexEntry *entry) {
+    const ZliteIndexEntry *block;
+
+    if (entry->block >= b->index->block_count) {
+        return 0;
+    }
+    block = &b->index->blocks[entry->block];
+    return entry->unpack_offset <= block->size &&
+           entry->size <= block->size - entry->unpack_offset;
+}
+
+static void builder_reset(IndexBuilder *b) {
+    b->index->count = 0;
+    b->index->block_count = 0;
+    b->strings_size = 0;
+}
+
+/* Turn pool offsets into pointers now that the pool no longer moves */
+static void builder_finish(IndexBuilder *b) {
+    uint32_t i;
+
+    for (i = 0; i < b->index->count; i++) {
+        ZliteIndexEntry *e = &b->index->entries[i];
+        e->path = b->index->strings + b->path_offs[i];
+        e->target = b->target_offs[i] == NO_STRING ? NULL
+                                                   : b->index->strings + b->target_offs[i];
+    }
+
+    free(b->path_offs);
+    free(b->target_offs);
+    b->path_offs = NULL;
+    b->target_offs = NULL;
+}
+
+/* Read the central directory. Returns ZLITE_ERROR_UNSUPPORTED when the
+ * archive has no footer and ZLITE_ERROR_CORRUPT when it is inconsistent. */
+static int load_directory(ZliteArchive *archive, uint64_t archive_size, IndexBuilder *b) {
+    const uint8_t *footer;
+    const uint8_t *dir;
+    uint64_t dir_offset;
+    uint64_t dir_size;
+    uint32_t count;
+    uint16_t entry_size;
+    uint32_t dir_crc;
+    uint64_t pos = 0;
+    uint32_t i;
+
+    if (archive_size < ZLITE_ARCHIVE_HEADER_SIZE + ZLITE_FOOTER_SIZE) {
+        return ZLITE_ERROR_UNSUPPORTED;
+    }
+
+    footer = zlite_archive_view(archive, archive_size - ZLITE_FOOTER_SIZE, ZLITE_FOOTER_SIZE);
+    if (!footer || memcmp(footer + 28, ZLITE_FOOTER_MAGIC, 4) != 0) {
+        return ZLITE_ERROR_UNSUPPORTED;
+    }
+
+    dir_offset = get_u64(footer);
+    dir_size = get_u64(footer + 8);
+    count = get_u32(footer + 16);
+    entry_size = get_u16(footer + 20);
+    dir_crc = get_u32(footer + 24);
+
+    /* The directory sits between the last record and the footer */
+    if (entry_size < ZLITE_DIR_ENTRY_SIZE_V1 ||
+        dir_offset < ZLITE_ARCHIVE_HEADER_SIZE ||
+        dir_offset > archive_size - ZLITE_FOOTER_SIZE ||
+        dir_size != archive_size - ZLITE_FOOTER_SIZE - dir_offset ||
+        (uint64_t)count * entry_size > dir_size ||
+        (size_t)dir_size != dir_size) {
+        return ZLITE_ERROR_CORRUPT;
+    }
+
+    b->index->records_end = dir_offset;
+    dir = zlite_archive_view(archive, dir_offset, (size_t)dir_size);
+    if (!dir || CrcCalc(dir, (size_t)dir_size) != dir_crc) {
+        return ZLITE_ERROR_CORRUPT;
+    }
+
+    /* Every string fits in the directory bytes plus its terminator */
+    if (builder_reserve(b, count, (size_t)dir_size + count * 2) != ZLITE_OK) {
+        return ZLITE_ERROR_MEMORY;
+    }
+
+    for (i = 0; i < count; i++) {
+        const uint8_t *p = dir + pos;
+        ZliteIndexEntry entry;
+        uint32_t path_len;
+        uint32_t target_len;
+        size_t path_off;
+        size_t target_off = NO_STRING;
+
+        if (dir_size - pos < entry_size) {
+            return ZLITE_ERROR_CORRUPT;
+        }
+
+        entry.offset = get_u64(p);
+        entry.size = get_u64(p + 8);
+        entry.compressed_size = get_u64(p + 16);
+        entry.crc = get_u32(p + 24);
+        entry.type = (int)(get_u32(p + 28) & ZLITE_TYPE_MASK);
+        entry.flags = get_u32(p + 28) & ~(uint32_t)ZLITE_TYPE_MASK;
+        path_len = get_u32(p + 32);
+        target_len = get_u32(p + 36);
+        entry.unpack_offset = 0;
+        entry.block = ZLITE_NO_BLOCK;
+        entry.mtime = 0;
+        entry.inode = 0;
+        if (entry_size >= ZLITE_DIR_ENTRY_SIZE_V2) {
+            entry.unpack_offset = get_u64(p + 40);
+            entry.block = get_u32(p + 48);
+        }
+        if (entry_size >= ZLITE_DIR_ENTRY_SIZE) {
+            entry.mtime = (int64_t)get_u64(p + 52);
+            entry.inode = get_u64(p + 60);
+        }
+        pos += entry_size;
+
+        if ((uint64_t)path_len + target_len > dir_size - pos) {
+            return ZLITE_ERROR_CORRUPT;
+        }
+
+        entry.data_offset = entry.offset + ZLITE_RECORD_HEADER_SIZE(path_len);
+        if (entry.offset < ZLITE_ARCHIVE_HEADER_SIZE ||
+            entry.data_offset > dir_offset ||
+            entry.compressed_size > dir_offset - entry.data_offset) {
+            return ZLITE_ERROR_CORRUPT;
+        }
+
+        if (entry.type == ZLITE_FILETYPE_SOLID_BLOCK) {
+            if (builder_push_block(b, &entry) != ZLITE_OK) {
+                return ZLITE_ERROR_MEMORY;
+            }
+            pos += (uint64_t)path_len + target_len;
+            continue;
+        }
+        if ((entry.flags & ZLITE_FLAG_SOLID) && !member_is_valid(b, &entry)) {
+            return ZLITE_ERROR_CORRUPT;
+        }
+
+        builder_string(b, dir + pos, path_len, &path_off);
+        pos += path_len;
+
+        if (is_link_type(entry.type)) {
+            builder_string(b, dir + pos, target_len, &target_off);
+        }
+        pos += target_len;
+
+        builder_push(b, &entry, path_off, target_off);
+    }
+
+    return ZLITE_OK;
+}
+
+/* Index an archive without a directory by walking its records. Stops at
+ * the first record that does not fit in the file, like the extractor. */
+static int scan_records(ZliteArchive *archive, uint64_t archive_size,
+                        uint32_t record_count, IndexBuilder *b) {
+    uint64_t pos = ZLITE_ARCHIVE_HEADER_SIZE;
+    uint64_t unpack_offset = 0;
+    uint32_t i;
+
+    b->index->records_end = pos;
+    for (i = 0; i < record_count; i++) {
+        const uint8_t *p;
+        ZliteIndexEntry entry;
+        uint32_t path_len;
+        size_t path_off;
+        size_t target_off = NO_STRING;
+
+        entry.offset = pos;
+
+        p = zlite_archive_view(archive, pos, sizeof(uint32_t));
+        if (!p) {
+            break;
+        }
+        path_len = get_u32(p);
+        pos += sizeof(uint32_t);
+
+        p = zlite_archive_view(archive, pos, path_len);
+        if (!p || builder_string(b, p, path_len, &path_off) != ZLITE_OK) {
+            break;
+        }
+        pos += path_len;
+
+        p = zlite_archive_view(archive, pos, 24);
+        if (!p) {
+            break;
+        }
+        entry.type = (int)(get_u32(p) & ZLITE_TYPE_MASK);
+        entry.flags = get_u32(p) & ~(uint32_t)ZLITE_TYPE_MASK;
+        entry.size = get_u64(p + 4);
+        entry.compressed_size = get_u64(p + 12);
+        entry.crc = get_u32(p + 20);
+        entry.block = ZLITE_NO_BLOCK;
+        entry.unpack_offset = 0;
+        entry.mtime = 0;
+        entry.inode = 0;
+        pos += 24;
+        entry.data_offset = pos;
+
+        /* Where a streamed record ends only the directory knows */
+        if (entry.flags & ZLITE_FLAG_TRAILER) {
+            break;
+        }
+
+        /* Payload */
+        if (entry.type == ZLITE_FILETYPE_REGULAR || entry.type == ZLITE_FILETYPE_SOLID_BLOCK) {
+            if (entry.compressed_size > archive_size - pos) {
+                break;
+            }
+            pos += entry.compressed_size;
+        }
+
+        /* Solid members follow their block and are stored back to back */
+        if (entry.type == ZLITE_FILETYPE_SOLID_BLOCK) {
+            if (builder_push_block(b, &entry) != ZLITE_OK) {
+                return ZLITE_ERROR_MEMORY;
+            }
+            b->index->records_end = pos;
+            unpack_offset = 0;
+            continue;
+        }
+        if (entry.flags & ZLITE_FLAG_SOLID) {
+            entry.block = b->index->block_count - 1;
+            entry.unpack_offset = unpack_offset;
+            if (b->index->block_count == 0 || !member_is_valid(b, &entry)) {
+                break;
+            }
+            unpack_offset += entry.size;
+        }
+
+        /* Symlink/hardlink/copy target */
+        if (is_link_type(entry.type)) {
+            uint32_t target_len;
+
+            p = zlite_archive_view(archive, pos, sizeof(uint32_t));
+            if (!p) {
+                break;
+            }
+            target_len = get_u32(p);
+            pos += sizeof(uint32_t);
+
+            p = zlite_archive_view(archive, pos, target_len);
+            if (!p || builder_string(b, p, target_len, &target_off) != ZLITE_OK) {
+                break;
+            }
+            pos += target_len;
+        }
+
+        if (builder_push(b, &entry, path_off, target_off) != ZLITE_OK) {
+            return ZLITE_ERROR_MEMORY;
+        }
+        b->index->records_end = pos;
+    }
+
+    return ZLITE_OK;
+}
+
+int zlite_index_load(ZliteArchive *archive, ZliteIndex *index) {
+    IndexBuilder builder;
+    const uint8_t *header;
+    uint64_t archive_size;
+    uint32_t record_count;
+    int result;
+
+    memset(index, 0, sizeof(*index));
+    memset(&builder, 0, sizeof(builder));
+    builder.index = index;
+
+    archive_size = zlite_archive_size(archive);
+    header = zlite_archive_view(archive, 0, ZLITE_ARCHIVE_HEADER_SIZE);
+    if (!header || memcmp(header, ZLITE_ARCHIVE_MAGIC, ZLITE_ARCHIVE_MAGIC_SIZE) != 0) {
+        return ZLITE_ERROR_CORRUPT;
+    }
+    record_count = get_u32(header + ZLITE_ARCHIVE_MAGIC_SIZE);
+
+    CrcGenerateTable();
+
+    result = load_directory(archive, archive_size, &builder);
+    if (result == ZLITE_OK) {
+        index->from_directory = 1;
+    } else if (result != ZLITE_ERROR_MEMORY) {
+        /* No usable directory: the records themselves are authoritative.
+         * Records without a count, as in an archive written to a stream,
+         * cannot be told from what follows them. */
+        builder_reset(&builder);
+        if (record_count == 0 && archive_size > ZLITE_ARCHIVE_HEADER_SIZE) {
+            result = ZLITE_ERROR_CORRUPT;
+        } else {
+            result = scan_records(archive, archive_size, record_count, &builder);
+        }
+    }
+
+    builder_finish(&builder);
+
+    if (result != ZLITE_OK) {
+        zlite_index_free(index);
+    }
+    return result;
+}
+
+void zlite_index_free(ZliteIndex *index) {
+    free(index->entries);
+    free(index->blocks);
+    free(index->strings);
+    memset(index, 0, sizeof(*index));
+}
+
+/* ========================================================================
+ * Central directory writer
+ * ======================================================================== */
+
+void zlite_dir_init(ZliteDirWriter *dir) {
+    memset(dir, 0, sizeof(*dir));
+}
+
+static int dir_append(ZliteDirWriter *dir, const void *data, size_t size) {
+    if (size == 0) {
+        return ZLITE_OK;
+    }
+    if (size > dir->capacity - dir->size) {
+        size_t capacity = dir->capacity ? dir->capacity : 65536;
+        uint8_t *new_data;
+
+        while (capacity - dir->size < size) {
+            capacity *= 2;
+        }
+        new_data = (uint8_t *)realloc(dir->data, capacity);
+        if (!new_data) {
+            return ZLITE_ERROR_MEMORY;
+        }
+        dir->data = new_data;
+        dir->capacity = capacity;
+    }
+
+    memcpy(dir->data + dir->size, data, size);
+    dir->size += size;
+    return ZLITE_OK;
+}
+
+int zlite_dir_add(ZliteDirWriter *dir, const ZliteIndexEntry *entry) {
+    uint8_t fixed[ZLITE_DIR_ENTRY_SIZE];
+    uint32_t path_len = (uint32_t)strlen(entry->path);
+    uint32_t target_len = entry->target ? (uint32_t)strlen(entry->target) : 0;
+
+    put_u64(fixed, entry->offset);
+    put_u64(fixed + 8, entry->size);
+    put_u64(fixed + 16, entry->compressed_size);
+    put_u32(fixed + 24, entry->crc);
+    put_u32(fixed + 28, (uint32_t)entry->type | entry->flags);
+    put_u32(fixed + 32, path_len);
+    put_u32(fixed + 36, target_len);
+    put_u64(fixed + 40, entry->unpack_offset);
+    put_u32(fixed + 48, entry->block);
+    put_u64(fixed + 52, (uint64_t)entry->mtime);
+    put_u64(fixed + 60, entry->inode);
+
+    if (dir_append(dir, fixed, sizeof(fixed)) != ZLITE_OK ||
+        dir_append(dir, entry->path, path_len) != ZLITE_OK ||
+        dir_append(dir, entry->target, target_len) != ZLITE_OK) {
+        return ZLITE_ERROR_MEMORY;
+    }
+
+    dir->count++;
+    return ZLITE_OK;
+}
+
+/* Append the directory and footer at the current position of out */
+int zlite_dir_write(ZliteDirWriter *dir, ZliteOutput *out) {
+    uint8_t footer[ZLITE_FOOTER_SIZE];
+    uint64_t dir_offset = zlite_output_tell(out);
+
+    put_u64(footer, dir_offset);
+    put_u64(footer + 8, dir->size);
+    put_u32(footer + 16, dir->count);
+    put_u16(footer + 20, ZLITE_DIR_ENTRY_SIZE);
+    put_u16(footer + 22, ZLITE_DIR_VERSION);
+    put_u32(footer + 24, CrcCalc(dir->data, dir->size));
+    memcpy(footer + 28, ZLITE_FOOTER_MAGIC, 4);
+
+    if (zlite_output_write(out, dir->data, dir->size) != dir->size ||
+        zlite_output_write(out, footer, sizeof(footer)) != sizeof(footer)) {
+        return ZLITE_ERROR_WRITE;
+    }
+
+    return ZLITE_OK;
+}
+
+void zlite_dir_free(ZliteDirWriter *dir) {
+    free(dir->data);
+    zlite_dir_init(dir);
+}
@@ -3,43 +3,134 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <stddef.h>
 
 /* Hard link tracking for efficient storage */
 /* Structures are defined in 7zlite.h */
 
 static HardLinkTable *g_link_table = NULL;
 
+#define LINK_TABLE_INITIAL   1024
+#define LINK_ARENA_CHUNK     ((size_t)64 << 10)
+
+/* first_path strings are carved out of large chunks that are released
+ * together, instead of one allocation per hard link */
+struct LinkArenaChunk {
+    struct LinkArenaChunk *next;
+    size_t size;
+    size_t used;
+    char data[1];
+};
+
+static char* arena_strdup(HardLinkTable *table, const char *str) {
+    size_t len = strlen(str) + 1;
+    struct LinkArenaChunk *chunk = table->arena;
+    char *copy;
+    
+    if (!chunk || chunk->size - chunk->used < len) {
+        size_t size = len > LINK_ARENA_CHUNK ? len : LINK_ARENA_CHUNK;
+        
+        chunk = (struct LinkArenaChunk *)malloc(offsetof(struct LinkArenaChunk, data) + size);
+        if (!chunk) {
+            return NULL;
+        }
+        chunk->size = size;
+        chunk->used = 0;
+        chunk->next = table->arena;
+        table->arena = chunk;
+    }
+    
+    copy = chunk->data + chunk->used;
+    memcpy(copy, str, len);
+    chunk->used += len;
+    return copy;
+}
+
+static uint32_t link_hash(uint64_t inode, uint64_t device) {
+    uint64_t h = inode ^ (device * 0x9E3779B97F4A7C15ull);
+    
+    h ^= h >> 33;
+    h *= 0xFF51AFD7ED558CCDull;
+    h ^= h >> 33;
+    return (uint32_t)h;
+}
+
+/* Rebuild the slot array with room for `size` slots (a power of two) */
+static int link_table_rehash(HardLinkTable *table, uint32_t size) {
+    int *slots = (int *)malloc(size * sizeof(int));
+    uint32_t mask = size - 1;
+    int i;
+    
+    if (!slots) {
+        return -1;
+    }
+    memset(slots, 0xFF, size * sizeof(int));
+    
+    for (i = 0; i < table->count; i++) {
+        uint32_t h = link_hash(table->entries[i].inode, table->entries[i].device) & mask;
+        while (slots[h] >= 0) {
+            h = (h + 1) & mask;
+        }
+        slots[h] = i;
+    }
+    
+    free(table->slots);
+    table->slots = slots;
+    table->slot_mask = mask;
+    return 0;
+}
+
 HardLinkTable* zlite_link_table_create(void) {
-    HardLinkTable *table = (HardLinkTable *)malloc(sizeof(HardLinkTable));
+    HardLinkTable *table = (HardLinkTable *)calloc(1, sizeof(HardLinkTable));
     if (!table) {
         return NULL;
     }
     
-    table->capacity = 1024;
-    table->count = 0;
-    table->entries = (struct HardLinkEntry *)calloc(table->capacity, sizeof(struct HardLinkEntry));
+    table->capacity = LINK_TABLE_INITIAL;
+    table->entries = (struct HardLinkEntry *)malloc(table->capacity * sizeof(struct HardLinkEntry));
     
-    if (!table->entries) {
-        free(table);
+    if (!table->entries || link_table_rehash(table, LINK_TABLE_INITIAL * 2) != 0) {
+        zlite_link_table_free(table);
         return NULL;
     }
     
     return table;
 }
 
-void zlite_link_table_free(HardLinkTable *table) {
-    int i;
+/* Forget all entries but keep the memory for the next run */
+void zlite_link_table_reset(HardLinkTable *table) {
+    struct LinkArenaChunk *chunk;
     
     if (!table) {
         return;
     }
     
-    for (i = 0; i < table->count; i++) {
-        if (table->entries[i].first_path) {
-            free(table->entries[i].first_path);
-        }
+    /* Keep the newest chunk only; it is the one strings go to next */
+    while (table->arena && table->arena->next) {
+        chunk = table->arena->next;
+        table->arena->next = chunk->next;
+        free(chunk);
+    }
+    if (table->arena) {
+        table->arena->used = 0;
+    }
+    
+    table->count = 0;
+    memset(table->slots, 0xFF, (table->slot_mask + 1) * sizeof(int));
+}
+
+void zlite_link_table_free(HardLinkTable *table) {
+    if (!table) {
+        return;
     }
     
+    while (table->arena) {
+        struct LinkArenaChunk *next = table->arena->next;
+        free(table->arena);
+        table->arena = next;
+    }
+    
+    free(table->slots);
     free(table->entries);
     free(table);
 }
@@ -48,33 +139,52 @@ struct HardLinkEntry* zlite_link_table_find_or_add(HardLinkTable *table,
                                             const char *path,
                                             uint64_t inode,
                                             uint64_t device) {
-    int i;
+    struct HardLinkEntry *entry;
+    uint32_t h = link_hash(inode, device) & table->slot_mask;
     
     /* First check if we already have this inode/device pair */
-    for (i = 0; i < table->count; i++) {
-        if (table->entries[i].inode == inode && 
-            table->entries[i].device == device) {
-            table->entries[i].ref_count++;
-            return &table->entries[i];
+    while (table->slots[h] >= 0) {
+        entry = &table->entries[table->slots[h]];
+        if (entry->inode == inode && entry->device == device) {
+            entry->ref_count++;
+            return entry;
         }
+        h = (h + 1) & table->slot_mask;
     }
     
     /* Not found, add new entry */
     if (table->count >= table->capacity) {
-        table->capacity *= 2;
-        table->entries = (struct HardLinkEntry *)realloc(table->entries, 
-                                                  table->capacity * sizeof(struct HardLinkEntry));
-        if (!table->entries) {
+        struct HardLinkEntry *entries;
+        
+        entries = (struct HardLinkEntry *)realloc(table->entries, 
+                                                  table->capacity * 2 * sizeof(struct HardLinkEntry));
+        if (!entries) {
             return NULL;
         }
+        table->entries = entries;
+        table->capacity *= 2;
     }
     
-    table->entries[table->count].inode = inode;
-    table->entries[table->count].device = device;
-    table->entries[table->count].first_path = strdup(path);
-    table->entries[table->count].ref_count = 1;
+    entry = &table->entries[table->count];
+    entry->inode = inode;
+    entry->device = device;
+    entry->first_path = arena_strdup(table, path);
+    entry->ref_count = 1;
+    if (!entry->first_path) {
+        return NULL;
+    }
+    table->slots[h] = table->count++;
+    
+    /* Keep the load factor at or below one half */
+    if ((uint32_t)table->count * 2 > table->slot_mask + 1) {
+        if (link_table_rehash(table, (table->slot_mask + 1) * 2) != 0) {
+            table->slots[h] = -1;
+            table->count--;
+            return NULL;
+        }
+    }
     
-    return &table->entries[table->count++];
+    return entry;
 }
 
 /* Global link table for archive operations */
@@ -1,3 +1,8 @@
+/* statx() is a Linux extension */
+#ifndef _GNU_SOURCE
+#define _GNU_SOURCE
+#endif
+
 #include "../../include/compat.h"
 #include "../../include/7zlite.h"
 #include <stdio.h>
@@ -10,6 +15,12 @@
 #include <fcntl.h>
 #include <sys/types.h>
 #include <sys/xattr.h>
+#include <sys/mman.h>
+#include <sys/resource.h>
+#include <time.h>
+#ifdef __linux__
+#include <sys/sysmacros.h>
+#endif
 
 #ifndef PATH_MAX
 #define PATH_MAX 4096
@@ -67,39 +78,101 @@ int zlite_set_file_mode(const char *path, uint32_t mode) {
     return chmod(path, mode);
 }
 
-int zlite_platform_detect_links(const char *path, ZliteFileInfo *info) {
-    ZliteFileStat stat;
+/* Read a symlink target; `size` is the length reported by stat, which is
+ * 0 for some pseudo file systems */
+static char* read_link_target(int dir_fd, const char *name, uint64_t size) {
+    size_t cap = (size > 0 && size < PATH_MAX) ? (size_t)size + 1 : PATH_MAX;
+    char *target = (char *)malloc(cap);
+    ssize_t len;
     
-    if (zlite_stat_file(path, &stat) != 0) {
-        return -1;
+    if (!target) {
+        return NULL;
     }
     
-    info->device = stat.dev;
-    info->inode = stat.ino;
+    len = readlinkat(dir_fd, name, target, cap);
+    if (len >= (ssize_t)cap && cap < PATH_MAX) {
+        /* The link changed since the stat */
+        free(target);
+        return read_link_target(dir_fd, name, 0);
+    }
+    if (len < 0 || len >= (ssize_t)cap) {
+        len = 0;
+    }
+    target[len] = '\0';
+    return target;
+}
+
+static void set_file_type(ZliteFileInfo *info, uint32_t mode, uint64_t nlink) {
+    info->attributes = mode;
+    info->is_hardlink = 0;
     
-    if (S_ISLNK(stat.mode)) {
+    if (S_ISLNK(mode)) {
         info->file_type = ZLITE_FILETYPE_SYMLINK;
-        info->link_target = strdup(stat.symlink_target);
-        info->is_hardlink = 0;
-    } else if (S_ISREG(stat.mode) && stat.nlink > 1) {
+    } else if (S_ISDIR(mode)) {
+        info->file_type = ZLITE_FILETYPE_DIR;
+    } else if (S_ISREG(mode) && nlink > 1) {
         info->file_type = ZLITE_FILETYPE_HARDLINK;
-        info->link_target = NULL;
         info->is_hardlink = 1;
-    } else if (S_ISDIR(stat.mode)) {
-        info->file_type = ZLITE_FILETYPE_DIR;
-        info->link_target = NULL;
-        info->is_hardlink = 0;
     } else {
         info->file_type = ZLITE_FILETYPE_REGULAR;
-        info->link_target = NULL;
-        info->is_hardlink = 0;
     }
+}
+
+int zlite_stat_at(int dir_fd, const char *name, ZliteFileInfo *info) {
+#if defined(__linux__) && defined(STATX_TYPE)
+    /* Ask only for what the archive needs; the kernel can skip the rest */
+    static int no_statx = 0;
     
-    info->attributes = stat.mode;
-    
+    if (!no_statx) {
+        struct statx stx;
+        
+        if (statx(dir_fd, name, AT_SYMLINK_NOFOLLOW,
+                  STATX_TYPE | STATX_MODE | STATX_NLINK | STATX_INO | STATX_SIZE | STATX_MTIME,
+                  &stx) == 0) {
+            info->size = stx.stx_size;
+            info->mtime = (int64_t)stx.stx_mtime.tv_sec * 1000000000 + stx.stx_mtime.tv_nsec;
+            info->inode = stx.stx_ino;
+            info->device = makedev(stx.stx_dev_major, stx.stx_dev_minor);
+            set_file_type(info, stx.stx_mode, stx.stx_nlink);
+            info->link_target = NULL;
+            if (S_ISLNK(stx.stx_mode)) {
+                info->link_target = read_link_target(dir_fd, name, stx.stx_size);
+            }
+            return 0;
+        }
+        if (errno != ENOSYS) {
+            return -1;
+        }
+        no_statx = 1;
+    }
+#endif
+    {
+        struct stat st;
+        
+        if (fstatat(dir_fd, name, &st, AT_SYMLINK_NOFOLLOW) != 0) {
+            return -1;
+        }
+        info->size = st.st_size;
+#ifdef __APPLE__
+        info->mtime = (int64_t)st.st_mtimespec.tv_sec * 1000000000 + st.st_mtimespec.tv_nsec;
+#else
+        info->mtime = (int64_t)st.st_mtim.tv_sec * 1000000000 + st.st_mtim.tv_nsec;
+#endif
+        info->inode = st.st_ino;
+        info->device = st.st_dev;
+        set_file_type(info, st.st_mode, st.st_nlink);
+        info->link_target = NULL;
+        if (S_ISLNK(st.st_mode)) {
+            info->link_target = read_link_target(dir_fd, name, st.st_size);
+        }
+    }
     return 0;
 }
 
+int zlite_platform_detect_links(const char *path, ZliteFileInfo *info) {
+    return zlite_stat_at(AT_FDCWD, path, info);
+}
+
 int zlite_platform_create_link(const char *target, const char *link_path, int link_type) {
     if (link_type == ZLITE_FILETYPE_SYMLINK) {
         return symlink(target, link_path);
@@ -136,4 +209,137 @@ int zlite_mkdir_recursive(const char *path) {
     }
     
     return 0;
-}
\ No newline at end of file
+}
+int zlite_get_cpu_count(void) {
+    long n = sysconf(_SC_NPROCESSORS_ONLN);
+    
+    return n > 0 ? (int)n : 1;
+}
+
+uint64_t zlite_time_usec(void) {
+    struct timespec ts;
+    
+    if (clock_gettime(CLOCK_MONOTONIC, &ts) != 0) {
+        return 0;
+    }
+    return (uint64_t)ts.tv_sec * 1000000 + (uint64_t)ts.tv_nsec / 1000;
+}
+
+uint64_t zlite_cpu_usec(void) {
+    struct rusage usage;
+    
+    if (getrusage(RUSAGE_SELF, &usage) != 0) {
+        return 0;
+    }
+    return (uint64_t)(usage.ru_utime.tv_sec + usage.ru_stime.tv_sec) * 1000000 +
+           (uint64_t)(usage.ru_utime.tv_usec + usage.ru_stime.tv_usec);
+}
+
+int zlite_truncate_file(FILE *fp, uint64_t size) {
+    if (fflush(fp) != 0) {
+        return -1;
+    }
+    return ftruncate(fileno(fp), (off_t)size);
+}
+
+int zlite_sync_file(FILE *fp) {
+    if (fflush(fp) != 0) {
+        return -1;
+    }
+    return fsync(fileno(fp));
+}
+
+FILE* zlite_stdin_binary(void) {
+    return stdin;
+}
+
+FILE* zlite_stdout_binary(void) {
+    FILE *fp;
+    int fd;
+
+    fflush(stdout);
+    fd = dup(STDOUT_FILENO);
+    if (fd < 0) {
+        return NULL;
+    }
+    fp = fdopen(fd, "wb");
+    if (!fp) {
+        close(fd);
+        return NULL;
+    }
+    if (dup2(STDERR_FILENO, STDOUT_FILENO) < 0) {
+        fclose(fp);
+        return NULL;
+    }
+    return fp;
+}
+
+void* zlite_map_file(FILE *fp, uint64_t size, void **handle) {
+    void *addr;
+    
+    *handle = NULL;
+    if ((uint64_t)(size_t)size != size) {
+        return NULL;
+    }
+    
+    addr = mmap(NULL, (size_t)size, PROT_READ, MAP_PRIVATE, fileno(fp), 0);
+    return addr == MAP_FAILED ? NULL : addr;
+}
+
+void zlite_unmap_file(void *addr, uint64_t size, void *handle) {
+    (void)handle;
+    munmap(addr, (size_t)size);
+}
+
+void zlite_advise(void *addr, uint64_t size, int advice) {
+    long page = sysconf(_SC_PAGESIZE);
+    uintptr_t start = (uintptr_t)addr;
+    uintptr_t aligned;
+    
+    /* posix_madvise() wants a page-aligned address */
+    if (page <= 0) {
+        page = 4096;
+    }
+    aligned = start & ~((uintptr_t)page - 1);
+    
+    posix_madvise((void *)aligned, (size_t)(size + (start - aligned)),
+                  advice == ZLITE_ADVISE_WILLNEED ? POSIX_MADV_WILLNEED
+                                                  : POSIX_MADV_SEQUENTIAL);
+}
+
+uint64_t zlite_copy_range(FILE *src, uint64_t src_offset, FILE *dst, uint64_t dst_offset,
+                          uint64_t size) {
+    uint64_t done = 0;
+#if defined(__linux__) && defined(__GLIBC__) && \
+    (__GLIBC__ > 2 || (__GLIBC__ == 2 && __GLIBC_MINOR__ >= 27))
+    loff_t in = (loff_t)src_offset;
+    loff_t out = (loff_t)dst_offset;
+    
+    if (fflush(dst) != 0) {
+        return 0;
+    }
+    
+    /* The kernel copies without a trip through user space, and shares
+     * extents on filesystems that support reflinks */
+    while (done < size) {
+        size_t n = size - done > ((size_t)1 << 30) ? ((size_t)1 << 30) : (size_t)(size - done);
+        ssize_t copied = copy_file_range(fileno(src), &in, fileno(dst), &out, n, 0);
+        
+        if (copied <= 0) {
+            break;
+        }
+        done += (uint64_t)copied;
+    }
+#else
+    (void)src;
+    (void)src_offset;
+    (void)dst;
+    (void)dst_offset;
+    (void)size;
+#endif
+    return done;
+}
+
+int zlite_replace_file(const char *from, const char *to) {
+    return rename(from, to);
+}
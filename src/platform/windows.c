@@ -5,6 +5,8 @@
 #include <string.h>
 #include <windows.h>
 #include <shlwapi.h>
+#include <io.h>
+#include <fcntl.h>
 
 #ifndef _S_IFDIR
 #define _S_IFDIR 0040000
@@ -150,6 +152,9 @@ int zlite_platform_detect_links(const char *path, ZliteFileInfo *info) {
 
     info->attributes = attr;
 
+    /* FILETIME counts 100 ns steps from 1601 */
+    info->mtime = ((int64_t)stat.mtime - 116444736000000000LL) * 100;
+
     if (attr & FILE_ATTRIBUTE_REPARSE_POINT) {
         /* Windows symbolic link or junction */
         info->file_type = ZLITE_FILETYPE_SYMLINK;
@@ -212,3 +217,136 @@ int zlite_mkdir_recursive(const char *path) {
     
     return 0;
 }
+
+int zlite_get_cpu_count(void) {
+    SYSTEM_INFO info;
+    
+    GetSystemInfo(&info);
+    return info.dwNumberOfProcessors > 0 ? (int)info.dwNumberOfProcessors : 1;
+}
+
+uint64_t zlite_time_usec(void) {
+    LARGE_INTEGER freq;
+    LARGE_INTEGER now;
+    
+    if (!QueryPerformanceFrequency(&freq) || !QueryPerformanceCounter(&now)) {
+        return 0;
+    }
+    return (uint64_t)(now.QuadPart / freq.QuadPart) * 1000000 +
+           (uint64_t)(now.QuadPart % freq.QuadPart) * 1000000 / (uint64_t)freq.QuadPart;
+}
+
+uint64_t zlite_cpu_usec(void) {
+    FILETIME created, exited, kernel, user;
+    ULARGE_INTEGER k, u;
+    
+    if (!GetProcessTimes(GetCurrentProcess(), &created, &exited, &kernel, &user)) {
+        return 0;
+    }
+    k.LowPart = kernel.dwLowDateTime;
+    k.HighPart = kernel.dwHighDateTime;
+    u.LowPart = user.dwLowDateTime;
+    u.HighPart = user.dwHighDateTime;
+    return (k.QuadPart + u.QuadPart) / 10;     /* 100 ns units */
+}
+
+int zlite_truncate_file(FILE *fp, uint64_t size) {
+    if (fflush(fp) != 0) {
+        return -1;
+    }
+    return _chsize_s(_fileno(fp), (__int64)size) == 0 ? 0 : -1;
+}
+
+int zlite_sync_file(FILE *fp) {
+    if (fflush(fp) != 0) {
+        return -1;
+    }
+    return FlushFileBuffers((HANDLE)_get_osfhandle(_fileno(fp))) ? 0 : -1;
+}
+
+FILE* zlite_stdin_binary(void) {
+    _setmode(_fileno(stdin), _O_BINARY);
+    return stdin;
+}
+
+FILE* zlite_stdout_binary(void) {
+    FILE *fp;
+    int fd;
+
+    fflush(stdout);
+    fd = _dup(_fileno(stdout));
+    if (fd < 0) {
+        return NULL;
+    }
+    _setmode(fd, _O_BINARY);
+    fp = _fdopen(fd, "wb");
+    if (!fp) {
+        _close(fd);
+        return NULL;
+    }
+    if (_dup2(_fileno(stderr), _fileno(stdout)) != 0) {
+        fclose(fp);
+        return NULL;
+    }
+    return fp;
+}
+
+void* zlite_map_file(FILE *fp, uint64_t size, void **handle) {
+    HANDLE hFile = (HANDLE)_get_osfhandle(_fileno(fp));
+    HANDLE hMap;
+    void *addr;
+    
+    *handle = NULL;
+    if (hFile == INVALID_HANDLE_VALUE || (uint64_t)(SIZE_T)size != size) {
+        return NULL;
+    }
+    
+    hMap = CreateFileMappingW(hFile, NULL, PAGE_READONLY, 0, 0, NULL);
+    if (!hMap) {
+        return NULL;
+    }
+    
+    addr = MapViewOfFile(hMap, FILE_MAP_READ, 0, 0, (SIZE_T)size);
+    if (!addr) {
+        CloseHandle(hMap);
+        return NULL;
+    }
+    
+    *handle = hMap;
+    return addr;
+}
+
+void zlite_unmap_file(void *addr, uint64_t size, void *handle) {
+    (void)size;
+    UnmapViewOfFile(addr);
+    if (handle) {
+        CloseHandle((HANDLE)handle);
+    }
+}
+
+void zlite_advise(void *addr, uint64_t size, int advice) {
+    /* The Windows cache manager reads ahead on mapped views by itself */
+    (void)addr;
+    (void)size;
+    (void)advice;
+}
+
+uint64_t zlite_copy_range(FILE *src, uint64_t src_offset, FILE *dst, uint64_t dst_offset,
+                          uint64_t size) {
+    /* No kernel copy between handles; the caller copies the bytes */
+    (void)src;
+    (void)src_offset;
+    (void)dst;
+    (void)dst_offset;
+    (void)size;
+    return 0;
+}
+
+int zlite_replace_file(const char *from, const char *to) {
+    wchar_t wfrom[MAX_PATH];
+    wchar_t wto[MAX_PATH];
+    
+    MultiByteToWideChar(CP_UTF8, 0, from, -1, wfrom, MAX_PATH);
+    MultiByteToWideChar(CP_UTF8, 0, to, -1, wto, MAX_PATH);
+    return MoveFileExW(wfrom, wto, MOVEFILE_REPLACE_EXISTING) ? 0 : -1;
+}
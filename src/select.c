@@ -0,0 +1,232 @@
+#include "../include/7zlite.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+/* Entry selection for extract/test with path arguments.
+ *
+ * A pattern selects an entry when it matches the entry path, or a leading
+ * part of it that ends at a '/', so naming a directory selects everything
+ * below it. '*' and '?' do not cross '/'; [abc], [a-z] and [!x] match one
+ * character. Literal patterns are resolved through a hash of the entry
+ * names instead of a scan. */
+
+static uint32_t hash_name(const char *name) {
+    uint32_t h = 2166136261u;   /* FNV-1a */
+
+    while (*name) {
+        h ^= (uint8_t)*name++;
+        h *= 16777619u;
+    }
+    return h;
+}
+
+int zlite_name_index_init(ZliteNameIndex *ni, const char *const *names,
+                          const uint8_t *is_dir, uint32_t count) {
+    uint32_t size = 16;
+    uint32_t i;
+
+    memset(ni, 0, sizeof(*ni));
+
+    while (size < count * 2 && size < 0x80000000u) {
+        size *= 2;
+    }
+
+    ni->buckets = (uint32_t *)malloc(size * sizeof(uint32_t));
+    ni->next = (uint32_t *)malloc((count ? count : 1) * sizeof(uint32_t));
+    if (!ni->buckets || !ni->next) {
+        zlite_name_index_free(ni);
+        return ZLITE_ERROR_MEMORY;
+    }
+
+    ni->names = names;
+    ni->is_dir = is_dir;
+    ni->count = count;
+    ni->mask = size - 1;
+
+    for (i = 0; i < size; i++) {
+        ni->buckets[i] = count;
+    }
+
+    /* Insert backwards so every chain lists entries in archive order */
+    for (i = count; i-- > 0; ) {
+        uint32_t b = hash_name(names[i]) & ni->mask;
+        ni->next[i] = ni->buckets[b];
+        ni->buckets[b] = i;
+    }
+
+    return ZLITE_OK;
+}
+
+void zlite_name_index_free(ZliteNameIndex *ni) {
+    free(ni->buckets);
+    free(ni->next);
+    memset(ni, 0, sizeof(*ni));
+}
+
+uint32_t zlite_name_index_find(const ZliteNameIndex *ni, const char *name) {
+    uint32_t i;
+
+    if (!ni->buckets) {
+        return ni->count;
+    }
+
+    for (i = ni->buckets[hash_name(name) & ni->mask]; i != ni->count; i = ni->next[i]) {
+        if (strcmp(ni->names[i], name) == 0) {
+            return i;
+        }
+    }
+    return ni->count;
+}
+
+/* Match one bracket expression at p against c; advances *pp past it */
+static int match_class(const char **pp, char c) {
+    const char *p = *pp + 1;
+    int negate = 0;
+    int matched = 0;
+
+    if (*p == '!' || *p == '^') {
+        negate = 1;
+        p++;
+    }
+
+    do {
+        if (*p == '\0') {
+            return -1;      /* unterminated: treat '[' literally */
+        }
+        if (p[1] == '-' && p[2] != ']' && p[2] != '\0') {
+            if ((uint8_t)c >= (uint8_t)p[0] && (uint8_t)c <= (uint8_t)p[2]) {
+                matched = 1;
+            }
+            p += 3;
+        } else {
+            if (c == *p) {
+                matched = 1;
+            }
+            p++;
+        }
+    } while (*p != ']');
+
+    *pp = p + 1;
+    return matched != negate;
+}
+
+int zlite_match_pattern(const char *pattern, const char *path) {
+    const char *p = pattern;
+    const char *s = path;
+
+    for (;;) {
+        if (*p == '\0') {
+            return *s == '\0' || *s == '/';
+        }
+
+        if (*p == '*') {
+            while (*p == '*') {
+                p++;
+            }
+            for (;;) {
+                if (zlite_match_pattern(p, s)) {
+                    return 1;
+                }
+                if (*s == '\0' || *s == '/') {
+                    return 0;
+                }
+                s++;
+            }
+        }
+
+        if (*s == '\0') {
+            return 0;
+        }
+
+        if (*p == '[' && *s != '/') {
+            int r = match_class(&p, *s);
+            if (r == 0) {
+                return 0;
+            }
+            if (r > 0) {
+                s++;
+                continue;
+            }
+        }
+
+        if (*p == '?') {
+            if (*s == '/') {
+                return 0;
+            }
+        } else if (*p != *s) {
+            return 0;
+        }
+        p++;
+        s++;
+    }
+}
+
+static int is_literal(const char *pattern) {
+    return strpbrk(pattern, "*?[") == NULL;
+}
+
+uint32_t zlite_name_index_select(const ZliteNameIndex *ni, char **patterns, int num_patterns,
+                                 uint8_t *selected, int *unmatched) {
+    uint32_t total = 0;
+    uint32_t i;
+    int k;
+
+    memset(selected, 0, ni->count);
+    *unmatched = 0;
+
+    for (k = 0; k < num_patterns; k++) {
+        char pattern[4096];
+        size_t len;
+        uint32_t matches = 0;
+        int scan = 1;
+
+        /* Archive paths are relative and never end with '/' */
+        const char *src = patterns[k];
+        while (src[0] == '.' && src[1] == '/') {
+            src += 2;
+        }
+        snprintf(pattern, sizeof(pattern), "%s", src);
+        len = strlen(pattern);
+        while (len > 0 && pattern[len - 1] == '/') {
+            pattern[--len] = '\0';
+        }
+
+        if (is_literal(pattern)) {
+            /* Exact hits come from the hash; only a directory (or a miss)
+             * needs the scan for entries below it */
+            uint32_t b = hash_name(pattern) & ni->mask;
+            scan = 0;
+            for (i = ni->buckets[b]; i != ni->count; i = ni->next[i]) {
+                if (strcmp(ni->names[i], pattern) == 0) {
+                    matches++;
+                    total += !selected[i];
+                    selected[i] = 1;
+                    if (!ni->is_dir || ni->is_dir[i]) {
+                        scan = 1;
+                    }
+                }
+            }
+            if (matches == 0) {
+                scan = 1;
+            }
+        }
+
+        if (scan) {
+            for (i = 0; i < ni->count; i++) {
+                if (zlite_match_pattern(pattern, ni->names[i])) {
+                    matches++;
+                    total += !selected[i];
+                    selected[i] = 1;
+                }
+            }
+        }
+
+        if (matches == 0) {
+            fprintf(stderr, "Warning: No files matching '%s'\n", patterns[k]);
+            (*unmatched)++;
+        }
+    }
+
+    return total;
+}
@@ -0,0 +1,492 @@
+#include "../include/7zlite.h"
+#include "../include/compat.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#ifndef PATH_MAX
+#define PATH_MAX 4096
+#endif
+
+#include "Threads.h"
+
+/* Archive output, optionally split into volumes.
+ *
+ * Volume k holds bytes [k * volume_size, (k + 1) * volume_size) of the
+ * archive and is named path.00(k+1), the layout 7-Zip uses, so a split
+ * standard 7z archive opens in 7-Zip as well. The writer patches record
+ * headers after their payload and the archive header at the very end, so
+ * volumes stay open until the caller commits a position: everything
+ * before it is final, and volumes that end there are closed and passed to
+ * the hook. The first volume is closed last.
+ *
+ * The hook runs on a thread of its own, in volume order, so an upload of
+ * one volume overlaps the compression of the next.
+ *
+ * A stream output writes to a FILE the caller opened, such as stdout,
+ * strictly in order: it cannot seek back, and the writer leaves out what
+ * it would patch. */
+
+typedef struct {
+    ZliteVolumeHook hook;
+    void *arg;
+    char **paths;
+    uint32_t count;
+    uint32_t capacity;
+    uint32_t next;              /* paths[] before this have been handed over */
+    int stop;
+    CCriticalSection cs;
+    CAutoResetEvent ready;
+    CThread thread;
+} HookQueue;
+
+static THREAD_FUNC_DECL hook_worker(void *arg) {
+    HookQueue *q = (HookQueue *)arg;
+
+    for (;;) {
+        char *path = NULL;
+
+        CriticalSection_Enter(&q->cs);
+        while (q->next == q->count && !q->stop) {
+            CriticalSection_Leave(&q->cs);
+            Event_Wait(&q->ready);
+            CriticalSection_Enter(&q->cs);
+        }
+        if (q->next < q->count) {
+            path = q->paths[q->next];
+            q->paths[q->next++] = NULL;
+        }
+        CriticalSection_Leave(&q->cs);
+
+        if (!path) {
+            break;
+        }
+        q->hook(path, q->arg);
+        free(path);
+    }
+    return THREAD_FUNC_RET_ZERO;
+}
+
+/* Start the hook thread; NULL means the hook is called directly */
+static HookQueue* hook_queue_start(ZliteVolumeHook hook, void *arg) {
+    HookQueue *q = (HookQueue *)calloc(1, sizeof(HookQueue));
+
+    if (!q) {
+        return NULL;
+    }
+    q->hook = hook;
+    q->arg = arg;
+
+    Event_Construct(&q->ready);
+    Thread_CONSTRUCT(&q->thread);
+    if (CriticalSection_Init(&q->cs) != 0) {
+        free(q);
+        return NULL;
+    }
+    if (AutoResetEvent_CreateNotSignaled(&q->ready) != 0 ||
+        Thread_Create(&q->thread, hook_worker, q) != 0) {
+        Event_Close(&q->ready);
+        CriticalSection_Delete(&q->cs);
+        free(q);
+        return NULL;
+    }
+    return q;
+}
+
+/* Wait for the hooks queued so far and stop the thread */
+static void hook_queue_stop(HookQueue *q) {
+    uint32_t i;
+
+    CriticalSection_Enter(&q->cs);
+    q->stop = 1;
+    CriticalSection_Leave(&q->cs);
+    Event_Set(&q->ready);
+    Thread_Wait_Close(&q->thread);
+
+    for (i = q->next; i < q->count; i++) {
+        free(q->paths[i]);
+    }
+    free(q->paths);
+    Event_Close(&q->ready);
+    CriticalSection_Delete(&q->cs);
+    free(q);
+}
+
+static void volume_path(const ZliteOutput *out, uint32_t index, char *path, size_t size) {
+    if (out->volume_size > 0) {
+        snprintf(path, size, "%s.%03u", out->path, index + 1);
+    } else {
+        snprintf(path, size, "%s", out->path);
+    }
+}
+
+/* Queue a closed volume for the hook thread */
+static void volume_done(ZliteOutput *out, uint32_t index) {
+    HookQueue *q = (HookQueue *)out->hooks;
+    char path[PATH_MAX];
+    char *copy;
+    int queued = 0;
+
+    if (!q) {
+        return;
+    }
+
+    volume_path(out, index, path, sizeof(path));
+    copy = strdup(path);
+    CriticalSection_Enter(&q->cs);
+    if (copy && q->count == q->capacity) {
+        uint32_t capacity = q->capacity ? q->capacity * 2 : 16;
+        char **paths = (char **)realloc(q->paths, capacity * sizeof(char *));
+        if (paths) {
+            q->paths = paths;
+            q->capacity = capacity;
+        }
+    }
+    if (copy && q->count < q->capacity) {
+        q->paths[q->count++] = copy;
+        queued = 1;
+    }
+    CriticalSection_Leave(&q->cs);
+    Event_Set(&q->ready);
+
+    /* Out of memory: run the hook here rather than skip a volume */
+    if (!queued) {
+        free(copy);
+        q->hook(path, q->arg);
+    }
+}
+
+static int volume_close(ZliteVolume *v, int owned) {
+    int failed = 0;
+
+    if (v->fp) {
+        failed = (owned ? fclose(v->fp) : fflush(v->fp)) != 0;
+        v->fp = NULL;
+    }
+    return failed;
+}
+
+/* The open volume `index`, created when it is written for the first time */
+static ZliteVolume* open_volume(ZliteOutput *out, uint32_t index) {
+    while (out->num_volumes <= index) {
+        char path[PATH_MAX];
+        ZliteVolume *v;
+
+        if (out->num_volumes == out->volumes_capacity) {
+            uint32_t capacity = out->volumes_capacity ? out->volumes_capacity * 2 : 16;
+            ZliteVolume *volumes = (ZliteVolume *)realloc(out->volumes,
+                                                          capacity * sizeof(ZliteVolume));
+            if (!volumes) {
+                return NULL;
+            }
+            out->volumes = volumes;
+            out->volumes_capacity = capacity;
+        }
+
+        volume_path(out, out->num_volumes, path, sizeof(path));
+        v = &out->volumes[out->num_volumes];
+        v->fp = fopen(path, out->num_volumes < out->num_existing ? "r+b" : "wb");
+        v->pos = 0;
+        if (!v->fp) {
+            fprintf(stderr, "Error: Cannot open archive for writing '%s'\n", path);
+            return NULL;
+        }
+        out->num_volumes++;
+    }
+
+    /* Closed volumes cannot change any more */
+    return out->volumes[index].fp ? &out->volumes[index] : NULL;
+}
+
+static int output_init(ZliteOutput *out, const char *path, uint64_t volume_size,
+                       ZliteVolumeHook hook, void *hook_arg) {
+    memset(out, 0, sizeof(*out));
+    out->path = strdup(path);
+    out->volume_size = volume_size;
+    if (!out->path) {
+        return ZLITE_ERROR_MEMORY;
+    }
+
+    if (hook) {
+        out->hooks = hook_queue_start(hook, hook_arg);
+        if (!out->hooks) {
+            free(out->path);
+            out->path = NULL;
+            return ZLITE_ERROR_MEMORY;
+        }
+    }
+    return ZLITE_OK;
+}
+
+int zlite_output_open(ZliteOutput *out, const char *path, uint64_t volume_size,
+                      ZliteVolumeHook hook, void *hook_arg) {
+    int result = output_init(out, path, volume_size, hook, hook_arg);
+
+    if (result != ZLITE_OK) {
+        return result;
+    }
+
+    /* Create the first volume now so a bad path fails early */
+    if (!open_volume(out, 0)) {
+        zlite_output_close(out, 0);
+        return ZLITE_ERROR_FILE;
+    }
+    return ZLITE_OK;
+}
+
+/* Write the archive to fp, which stays open */
+int zlite_output_open_stream(ZliteOutput *out, FILE *fp) {
+    int result = output_init(out, "-", 0, NULL, NULL);
+
+    if (result != ZLITE_OK) {
+        return result;
+    }
+
+    out->volumes = (ZliteVolume *)malloc(sizeof(ZliteVolume));
+    if (!out->volumes) {
+        zlite_output_close(out, 0);
+        return ZLITE_ERROR_MEMORY;
+    }
+    out->volumes[0].fp = fp;
+    out->volumes[0].pos = 0;
+    out->num_volumes = out->volumes_capacity = 1;
+    out->stream = 1;
+    return ZLITE_OK;
+}
+
+/* Open an existing archive to write from pos, at most its size, on. The
+ * bytes before pos stay. Of the volumes before the one holding pos only
+ * the first is kept open; the others are not written and do not go to
+ * the hook again. */
+int zlite_output_reopen(ZliteOutput *out, const char *path, uint64_t volume_size,
+                        uint64_t pos, ZliteVolumeHook hook, void *hook_arg) {
+    uint32_t index = volume_size > 0 ? (uint32_t)(pos / volume_size) : 0;
+    uint32_t i;
+    int result = output_init(out, path, volume_size, hook, hook_arg);
+
+    if (result != ZLITE_OK) {
+        return result;
+    }
+
+    /* A set that fills its last volume exactly continues in a new one */
+    out->num_existing = index > 0 && pos % volume_size == 0 ? index : index + 1;
+    if (!open_volume(out, index)) {
+        zlite_output_close(out, 0);
+        return ZLITE_ERROR_FILE;
+    }
+    for (i = 1; i < index; i++) {
+        volume_close(&out->volumes[i], 1);
+    }
+    out->num_sealed = index > 0 ? index - 1 : 0;
+    out->pos = pos;
+    return ZLITE_OK;
+}
+
+size_t zlite_output_write(ZliteOutput *out, const void *data, size_t size) {
+    const uint8_t *p = (const uint8_t *)data;
+    size_t done = 0;
+
+    while (done < size) {
+        uint32_t index = 0;
+        uint64_t local = out->pos;
+        size_t n = size - done;
+        size_t written;
+        ZliteVolume *v;
+
+        if (out->volume_size > 0) {
+            index = (uint32_t)(out->pos / out->volume_size);
+            local = out->pos % out->volume_size;
+            if (n > out->volume_size - local) {
+                n = (size_t)(out->volume_size - local);
+            }
+        }
+
+        v = open_volume(out, index);
+        if (!v) {
+            break;
+        }
+        if (v->pos != local) {
+            if (zlite_fseek(v->fp, (int64_t)local, SEEK_SET) != 0) {
+                break;
+            }
+            v->pos = local;
+        }
+
+        written = fwrite(p + done, 1, n, v->fp);
+        v->pos += written;
+        out->pos += written;
+        done += written;
+        if (written != n) {
+            break;
+        }
+    }
+    return done;
+}
+
+/* Copy size bytes of src at src_offset to the current position in the
+ * kernel. Returns how many were copied; the caller writes the rest. */
+uint64_t zlite_output_copy(ZliteOutput *out, FILE *src, uint64_t src_offset, uint64_t size) {
+    uint64_t done = 0;
+
+    if (out->stream) {
+        return 0;
+    }
+
+    while (done < size) {
+        uint32_t index = 0;
+        uint64_t local = out->pos;
+        uint64_t n = size - done;
+        uint64_t copied;
+        ZliteVolume *v;
+
+        if (out->volume_size > 0) {
+            index = (uint32_t)(out->pos / out->volume_size);
+            local = out->pos % out->volume_size;
+            if (n > out->volume_size - local) {
+                n = out->volume_size - local;
+            }
+        }
+
+        v = open_volume(out, index);
+        if (!v) {
+            break;
+        }
+
+        /* The FILE position stays at v->pos, so the next write seeks */
+        copied = zlite_copy_range(src, src_offset + done, v->fp, local, n);
+        out->pos += copied;
+        done += copied;
+        if (copied != n) {
+            break;
+        }
+    }
+    return done;
+}
+
+int zlite_output_seek(ZliteOutput *out, uint64_t pos) {
+    if (out->stream && pos != out->pos) {
+        return ZLITE_ERROR_WRITE;
+    }
+    out->pos = pos;
+    return ZLITE_OK;
+}
+
+uint64_t zlite_output_tell(const ZliteOutput *out) {
+    return out->pos;
+}
+
+/* Nothing before `pos` will be written again: close the volumes that end
+ * there, except the first */
+void zlite_output_commit(ZliteOutput *out, uint64_t pos) {
+    uint32_t end;
+
+    if (out->volume_size == 0) {
+        return;
+    }
+
+    end = (uint32_t)(pos / out->volume_size);
+    if (end > out->num_volumes) {
+        end = out->num_volumes;
+    }
+    while (out->num_sealed + 1 < end) {
+        uint32_t index = ++out->num_sealed;
+
+        if (volume_close(&out->volumes[index], 1) != 0) {
+            out->error = 1;
+        } else {
+            volume_done(out, index);
+        }
+    }
+}
+
+/* Cut the archive at the current position; volumes past it are removed */
+int zlite_output_truncate(ZliteOutput *out) {
+    uint32_t last = 0;
+    uint64_t local = out->pos;
+    ZliteVolume *v;
+
+    /* Nothing was written past the position of a stream */
+    if (out->stream) {
+        return ZLITE_OK;
+    }
+
+    if (out->volume_size > 0 && out->pos > 0) {
+        last = (uint32_t)((out->pos - 1) / out->volume_size);
+        local = out->pos - (uint64_t)last * out->volume_size;
+    }
+
+    while (out->num_volumes > last + 1) {
+        char path[PATH_MAX];
+
+        out->num_volumes--;
+        volume_close(&out->volumes[out->num_volumes], 1);
+        volume_path(out, out->num_volumes, path, sizeof(path));
+        remove(path);
+    }
+
+    v = open_volume(out, last);
+    if (!v || zlite_truncate_file(v->fp, local) != 0) {
+        return ZLITE_ERROR_WRITE;
+    }
+    return ZLITE_OK;
+}
+
+/* Make what was written so far durable, for writes that must not reach
+ * the disk before it */
+int zlite_output_sync(ZliteOutput *out) {
+    uint32_t i;
+
+    if (out->stream) {
+        return fflush(out->volumes[0].fp) == 0 ? ZLITE_OK : ZLITE_ERROR_WRITE;
+    }
+
+    for (i = 0; i < out->num_volumes; i++) {
+        if (out->volumes[i].fp && zlite_sync_file(out->volumes[i].fp) != 0) {
+            return ZLITE_ERROR_WRITE;
+        }
+    }
+    return ZLITE_OK;
+}
+
+/* Close the remaining volumes; when the archive is complete they go to
+ * the hook, and volumes left over from an earlier, longer set are
+ * removed. Returns the first close error. */
+int zlite_output_close(ZliteOutput *out, int complete) {
+    HookQueue *q = (HookQueue *)out->hooks;
+    int result = out->error ? ZLITE_ERROR_WRITE : ZLITE_OK;
+    uint32_t k;
+    uint32_t i;
+
+    /* The first volume holds the archive header, written last: it goes
+     * after all the others */
+    for (k = 0; k < out->num_volumes; k++) {
+        i = (k + 1) % out->num_volumes;
+        if (!out->volumes[i].fp) {
+            continue;
+        }
+        if (volume_close(&out->volumes[i], !out->stream) != 0) {
+            result = ZLITE_ERROR_WRITE;
+        } else if (complete && result == ZLITE_OK) {
+            volume_done(out, i);
+        }
+    }
+
+    if (complete && result == ZLITE_OK && out->volume_size > 0) {
+        char path[PATH_MAX];
+
+        for (i = out->num_volumes; ; i++) {
+            volume_path(out, i, path, sizeof(path));
+            if (remove(path) != 0) {
+                break;
+            }
+        }
+    }
+
+    if (q) {
+        hook_queue_stop(q);
+    }
+    free(out->volumes);
+    free(out->path);
+    memset(out, 0, sizeof(*out));
+    return result;
+}
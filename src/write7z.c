@@ -0,0 +1,660 @@
+#include "../include/7zlite.h"
+#include "../include/compat.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "Alloc.h"
+#include "7zCrc.h"
+#include "Lzma2Enc.h"
+
+/* Standard 7z output.
+ *
+ * The archive starts with the 32-byte signature header; the packed
+ * streams follow it back to back, then the header that describes them.
+ * Every folder has one packed stream and holds one file or a solid block.
+ * Its coders are the method (LZMA2, LZMA, PPMd or Copy) and, for filtered
+ * data, the branch or delta filter as a second coder bound to the
+ * method's output, the layout the SDK's decoder accepts. The header is
+ * itself LZMA2 compressed and described by a small encoded header.
+ *
+ * 7z has no links between entries: symlinks are files whose data is the
+ * target and whose attributes carry S_IFLNK in the Unix mode, the way
+ * p7zip and 7-Zip for Linux store them. */
+
+/* Property ids */
+#define ID_END                  0x00
+#define ID_HEADER               0x01
+#define ID_MAIN_STREAMS_INFO    0x04
+#define ID_FILES_INFO           0x05
+#define ID_PACK_INFO            0x06
+#define ID_UNPACK_INFO          0x07
+#define ID_SUBSTREAMS_INFO      0x08
+#define ID_SIZE                 0x09
+#define ID_CRC                  0x0A
+#define ID_FOLDER               0x0B
+#define ID_CODERS_UNPACK_SIZE   0x0C
+#define ID_NUM_UNPACK_STREAM    0x0D
+#define ID_EMPTY_STREAM         0x0E
+#define ID_EMPTY_FILE           0x0F
+#define ID_NAME                 0x11
+#define ID_WIN_ATTRIB           0x15
+#define ID_ENCODED_HEADER       0x17
+
+/* Windows attributes */
+#define ATTRIB_DIRECTORY        0x10
+#define ATTRIB_ARCHIVE          0x20
+#define ATTRIB_UNIX_EXTENSION   0x8000
+
+#ifndef S_IFMT
+#define S_IFMT   0170000
+#endif
+#ifndef S_IFDIR
+#define S_IFDIR  0040000
+#endif
+#ifndef S_IFLNK
+#define S_IFLNK  0120000
+#endif
+
+static const uint8_t signature[6] = { '7', 'z', 0xBC, 0xAF, 0x27, 0x1C };
+
+/* ========================================================================
+ * Coders
+ * ======================================================================== */
+
+/* 7z method ids, indexed by ZLITE_METHOD_* and ZLITE_FILTER_* */
+static const uint32_t method_ids[] = { 0x21, 0x030101, 0x030401, 0x00 };
+static const uint32_t filter_ids[] = {
+    0, 0x03030103, 0x03030501, 0x03030701, 0x0A, 0x03030205, 0x03030805, 0x0B, 0x03
+};
+
+static uint32_t coder_method(uint32_t coder) {
+    return (coder & ZLITE_METHOD_MASK) >> ZLITE_METHOD_SHIFT;
+}
+
+static uint32_t coder_filter(uint32_t coder) {
+    return (coder & ZLITE_FILTER_MASK) >> ZLITE_FILTER_SHIFT;
+}
+
+size_t zlite_7z_props_size(uint32_t coder) {
+    switch (coder_method(coder)) {
+        case ZLITE_METHOD_LZMA2:
+            return 1;
+        case ZLITE_METHOD_LZMA:
+        case ZLITE_METHOD_PPMD:
+            return 5;
+        default:
+            return 0;
+    }
+}
+
+uint32_t zlite_7z_attrib(int file_type, uint32_t attrib) {
+#ifdef _WIN32
+    (void)file_type;
+    return attrib;
+#else
+    uint32_t result = file_type == ZLITE_FILETYPE_DIR ? ATTRIB_DIRECTORY : ATTRIB_ARCHIVE;
+
+    /* Directories found through d_type only know they are directories;
+     * leave their permissions to the extracting side */
+    if ((attrib & 07777) != 0) {
+        result |= ATTRIB_UNIX_EXTENSION | ((attrib & 0xFFFF) << 16);
+    }
+    return result;
+#endif
+}
+
+/* ========================================================================
+ * Header buffer
+ * ======================================================================== */
+
+typedef struct {
+    uint8_t *data;
+    size_t size;
+    size_t capacity;
+    int error;
+} HeaderBuf;
+
+static void hb_bytes(HeaderBuf *hb, const void *data, size_t size) {
+    if (hb->error || size == 0) {
+        return;
+    }
+    if (size > hb->capacity - hb->size) {
+        size_t capacity = hb->capacity ? hb->capacity : 4096;
+        uint8_t *new_data;
+
+        while (capacity - hb->size < size) {
+            capacity *= 2;
+        }
+        new_data = (uint8_t *)realloc(hb->data, capacity);
+        if (!new_data) {
+            hb->error = 1;
+            return;
+        }
+        hb->data = new_data;
+        hb->capacity = capacity;
+    }
+    memcpy(hb->data + hb->size, data, size);
+    hb->size += size;
+}
+
+static void hb_byte(HeaderBuf *hb, uint8_t b) {
+    hb_bytes(hb, &b, 1);
+}
+
+static void hb_u32(HeaderBuf *hb, uint32_t v) {
+    uint8_t b[4];
+    int i;
+
+    for (i = 0; i < 4; i++) {
+        b[i] = (uint8_t)(v >> (8 * i));
+    }
+    hb_bytes(hb, b, sizeof(b));
+}
+
+/* 7z variable-length number: the high bits of the first byte tell how
+ * many little-endian bytes follow */
+static void hb_number(HeaderBuf *hb, uint64_t v) {
+    uint8_t first = 0;
+    uint8_t mask = 0x80;
+    int i;
+
+    for (i = 0; i < 8; i++) {
+        if (v < ((uint64_t)1 << (7 * (i + 1)))) {
+            first |= (uint8_t)(v >> (8 * i));
+            break;
+        }
+        first |= mask;
+        mask >>= 1;
+    }
+    hb_byte(hb, first);
+    for (; i > 0; i--) {
+        hb_byte(hb, (uint8_t)v);
+        v >>= 8;
+    }
+}
+
+/* Bit vector, most significant bit first */
+static void hb_bits(HeaderBuf *hb, const uint8_t *bits, uint32_t count) {
+    uint8_t b = 0;
+    uint32_t i;
+
+    for (i = 0; i < count; i++) {
+        if (bits[i]) {
+            b |= (uint8_t)(0x80 >> (i & 7));
+        }
+        if ((i & 7) == 7) {
+            hb_byte(hb, b);
+            b = 0;
+        }
+    }
+    if (count & 7) {
+        hb_byte(hb, b);
+    }
+}
+
+static void hb_method_id(HeaderBuf *hb, uint32_t id, uint8_t flags) {
+    uint8_t bytes[4];
+    int n = 0;
+    int i;
+
+    do {
+        bytes[n++] = (uint8_t)id;
+        id >>= 8;
+    } while (id != 0);
+
+    hb_byte(hb, (uint8_t)(flags | n));
+    for (i = n - 1; i >= 0; i--) {
+        hb_byte(hb, bytes[i]);
+    }
+}
+
+/* Coders of a folder: the method first, then the filter reading its output */
+static void hb_folder(HeaderBuf *hb, const Zlite7zFolder *f) {
+    uint32_t filter = coder_filter(f->coder);
+
+    hb_number(hb, filter ? 2 : 1);
+    hb_method_id(hb, method_ids[coder_method(f->coder)], f->props_size ? 0x20 : 0);
+    if (f->props_size) {
+        hb_number(hb, f->props_size);
+        hb_bytes(hb, f->props, f->props_size);
+    }
+
+    if (filter) {
+        if (filter == ZLITE_FILTER_DELTA) {
+            hb_method_id(hb, filter_ids[filter], 0x20);
+            hb_number(hb, 1);
+            hb_byte(hb, (uint8_t)((f->coder & ZLITE_FILTER_ARG_MASK) >> ZLITE_FILTER_ARG_SHIFT));
+        } else {
+            hb_method_id(hb, filter_ids[filter], 0);
+        }
+        /* Bond: the filter's input is the method's output */
+        hb_number(hb, 1);
+        hb_number(hb, 0);
+    }
+}
+
+/* ========================================================================
+ * Writer
+ * ======================================================================== */
+
+void zlite_7z_init(Zlite7zWriter *w) {
+    memset(w, 0, sizeof(*w));
+}
+
+void zlite_7z_free(Zlite7zWriter *w) {
+    free(w->folders);
+    free(w->files);
+    free(w->names);
+    zlite_7z_init(w);
+}
+
+/* Placeholder for the signature header, filled in by zlite_7z_write() */
+int zlite_7z_begin(ZliteOutput *out) {
+    uint8_t header[ZLITE_7Z_SIGNATURE_HEADER_SIZE];
+
+    memset(header, 0, sizeof(header));
+    memcpy(header, signature, sizeof(signature));
+    header[7] = 4;
+    if (zlite_output_write(out, header, sizeof(header)) != sizeof(header)) {
+        return ZLITE_ERROR_WRITE;
+    }
+    return ZLITE_OK;
+}
+
+int zlite_7z_add_folder(Zlite7zWriter *w, uint32_t coder, const uint8_t *props,
+                        uint64_t pack_size, uint64_t unpack_size) {
+    Zlite7zFolder *f;
+
+    if (coder_method(coder) >= sizeof(method_ids) / sizeof(method_ids[0]) ||
+        coder_filter(coder) >= sizeof(filter_ids) / sizeof(filter_ids[0])) {
+        return ZLITE_ERROR_UNSUPPORTED;
+    }
+    if (w->num_folders == w->folders_capacity) {
+        uint32_t capacity = w->folders_capacity ? w->folders_capacity * 2 : 64;
+        Zlite7zFolder *folders = (Zlite7zFolder *)realloc(w->folders,
+                                                          capacity * sizeof(Zlite7zFolder));
+        if (!folders) {
+            return ZLITE_ERROR_MEMORY;
+        }
+        w->folders = folders;
+        w->folders_capacity = capacity;
+    }
+
+    f = &w->folders[w->num_folders++];
+    memset(f, 0, sizeof(*f));
+    f->coder = coder;
+    f->props_size = (uint8_t)zlite_7z_props_size(coder);
+    if (f->props_size) {
+        memcpy(f->props, props, f->props_size);
+    }
+    f->pack_size = pack_size;
+    f->unpack_size = unpack_size;
+    return ZLITE_OK;
+}
+
+/* Append `path` to the names as UTF-16LE. Bytes that are not valid UTF-8
+ * become U+FFFD. */
+static int add_name(Zlite7zWriter *w, const char *path) {
+    const uint8_t *s = (const uint8_t *)path;
+    size_t need = (strlen(path) + 1) * 4;
+
+    if (need > w->names_capacity - w->names_size) {
+        size_t capacity = w->names_capacity ? w->names_capacity : 65536;
+        uint8_t *names;
+
+        while (capacity - w->names_size < need) {
+            capacity *= 2;
+        }
+        names = (uint8_t *)realloc(w->names, capacity);
+        if (!names) {
+            return ZLITE_ERROR_MEMORY;
+        }
+        w->names = names;
+        w->names_capacity = capacity;
+    }
+
+    for (;;) {
+        uint32_t c = *s;
+        int extra = 0;
+
+        if (c >= 0xF0 && c < 0xF8) {
+            c &= 0x07;
+            extra = 3;
+        } else if (c >= 0xE0) {
+            c &= 0x0F;
+            extra = 2;
+        } else if (c >= 0xC0) {
+            c &= 0x1F;
+            extra = 1;
+        } else if (c >= 0x80) {
+            c = 0xFFFD;
+        }
+        s++;
+        for (; extra > 0; extra--, s++) {
+            if ((*s & 0xC0) != 0x80) {
+                c = 0xFFFD;
+                break;
+            }
+            c = (c << 6) | (*s & 0x3F);
+        }
+        if (c == '\\' || c == '/') {
+            c = '/';
+        }
+
+        if (c >= 0x10000) {
+            c -= 0x10000;
+            w->names[w->names_size++] = (uint8_t)(0xD800 | (c >> 10));
+            w->names[w->names_size++] = (uint8_t)((0xD800 | (c >> 10)) >> 8);
+            c = 0xDC00 | (c & 0x3FF);
+        }
+        w->names[w->names_size++] = (uint8_t)c;
+        w->names[w->names_size++] = (uint8_t)(c >> 8);
+        if (c == 0) {
+            return ZLITE_OK;
+        }
+    }
+}
+
+int zlite_7z_add_file(Zlite7zWriter *w, const char *path, uint64_t size, uint32_t crc,
+                      uint32_t attrib) {
+    Zlite7zFile *f;
+
+    if (w->num_files == w->files_capacity) {
+        uint32_t capacity = w->files_capacity ? w->files_capacity * 2 : 256;
+        Zlite7zFile *files = (Zlite7zFile *)realloc(w->files, capacity * sizeof(Zlite7zFile));
+        if (!files) {
+            return ZLITE_ERROR_MEMORY;
+        }
+        w->files = files;
+        w->files_capacity = capacity;
+    }
+    if (size > 0 && w->num_folders == 0) {
+        return ZLITE_ERROR_PARAM;
+    }
+    if (add_name(w, path) != ZLITE_OK) {
+        return ZLITE_ERROR_MEMORY;
+    }
+
+    f = &w->files[w->num_files++];
+    f->size = size;
+    f->crc = crc;
+    f->attrib = attrib;
+    if (size > 0) {
+        w->folders[w->num_folders - 1].num_streams++;
+    }
+    return ZLITE_OK;
+}
+
+/* Streams info of the main streams: pack sizes, folders and the files'
+ * sizes and CRCs inside them */
+static void write_streams_info(HeaderBuf *hb, const Zlite7zWriter *w) {
+    uint32_t i;
+    int substreams = 0;
+
+    hb_byte(hb, ID_PACK_INFO);
+    hb_number(hb, 0);
+    hb_number(hb, w->num_folders);
+    hb_byte(hb, ID_SIZE);
+    for (i = 0; i < w->num_folders; i++) {
+        hb_number(hb, w->folders[i].pack_size);
+    }
+    hb_byte(hb, ID_END);
+
+    hb_byte(hb, ID_UNPACK_INFO);
+    hb_byte(hb, ID_FOLDER);
+    hb_number(hb, w->num_folders);
+    hb_byte(hb, 0);
+    for (i = 0; i < w->num_folders; i++) {
+        hb_folder(hb, &w->folders[i]);
+    }
+    hb_byte(hb, ID_CODERS_UNPACK_SIZE);
+    for (i = 0; i < w->num_folders; i++) {
+        hb_number(hb, w->folders[i].unpack_size);
+        if (coder_filter(w->folders[i].coder)) {
+            hb_number(hb, w->folders[i].unpack_size);
+        }
+    }
+    hb_byte(hb, ID_END);
+
+    hb_byte(hb, ID_SUBSTREAMS_INFO);
+    for (i = 0; i < w->num_folders; i++) {
+        if (w->folders[i].num_streams != 1) {
+            substreams = 1;
+        }
+    }
+    if (substreams) {
+        uint32_t f;
+        uint32_t k = 0;
+
+        hb_byte(hb, ID_NUM_UNPACK_STREAM);
+        for (i = 0; i < w->num_folders; i++) {
+            hb_number(hb, w->folders[i].num_streams);
+        }
+
+        /* Every size but the last of each folder */
+        hb_byte(hb, ID_SIZE);
+        for (f = 0; f < w->num_folders; f++) {
+            uint32_t n = w->folders[f].num_streams;
+
+            while (n > 0) {
+                if (w->files[k].size == 0) {
+                    k++;
+                    continue;
+                }
+                if (n > 1) {
+                    hb_number(hb, w->files[k].size);
+                }
+                k++;
+                n--;
+            }
+        }
+    }
+    hb_byte(hb, ID_CRC);
+    hb_byte(hb, 1);
+    for (i = 0; i < w->num_files; i++) {
+        if (w->files[i].size > 0) {
+            hb_u32(hb, w->files[i].crc);
+        }
+    }
+    hb_byte(hb, ID_END);
+
+    hb_byte(hb, ID_END);
+}
+
+static void write_files_info(HeaderBuf *hb, const Zlite7zWriter *w) {
+    uint8_t *empty_stream;
+    uint8_t *empty_file;
+    uint32_t num_empty = 0;
+    int any_empty_file = 0;
+    uint32_t i;
+
+    empty_stream = (uint8_t *)malloc(w->num_files + 1);
+    empty_file = (uint8_t *)malloc(w->num_files + 1);
+    if (!empty_stream || !empty_file) {
+        free(empty_stream);
+        free(empty_file);
+        hb->error = 1;
+        return;
+    }
+    for (i = 0; i < w->num_files; i++) {
+        empty_stream[i] = w->files[i].size == 0;
+        if (empty_stream[i]) {
+            empty_file[num_empty] = !(w->files[i].attrib & ATTRIB_DIRECTORY);
+            any_empty_file |= empty_file[num_empty];
+            num_empty++;
+        }
+    }
+
+    hb_byte(hb, ID_FILES_INFO);
+    hb_number(hb, w->num_files);
+
+    if (num_empty > 0) {
+        hb_byte(hb, ID_EMPTY_STREAM);
+        hb_number(hb, (w->num_files + 7) / 8);
+        hb_bits(hb, empty_stream, w->num_files);
+        if (any_empty_file) {
+            hb_byte(hb, ID_EMPTY_FILE);
+            hb_number(hb, (num_empty + 7) / 8);
+            hb_bits(hb, empty_file, num_empty);
+        }
+    }
+
+    hb_byte(hb, ID_NAME);
+    hb_number(hb, w->names_size + 1);
+    hb_byte(hb, 0);
+    hb_bytes(hb, w->names, w->names_size);
+
+    hb_byte(hb, ID_WIN_ATTRIB);
+    hb_number(hb, 2 + (uint64_t)w->num_files * 4);
+    hb_byte(hb, 1);
+    hb_byte(hb, 0);
+    for (i = 0; i < w->num_files; i++) {
+        hb_u32(hb, w->files[i].attrib);
+    }
+
+    hb_byte(hb, ID_END);
+    free(empty_stream);
+    free(empty_file);
+}
+
+/* LZMA2 compress the header into out (allocated); returns the property
+ * byte or -1 */
+static int compress_header(const HeaderBuf *hb, uint8_t **out, size_t *out_size) {
+    CLzma2EncHandle enc;
+    CLzma2EncProps props;
+    size_t capacity = hb->size + hb->size / 2 + 4096;
+    int prop = -1;
+
+    *out = (uint8_t *)malloc(capacity);
+    enc = Lzma2Enc_Create(&g_Alloc, &g_Alloc);
+    if (*out && enc) {
+        Lzma2EncProps_Init(&props);
+        props.lzmaProps.level = 5;
+        props.lzmaProps.reduceSize = hb->size;
+        props.numTotalThreads = 1;
+        Lzma2EncProps_Normalize(&props);
+
+        *out_size = capacity;
+        if (Lzma2Enc_SetProps(enc, &props) == SZ_OK &&
+            Lzma2Enc_Encode2(enc, NULL, *out, out_size, NULL, hb->data, hb->size, NULL) == SZ_OK) {
+            prop = Lzma2Enc_WriteProperties(enc);
+        }
+    }
+    if (enc) {
+        Lzma2Enc_Destroy(enc);
+    }
+    if (prop < 0) {
+        free(*out);
+        *out = NULL;
+    }
+    return prop;
+}
+
+static void put_u32(uint8_t *p, uint32_t v) {
+    int i;
+    for (i = 0; i < 4; i++) {
+        p[i] = (uint8_t)(v >> (8 * i));
+    }
+}
+
+static void put_u64(uint8_t *p, uint64_t v) {
+    put_u32(p, (uint32_t)v);
+    put_u32(p + 4, (uint32_t)(v >> 32));
+}
+
+/* Write the header at the current position of out, which must be the end
+ * of the last packed stream, and fill in the signature header */
+int zlite_7z_write(Zlite7zWriter *w, ZliteOutput *out) {
+    HeaderBuf hb;
+    HeaderBuf enc;
+    uint8_t start[ZLITE_7Z_SIGNATURE_HEADER_SIZE];
+    uint8_t *packed = NULL;
+    size_t packed_size = 0;
+    uint64_t header_pos = zlite_output_tell(out);
+    uint64_t next_pos;
+    int prop;
+    int result = ZLITE_OK;
+
+    if (header_pos < ZLITE_7Z_SIGNATURE_HEADER_SIZE) {
+        return ZLITE_ERROR_WRITE;
+    }
+
+    memset(&hb, 0, sizeof(hb));
+    memset(&enc, 0, sizeof(enc));
+    memset(start, 0, sizeof(start));
+    memcpy(start, signature, sizeof(signature));
+    start[7] = 4;
+
+    if (w->num_files > 0) {
+        hb_byte(&hb, ID_HEADER);
+        if (w->num_folders > 0) {
+            hb_byte(&hb, ID_MAIN_STREAMS_INFO);
+            write_streams_info(&hb, w);
+        }
+        write_files_info(&hb, w);
+        hb_byte(&hb, ID_END);
+        if (hb.error) {
+            free(hb.data);
+            return ZLITE_ERROR_MEMORY;
+        }
+
+        /* The compressed header is a packed stream of its own, described
+         * by the encoded header that follows it */
+        prop = compress_header(&hb, &packed, &packed_size);
+        if (prop < 0) {
+            free(hb.data);
+            return ZLITE_ERROR_MEMORY;
+        }
+        hb_byte(&enc, ID_ENCODED_HEADER);
+        hb_byte(&enc, ID_PACK_INFO);
+        hb_number(&enc, header_pos - ZLITE_7Z_SIGNATURE_HEADER_SIZE);
+        hb_number(&enc, 1);
+        hb_byte(&enc, ID_SIZE);
+        hb_number(&enc, packed_size);
+        hb_byte(&enc, ID_END);
+        hb_byte(&enc, ID_UNPACK_INFO);
+        hb_byte(&enc, ID_FOLDER);
+        hb_number(&enc, 1);
+        hb_byte(&enc, 0);
+        hb_number(&enc, 1);
+        hb_method_id(&enc, method_ids[ZLITE_METHOD_LZMA2], 0x20);
+        hb_number(&enc, 1);
+        hb_byte(&enc, (uint8_t)prop);
+        hb_byte(&enc, ID_CODERS_UNPACK_SIZE);
+        hb_number(&enc, hb.size);
+        hb_byte(&enc, ID_CRC);
+        hb_byte(&enc, 1);
+        hb_u32(&enc, CrcCalc(hb.data, hb.size));
+        hb_byte(&enc, ID_END);
+        hb_byte(&enc, ID_END);
+
+        if (enc.error) {
+            result = ZLITE_ERROR_MEMORY;
+        } else if (zlite_output_write(out, packed, packed_size) != packed_size ||
+                   zlite_output_write(out, enc.data, enc.size) != enc.size) {
+            result = ZLITE_ERROR_WRITE;
+        }
+
+        next_pos = header_pos + packed_size;
+        put_u64(start + 12, next_pos - ZLITE_7Z_SIGNATURE_HEADER_SIZE);
+        put_u64(start + 20, enc.size);
+        put_u32(start + 28, CrcCalc(enc.data, enc.size));
+    }
+    put_u32(start + 8, CrcCalc(start + 12, 20));
+
+    free(hb.data);
+    free(enc.data);
+    free(packed);
+
+    if (result == ZLITE_OK) {
+        uint64_t end_pos = zlite_output_tell(out);
+
+        if (zlite_output_seek(out, 0) != ZLITE_OK ||
+            zlite_output_write(out, start, sizeof(start)) != sizeof(start) ||
+            zlite_output_seek(out, end_pos) != ZLITE_OK) {
+            result = ZLITE_ERROR_WRITE;
+        }
+    }
+    return result;
+}